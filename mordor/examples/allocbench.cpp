@@ -0,0 +1,208 @@
+//
+// Mordor allocation benchmark app.
+//
+// Counts heap allocations (by replacing the global operator new) made by
+// code paths that are supposed to be allocation free once warmed up, and
+// times them.  Exits with 1 if any of them allocated.
+//
+
+#include "mordor/predef.h"
+
+#include <iostream>
+#include <new>
+
+#include <boost/bind.hpp>
+#include <boost/config.hpp>
+
+#include <stdlib.h>
+#ifndef WINDOWS
+#include <unistd.h>
+#endif
+
+#include "mordor/atomic.h"
+#include "mordor/config.h"
+#include "mordor/exception.h"
+#include "mordor/fiber.h"
+#include "mordor/main.h"
+#include "mordor/streams/buffer.h"
+#include "mordor/streams/fd.h"
+#include "mordor/timer.h"
+#include "mordor/workerpool.h"
+
+using namespace Mordor;
+
+static volatile size_t g_allocations;
+
+void *operator new(size_t size)
+{
+    atomicIncrement(g_allocations);
+    void *result = malloc(size ? size : 1);
+    if (!result)
+        throw std::bad_alloc();
+    return result;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *p) BOOST_NOEXCEPT
+{
+    free(p);
+}
+
+void operator delete[](void *p) BOOST_NOEXCEPT
+{
+    free(p);
+}
+
+#ifdef __cpp_sized_deallocation
+void operator delete(void *p, size_t) BOOST_NOEXCEPT
+{
+    free(p);
+}
+
+void operator delete[](void *p, size_t) BOOST_NOEXCEPT
+{
+    free(p);
+}
+#endif
+
+static ConfigVar<int>::ptr g_iterations =
+    Config::lookup<int>("allocbench.iterations", 100000,
+    "Times each operation is measured, after warming up");
+
+enum {
+    WARMUP = 1000
+};
+
+namespace {
+struct Measurement
+{
+    Measurement(const char *what, int iterations)
+        : m_what(what),
+          m_iterations(iterations),
+          m_allocations(g_allocations),
+          m_start(TimerManager::now())
+    {}
+
+    /// @return allocations made since construction
+    size_t finish()
+    {
+        unsigned long long elapsed = TimerManager::now() - m_start;
+        size_t allocations = g_allocations - m_allocations;
+        std::cout << m_what << ": "
+            << (double)allocations / m_iterations << " allocations/op, "
+            << (double)elapsed * 1000 / m_iterations << " ns/op"
+            << std::endl;
+        return allocations;
+    }
+
+private:
+    const char *m_what;
+    int m_iterations;
+    size_t m_allocations;
+    unsigned long long m_start;
+};
+}
+
+static void yieldLoop(int iterations, size_t &allocations)
+{
+    for (int i = 0; i < WARMUP; ++i)
+        Scheduler::yield();
+    Measurement measurement("Scheduler::yield", iterations);
+    for (int i = 0; i < iterations; ++i)
+        Scheduler::yield();
+    allocations = measurement.finish();
+}
+
+static size_t scheduleFiber(int iterations)
+{
+    WorkerPool pool;
+    size_t allocations = ~0u;
+    pool.schedule(Fiber::ptr(new Fiber(boost::bind(&yieldLoop, iterations,
+        boost::ref(allocations)))));
+    pool.dispatch();
+    return allocations;
+}
+
+static void accumulate(int &sum, int a, int b, int c)
+{
+    sum += a + b + c;
+}
+
+// The bound functor is too big for boost::function to store in place
+static void functorLoop(int iterations, int &sum, size_t &allocations)
+{
+    for (int i = 0; i < WARMUP; ++i) {
+        Scheduler::getThis()->schedule(
+            boost::bind(&accumulate, boost::ref(sum), 1, 2, 3));
+        Scheduler::yield();
+    }
+    Measurement measurement("Scheduler::schedule(functor)", iterations);
+    for (int i = 0; i < iterations; ++i) {
+        Scheduler::getThis()->schedule(
+            boost::bind(&accumulate, boost::ref(sum), 1, 2, 3));
+        Scheduler::yield();
+    }
+    allocations = measurement.finish();
+}
+
+static size_t scheduleFunctor(int iterations)
+{
+    WorkerPool pool;
+    int sum = 0;
+    size_t allocations = ~0u;
+    pool.schedule(Fiber::ptr(new Fiber(boost::bind(&functorLoop, iterations,
+        boost::ref(sum), boost::ref(allocations)))));
+    pool.dispatch();
+    MORDOR_VERIFY(sum == 6 * (WARMUP + iterations));
+    return allocations;
+}
+
+#ifndef WINDOWS
+static size_t fdStreamBufferIO(int iterations)
+{
+    int fds[2];
+    if (pipe(fds))
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("pipe");
+    FDStream readStream(fds[0]), writeStream(fds[1]);
+    Buffer message("hello"), received;
+    received.reserve(5 * (WARMUP + iterations));
+    for (int i = 0; i < WARMUP; ++i) {
+        writeStream.write(message, 5);
+        readStream.read(received, 5);
+        received.consume(5);
+    }
+    Measurement measurement("FDStream::write/read(Buffer)", iterations);
+    for (int i = 0; i < iterations; ++i) {
+        writeStream.write(message, 5);
+        readStream.read(received, 5);
+        received.consume(5);
+    }
+    return measurement.finish();
+}
+#endif
+
+MORDOR_MAIN(int argc, char *argv[])
+{
+    try {
+        Config::loadFromEnvironment();
+        int iterations = g_iterations->val();
+        if (iterations < 1)
+            iterations = 1;
+        size_t allocations = scheduleFiber(iterations);
+        allocations += scheduleFunctor(iterations);
+#ifndef WINDOWS
+        allocations += fdStreamBufferIO(iterations);
+#endif
+        if (allocations != 0)
+            return 1;
+    } catch (...) {
+        std::cerr << boost::current_exception_diagnostic_information()
+            << std::endl;
+        return 1;
+    }
+    return 0;
+}
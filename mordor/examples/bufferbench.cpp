@@ -0,0 +1,154 @@
+//
+// Mordor Buffer benchmark app.
+//
+// Runs Buffer through the shapes of work the HTTP and proxy code gives it,
+// and prints the time each one takes.
+//
+
+#include "mordor/predef.h"
+
+#include <iostream>
+#include <string>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mordor/assert.h"
+#include "mordor/config.h"
+#include "mordor/exception.h"
+#include "mordor/main.h"
+#include "mordor/streams/buffer.h"
+#include "mordor/timer.h"
+
+using namespace Mordor;
+
+static size_t residentPages()
+{
+    size_t pages = 0;
+#ifdef LINUX
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (file) {
+        size_t size;
+        if (fscanf(file, "%lu %lu", (unsigned long *)&size,
+            (unsigned long *)&pages) != 2)
+            pages = 0;
+        fclose(file);
+    }
+#endif
+    return pages;
+}
+
+// Emulates a proxy relaying many connections: a window of buffers with
+// assorted sizes stays alive while the oldest is retired and replaced
+static void proxyWorkload(const char *name, BufferAllocator &allocator)
+{
+    enum {
+        CONNECTIONS = 256,
+        ITERATIONS = 200000
+    };
+    Buffer buffers[CONNECTIONS];
+    for (size_t i = 0; i < CONNECTIONS; ++i)
+        buffers[i].allocator(allocator);
+    size_t rssBefore = residentPages();
+    srand(1);
+    unsigned long long start = TimerManager::now();
+    for (size_t i = 0; i < ITERATIONS; ++i) {
+        Buffer &buffer = buffers[i % CONNECTIONS];
+        buffer.clear();
+        size_t length = 512 + rand() % 65536;
+        buffer.reserve(length);
+        buffer.produce(length);
+        buffer.consume(length / 2);
+    }
+    unsigned long long elapsed = TimerManager::now() - start;
+    std::cout << name << " proxy workload: "
+        << (double)elapsed * 1000 / ITERATIONS << " ns/op, RSS grew "
+        << (long)(residentPages() - rssBefore) << " pages" << std::endl;
+}
+
+// Header parsing and chunked decoding shape: many short segments appended,
+// searched, and consumed
+static void smallSegmentChurn()
+{
+    enum {
+        ITERATIONS = 200000
+    };
+    Buffer lines[3] = { Buffer("Host: example.com\r\n"),
+        Buffer("Content-Length: 1234\r\n"), Buffer("\r\n") };
+    Buffer b;
+    size_t found = 0;
+    unsigned long long start = TimerManager::now();
+    for (size_t i = 0; i < ITERATIONS; ++i) {
+        b.copyIn(lines[i % 3]);
+        if (b.segments() >= 6) {
+            ptrdiff_t newline = b.find('\n');
+            found += newline;
+            b.consume(newline + 1);
+        }
+    }
+    unsigned long long elapsed = TimerManager::now() - start;
+    MORDOR_ASSERT(found > 0);
+    std::cout << "small segment churn: "
+        << (double)elapsed * 1000 / ITERATIONS << " ns/op" << std::endl;
+}
+
+// A multipart upload as it arrives off a socket: a large part in 16KB
+// segments, terminated by a long boundary
+static void multipartBoundarySearch(const char *name, bool text)
+{
+    enum {
+        PART_SIZE = 4 * 1024 * 1024,
+        SEGMENT_SIZE = 16 * 1024,
+        ITERATIONS = 20
+    };
+    static const char base64[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string boundary = "\r\n--"
+        "----------------------------MordorBoundary7d93b2a1c0e4f5";
+    std::string segment(SEGMENT_SIZE, '\0');
+    srand(1);
+    Buffer b;
+    size_t column = 0;
+    for (size_t i = 0; i < PART_SIZE / SEGMENT_SIZE; ++i) {
+        for (size_t j = 0; j < segment.size(); ++j) {
+            // Base64 is wrapped at 76 columns
+            if (!text)
+                segment[j] = (char)rand();
+            else if (column == 76)
+                segment[j] = '\r';
+            else if (column == 77)
+                segment[j] = '\n';
+            else
+                segment[j] = base64[rand() % 64];
+            column = column == 77 ? 0 : column + 1;
+        }
+        b.copyIn(Buffer(segment));
+    }
+    b.copyIn(Buffer(boundary + "--\r\n"));
+
+    ptrdiff_t found = 0;
+    unsigned long long start = TimerManager::now();
+    for (int i = 0; i < ITERATIONS; ++i)
+        found = b.find(boundary);
+    unsigned long long elapsed = TimerManager::now() - start;
+    MORDOR_ASSERT(found == (ptrdiff_t)PART_SIZE);
+    std::cout << name << " multipart boundary search: "
+        << (double)PART_SIZE * ITERATIONS / elapsed << " MB/s" << std::endl;
+}
+
+MORDOR_MAIN(int argc, char *argv[])
+{
+    try {
+        Config::loadFromEnvironment();
+        proxyWorkload("heap", BufferAllocator::heap());
+        proxyWorkload("slab", BufferAllocator::slab());
+        smallSegmentChurn();
+        multipartBoundarySearch("binary", false);
+        multipartBoundarySearch("base64", true);
+    } catch (...) {
+        std::cerr << boost::current_exception_diagnostic_information()
+            << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,90 @@
+//
+// Mordor fiber context switch benchmark app.
+//
+// Times a Fiber::call/Fiber::yield round trip (with whichever backend
+// fiber.h picked), and on Linux a bare swapcontext round trip next to it.
+//
+
+#include "mordor/predef.h"
+
+#include <iostream>
+#include <vector>
+
+#ifdef LINUX
+#include <ucontext.h>
+#endif
+
+#include <boost/bind.hpp>
+
+#include "mordor/assert.h"
+#include "mordor/config.h"
+#include "mordor/exception.h"
+#include "mordor/fiber.h"
+#include "mordor/main.h"
+#include "mordor/timer.h"
+
+using namespace Mordor;
+
+static ConfigVar<unsigned long long>::ptr g_switches =
+    Config::lookup<unsigned long long>("fiberbench.switches", 1000000ull,
+    "Round trips to time");
+
+static void yieldLoop(unsigned long long switches)
+{
+    for (unsigned long long i = 0; i < switches; ++i)
+        Fiber::yield();
+}
+
+#ifdef LINUX
+static ucontext_t g_mainContext, g_otherContext;
+static unsigned long long g_contextSwitches;
+
+static void swapcontextLoop()
+{
+    for (unsigned long long i = 0; i < g_contextSwitches; ++i)
+        swapcontext(&g_otherContext, &g_mainContext);
+}
+#endif
+
+MORDOR_MAIN(int argc, char *argv[])
+{
+    try {
+        Config::loadFromEnvironment();
+        unsigned long long switches = g_switches->val();
+        if (switches == 0)
+            switches = 1;
+
+        Fiber::ptr fiber(new Fiber(boost::bind(&yieldLoop, switches)));
+        unsigned long long start = TimerManager::now();
+        for (unsigned long long i = 0; i < switches; ++i)
+            fiber->call();
+        unsigned long long elapsed = TimerManager::now() - start;
+        fiber->call();
+        MORDOR_ASSERT(fiber->state() == Fiber::TERM);
+        std::cout << "Fiber::call + Fiber::yield: "
+            << (double)elapsed * 1000 / switches << " ns" << std::endl;
+
+#ifdef LINUX
+        g_contextSwitches = switches;
+        std::vector<char> stack(65536);
+        if (getcontext(&g_otherContext))
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("getcontext");
+        g_otherContext.uc_link = &g_mainContext;
+        g_otherContext.uc_stack.ss_sp = &stack[0];
+        g_otherContext.uc_stack.ss_size = stack.size();
+        makecontext(&g_otherContext, &swapcontextLoop, 0);
+        start = TimerManager::now();
+        for (unsigned long long i = 0; i < switches; ++i)
+            swapcontext(&g_mainContext, &g_otherContext);
+        elapsed = TimerManager::now() - start;
+        swapcontext(&g_mainContext, &g_otherContext);
+        std::cout << "swapcontext round trip: "
+            << (double)elapsed * 1000 / switches << " ns" << std::endl;
+#endif
+    } catch (...) {
+        std::cerr << boost::current_exception_diagnostic_information()
+            << std::endl;
+        return 1;
+    }
+    return 0;
+}
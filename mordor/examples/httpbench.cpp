@@ -0,0 +1,145 @@
+//
+// Mordor HTTP header benchmark app.
+//
+// Times serializing a typical request and response, through operator<< on an
+// ostringstream (which renders through serialize() and then copies) and
+// through serialize() into a Buffer; and parsing a typical request, into a Request with
+// RequestParser and into a CompactRequest with CompactRequestParser.
+//
+
+#include "mordor/predef.h"
+
+#include <iostream>
+#include <sstream>
+
+#include "mordor/assert.h"
+#include "mordor/config.h"
+#include "mordor/http/compact.h"
+#include "mordor/http/parser.h"
+#include "mordor/main.h"
+#include "mordor/streams/buffer.h"
+#include "mordor/timer.h"
+
+using namespace Mordor;
+using namespace Mordor::HTTP;
+
+static ConfigVar<unsigned long long>::ptr g_iterations =
+    Config::lookup<unsigned long long>("httpbench.iterations", 200000ull,
+    "Times each message is serialized");
+
+static Request typicalRequest()
+{
+    Request request;
+    request.requestLine.method = GET;
+    request.requestLine.uri = "/api/v1/objects/0123456789abcdef?version=3";
+    request.requestLine.ver = Version(1, 1);
+    request.general.connection.insert("Keep-Alive");
+    request.request.host = "storage.example.com";
+    request.request.acceptEncoding.push_back(AcceptValue("gzip", 1000));
+    request.request.acceptEncoding.push_back(AcceptValue("identity", 500));
+    request.request.authorization.scheme = "Basic";
+    request.request.authorization.base64 = "dXNlcm5hbWU6cGFzc3dvcmQ=";
+    request.request.ifNoneMatch.insert(ETag("5d41402abc4b2a76"));
+    request.request.userAgent.push_back(Product("mordor", "1.0"));
+    request.entity.extension["X-Request-Id"] = "b7d1c2a0-94f1-4c3e";
+    return request;
+}
+
+static Response typicalResponse()
+{
+    Response response;
+    response.status.ver = Version(1, 1);
+    response.status.status = OK;
+    response.status.reason = reason(OK);
+    response.general.date = boost::posix_time::second_clock::universal_time();
+    response.general.transferEncoding.push_back("chunked");
+    response.response.eTag = ETag("5d41402abc4b2a76");
+    response.response.server.push_back(Product("mordor", "1.0"));
+    response.entity.contentType = MediaType("application", "json");
+    response.entity.contentType.parameters["charset"] = "utf-8";
+    response.entity.lastModified = response.general.date;
+    response.entity.extension["Cache-Control"] = "private, max-age=0";
+    return response;
+}
+
+template <class T>
+static void bench(const char *name, const T &message,
+    unsigned long long iterations)
+{
+    size_t bytes = 0;
+    unsigned long long start = TimerManager::now();
+    for (unsigned long long i = 0; i < iterations; ++i) {
+        std::ostringstream os;
+        os << message;
+        std::string str = os.str();
+        bytes += str.size();
+    }
+    unsigned long long streamed = TimerManager::now() - start;
+
+    start = TimerManager::now();
+    for (unsigned long long i = 0; i < iterations; ++i) {
+        Buffer buffer;
+        serialize(buffer, message);
+        bytes += buffer.readAvailable();
+    }
+    unsigned long long serialized = TimerManager::now() - start;
+
+    std::cout << name << " (" << bytes / iterations / 2 << " bytes): "
+        << "ostream " << streamed * 1000 / iterations << " ns, "
+        << "serialize " << serialized * 1000 / iterations << " ns"
+        << std::endl;
+}
+
+static void benchParse(const Request &message, unsigned long long iterations)
+{
+    std::ostringstream os;
+    os << message;
+    std::string text = os.str();
+
+    unsigned long long start = TimerManager::now();
+    for (unsigned long long i = 0; i < iterations; ++i) {
+        Request request;
+        RequestParser parser(request);
+        parser.run(text);
+        MORDOR_ASSERT(parser.complete());
+    }
+    unsigned long long structs = TimerManager::now() - start;
+
+    // What a servlet typically looks at, on a CompactRequest reused across
+    // requests the way a connection would
+    CompactRequest compact;
+    CompactRequestParser compactParser(compact);
+    size_t seen = 0;
+    start = TimerManager::now();
+    for (unsigned long long i = 0; i < iterations; ++i) {
+        compactParser.run(text);
+        MORDOR_ASSERT(compactParser.complete());
+        seen += compact.header(HOST).length + compact.uri().length;
+        if (compact.contentLength() != ~0ull)
+            ++seen;
+    }
+    unsigned long long compacted = TimerManager::now() - start;
+
+    std::cout << "parse (" << text.size() << " bytes): "
+        << "Request " << structs * 1000 / iterations << " ns, "
+        << "CompactRequest " << compacted * 1000 / iterations << " ns"
+        << std::endl;
+}
+
+MORDOR_MAIN(int argc, char *argv[])
+{
+    try {
+        Config::loadFromEnvironment();
+        unsigned long long iterations = g_iterations->val();
+        if (iterations == 0)
+            iterations = 1;
+        bench("request", typicalRequest(), iterations);
+        bench("response", typicalResponse(), iterations);
+        benchParse(typicalRequest(), iterations);
+    } catch (...) {
+        std::cerr << boost::current_exception_diagnostic_information()
+            << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -3,6 +3,9 @@
 //
 // Can act as both the client and the server.
 //
+// On Linux, compare the epoll and io_uring backends side by side by running
+// it once as is, and once with IOMANAGER_IOURING=1 in the environment.
+//
 
 #include "mordor/predef.h"
 
@@ -305,6 +308,10 @@ MORDOR_MAIN(int argc, char *argv[])
 
         Config::loadFromEnvironment();
         IOManager iom(g_iomThreads->val());
+#ifdef LINUX
+        MORDOR_LOG_INFO(g_log) << "backend: "
+            << (iom.ioUring() ? "io_uring" : "epoll");
+#endif
 
         IOMBenchServer server(iom);
         IOMBenchClient client(iom);
@@ -0,0 +1,77 @@
+//
+// Mordor IOManager event registration benchmark app.
+//
+// Several threads registering and unregistering events on their own fds
+// only contend on the IOManager's fd table itself.
+//
+
+#include "mordor/predef.h"
+
+#include <iostream>
+#include <vector>
+
+#include <boost/bind.hpp>
+
+#include "mordor/assert.h"
+#include "mordor/config.h"
+#include "mordor/exception.h"
+#include "mordor/iomanager.h"
+#include "mordor/main.h"
+
+using namespace Mordor;
+
+static ConfigVar<int>::ptr g_threads =
+    Config::lookup<int>("registerbench.threads", 4,
+    "Threads registering events concurrently");
+static ConfigVar<unsigned long long>::ptr g_registrations =
+    Config::lookup<unsigned long long>("registerbench.registrations",
+    100000ull, "registerEvent/unregisterEvent pairs per thread");
+
+static void noop() {}
+
+static void registerLoop(IOManager &ioManager, int fd,
+    unsigned long long registrations)
+{
+    for (unsigned long long i = 0; i < registrations; ++i) {
+        ioManager.registerEvent(fd, IOManager::READ, &noop);
+        MORDOR_VERIFY(ioManager.unregisterEvent(fd, IOManager::READ));
+    }
+}
+
+MORDOR_MAIN(int argc, char *argv[])
+{
+    try {
+        Config::loadFromEnvironment();
+        int threads = g_threads->val();
+        if (threads < 1)
+            threads = 1;
+        unsigned long long registrations = g_registrations->val();
+        if (registrations == 0)
+            registrations = 1;
+
+        std::vector<int> fds(threads * 2);
+        for (int i = 0; i < threads; ++i)
+            if (pipe(&fds[i * 2]))
+                MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("pipe");
+        unsigned long long elapsed;
+        {
+            IOManager ioManager(threads, false);
+            unsigned long long start = TimerManager::now();
+            for (int i = 0; i < threads; ++i)
+                ioManager.schedule(boost::bind(&registerLoop,
+                    boost::ref(ioManager), fds[i * 2], registrations));
+            ioManager.stop();
+            elapsed = TimerManager::now() - start;
+        }
+        for (size_t i = 0; i < fds.size(); ++i)
+            close(fds[i]);
+        std::cout << threads << " threads registerEvent + unregisterEvent: "
+            << (double)elapsed * 1000 / registrations << " ns/iteration"
+            << std::endl;
+    } catch (...) {
+        std::cerr << boost::current_exception_diagnostic_information()
+            << std::endl;
+        return 1;
+    }
+    return 0;
+}
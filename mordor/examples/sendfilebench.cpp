@@ -0,0 +1,134 @@
+//
+// Mordor file response benchmark app.
+//
+// Serves sparse files of increasing size with respondStream over loopback
+// TCP, and prints the throughput of copying them through user space versus
+// handing them to sendfile (transferstream.zerocopy).
+//
+
+#include "mordor/predef.h"
+
+#include <algorithm>
+#include <iostream>
+
+#include <boost/bind.hpp>
+
+#include <stdlib.h>
+
+#include "mordor/assert.h"
+#include "mordor/config.h"
+#include "mordor/exception.h"
+#include "mordor/http/client.h"
+#include "mordor/http/server.h"
+#include "mordor/iomanager.h"
+#include "mordor/main.h"
+#include "mordor/socket.h"
+#include "mordor/streams/fd.h"
+#include "mordor/streams/null.h"
+#include "mordor/streams/socket.h"
+#include "mordor/streams/transfer.h"
+#include "mordor/timer.h"
+
+using namespace Mordor;
+using namespace Mordor::HTTP;
+
+static ConfigVar<unsigned long long>::ptr g_bytes =
+    Config::lookup<unsigned long long>("sendfilebench.bytes", 64ull << 20,
+    "Minimum bytes fetched per measurement, so small files aren't all "
+    "overhead");
+
+static void fileServer(int fd, ServerRequest::ptr request)
+{
+    FDStream file(fd, NULL, NULL, false);
+    file.seek(0, Stream::BEGIN);
+    respondStream(request, file);
+}
+
+static void acceptFileConnection(Socket::ptr listen, int fd)
+{
+    Socket::ptr socket = listen->accept();
+    ServerConnection::ptr conn(new ServerConnection(
+        Stream::ptr(new SocketStream(socket)),
+        boost::bind(&fileServer, fd, _1)));
+    conn->processRequests();
+}
+
+static ClientConnection::ptr fileServerConnection(IOManager &ioManager,
+    int fd)
+{
+    std::vector<Address::ptr> addresses = Address::lookup("localhost");
+    MORDOR_ASSERT(!addresses.empty());
+    IPAddress::ptr address =
+        boost::dynamic_pointer_cast<IPAddress>(addresses.front());
+    address->port(0);
+    Socket::ptr listen = address->createSocket(ioManager, SOCK_STREAM);
+    listen->bind(address);
+    listen->listen();
+    ioManager.schedule(boost::bind(&acceptFileConnection, listen, fd));
+    Socket::ptr socket = address->createSocket(ioManager, SOCK_STREAM);
+    socket->connect(listen->localAddress());
+    return ClientConnection::ptr(new ClientConnection(
+        Stream::ptr(new SocketStream(socket))));
+}
+
+// Sparse, and unlinked as soon as it's created
+static int sparseFile(long long size)
+{
+    char path[] = "/tmp/mordor_sendfilebench_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("mkstemp");
+    unlink(path);
+    FDStream stream(fd, NULL, NULL, false);
+    stream.truncate(size);
+    return fd;
+}
+
+static void fetchFiles(ClientConnection::ptr conn, long long size,
+    const char *mode)
+{
+    long long requests = (std::max)(1ll, (long long)g_bytes->val() / size);
+    Request requestHeaders;
+    requestHeaders.requestLine.uri = "/file";
+    requestHeaders.request.host = "localhost";
+    unsigned long long start = TimerManager::now();
+    for (long long i = 0; i < requests; ++i) {
+        ClientRequest::ptr request = conn->request(requestHeaders);
+        MORDOR_VERIFY(request->response().status.status == OK);
+        MORDOR_VERIFY(transferStream(request->responseStream(),
+            NullStream::get()) == (unsigned long long)size);
+    }
+    unsigned long long elapsed = TimerManager::now() - start;
+    std::cout << mode << " " << (size >> 20) << "MB: "
+        << (double)size * requests / elapsed << " MB/s" << std::endl;
+}
+
+MORDOR_MAIN(int argc, char *argv[])
+{
+    static const long long sizes[] = { 1ll << 20, 16ll << 20, 256ll << 20,
+        1ll << 30 };
+    try {
+        Config::loadFromEnvironment();
+        // Only registered where transferStream can use sendfile
+        ConfigVarBase::ptr zeroCopy =
+            Config::lookup("transferstream.zerocopy");
+        IOManager ioManager;
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+            FDStream file(sparseFile(sizes[i]));
+            ClientConnection::ptr conn = fileServerConnection(ioManager,
+                file.fd());
+            if (zeroCopy)
+                zeroCopy->fromString("0");
+            fetchFiles(conn, sizes[i], "copy");
+            if (zeroCopy) {
+                zeroCopy->fromString("1");
+                fetchFiles(conn, sizes[i], "sendfile");
+            }
+        }
+    } catch (...) {
+        std::cerr << boost::current_exception_diagnostic_information()
+            << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -10,6 +10,8 @@
 #include <valgrind/valgrind.h>
 #endif
 
+#include <algorithm>
+
 #include <boost/thread/tss.hpp>
 
 #include "assert.h"
@@ -38,6 +40,14 @@ static AverageMinMaxStatistic<unsigned int> &g_statFree=
 static volatile unsigned int g_cntFibers = 0; // Active fibers
 static MaxStatistic<unsigned int> &g_statMaxFibers=Statistics::registerStatistic("fiber.max",
     MaxStatistic<unsigned int>());
+static AverageMinMaxStatistic<unsigned long long> &g_statStackUsage =
+    Statistics::registerStatistic("fiber.stackusage",
+    AverageMinMaxStatistic<unsigned long long>("bytes"),
+    "High-water mark of fiber stacks, measured when they are destroyed");
+static CountStatistic<unsigned int> &g_statStackCacheHits =
+    Statistics::registerStatistic("fiber.stackcachehits",
+    CountStatistic<unsigned int>(),
+    "Fiber stacks reused instead of being allocated");
 
 #ifdef SETJMP_FIBERS
 #ifdef OSX
@@ -46,6 +56,43 @@ static MaxStatistic<unsigned int> &g_statMaxFibers=Statistics::registerStatistic
 #endif
 #endif
 
+#ifdef ASM_FIBERS
+// Saves the callee-saved registers (and the SSE and x87 control words) on
+// the current stack, stores the stack pointer in *from, then switches to the
+// stack in to and restores the same from it
+extern "C" void mordor_fiber_switch(void **from, void *to);
+asm(
+    ".text\n"
+    ".globl mordor_fiber_switch\n"
+    ".hidden mordor_fiber_switch\n"
+    ".type mordor_fiber_switch, @function\n"
+    ".align 16\n"
+"mordor_fiber_switch:\n"
+    "pushq %rbp\n"
+    "pushq %rbx\n"
+    "pushq %r12\n"
+    "pushq %r13\n"
+    "pushq %r14\n"
+    "pushq %r15\n"
+    "subq $8, %rsp\n"
+    "stmxcsr (%rsp)\n"
+    "fnstcw 4(%rsp)\n"
+    "movq %rsp, (%rdi)\n"
+    "movq %rsi, %rsp\n"
+    "ldmxcsr (%rsp)\n"
+    "fldcw 4(%rsp)\n"
+    "addq $8, %rsp\n"
+    "popq %r15\n"
+    "popq %r14\n"
+    "popq %r13\n"
+    "popq %r12\n"
+    "popq %rbx\n"
+    "popq %rbp\n"
+    "ret\n"
+    ".size mordor_fiber_switch, .-mordor_fiber_switch\n"
+);
+#endif
+
 static size_t g_pagesize;
 
 namespace {
@@ -74,6 +121,29 @@ static ConfigVar<size_t>::ptr g_defaultStackSize = Config::lookup<size_t>(
 #endif
     "Default stack size for new fibers.  This is the virtual size; physical "
     "memory isn't consumed until it is actually referenced.");
+static ConfigVar<size_t>::ptr g_stackCacheSize = Config::lookup<size_t>(
+    "fiber.stackcachesize", 16u,
+    "Number of freed fiber stacks each thread keeps for reuse by new fibers");
+static ConfigVar<size_t>::ptr g_globalStackCacheSize = Config::lookup<size_t>(
+    "fiber.globalstackcachesize", 256u,
+    "Number of freed fiber stacks kept for reuse by any thread, once a "
+    "thread's own cache is full");
+static ConfigVar<bool>::ptr g_trackStackUsage = Config::lookup(
+    "fiber.trackstackusage", false,
+    "Measure how much of its stack each fiber used when it is destroyed, "
+    "for the fiber.stackusage statistic.  So that the next fiber's "
+    "measurement only sees its own pages, a measured stack is given back to "
+    "the OS entirely before it is cached for reuse.  Costs two syscalls per "
+    "fiber, and page faults when its stack is reused.");
+static ConfigVar<size_t>::ptr g_stackRetainSize = Config::lookup<size_t>(
+    "fiber.stackretainsize", 0u,
+    "If non-zero, how much of a freed fiber stack to leave resident when it "
+    "is cached for reuse; the rest is given back to the OS, at the cost of a "
+    "syscall per fiber.  Ignored if fiber.trackstackusage is on.");
+static ConfigVar<bool>::ptr g_stackGuardPage = Config::lookup(
+    "fiber.stackguardpage", false,
+    "Map an inaccessible page below each fiber stack, so overflowing it "
+    "faults instead of corrupting memory.  Costs an extra mapping per stack.");
 
 // t_fiber is the Fiber currently executing on this thread
 // t_threadFiber is the Fiber that represents the thread's original stack
@@ -96,12 +166,15 @@ static std::vector<bool> & g_flsIndices()
 }
 
 Fiber::Fiber()
+    : m_hook(this),
+      m_queued(0)
 {
     g_statMaxFibers.update(atomicIncrement(g_cntFibers));
     MORDOR_ASSERT(!t_fiber);
     m_state = EXEC;
     m_stack = NULL;
     m_stacksize = 0;
+    m_guardsize = 0;
     m_sp = NULL;
     setThis(this);
 #ifdef NATIVE_WINDOWS_FIBERS
@@ -116,6 +189,8 @@ Fiber::Fiber()
 }
 
 Fiber::Fiber(boost::function<void ()> dg, size_t stacksize)
+    : m_hook(this),
+      m_queued(0)
 {
     g_statMaxFibers.update(atomicIncrement(g_cntFibers));
     stacksize += g_pagesize - 1;
@@ -124,6 +199,7 @@ Fiber::Fiber(boost::function<void ()> dg, size_t stacksize)
     m_state = INIT;
     m_stack = NULL;
     m_stacksize = stacksize;
+    m_guardsize = 0;
     allocStack();
 #ifdef UCONTEXT_FIBERS
     m_sp = &m_ctx;
@@ -395,6 +471,134 @@ static VOID CALLBACK native_fiber_entryPoint(PVOID lpParameter)
 }
 #endif
 
+#if !defined(WINDOWS) && defined(POSIX)
+namespace {
+
+struct CachedStack
+{
+    void *stack;
+    size_t size, guardsize;
+};
+
+/// Stacks of fibers that have been destroyed, kept for reuse
+
+/// Each thread has one, and overflows into a global one.  Stacks are only
+/// reused for Fibers asking for exactly the same size and guard.
+struct StackCache : boost::noncopyable
+{
+    ~StackCache();
+
+    bool take(size_t size, size_t guardsize, void *&stack)
+    {
+        for (size_t i = stacks.size(); i > 0; --i) {
+            CachedStack &cached = stacks[i - 1];
+            if (cached.size == size && cached.guardsize == guardsize) {
+                stack = cached.stack;
+                stacks.erase(stacks.begin() + (i - 1));
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::vector<CachedStack> stacks;
+};
+
+}
+
+static boost::thread_specific_ptr<StackCache> t_stackCache;
+
+// These are never destroyed, so that fibers outliving static destruction
+// can still free their stacks
+static boost::mutex &g_stackCacheMutex()
+{
+    static boost::mutex *mutex = new boost::mutex();
+    return *mutex;
+}
+static StackCache &g_stackCache()
+{
+    static StackCache *cache = new StackCache();
+    return *cache;
+}
+
+#ifdef LINUX
+typedef unsigned char mincore_t;
+#else
+typedef char mincore_t;
+#endif
+
+// Stacks grow down, and untouched pages of an anonymous mapping aren't
+// resident, so the lowest resident page marks the deepest the stack has
+// been used
+static size_t measureStackUsage(void *stack, size_t size)
+{
+    mincore_t resident[256];
+    size_t pages = size / g_pagesize;
+    for (size_t page = 0; page < pages; page += sizeof(resident)) {
+        size_t count = std::min(pages - page, sizeof(resident));
+        if (mincore((char *)stack + page * g_pagesize, count * g_pagesize,
+            resident))
+            return 0;
+        for (size_t i = 0; i < count; ++i)
+            if (resident[i] & 1)
+                return size - (page + i) * g_pagesize;
+    }
+    return 0;
+}
+
+static void unmapStack(const CachedStack &cached)
+{
+    munmap((char *)cached.stack - cached.guardsize,
+        cached.size + cached.guardsize);
+}
+
+// Keeps the stack in this thread's cache, the global cache, or failing that,
+// returns it to the OS
+static void cacheStack(const CachedStack &cached)
+{
+    StackCache *cache = t_stackCache.get();
+    if (!cache) {
+        cache = new StackCache();
+        t_stackCache.reset(cache);
+    }
+    if (cache->stacks.size() < g_stackCacheSize->val()) {
+        cache->stacks.push_back(cached);
+        return;
+    }
+    {
+        boost::mutex::scoped_lock lock(g_stackCacheMutex());
+        StackCache &global = g_stackCache();
+        if (global.stacks.size() < g_globalStackCacheSize->val()) {
+            global.stacks.push_back(cached);
+            return;
+        }
+    }
+    unmapStack(cached);
+}
+
+static bool reuseStack(size_t size, size_t guardsize, void *&stack)
+{
+    StackCache *cache = t_stackCache.get();
+    if (cache && cache->take(size, guardsize, stack))
+        return true;
+    boost::mutex::scoped_lock lock(g_stackCacheMutex());
+    return g_stackCache().take(size, guardsize, stack);
+}
+
+// A thread is exiting; hand its stacks on to the global cache
+StackCache::~StackCache()
+{
+    boost::mutex::scoped_lock lock(g_stackCacheMutex());
+    StackCache &global = g_stackCache();
+    for (size_t i = 0; i < stacks.size(); ++i) {
+        if (global.stacks.size() < g_globalStackCacheSize->val())
+            global.stacks.push_back(stacks[i]);
+        else
+            unmapStack(stacks[i]);
+    }
+}
+#endif
+
 void
 Fiber::allocStack()
 {
@@ -414,9 +618,25 @@ Fiber::allocStack()
     VirtualAlloc((char*)m_stack + g_pagesize, m_stacksize, MEM_COMMIT, PAGE_READWRITE);
     m_sp = (char*)m_stack + m_stacksize + g_pagesize;
 #elif defined(POSIX)
-    m_stack = mmap(NULL, m_stacksize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
-    if (m_stack == MAP_FAILED)
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("mmap");
+    m_guardsize = g_stackGuardPage->val() ? g_pagesize : 0;
+    if (reuseStack(m_stacksize, m_guardsize, m_stack)) {
+        g_statStackCacheHits.increment();
+    } else {
+        // Pages are only committed as the fiber touches them
+        int flags = MAP_PRIVATE | MAP_ANON;
+#ifdef MAP_NORESERVE
+        flags |= MAP_NORESERVE;
+#endif
+        void *mapping = mmap(NULL, m_stacksize + m_guardsize,
+            PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (mapping == MAP_FAILED)
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("mmap");
+        if (m_guardsize && mprotect(mapping, m_guardsize, PROT_NONE)) {
+            munmap(mapping, m_stacksize + m_guardsize);
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("mprotect");
+        }
+        m_stack = (char *)mapping + m_guardsize;
+    }
 #ifdef HAVE_VALGRIND_VALGRIND_H
     m_valgrindStackId = VALGRIND_STACK_REGISTER(m_stack, (char *)m_stack + m_stacksize);
 #endif
@@ -437,7 +657,19 @@ Fiber::freeStack()
 #ifdef HAVE_VALGRIND_VALGRIND_H
     VALGRIND_STACK_DEREGISTER(m_valgrindStackId);
 #endif
-    munmap(m_stack, m_stacksize);
+    if (g_trackStackUsage->val()) {
+        g_statStackUsage.update(measureStackUsage(m_stack, m_stacksize));
+        madvise(m_stack, m_stacksize, MADV_DONTNEED);
+    } else {
+        // Don't let a cached stack hold on to memory only one deep call
+        // needed
+        size_t retain = g_stackRetainSize->val();
+        retain -= retain % g_pagesize;
+        if (retain && m_stacksize > retain)
+            madvise(m_stack, m_stacksize - retain, MADV_DONTNEED);
+    }
+    CachedStack cached = { m_stack, m_stacksize, m_guardsize };
+    cacheStack(cached);
 #endif
 }
 
@@ -454,6 +686,12 @@ Fiber::switchContext(Fiber *to)
     if (swapcontext((ucontext_t*)(this->m_sp), (ucontext_t*)to->m_sp))
         MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("swapcontext");
 
+#elif defined(ASM_FIBERS)
+#  if defined(CXXABIV1_EXCEPTION)
+    this->m_eh.swap(to->m_eh);
+#  endif
+    mordor_fiber_switch(&this->m_sp, to->m_sp);
+
 #elif defined(SETJMP_FIBERS)
     if (!setjmp(*(jmp_buf*)this->m_sp)) {
 #  if defined(CXXABIV1_EXCEPTION)
@@ -488,6 +726,19 @@ Fiber::initStack()
     m_ctx.uc_mcontext = (mcontext_t)m_mctx;
 #endif
     makecontext(&m_ctx, &Fiber::entryPoint, 0);
+#elif defined(ASM_FIBERS)
+    // Build the frame that mordor_fiber_switch restores from, so that it
+    // "returns" into entryPoint with the stack aligned as for a call
+    void **sp = (void **)(((uintptr_t)m_stack + m_stacksize) & ~(uintptr_t)15);
+    *--sp = NULL; // entryPoint's return address; it never returns
+    *--sp = (void *)&Fiber::entryPoint;
+    for (int i = 0; i < 6; ++i)
+        *--sp = NULL; // rbp, rbx, r12-r15
+    --sp;
+    // Start with this thread's floating point control words, like getcontext
+    asm volatile("stmxcsr %0" : "=m" (((unsigned int *)sp)[0]));
+    asm volatile("fnstcw %0" : "=m" (((unsigned short *)sp)[2]));
+    m_sp = sp;
 #elif defined(SETJMP_FIBERS)
     if (setjmp(m_env)) {
         Fiber::entryPoint();
@@ -519,6 +770,18 @@ Fiber::initStack()
 #endif
 }
 
+size_t
+Fiber::stackUsage()
+{
+#if !defined(WINDOWS) && defined(POSIX)
+    if (!m_stack)
+        return 0;
+    return measureStackUsage(m_stack, m_stacksize);
+#else
+    return 0;
+#endif
+}
+
 #ifdef WINDOWS
 static bool g_doesntHaveOSFLS;
 #endif
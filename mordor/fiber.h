@@ -10,17 +10,24 @@
 #include <boost/thread/mutex.hpp>
 
 #include "exception.h"
+#include "thread.h"
 #include "thread_local_storage.h"
 #include "version.h"
 
 // Fiber impl selection
 
+// On x86_64 Linux, fibers switch with a few instructions of assembly instead
+// of swapcontext, which makes a sigprocmask syscall every time.  Define
+// UCONTEXT_FIBERS (consistently, for everything including this header) to
+// fall back to ucontext.
 #ifdef X86_64
 #   ifdef WINDOWS
 #       define NATIVE_WINDOWS_FIBERS
 #   elif defined(OSX)
 #       define SETJMP_FIBERS
-#   elif defined(POSIX)
+#   elif defined(LINUX) && defined(GCC) && !defined(UCONTEXT_FIBERS)
+#       define ASM_FIBERS
+#   elif defined(POSIX) && !defined(UCONTEXT_FIBERS)
 #       define UCONTEXT_FIBERS
 #   endif
 #elif defined(X86)
@@ -56,10 +63,31 @@
 
 namespace Mordor {
 
+class Fiber;
+
+/// Link in a Scheduler's run queues
+
+/// Every Fiber embeds one, so that scheduling a Fiber doesn't need to
+/// allocate.  Scheduler derives its entries for scheduled functors from it.
+struct SchedulerHook
+{
+    SchedulerHook(Fiber *fiber = NULL)
+        : next(NULL),
+          fiber(fiber),
+          thread(emptytid())
+    {}
+
+    SchedulerHook *next;
+    /// The Fiber to run, or NULL for a functor
+    Fiber *fiber;
+    tid_t thread;
+};
+
 /// Cooperative Thread
 class Fiber : public boost::enable_shared_from_this<Fiber>
 {
     template <class T> friend class FiberLocalStorageBase;
+    friend class Scheduler;
 public:
     typedef boost::shared_ptr<Fiber> ptr;
     typedef boost::weak_ptr<Fiber> weak_ptr;
@@ -162,6 +190,16 @@ public:
     /// @pre state() != EXEC
     std::vector<void *> backtrace();
 
+    /// How deep this Fiber's stack has been used
+
+    /// This is judged by which pages of the stack have been touched, so it is
+    /// rounded up to a whole page.  Unless fiber.trackstackusage is on, a
+    /// reused stack may still have pages resident from an earlier Fiber, and
+    /// this will over-report.  With it on, the usage of every Fiber is also
+    /// recorded in the fiber.stackusage statistic when it is destroyed.
+    /// @return The high-water mark in bytes, or 0 if it can't be measured
+    size_t stackUsage();
+
 private:
     Fiber::ptr yieldTo(bool yieldToCallerOnTerminate, State targetState);
     static void setThis(Fiber *f);
@@ -178,6 +216,8 @@ private:
     boost::function<void ()> m_dg;
     void *m_stack, *m_sp;
     size_t m_stacksize;
+    // Size of the inaccessible page(s) mapped just below m_stack
+    size_t m_guardsize;
 #ifdef UCONTEXT_FIBERS
     ucontext_t m_ctx;
 #ifdef OSX
@@ -197,6 +237,12 @@ private:
     weak_ptr m_terminateOuter;
     boost::exception_ptr m_exception;
 
+    // Scheduler queue linkage; while m_queued is set, m_hook is sitting in
+    // a Scheduler's queue, and m_scheduledSelf keeps this Fiber alive
+    SchedulerHook m_hook;
+    ptr m_scheduledSelf;
+    volatile int m_queued;
+
     static ThreadLocalStorage<Fiber *> t_fiber;
 
     // FLS Support
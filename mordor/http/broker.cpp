@@ -2,14 +2,18 @@
 
 #include "broker.h"
 
+#include <boost/exception_ptr.hpp>
+
 #include "auth.h"
 #include "client.h"
 #include "mordor/atomic.h"
+#include "mordor/config.h"
 #include "mordor/fiber.h"
 #include "mordor/future.h"
 #include "mordor/iomanager.h"
 #include "mordor/log.h"
 #include "mordor/socks.h"
+#include "mordor/statistics.h"
 #include "mordor/streams/buffered.h"
 #include "mordor/streams/pipe.h"
 #include "mordor/streams/socket.h"
@@ -21,6 +25,8 @@
 namespace Mordor {
 namespace HTTP {
 
+static Logger::ptr g_log = Log::lookup("mordor:http:broker");
+
 std::pair<RequestBroker::ptr, ConnectionCache::ptr>
 createRequestBroker(const RequestBrokerOptions &options)
 {
@@ -31,6 +37,7 @@ createRequestBroker(const RequestBrokerOptions &options)
     SocketStreamBroker::ptr socketBroker(new SocketStreamBroker(options.ioManager,
         options.scheduler));
     socketBroker->connectTimeout(options.connectTimeout);
+    socketBroker->connectAttemptDelay(options.connectAttemptDelay);
     socketBroker->networkFilterCallback(options.filterNetworksCB);
 
     StreamBroker::ptr streamBroker = socketBroker;
@@ -51,6 +58,7 @@ createRequestBroker(const RequestBrokerOptions &options)
     connectionCache->proxyRequestBroker(options.proxyRequestBroker);
     connectionCache->verifySslCertificate(options.verifySslCertificate);
     connectionCache->verifySslCertificateHost(options.verifySslCertificateHost);
+    connectionCache->policy(options.endpointPolicy);
 
     RequestBroker::ptr requestBroker(new BaseRequestBroker(
         boost::static_pointer_cast<ConnectionBroker>(connectionCache)));
@@ -110,26 +118,65 @@ SocketStreamBroker::getStream(const URI &uri)
     std::vector<Address::ptr> addresses;
     {
         SchedulerSwitcher switcher(m_scheduler);
-        addresses = Address::lookup(os.str());
+        addresses = Address::lookup(os.str(), AF_UNSPEC, SOCK_STREAM);
     }
+    Stream::ptr stream(new SocketStream(connect(addresses)));
+    return stream;
+}
+
+Socket::ptr
+SocketStreamBroker::connect(const std::vector<Address::ptr> &addresses)
+{
+    MORDOR_ASSERT(!addresses.empty());
+    if (!m_ioManager || addresses.size() == 1 || m_connectAttemptDelay == ~0ull)
+        return connectSequentially(addresses);
+    return raceConnections(addresses);
+}
+
+std::list<Socket::ptr>::iterator
+SocketStreamBroker::addPending(const Address::ptr &address)
+{
+    Socket::ptr socket;
+    if (m_ioManager)
+        socket = address->createSocket(*m_ioManager, SOCK_STREAM);
+    else
+        socket = address->createSocket(SOCK_STREAM);
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (m_cancelled)
+        MORDOR_THROW_EXCEPTION(OperationAbortedException());
+    m_pending.push_back(socket);
+    std::list<Socket::ptr>::iterator it = m_pending.end();
+    return --it;
+}
+
+void
+SocketStreamBroker::removePending(std::list<Socket::ptr>::iterator it)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_pending.erase(it);
+}
+
+Socket::ptr
+SocketStreamBroker::connectSequentially(const std::vector<Address::ptr> &addresses)
+{
     Socket::ptr socket;
     for (std::vector<Address::ptr>::const_iterator it(addresses.begin());
         it != addresses.end();
         )
     {
-        if (m_ioManager)
-            socket = (*it)->createSocket(*m_ioManager, SOCK_STREAM);
-        else
-            socket = (*it)->createSocket(SOCK_STREAM);
         std::list<Socket::ptr>::iterator it2;
-        {
-            boost::mutex::scoped_lock lock(m_mutex);
-            if (m_cancelled)
-                MORDOR_THROW_EXCEPTION(OperationAbortedException());
-            m_pending.push_back(socket);
-            it2 = m_pending.end();
-            --it2;
+        try {
+            it2 = addPending(*it);
+        } catch (OperationAbortedException &) {
+            throw;
+        } catch (...) {
+            // Couldn't even create a socket for this address (its family
+            // isn't supported, say); move on to the next one
+            if (++it == addresses.end())
+                throw;
+            continue;
         }
+        socket = *it2;
         socket->sendTimeout(m_connectTimeout);
         try {
             // if we are filtering network connections, the callback will bind
@@ -141,19 +188,212 @@ SocketStreamBroker::getStream(const URI &uri)
                 m_filterNetworkCallback(socket);
             }
             socket->connect(*it);
-            boost::mutex::scoped_lock lock(m_mutex);
-            m_pending.erase(it2);
+            removePending(it2);
             break;
         } catch (...) {
-            boost::mutex::scoped_lock lock(m_mutex);
-            m_pending.erase(it2);
+            removePending(it2);
             if (++it == addresses.end())
                 throw;
         }
         socket->sendTimeout(~0ull);
     }
-    Stream::ptr stream(new SocketStream(socket));
-    return stream;
+    return socket;
+}
+
+namespace {
+// Shared by raceConnections and its connection attempts, which can still be
+// finishing up when it returns
+struct ConnectRace
+{
+    ConnectRace()
+        : running(0),
+          failures(0),
+          delayElapsed(false)
+    {}
+
+    boost::mutex mutex;
+    // Set whenever an attempt finishes, or it's time to start another
+    FiberEvent event;
+    size_t running, failures;
+    bool delayElapsed;
+    Socket::ptr winner;
+    boost::exception_ptr exception;
+};
+}
+
+static void connectAttempt(boost::shared_ptr<ConnectRace> race,
+    Socket::ptr socket, Address::ptr address)
+{
+    boost::exception_ptr exception;
+    try {
+        socket->connect(address);
+    } catch (boost::exception &ex) {
+        removeTopFrames(ex);
+        exception = boost::current_exception();
+    } catch (...) {
+        exception = boost::current_exception();
+    }
+    {
+        boost::mutex::scoped_lock lock(race->mutex);
+        --race->running;
+        if (exception) {
+            ++race->failures;
+            race->exception = exception;
+        } else if (!race->winner) {
+            race->winner = socket;
+        }
+    }
+    race->event.set();
+}
+
+static void connectAttemptDelayElapsed(boost::shared_ptr<ConnectRace> race)
+{
+    {
+        boost::mutex::scoped_lock lock(race->mutex);
+        race->delayElapsed = true;
+    }
+    race->event.set();
+}
+
+// RFC 8305 section 4: alternate between address families, starting with
+// whichever the resolver put first, so that a family that's broken costs
+// at most one connection attempt delay
+static std::vector<Address::ptr>
+interleaveFamilies(const std::vector<Address::ptr> &addresses)
+{
+    std::vector<Address::ptr> preferred, others, result;
+    int family = addresses.front()->family();
+    for (std::vector<Address::ptr>::const_iterator it(addresses.begin());
+        it != addresses.end();
+        ++it) {
+        if ((*it)->family() == family)
+            preferred.push_back(*it);
+        else
+            others.push_back(*it);
+    }
+    result.reserve(addresses.size());
+    for (size_t i = 0; i < preferred.size() || i < others.size(); ++i) {
+        if (i < preferred.size())
+            result.push_back(preferred[i]);
+        if (i < others.size())
+            result.push_back(others[i]);
+    }
+    return result;
+}
+
+Socket::ptr
+SocketStreamBroker::raceConnections(const std::vector<Address::ptr> &addresses)
+{
+    std::vector<Address::ptr> ordered = interleaveFamilies(addresses);
+    boost::shared_ptr<ConnectRace> race(new ConnectRace());
+    std::vector<std::list<Socket::ptr>::iterator> pending;
+    Timer::ptr delay;
+    size_t next = 0, failuresSeen = 0;
+    bool startNext = true, aborted = false;
+    while (true) {
+        if (startNext && next < ordered.size()) {
+            startNext = false;
+            Address::ptr address = ordered[next++];
+            std::list<Socket::ptr>::iterator it;
+            try {
+                it = addPending(address);
+            } catch (OperationAbortedException &) {
+                // Stop starting attempts, and let the rest be cancelled
+                aborted = true;
+                next = ordered.size();
+                continue;
+            } catch (...) {
+                // Couldn't even create a socket for this address (its family
+                // isn't supported, say); move on to the next one
+                boost::mutex::scoped_lock lock(race->mutex);
+                race->exception = boost::current_exception();
+                startNext = true;
+                continue;
+            }
+            pending.push_back(it);
+            Socket::ptr socket = *it;
+            socket->sendTimeout(m_connectTimeout);
+            try {
+                // if we are filtering network connections, the callback will
+                // bind the socket to an approved network address (or throw)
+                if (m_filterNetworkCallback != NULL)
+                    m_filterNetworkCallback(socket);
+            } catch (...) {
+                boost::mutex::scoped_lock lock(race->mutex);
+                race->exception = boost::current_exception();
+                startNext = true;
+                continue;
+            }
+            {
+                boost::mutex::scoped_lock lock(race->mutex);
+                ++race->running;
+                race->delayElapsed = false;
+            }
+            MORDOR_LOG_DEBUG(g_log) << this << " racing connection to "
+                << *address;
+            m_ioManager->schedule(boost::bind(&connectAttempt, race, socket,
+                address));
+            if (delay)
+                delay->cancel();
+            if (next < ordered.size())
+                delay = m_ioManager->registerTimer(m_connectAttemptDelay,
+                    boost::bind(&connectAttemptDelayElapsed, race));
+        }
+        {
+            boost::mutex::scoped_lock lock(race->mutex);
+            if (race->winner ||
+                (race->running == 0 && next >= ordered.size()))
+                break;
+            // A failure means there's no point waiting out the delay
+            if (race->failures != failuresSeen || race->running == 0 ||
+                race->delayElapsed) {
+                failuresSeen = race->failures;
+                race->delayElapsed = false;
+                startNext = true;
+                continue;
+            }
+        }
+        race->event.wait();
+    }
+    if (delay)
+        delay->cancel();
+
+    Socket::ptr winner;
+    {
+        boost::mutex::scoped_lock lock(race->mutex);
+        winner = race->winner;
+    }
+    // Call off the rest, and wait for them to give up
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        for (std::vector<std::list<Socket::ptr>::iterator>::const_iterator
+            it(pending.begin()); it != pending.end(); ++it) {
+            if (**it != winner)
+                (**it)->cancelConnect();
+        }
+    }
+    while (true) {
+        {
+            boost::mutex::scoped_lock lock(race->mutex);
+            if (race->running == 0)
+                break;
+        }
+        race->event.wait();
+    }
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        for (std::vector<std::list<Socket::ptr>::iterator>::const_iterator
+            it(pending.begin()); it != pending.end(); ++it)
+            m_pending.erase(*it);
+    }
+    if (!winner) {
+        if (aborted)
+            MORDOR_THROW_EXCEPTION(OperationAbortedException());
+        Mordor::rethrow_exception(race->exception);
+    }
+    MORDOR_LOG_DEBUG(g_log) << this << " connected to "
+        << *winner->remoteAddress();
+    return winner;
 }
 
 void
@@ -170,20 +410,100 @@ SocketStreamBroker::cancelPending()
     }
 }
 
-static bool least(const ClientConnection::ptr &lhs,
-                  const ClientConnection::ptr &rhs)
+static Logger::ptr g_cacheLog = Log::lookup("mordor:http:connectioncache");
+
+static ConfigVar<size_t>::ptr g_endpointStatistics =
+    Config::lookup<size_t>("http.endpointstatistics", 100u,
+    "Endpoints counted in their own http.endpoint.* statistics; the rest "
+    "share http.endpoint.other.*");
+
+// Guards registering each endpoint's statistics
+static boost::mutex g_statisticsMutex;
+
+struct ConnectionCache::EndpointStatistics
 {
-    if (lhs && rhs)
-        return lhs->outstandingRequests() <
-            rhs->outstandingRequests();
-    if (!lhs)
-        return false;
-    if (!rhs)
-        return true;
-    MORDOR_NOTREACHED();
+    EndpointStatistics(const std::string &prefix)
+        : connections(lookup(prefix + "connections",
+              "connections established")),
+          requests(lookup(prefix + "requests",
+              "connections handed out for a request")),
+          pipelined(lookup(prefix + "pipelined",
+              "requests pipelined behind another")),
+          waits(lookup(prefix + "waits",
+              "times a request waited for a connection")),
+          passedOver(lookup(prefix + "passedover",
+              "times a connection reading a large response was passed over"))
+    {}
+
+    static CountStatistic<unsigned long long> &lookup(const std::string &name,
+        const char *description)
+    {
+        CountStatistic<unsigned long long> *stat =
+            Statistics::lookup<CountStatistic<unsigned long long> >(name);
+        if (stat)
+            return *stat;
+        return Statistics::registerStatistic(name,
+            CountStatistic<unsigned long long>(), description);
+    }
+
+    CountStatistic<unsigned long long> &connections, &requests, &pipelined,
+        &waits, &passedOver;
+};
+
+ConnectionCache::EndpointStatistics &
+ConnectionCache::statistics(const URI &endpoint)
+{
+    boost::mutex::scoped_lock lock(g_statisticsMutex);
+    // Shared by every ConnectionCache, and never freed, like every other
+    // Statistic; so a process that talks to endless hosts only gets so many
+    static std::map<URI, EndpointStatistics *> stats;
+    std::map<URI, EndpointStatistics *>::iterator it = stats.find(endpoint);
+    if (it != stats.end())
+        return *it->second;
+    if (stats.size() >= g_endpointStatistics->val()) {
+        static EndpointStatistics *other =
+            new EndpointStatistics("http.endpoint.other.");
+        return *other;
+    }
+    it = stats.insert(std::make_pair(endpoint, new EndpointStatistics(
+        "http.endpoint." + endpoint.toString() + "."))).first;
+    return *it->second;
 }
 
-static Logger::ptr g_cacheLog = Log::lookup("mordor:http:connectioncache");
+ConnectionCache::~ConnectionCache()
+{
+    // Connections handed out can outlive us; don't leave their idle timers
+    // calling back into a dead cache.  Not locked: nothing else may be using
+    // the cache by now, and a FiberMutex would need a Scheduler.
+    // requestComplete needs no help; it only holds a weak_ptr
+    for (CachedConnectionMap::iterator it = m_conns.begin();
+        it != m_conns.end();
+        ++it) {
+        for (ConnectionList::iterator it2 = it->second->connections.begin();
+            it2 != it->second->connections.end();
+            ++it2) {
+            if (*it2 && m_idleTimeout != ~0ull)
+                (*it2)->idleTimeout(~0ull, NULL);
+        }
+    }
+}
+
+void
+ConnectionCache::policy(const URI &endpoint, const EndpointPolicy &policy)
+{
+    URI schemeAndAuthority = endpoint;
+    schemeAndAuthority.path = URI::Path();
+    schemeAndAuthority.queryDefined(false);
+    schemeAndAuthority.fragmentDefined(false);
+    m_policies[schemeAndAuthority] = policy;
+}
+
+const EndpointPolicy &
+ConnectionCache::policyFor(const URI &endpoint) const
+{
+    std::map<URI, EndpointPolicy>::const_iterator it = m_policies.find(endpoint);
+    return it == m_policies.end() ? m_defaultPolicy : it->second;
+}
 
 std::pair<ClientConnection::ptr, bool>
 ConnectionCache::getConnection(const URI &uri, bool forceNewConnection)
@@ -210,7 +530,7 @@ ConnectionCache::getConnection(const URI &uri, bool forceNewConnection)
     schemeAndAuthority.fragmentDefined(false);
     std::pair<ClientConnection::ptr, bool> result;
 
-    FiberMutex::ScopedLock lock(m_mutex);
+    FiberMutex::ScopedLock lock(*m_mutex);
 
     if (g_cacheLog->enabled(Log::DEBUG)) {
         std::ostringstream os;
@@ -277,42 +597,84 @@ ConnectionCache::getConnectionViaProxyFromCache(const URI &uri, const URI &proxy
 
     bool proxied = proxy.schemeDefined() && proxy.scheme() == "http";
     const URI &endpoint = proxied ? proxy : uri;
+    const EndpointPolicy &policy = policyFor(endpoint);
     CachedConnectionMap::iterator it = m_conns.find(endpoint);
-    ConnectionList::iterator it2;
     while (true) {
-        if (it != m_conns.end() &&
-            !it->second->connections.empty() &&
-            it->second->connections.size() >= m_connectionsPerHost) {
-            boost::shared_ptr<ConnectionInfo> info = it->second;
-            ConnectionList &connsForThisUri = info->connections;
-            // Assign it2 to point to the connection with the
-            // least number of outstanding requests
-            it2 = std::min_element(connsForThisUri.begin(),
-                connsForThisUri.end(), &least);
-            // No connection has completed yet (but it's in progress)
-            if (!*it2) {
-                MORDOR_LOG_TRACE(g_cacheLog) << this << " waiting for connection to "
-                    << endpoint;
-                // Wait for somebody to let us try again
-                unsigned long long start = TimerManager::now();
-                info->condition.wait();
-                if (info->lastFailedConnectionTimestamp <= start)
-                    MORDOR_THROW_EXCEPTION(PriorConnectionFailedException());
-                if (m_closed)
-                    MORDOR_THROW_EXCEPTION(OperationAbortedException());
-                // We let go of the mutex, and the last connection may have
-                // disappeared
-                it = m_conns.find(endpoint);
-            } else {
-                MORDOR_LOG_TRACE(g_cacheLog) << this << " returning cached connection "
-                    << *it2 << " to " << endpoint;
-                // Return the existing, completed connection
-                return std::make_pair(*it2, proxied);
-            }
-        } else {
+        if (it == m_conns.end() || it->second->connections.empty()) {
             // No existing connections
             return std::make_pair(ClientConnection::ptr(), false);
         }
+        boost::shared_ptr<ConnectionInfo> info = it->second;
+        ConnectionList &connsForThisUri = info->connections;
+        // Find the connection with room in its pipeline and the least
+        // pending Content-Length (then requests), preferring ones that
+        // aren't in the middle of a large response
+        ClientConnection::ptr best;
+        size_t bestRequests = 0;
+        unsigned long long bestBytes = 0;
+        bool bestLarge = false, sawLarge = false;
+        for (ConnectionList::iterator it2 = connsForThisUri.begin();
+            it2 != connsForThisUri.end();
+            ++it2) {
+            // Not established yet
+            if (!*it2)
+                continue;
+            size_t requests = (*it2)->outstandingRequests();
+            if (requests >= policy.maxPipelineDepth)
+                continue;
+            bool large = (*it2)->currentResponseLength() >=
+                policy.largeResponse;
+            unsigned long long bytes = (*it2)->pendingContentLength();
+            sawLarge = sawLarge || large;
+            if (!best || large < bestLarge || (large == bestLarge &&
+                (bytes < bestBytes ||
+                (bytes == bestBytes && requests < bestRequests)))) {
+                best = *it2;
+                bestRequests = requests;
+                bestBytes = bytes;
+                bestLarge = large;
+            }
+        }
+        // An idle connection beats opening another one
+        if (best && bestRequests == 0) {
+            MORDOR_LOG_TRACE(g_cacheLog) << this << " returning idle connection "
+                << best << " to " << endpoint;
+            info->stats.requests.increment();
+            if (sawLarge)
+                info->stats.passedOver.increment();
+            return std::make_pair(best, proxied);
+        }
+        if (connsForThisUri.size() < policy.maxConnections)
+            return std::make_pair(ClientConnection::ptr(), false);
+        if (best) {
+            MORDOR_LOG_TRACE(g_cacheLog) << this << " returning cached connection "
+                << best << " to " << endpoint << " (" << bestRequests
+                << " requests, " << bestBytes
+                << " bytes of Content-Length pending)";
+            info->stats.requests.increment();
+            info->stats.pipelined.increment();
+            if (sawLarge && !bestLarge)
+                info->stats.passedOver.increment();
+            return std::make_pair(best, proxied);
+        }
+        // Every connection is still being established, or is as deep as it's
+        // allowed to get
+        MORDOR_LOG_TRACE(g_cacheLog) << this << " waiting for connection to "
+            << endpoint;
+        info->stats.waits.increment();
+        // Wait for somebody to let us try again
+        unsigned long long start = TimerManager::now();
+        unsigned long long lastFailed = info->lastFailedConnectionTimestamp;
+        info->condition.wait();
+        if (info->lastFailedConnectionTimestamp != lastFailed &&
+            info->lastFailedConnectionTimestamp <= start)
+            MORDOR_THROW_EXCEPTION(PriorConnectionFailedException());
+        if (m_closed)
+            MORDOR_THROW_EXCEPTION(OperationAbortedException());
+        // We let go of the mutex, and connections may have died or
+        // disappeared
+        cleanOutDeadConns(m_conns);
+        it = m_conns.find(endpoint);
     }
 }
 
@@ -333,7 +695,7 @@ ConnectionCache::getConnectionViaProxy(const URI &uri, const URI &proxy,
     CachedConnectionMap::iterator it = m_conns.find(endpoint);
     boost::shared_ptr<ConnectionInfo> info;
     if (it == m_conns.end()) {
-        info.reset(new ConnectionInfo(m_mutex));
+        info.reset(new ConnectionInfo(m_mutex, statistics(endpoint)));
         it = m_conns.insert(std::make_pair(endpoint, info)).first;
     } else {
         info = it->second;
@@ -389,6 +751,13 @@ ConnectionCache::getConnectionViaProxy(const URI &uri, const URI &proxy,
             result.first->idleTimeout(m_idleTimeout,
             boost::bind(&ConnectionCache::dropConnection, this, endpoint,
                 result.first.get()));
+        // Only needed to wake up requests waiting for a pipeline to drain
+        if (policyFor(endpoint).maxPipelineDepth != (size_t)~0)
+            result.first->onRequestComplete(boost::bind(
+                &ConnectionCache::requestComplete,
+                boost::weak_ptr<ConnectionInfo>(info)));
+        info->stats.connections.increment();
+        info->stats.requests.increment();
         // Assign this connection to the first blank connection for this
         // schemeAndAuthority
         for (it2 = info->connections.begin();
@@ -436,7 +805,7 @@ ConnectionCache::getConnectionViaProxy(const URI &uri, const URI &proxy,
 void
 ConnectionCache::closeIdleConnections()
 {
-    FiberMutex::ScopedLock lock(m_mutex);
+    FiberMutex::ScopedLock lock(*m_mutex);
     MORDOR_LOG_DEBUG(g_cacheLog) << " dropping idle connections";
     // We don't just clear the list, because there may be a connection in
     // progress that has an iterator into it
@@ -451,6 +820,7 @@ ConnectionCache::closeIdleConnections()
                 connStream->cancelWrite();
                 if (m_idleTimeout != ~0ull)
                     (*it2)->idleTimeout(~0ull, NULL);
+                (*it2)->onRequestComplete(NULL);
                 it2 = it->second->connections.erase(it2);
             } else {
                 ++it2;
@@ -469,7 +839,7 @@ ConnectionCache::closeIdleConnections()
 void
 ConnectionCache::abortConnections()
 {
-    FiberMutex::ScopedLock lock(m_mutex);
+    FiberMutex::ScopedLock lock(*m_mutex);
     MORDOR_LOG_DEBUG(g_cacheLog) << " aborting all connections";
     m_closed = true;
     CachedConnectionMap::iterator it;
@@ -484,6 +854,7 @@ ConnectionCache::abortConnections()
                 connStream->cancelWrite();
                 if (m_idleTimeout != ~0ull)
                     (*it2)->idleTimeout(~0ull, NULL);
+                (*it2)->onRequestComplete(NULL);
             }
         }
     }
@@ -503,6 +874,7 @@ ConnectionCache::cleanOutDeadConns(CachedConnectionMap &conns)
             if (*it2 && !(*it2)->newRequestsAllowed()) {
                 if (m_idleTimeout != ~0ull)
                     (*it2)->idleTimeout(~0ull, NULL);
+                (*it2)->onRequestComplete(NULL);
                 it2 = it->second->connections.erase(it2);
             } else {
                 ++it2;
@@ -572,7 +944,7 @@ void
 ConnectionCache::dropConnection(const URI &uri,
     const ClientConnection *connection)
 {
-    FiberMutex::ScopedLock lock(m_mutex);
+    FiberMutex::ScopedLock lock(*m_mutex);
     CachedConnectionMap::iterator it = m_conns.find(uri);
     if (it == m_conns.end())
         return;
@@ -583,12 +955,27 @@ ConnectionCache::dropConnection(const URI &uri,
             << connection << " to " << uri;
         if (m_idleTimeout != ~0ull)
             (*it2)->idleTimeout(~0ull, NULL);
+        (*it2)->onRequestComplete(NULL);
         it->second->connections.erase(it2);
+        // Someone waiting for a connection may be able to open one now
+        it->second->condition.broadcast();
         if (it->second->connections.empty())
             m_conns.erase(it);
     }
 }
 
+void
+ConnectionCache::requestComplete(boost::weak_ptr<ConnectionInfo> weakInfo)
+{
+    // Called by the connection after it unlocks, so the cache (or just this
+    // endpoint's entry) may be gone already
+    boost::shared_ptr<ConnectionInfo> info = weakInfo.lock();
+    if (!info)
+        return;
+    FiberMutex::ScopedLock lock(*info->mutex);
+    info->condition.broadcast();
+}
+
 std::pair<ClientConnection::ptr, bool>
 MockConnectionBroker::getConnection(const URI &uri, bool forceNewConnection)
 {
@@ -9,6 +9,7 @@
 
 namespace Mordor {
 
+struct Address;
 class IOManager;
 class Scheduler;
 class Socket;
@@ -73,25 +74,48 @@ public:
           m_ioManager(ioManager),
           m_scheduler(scheduler),
           m_connectTimeout(~0ull),
+          m_connectAttemptDelay(250000ull),
           m_filterNetworkCallback(NULL)
     {}
 
     void connectTimeout(unsigned long long timeout) { m_connectTimeout = timeout; }
+    /// @brief How long to wait on one address before also trying the next
+    /// @details
+    /// When a host has several addresses, connections are raced in the
+    /// style of RFC 8305 ("Happy Eyeballs"): families are interleaved, a
+    /// new attempt is started each time this elapses (or the previous one
+    /// fails), and the first to connect wins while the rest are cancelled.
+    /// ~0ull tries one address at a time, each for the full connectTimeout.
+    /// Racing requires an IOManager.
+    void connectAttemptDelay(unsigned long long delay)
+    { m_connectAttemptDelay = delay; }
 
     // Resolve the uri to its IP address, create a socket, then connect
     boost::shared_ptr<Stream> getStream(const URI &uri);
+    /// Connect to the first of addresses to accept a connection
+    boost::shared_ptr<Socket> connect(
+        const std::vector<boost::shared_ptr<Address> > &addresses);
     void cancelPending();
 
     void networkFilterCallback(boost::function<void (boost::shared_ptr<Socket>)> fnCallback)
     {  m_filterNetworkCallback = fnCallback; }
 
+private:
+    std::list<boost::shared_ptr<Socket> >::iterator
+        addPending(const boost::shared_ptr<Address> &address);
+    void removePending(std::list<boost::shared_ptr<Socket> >::iterator it);
+    boost::shared_ptr<Socket> connectSequentially(
+        const std::vector<boost::shared_ptr<Address> > &addresses);
+    boost::shared_ptr<Socket> raceConnections(
+        const std::vector<boost::shared_ptr<Address> > &addresses);
+
 private:
     boost::mutex m_mutex;
     bool m_cancelled;
     std::list<boost::shared_ptr<Socket> > m_pending; // Multiple connections may be attempted when getaddrinfo returns multiple addresses
     IOManager *m_ioManager;
     Scheduler *m_scheduler;
-    unsigned long long m_connectTimeout;
+    unsigned long long m_connectTimeout, m_connectAttemptDelay;
 
     boost::function<void (boost::shared_ptr<Socket>)> m_filterNetworkCallback;
 };
@@ -111,6 +135,29 @@ public:
 
 struct PriorConnectionFailedException : virtual Exception {};
 
+/// How a ConnectionCache spreads requests to one endpoint (a host, or the
+/// proxy in front of it) over connections
+struct EndpointPolicy
+{
+    EndpointPolicy()
+        : maxConnections(1u),
+          maxPipelineDepth(~0),
+          largeResponse(~0ull)
+    {}
+
+    /// Connections to open to the endpoint; while there are fewer, a request
+    /// that finds no idle connection gets a new one instead of being
+    /// pipelined
+    size_t maxConnections;
+    /// Requests that may be outstanding on one connection; when every
+    /// connection is this deep, getConnection waits for one to drain
+    size_t maxPipelineDepth;
+    /// A connection reading a response whose Content-Length is at least this
+    /// many bytes only gets more requests if no other connection can take
+    /// them, to keep them from queuing behind it
+    unsigned long long largeResponse;
+};
+
 // The ConnectionCache holds all connections associated with a RequestBroker.
 // This is not a global cache of all connections - each RequestBroker instance
 // will have its own.
@@ -125,6 +172,13 @@ struct PriorConnectionFailedException : virtual Exception {};
 //
 // Although exposed by createRequestBroker(), normal clients will not manipulate
 // the ConnectionCache directly, apart from calling abortConnections or closeIdleConnections
+//
+// How requests are spread over the connections to each endpoint is set by
+// an EndpointPolicy; what happened is counted in the Statistics named
+// "http.endpoint.<scheme://authority>.*" (connections, requests, pipelined,
+// waits and passedover), shared by every ConnectionCache in the process.
+// Only the first http.endpointstatistics endpoints get their own; the rest
+// are counted together in "http.endpoint.other.*".
 class ConnectionCache : public ConnectionBroker
 {
 public:
@@ -132,8 +186,8 @@ public:
 
 public:
     ConnectionCache(StreamBroker::ptr streamBroker, TimerManager *timerManager = NULL)
-        : m_streamBroker(streamBroker),
-          m_connectionsPerHost(1u),
+        : m_mutex(new FiberMutex()),
+          m_streamBroker(streamBroker),
           m_closed(false),
           m_verifySslCertificate(false),
           m_verifySslCertificateHost(true),
@@ -145,10 +199,17 @@ public:
           m_sslWriteTimeout(~0ull),
           m_sslCtx(NULL)
     {}
+    ~ConnectionCache();
 
     // Specify the maximum number of seperate connections to allow to a specific host (or proxy)
     // at a time
-    void connectionsPerHost(size_t connections) { m_connectionsPerHost = connections; }
+    void connectionsPerHost(size_t connections)
+    { m_defaultPolicy.maxConnections = connections; }
+    /// The policy for endpoints that haven't been given their own
+    void policy(const EndpointPolicy &policy) { m_defaultPolicy = policy; }
+    /// The policy for one endpoint; only its scheme and authority are used
+    /// (for a connection through an HTTP proxy, the endpoint is the proxy)
+    void policy(const URI &endpoint, const EndpointPolicy &policy);
 
     void httpReadTimeout(unsigned long long timeout) { m_httpReadTimeout = timeout; }
     void httpWriteTimeout(unsigned long long timeout) { m_httpWriteTimeout = timeout; }
@@ -184,18 +245,27 @@ public:
 private:
     typedef std::list<boost::shared_ptr<ClientConnection> > ConnectionList;
 
+    struct EndpointStatistics;
+
     // Tracks active connections to a particular host
     // e.g. there might be 5 active connections to http://example.com
     struct ConnectionInfo
     {
-        ConnectionInfo(FiberMutex &mutex)
-            : condition(mutex),
-              lastFailedConnectionTimestamp(~0ull)
+        ConnectionInfo(boost::shared_ptr<FiberMutex> mutex,
+            EndpointStatistics &stats)
+            : mutex(mutex),
+              condition(*mutex),
+              lastFailedConnectionTimestamp(~0ull),
+              stats(stats)
         {}
 
+        // The cache's; held here too so requestComplete can still take it
+        // after the cache is gone
+        boost::shared_ptr<FiberMutex> mutex;
         ConnectionList connections;
         FiberCondition condition;
         unsigned long long lastFailedConnectionTimestamp;
+        EndpointStatistics &stats;
     };
 
     // Table of active connections for each scheme+host
@@ -212,11 +282,15 @@ private:
     void cleanOutDeadConns(CachedConnectionMap &conns);
     void addSSL(const URI &uri, boost::shared_ptr<Stream> &stream);
     void dropConnection(const URI &uri, const ClientConnection *connection);
+    static void requestComplete(boost::weak_ptr<ConnectionInfo> info);
+    static EndpointStatistics &statistics(const URI &endpoint);
+    const EndpointPolicy &policyFor(const URI &endpoint) const;
 
 private:
-    FiberMutex m_mutex;
+    boost::shared_ptr<FiberMutex> m_mutex;
     StreamBroker::ptr m_streamBroker;
-    size_t m_connectionsPerHost;
+    EndpointPolicy m_defaultPolicy;
+    std::map<URI, EndpointPolicy> m_policies;
 
     CachedConnectionMap m_conns;
     bool m_closed, m_verifySslCertificate, m_verifySslCertificateHost;
@@ -446,6 +520,7 @@ struct RequestBrokerOptions
         handleRedirects(true),
         timerManager(NULL),
         connectTimeout(~0ull),
+        connectAttemptDelay(250000ull),
         sslConnectReadTimeout(~0ull),
         sslConnectWriteTimeout(~0ull),
         httpReadTimeout(~0ull),
@@ -473,11 +548,15 @@ struct RequestBrokerOptions
 
     // Optional timeout values (ns)
     unsigned long long connectTimeout;
+    // See SocketStreamBroker::connectAttemptDelay
+    unsigned long long connectAttemptDelay;
     unsigned long long sslConnectReadTimeout;
     unsigned long long sslConnectWriteTimeout;
     unsigned long long httpReadTimeout;
     unsigned long long httpWriteTimeout;
     unsigned long long idleTimeout;
+    // See ConnectionCache::policy
+    EndpointPolicy endpointPolicy;
 
     // Callback to find proxy for an URI, see ConnectionCache::proxyForURI
     boost::function<std::vector<URI> (const URI &)> proxyForURIDg;
@@ -96,6 +96,44 @@ ClientConnection::outstandingRequests()
     return m_pendingRequests.size();
 }
 
+unsigned long long
+ClientConnection::pendingContentLength()
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    invariant();
+    unsigned long long result = 0;
+    for (std::list<ClientRequest *>::const_iterator it(m_pendingRequests.begin());
+        it != m_pendingRequests.end();
+        ++it) {
+        ClientRequest *request = *it;
+        if (request->m_requestState < ClientRequest::COMPLETE)
+            result += request->m_requestLength;
+        if (request->m_responseState == ClientRequest::BODY)
+            result += request->m_responseLength;
+    }
+    return result;
+}
+
+unsigned long long
+ClientConnection::currentResponseLength()
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    invariant();
+    if (m_pendingRequests.empty())
+        return 0;
+    ClientRequest *request = m_pendingRequests.front();
+    if (request->m_responseState != ClientRequest::BODY)
+        return 0;
+    return request->m_responseLength;
+}
+
+void
+ClientConnection::onRequestComplete(boost::function<void ()> dg)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_requestCompleteDg = dg;
+}
+
 bool
 ClientConnection::supportsTimeouts() const
 {
@@ -240,9 +278,11 @@ void
 ClientConnection::scheduleNextResponse(ClientRequest *request)
 {
     bool close = false;
+    boost::function<void ()> requestCompleteDg;
     {
         boost::mutex::scoped_lock lock(m_mutex);
         invariant();
+        requestCompleteDg = m_requestCompleteDg;
         MORDOR_ASSERT(!m_pendingRequests.empty());
         MORDOR_ASSERT(request == m_pendingRequests.front());
         MORDOR_ASSERT(request->m_responseState == ClientRequest::BODY ||
@@ -302,6 +342,8 @@ ClientConnection::scheduleNextResponse(ClientRequest *request)
         } catch (...) {
         }
     }
+    if (requestCompleteDg)
+        requestCompleteDg();
 }
 
 void
@@ -494,9 +536,12 @@ ClientRequest::ClientRequest(ClientConnection::ptr conn, const Request &request)
   m_responseState(PENDING),
   m_badTrailer(false),
   m_incompleteTrailer(false),
-  m_hasResponseBody(false)
+  m_hasResponseBody(false),
+  m_responseLength(0)
 {
     MORDOR_ASSERT(m_conn);
+    m_requestLength = m_request.entity.contentLength == ~0ull ? 0 :
+        m_request.entity.contentLength;
 }
 
 ClientRequest::~ClientRequest()
@@ -692,24 +737,30 @@ ClientRequest::cancel(bool abort, bool error)
         // Just abandon it
         m_requestState = CANCELED;
         m_responseState = CANCELED;
-        boost::mutex::scoped_lock lock(m_conn->m_mutex);
-        m_conn->invariant();
-        std::list<ClientRequest *>::iterator it =
-            std::find(m_conn->m_pendingRequests.begin(),
-            m_conn->m_pendingRequests.end(), this);
-        MORDOR_ASSERT(it != m_conn->m_pendingRequests.end());
-        m_conn->m_pendingRequests.erase(it);
-        if (m_responseState == WAITING) {
-            std::set<ClientRequest *>::iterator waitIt =
-                m_conn->m_waitingResponses.find(this);
-            MORDOR_ASSERT(waitIt != m_conn->m_waitingResponses.end());
-            m_conn->m_waitingResponses.erase(waitIt);
-            MORDOR_LOG_TRACE(g_log) << m_conn->m_connectionNumber << "-" << m_requestNumber
-                << " scheduling response";
-            m_scheduler->schedule(m_fiber);
-            m_scheduler = NULL;
-            m_fiber.reset();
+        boost::function<void ()> requestCompleteDg;
+        {
+            boost::mutex::scoped_lock lock(m_conn->m_mutex);
+            m_conn->invariant();
+            requestCompleteDg = m_conn->m_requestCompleteDg;
+            std::list<ClientRequest *>::iterator it =
+                std::find(m_conn->m_pendingRequests.begin(),
+                m_conn->m_pendingRequests.end(), this);
+            MORDOR_ASSERT(it != m_conn->m_pendingRequests.end());
+            m_conn->m_pendingRequests.erase(it);
+            if (m_responseState == WAITING) {
+                std::set<ClientRequest *>::iterator waitIt =
+                    m_conn->m_waitingResponses.find(this);
+                MORDOR_ASSERT(waitIt != m_conn->m_waitingResponses.end());
+                m_conn->m_waitingResponses.erase(waitIt);
+                MORDOR_LOG_TRACE(g_log) << m_conn->m_connectionNumber << "-" << m_requestNumber
+                    << " scheduling response";
+                m_scheduler->schedule(m_fiber);
+                m_scheduler = NULL;
+                m_fiber.reset();
+            }
         }
+        if (requestCompleteDg)
+            requestCompleteDg();
         return;
     }
     if (m_requestStream) {
@@ -740,9 +791,11 @@ ClientRequest::cancel(bool abort, bool error)
     bool close = false, waiting = m_responseState == WAITING;
     if (m_responseState != HEADERS)
         abort = true;
+    boost::function<void ()> requestCompleteDg;
     {
         boost::mutex::scoped_lock lock(m_conn->m_mutex);
         m_conn->invariant();
+        requestCompleteDg = m_conn->m_requestCompleteDg;
         m_conn->m_priorResponseFailed = m_requestNumber;
         if (m_requestState < COMPLETE)
             m_requestState = error ? ERROR : CANCELED;
@@ -779,6 +832,8 @@ ClientRequest::cancel(bool abort, bool error)
     if (close)
         m_conn->m_stream->cancelRead();
     m_conn->m_stream->cancelWrite();
+    if (requestCompleteDg)
+        requestCompleteDg();
 }
 
 void
@@ -963,11 +1018,12 @@ ClientRequest::doRequest()
 
     try {
         // Do the request
-        std::ostringstream os;
-        os << m_request;
-        std::string str = os.str();
+        Buffer headers;
+        serialize(headers, m_request);
         msp_requestLogger->logRequest(m_conn->m_connectionNumber, m_requestNumber, m_request);
-        m_conn->m_stream->write(str.c_str(), str.size());
+        while (headers.readAvailable() > 0)
+            headers.consume(m_conn->m_stream->write(headers,
+                headers.readAvailable()));
 
         if (!Connection::hasMessageBody(m_request.general, m_request.entity, requestLine.method, INVALID, false)) {
             MORDOR_LOG_TRACE(g_log) << m_conn->m_connectionNumber << "-" << m_requestNumber << " no request body";
@@ -1141,6 +1197,8 @@ ClientRequest::ensureResponse()
             if (close) {
                 boost::mutex::scoped_lock lock(m_conn->m_mutex);
                 m_conn->invariant();
+                if (hasBody && m_response.entity.contentLength != ~0ull)
+                    m_responseLength = m_response.entity.contentLength;
                 m_conn->m_priorResponseClosed = m_requestNumber;
                 MORDOR_ASSERT(!m_conn->m_pendingRequests.empty());
                 MORDOR_ASSERT(m_conn->m_pendingRequests.front() == this);
@@ -1150,6 +1208,9 @@ ClientRequest::ensureResponse()
                 m_conn->scheduleAllWaitingRequests();
                 m_conn->scheduleAllWaitingResponses();
             } else {
+                boost::mutex::scoped_lock lock(m_conn->m_mutex);
+                if (hasBody && m_response.entity.contentLength != ~0ull)
+                    m_responseLength = m_response.entity.contentLength;
                 m_responseState = connect ? COMPLETE : BODY;
             }
 
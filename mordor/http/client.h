@@ -118,6 +118,8 @@ private:
     State m_requestState, m_responseState;
     boost::exception_ptr m_priorResponseException;
     bool m_badTrailer, m_incompleteTrailer, m_hasResponseBody;
+    // Known body lengths, for ClientConnection::pendingContentLength
+    unsigned long long m_requestLength, m_responseLength;
     boost::shared_ptr<Stream> m_requestStream;
     boost::weak_ptr<Stream> m_responseStream;
     boost::shared_ptr<Multipart> m_requestMultipart;
@@ -163,6 +165,18 @@ public:
 
     bool newRequestsAllowed();
     size_t outstandingRequests();
+    /// Sum of the Content-Lengths of the request bodies not yet completely
+    /// sent on this connection, plus that of the response being read.  These
+    /// are whole lengths, not what's left of them: a cheap measure of how
+    /// much a new request would queue behind, not a transfer count
+    unsigned long long pendingContentLength();
+    /// Content-Length of the response being read; 0 if no response body is
+    /// being read, or its length isn't known (i.e. it's chunked)
+    unsigned long long currentResponseLength();
+    /// Called (without the connection's lock held) each time a response
+    /// completes or a request is cancelled, so whoever is limiting how many
+    /// requests are pipelined on this connection can queue another
+    void onRequestComplete(boost::function<void ()> dg);
 
     bool supportsTimeouts() const;
 
@@ -182,7 +196,7 @@ private:
     unsigned long long m_readTimeout, m_idleTimeout;
     boost::shared_ptr<Timer> m_idleTimer;
     TimerManager *m_timerManager;
-    boost::function<void ()> m_idleDg;
+    boost::function<void ()> m_idleDg, m_requestCompleteDg;
     std::list<ClientRequest *> m_pendingRequests;
     std::list<ClientRequest *>::iterator m_currentRequest;
     std::set<ClientRequest *> m_waitingResponses;
@@ -0,0 +1,203 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "compact.h"
+
+#include <stdexcept>
+
+#include "mordor/assert.h"
+#include "parser.h"
+
+namespace Mordor {
+namespace HTTP {
+
+#define HEADER_NAME(name) { name, sizeof(name) - 1 }
+
+static const struct {
+    const char *name;
+    size_t length;
+} g_headerNames[HEADER_FIELD_COUNT] = {
+    HEADER_NAME("Accept-Charset"),
+    HEADER_NAME("Accept-Encoding"),
+    HEADER_NAME("Authorization"),
+    HEADER_NAME("Connection"),
+    HEADER_NAME("Content-Encoding"),
+    HEADER_NAME("Content-Length"),
+    HEADER_NAME("Content-Range"),
+    HEADER_NAME("Content-Type"),
+    HEADER_NAME("Date"),
+    HEADER_NAME("Expect"),
+    HEADER_NAME("Expires"),
+    HEADER_NAME("Host"),
+    HEADER_NAME("If-Match"),
+    HEADER_NAME("If-Modified-Since"),
+    HEADER_NAME("If-None-Match"),
+    HEADER_NAME("If-Range"),
+    HEADER_NAME("If-Unmodified-Since"),
+    HEADER_NAME("Last-Modified"),
+    HEADER_NAME("Proxy-Authorization"),
+    HEADER_NAME("Proxy-Connection"),
+    HEADER_NAME("Range"),
+    HEADER_NAME("Referer"),
+    HEADER_NAME("TE"),
+    HEADER_NAME("Trailer"),
+    HEADER_NAME("Transfer-Encoding"),
+    HEADER_NAME("Upgrade"),
+    HEADER_NAME("User-Agent")
+};
+
+#undef HEADER_NAME
+
+HeaderField
+headerField(const char *name, size_t length)
+{
+    for (size_t i = 0; i < HEADER_FIELD_COUNT; ++i) {
+        if (g_headerNames[i].length == length &&
+            strnicmp(g_headerNames[i].name, name, length) == 0)
+            return (HeaderField)i;
+    }
+    return EXTENSION_HEADER;
+}
+
+const char *
+headerName(HeaderField field)
+{
+    MORDOR_ASSERT(field >= 0 && field < HEADER_FIELD_COUNT);
+    return g_headerNames[field].name;
+}
+
+static bool isLinearWhitespace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+CompactRequest::CompactRequest()
+{
+    // Enough for most requests, so parsing one doesn't grow it
+    m_fields.reserve(16);
+    reset();
+}
+
+void
+CompactRequest::reset()
+{
+    m_block.clear();
+    m_data = NULL;
+    m_method = m_uri = m_versionText = Span(0, 0);
+    m_headers = 0;
+    m_version = Version();
+    m_fields.clear();
+    memset(m_index, 0, sizeof(m_index));
+    m_request.reset();
+}
+
+void
+CompactRequest::finish()
+{
+    MORDOR_ASSERT(m_block.readAvailable() > 0);
+    m_data = (const char *)m_block.readBuffer(m_block.readAvailable(), true)
+        .iov_base;
+    // The parser has already checked it's "HTTP/" DIGIT+ "." DIGIT+
+    const char *version = m_data + m_versionText.first + 5;
+    m_version.major = (unsigned char)atoi(version);
+    m_version.minor = (unsigned char)atoi(strchr(version, '.') + 1);
+
+    for (size_t i = 0; i < m_fields.size(); ++i) {
+        Field &field = m_fields[i];
+        while (field.value.second > 0 &&
+            isLinearWhitespace(m_data[field.value.first])) {
+            ++field.value.first;
+            --field.value.second;
+        }
+        while (field.value.second > 0 && isLinearWhitespace(
+            m_data[field.value.first + field.value.second - 1]))
+            --field.value.second;
+        field.field = headerField(m_data + field.name.first,
+            field.name.second);
+        if (field.field != EXTENSION_HEADER && m_index[field.field] == 0)
+            m_index[field.field] = (unsigned int)i + 1;
+    }
+}
+
+Slice
+CompactRequest::header(HeaderField field) const
+{
+    MORDOR_ASSERT(field >= 0 && field < HEADER_FIELD_COUNT);
+    unsigned int index = m_index[field];
+    if (index == 0)
+        return Slice();
+    return slice(m_fields[index - 1].value);
+}
+
+Slice
+CompactRequest::header(const char *name) const
+{
+    size_t length = strlen(name);
+    for (std::vector<Field>::const_iterator it = m_fields.begin();
+        it != m_fields.end();
+        ++it) {
+        if (it->name.second == length &&
+            strnicmp(m_data + it->name.first, name, length) == 0)
+            return slice(it->value);
+    }
+    return Slice();
+}
+
+unsigned long long
+CompactRequest::contentLength() const
+{
+    Slice value = header(CONTENT_LENGTH);
+    if (!value.data)
+        return ~0ull;
+    if (value.empty())
+        MORDOR_THROW_EXCEPTION(BadMessageHeaderException());
+    unsigned long long result = 0;
+    for (size_t i = 0; i < value.length; ++i) {
+        char c = value.data[i];
+        if (c < '0' || c > '9' || result > (~0ull - (c - '0')) / 10)
+            MORDOR_THROW_EXCEPTION(BadMessageHeaderException());
+        result = result * 10 + (c - '0');
+    }
+    return result;
+}
+
+// What RequestParser accepts as the target: an authority for CONNECT,
+// otherwise "*", an absolute URI, or an absolute path with an optional query
+static void
+parseRequestTarget(RequestLine &requestLine, const Slice &target)
+{
+    try {
+        if (requestLine.method == CONNECT) {
+            requestLine.uri.authority = target.str();
+            return;
+        }
+        if (target.length == 1 && target.data[0] == '*')
+            return;
+        requestLine.uri = target.str();
+    } catch (std::invalid_argument &) {
+        MORDOR_THROW_EXCEPTION(BadMessageHeaderException());
+    }
+    const URI &uri = requestLine.uri;
+    if (uri.fragmentDefined() || (!uri.schemeDefined() &&
+        (uri.authority.hostDefined() || !uri.path.isAbsolute())))
+        MORDOR_THROW_EXCEPTION(BadMessageHeaderException());
+}
+
+const Request &
+CompactRequest::request() const
+{
+    if (!m_request) {
+        MORDOR_ASSERT(m_data);
+        boost::scoped_ptr<Request> request(new Request());
+        request->requestLine.method = method().str();
+        request->requestLine.ver = m_version;
+        parseRequestTarget(request->requestLine, uri());
+        RequestHeadersParser parser(*request);
+        parser.run(m_data + m_headers, m_block.readAvailable() - m_headers);
+        if (parser.error() || !parser.complete())
+            MORDOR_THROW_EXCEPTION(BadMessageHeaderException());
+        m_request.swap(request);
+    }
+    return *m_request;
+}
+
+}}
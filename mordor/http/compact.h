@@ -0,0 +1,156 @@
+#ifndef __MORDOR_HTTP_COMPACT_H__
+#define __MORDOR_HTTP_COMPACT_H__
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include "http.h"
+#include "mordor/streams/buffer.h"
+
+namespace Mordor {
+namespace HTTP {
+
+/// Standard headers a CompactRequest indexes directly
+enum HeaderField
+{
+    ACCEPT_CHARSET,
+    ACCEPT_ENCODING,
+    AUTHORIZATION,
+    CONNECTION,
+    CONTENT_ENCODING,
+    CONTENT_LENGTH,
+    CONTENT_RANGE,
+    CONTENT_TYPE,
+    DATE,
+    EXPECT,
+    EXPIRES,
+    HOST,
+    IF_MATCH,
+    IF_MODIFIED_SINCE,
+    IF_NONE_MATCH,
+    IF_RANGE,
+    IF_UNMODIFIED_SINCE,
+    LAST_MODIFIED,
+    PROXY_AUTHORIZATION,
+    PROXY_CONNECTION,
+    RANGE,
+    REFERER,
+    TE,
+    TRAILER,
+    TRANSFER_ENCODING,
+    UPGRADE,
+    USER_AGENT,
+
+    /// Any other header; look it up by name
+    EXTENSION_HEADER,
+    HEADER_FIELD_COUNT = EXTENSION_HEADER
+};
+
+/// Case-insensitive lookup of a header name, without allocating
+/// @return EXTENSION_HEADER if name isn't one of the indexed headers
+HeaderField headerField(const char *name, size_t length);
+/// The canonical spelling of field's name
+/// @pre field != EXTENSION_HEADER
+const char *headerName(HeaderField field);
+
+/// A run of bytes in a CompactRequest's header block
+struct Slice
+{
+    Slice() : data(NULL), length(0) {}
+    Slice(const char *data_, size_t length_)
+        : data(data_), length(length_)
+    {}
+
+    bool empty() const { return length == 0; }
+    std::string str() const { return std::string(data, length); }
+
+    const char *data;
+    size_t length;
+};
+
+/// A parsed HTTP request header that keeps the header block as received
+
+/// CompactRequestParser only records where the request line's parts and each
+/// header's name and value are in the block, and indexes the standard headers
+/// by HeaderField, so parsing costs a copy of the block into a Buffer and one
+/// vector of field positions instead of a string, set or map per header.
+/// Typed values are produced on demand: contentLength() parses just that
+/// header, and request() builds a Request the first time it's asked for.
+/// Header values are trimmed of surrounding whitespace, but otherwise exactly
+/// as received (folded lines keep their line breaks; quoted strings keep
+/// their quotes).
+class CompactRequest : boost::noncopyable
+{
+    friend class CompactRequestParser;
+public:
+    CompactRequest();
+
+    /// From the request line through the terminating blank line, in one
+    /// contiguous segment
+    const Buffer &block() const { return m_block; }
+
+    Slice method() const { return slice(m_method); }
+    /// The request target exactly as sent (not parsed as a URI)
+    Slice uri() const { return slice(m_uri); }
+    Version version() const { return m_version; }
+
+    /// Number of header lines; they're numbered in the order received
+    size_t fields() const { return m_fields.size(); }
+    HeaderField field(size_t index) const { return m_fields[index].field; }
+    Slice name(size_t index) const { return slice(m_fields[index].name); }
+    Slice value(size_t index) const { return slice(m_fields[index].value); }
+
+    /// The value of the first field header, or an empty Slice with NULL data
+    /// if there isn't one
+    Slice header(HeaderField field) const;
+    /// The value of the first header named name (case-insensitive)
+    Slice header(const char *name) const;
+
+    /// Content-Length, or ~0ull if absent
+    /// @throws BadMessageHeaderException if it isn't a decimal number
+    unsigned long long contentLength() const;
+
+    /// The full Request, built on first use
+
+    /// The request line comes from what CompactRequestParser already found
+    /// (only the target still has to be parsed, as a URI), and the header
+    /// lines are run through RequestHeadersParser.
+    /// @throws BadMessageHeaderException if the block doesn't parse as a
+    /// Request
+    const Request &request() const;
+
+private:
+    // Offset and length in m_block
+    typedef std::pair<size_t, size_t> Span;
+
+    struct Field
+    {
+        HeaderField field;
+        Span name, value;
+    };
+
+private:
+    void reset();
+    /// Called by CompactRequestParser once the blank line has been parsed
+    void finish();
+    Slice slice(const Span &span) const
+    { return Slice(m_data + span.first, span.second); }
+
+private:
+    Buffer m_block;
+    const char *m_data;
+    Span m_method, m_uri, m_versionText;
+    // Offset of the first header line, or of the blank line if there are none
+    size_t m_headers;
+    Version m_version;
+    std::vector<Field> m_fields;
+    // 1 + the index into m_fields of the first of each HeaderField; 0 if
+    // absent
+    unsigned int m_index[HEADER_FIELD_COUNT];
+    mutable boost::scoped_ptr<Request> m_request;
+};
+
+}}
+
+#endif
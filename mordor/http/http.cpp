@@ -3,11 +3,13 @@
 #include "http.h"
 
 #include <boost/bind.hpp>
+#include <boost/noncopyable.hpp>
 
 #include <algorithm>
 #include <iostream>
 
 #include "mordor/assert.h"
+#include "mordor/streams/buffer.h"
 
 namespace Mordor {
 namespace HTTP {
@@ -86,91 +88,6 @@ quote(const std::string &str, bool alwaysQuote, bool comment)
     return result;
 }
 
-static std::ostream& operator<<(std::ostream& os, const StringSet& set)
-{
-    for (StringSet::const_iterator it(set.begin());
-        it != set.end();
-        ++it) {
-        if (it != set.begin())
-            os << ", ";
-        os << *it;
-    }
-    return os;
-}
-
-static std::ostream& operator<<(std::ostream& os, const std::vector<std::string>& list)
-{
-    for (std::vector<std::string>::const_iterator it(list.begin());
-        it != list.end();
-        ++it) {
-        if (it != list.begin())
-            os << ", ";
-        os << *it;
-    }
-    return os;
-}
-
-static std::ostream& operator<<(std::ostream& os, const RangeSet& set)
-{
-    MORDOR_ASSERT(!set.empty());
-    os << "bytes=";
-    for (RangeSet::const_iterator it(set.begin());
-        it != set.end();
-        ++it) {
-        if (it != set.begin())
-            os << ", ";
-        if (it->first != ~0ull)
-            os << it->first;
-        os << "-";
-        if (it->second != ~0ull)
-            os << it->second;
-    }
-    return os;
-}
-
-struct serializeStringMapWithRequiredValue
-{
-    serializeStringMapWithRequiredValue(const StringMap &m,
-        const char *delim = ";", bool leadingDelimiter = true)
-        : map(m),
-          delimiter(delim),
-          lead(leadingDelimiter)
-    {}
-    const StringMap& map;
-    const char *delimiter;
-    bool lead;
-};
-
-struct serializeStringMapWithOptionalValue
-{
-    serializeStringMapWithOptionalValue(const StringMap &m) : map(m) {}
-    const StringMap& map;
-};
-
-static std::ostream& operator<<(std::ostream& os, const serializeStringMapWithRequiredValue &map)
-{
-    for (StringMap::const_iterator it(map.map.begin());
-        it != map.map.end();
-        ++it) {
-        if (map.lead || it != map.map.begin())
-            os << map.delimiter;
-        os << it->first << "=" << quote(it->second);
-    }
-    return os;
-}
-
-static std::ostream& operator<<(std::ostream& os, const serializeStringMapWithOptionalValue &map)
-{
-    for (StringMap::const_iterator it(map.map.begin());
-        it != map.map.end();
-        ++it) {
-        os << ";" << it->first;
-        if (!it->second.empty())
-            os << "=" << quote(it->second);
-    }
-    return os;
-}
-
 const std::string GET("GET");
 const std::string HEAD("HEAD");
 const std::string POST("POST");
@@ -402,256 +319,419 @@ preferred(const AcceptListWithParameters &accept, const AcceptListWithParameters
     return NULL;
 }
 
-std::ostream& operator<<(std::ostream& os, Status s)
+namespace {
+// Appends to a Buffer through a pointer into its write space, reserving more
+// only when a field doesn't fit in what's left
+class HeaderWriter : boost::noncopyable
 {
-    return os << (int)s;
+public:
+    HeaderWriter(Buffer &buffer, size_t estimate)
+        : m_buffer(buffer),
+          m_start(NULL),
+          m_next(NULL),
+          m_end(NULL)
+    {
+        reserve(estimate);
+    }
+
+    void append(const char *data, size_t length)
+    {
+        if ((size_t)(m_end - m_next) < length)
+            reserve((std::max)(length, (size_t)1024));
+        memcpy(m_next, data, length);
+        m_next += length;
+    }
+
+    /// Make everything appended so far readable in the Buffer
+    void finish()
+    {
+        m_buffer.produce(m_next - m_start);
+        m_start = m_next;
+    }
+
+    template <size_t N>
+    HeaderWriter &operator<<(const char (&literal)[N])
+    {
+        append(literal, N - 1);
+        return *this;
+    }
+
+    HeaderWriter &operator<<(const std::string &string)
+    {
+        append(string.c_str(), string.size());
+        return *this;
+    }
+
+    HeaderWriter &operator<<(char c)
+    {
+        append(&c, 1);
+        return *this;
+    }
+
+    HeaderWriter &operator<<(unsigned long long number)
+    {
+        char digits[20];
+        char *start = digits + sizeof(digits);
+        do {
+            *--start = (char)('0' + number % 10);
+            number /= 10;
+        } while (number != 0);
+        append(start, digits + sizeof(digits) - start);
+        return *this;
+    }
+
+    /// RFC 1123 format, as rfc1123Facet_out renders it
+    HeaderWriter &operator<<(const boost::posix_time::ptime &date)
+    {
+        if (date.is_special()) {
+            std::ostringstream os;
+            os.imbue(std::locale(os.getloc(), &rfc1123Facet_out));
+            os << date;
+            return *this << os.str();
+        }
+        static const char days[][4] = { "Sun", "Mon", "Tue", "Wed", "Thu",
+            "Fri", "Sat" };
+        static const char months[][4] = { "Jan", "Feb", "Mar", "Apr", "May",
+            "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+        boost::gregorian::date day = date.date();
+        boost::posix_time::time_duration time = date.time_of_day();
+        // "Sun, 06 Nov 1994 08:49:37 GMT"
+        char rendered[29];
+        memcpy(rendered, days[day.day_of_week().as_number()], 3);
+        memcpy(rendered + 3, ", ", 2);
+        twoDigits(rendered + 5, day.day());
+        rendered[7] = ' ';
+        memcpy(rendered + 8, months[day.month().as_number() - 1], 3);
+        rendered[11] = ' ';
+        unsigned int year = day.year();
+        twoDigits(rendered + 12, year / 100 % 100);
+        twoDigits(rendered + 14, year % 100);
+        rendered[16] = ' ';
+        twoDigits(rendered + 17, (unsigned int)time.hours());
+        rendered[19] = ':';
+        twoDigits(rendered + 20, (unsigned int)time.minutes());
+        rendered[22] = ':';
+        twoDigits(rendered + 23, (unsigned int)time.seconds());
+        memcpy(rendered + 25, " GMT", 4);
+        append(rendered, sizeof(rendered));
+        return *this;
+    }
+
+private:
+    static void twoDigits(char *out, unsigned int value)
+    {
+        out[0] = (char)('0' + value / 10);
+        out[1] = (char)('0' + value % 10);
+    }
+
+    void reserve(size_t length)
+    {
+        finish();
+        iovec iov = m_buffer.writeBuffer(length, true);
+        m_start = m_next = (char *)iov.iov_base;
+        m_end = m_start + iov.iov_len;
+    }
+
+private:
+    Buffer &m_buffer;
+    char *m_start, *m_next, *m_end;
+};
 }
 
-std::ostream& operator<<(std::ostream& os, Version v)
+static bool isToken(const std::string &str)
+{
+    static const char *tokenChars = "!#$%&'*+-./0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ^_`abcdefghijklmnopqrstuvwxyz|~";
+    return !str.empty() && str.find_first_not_of(tokenChars) ==
+        std::string::npos;
+}
+
+// quote(), without building a copy when the string can go out as is
+static void appendQuoted(HeaderWriter &w, const std::string &str,
+    bool alwaysQuote = false, bool comment = false)
+{
+    if (!alwaysQuote && !comment && isToken(str))
+        w << str;
+    else
+        w << quote(str, alwaysQuote, comment);
+}
+
+template <class T>
+static void appendList(HeaderWriter &w, const T &list)
+{
+    for (typename T::const_iterator it(list.begin());
+        it != list.end();
+        ++it) {
+        if (it != list.begin())
+            w << ", ";
+        w << *it;
+    }
+}
+
+static HeaderWriter &operator<<(HeaderWriter &w, Version v)
 {
+    if (v.major == 1 && v.minor == 1)
+        return w << "HTTP/1.1";
+    if (v.major == 1 && v.minor == 0)
+        return w << "HTTP/1.0";
     if (v.major == (unsigned char)~0 || v.minor == (unsigned char)~0)
-        return os << "HTTP/0.0";
-    return os << "HTTP/" << (int)v.major << "." << (int)v.minor;
+        return w << "HTTP/0.0";
+    return w << "HTTP/" << (unsigned long long)v.major << '.'
+        << (unsigned long long)v.minor;
 }
 
-std::ostream& operator<<(std::ostream& os, const ETag &e)
+static HeaderWriter &operator<<(HeaderWriter &w, const ETag &e)
 {
     if (e.unspecified)
-        return os << "*";
+        return w << '*';
     if (e.weak)
-        os << "W/";
-    return os << quote(e.value, true);
+        w << "W/";
+    appendQuoted(w, e.value, true);
+    return w;
 }
 
-std::ostream& operator<<(std::ostream& os, const std::set<ETag> &v)
+static HeaderWriter &operator<<(HeaderWriter &w, const std::set<ETag> &v)
 {
     MORDOR_ASSERT(!v.empty());
     for (std::set<ETag>::const_iterator it = v.begin();
         it != v.end();
         ++it) {
         if (it != v.begin())
-            os << ", ";
+            w << ", ";
         MORDOR_ASSERT(!it->unspecified || v.size() == 1);
-        os << *it;
+        w << *it;
     }
-    return os;
+    return w;
 }
 
-std::ostream& operator<<(std::ostream& os, const Product &p)
+static HeaderWriter &operator<<(HeaderWriter &w, const Product &p)
 {
     MORDOR_ASSERT(!p.product.empty());
-    os << p.product;
+    w << p.product;
     if (!p.version.empty())
-        os << "/" << p.version;
-    return os;
-}
-
-std::ostream& operator<<(std::ostream& os, const ProductList &l)
-{
-    MORDOR_ASSERT(!l.empty());
-    for (ProductList::const_iterator it = l.begin();
-        it != l.end();
-        ++it) {
-        if (it != l.begin())
-            os << ", ";
-        os << *it;
-    }
-    return os;
+        w << '/' << p.version;
+    return w;
 }
 
-std::ostream& operator<<(std::ostream& os, const ProductAndCommentList &l)
+static HeaderWriter &operator<<(HeaderWriter &w,
+    const ProductAndCommentList &l)
 {
     MORDOR_ASSERT(!l.empty());
     for (ProductAndCommentList::const_iterator it = l.begin();
         it != l.end();
         ++it) {
         if (it != l.begin())
-            os << " ";
+            w << ' ';
         const Product *product = boost::get<Product>(&*it);
         if (product)
-            os << *product;
+            w << *product;
         else
-            os << quote(boost::get<std::string>(*it), true, true);
+            appendQuoted(w, boost::get<std::string>(*it), true, true);
     }
-    return os;
+    return w;
 }
 
-std::ostream& operator<<(std::ostream& os, const ValueWithParameters &v)
+static void appendParameters(HeaderWriter &w, const StringMap &parameters,
+    bool valueRequired = true)
 {
-    MORDOR_ASSERT(!v.value.empty());
-    return os << v.value << serializeStringMapWithRequiredValue(v.parameters);
-}
-
-std::ostream& operator<<(std::ostream& os, const ParameterizedList &l)
-{
-    for (ParameterizedList::const_iterator it(l.begin());
-        it != l.end();
+    for (StringMap::const_iterator it(parameters.begin());
+        it != parameters.end();
         ++it) {
-        if (it != l.begin())
-            os << ", ";
-        os << *it;
+        w << ';' << it->first;
+        if (valueRequired || !it->second.empty()) {
+            w << '=';
+            appendQuoted(w, it->second);
+        }
     }
-    return os;
 }
 
-std::ostream &operator<<(std::ostream &os, const AuthParams &a)
+static HeaderWriter &operator<<(HeaderWriter &w, const ValueWithParameters &v)
 {
-    MORDOR_ASSERT(a.base64.empty() || a.parameters.empty());
-    os << a.scheme;
-    if (!a.base64.empty())
-        os << ' ' << a.base64;
-    if (!a.parameters.empty())
-        os << ' ' << serializeStringMapWithRequiredValue(a.parameters, ", ", false);
-    return os;
+    MORDOR_ASSERT(!v.value.empty());
+    w << v.value;
+    appendParameters(w, v.parameters);
+    return w;
 }
 
-std::ostream &operator<<(std::ostream &os, const ChallengeList &l)
+static HeaderWriter &operator<<(HeaderWriter &w, const AuthParams &a)
 {
-    for (ChallengeList::const_iterator it(l.begin());
-        it != l.end();
+    MORDOR_ASSERT(a.base64.empty() || a.parameters.empty());
+    w << a.scheme;
+    if (!a.base64.empty())
+        w << ' ' << a.base64;
+    for (StringMap::const_iterator it(a.parameters.begin());
+        it != a.parameters.end();
         ++it) {
-        if (it != l.begin())
-            os << ", ";
-        os << *it;
+        if (it == a.parameters.begin())
+            w << ' ';
+        else
+            w << ", ";
+        w << it->first << '=';
+        appendQuoted(w, it->second);
     }
-    return os;
+    return w;
 }
 
-std::ostream& operator<<(std::ostream& os, const KeyValueWithParameters &v)
+static HeaderWriter &operator<<(HeaderWriter &w,
+    const KeyValueWithParameters &v)
 {
     MORDOR_ASSERT(!v.key.empty());
-    os << quote(v.key);
-    if (!v.value.empty())
-        os << "=" << quote(v.value)
-            << serializeStringMapWithOptionalValue(v.parameters);
-    return os;
-}
-
-std::ostream& operator<<(std::ostream& os, const ParameterizedKeyValueList &l)
-{
-    MORDOR_ASSERT(!l.empty());
-    for (ParameterizedKeyValueList::const_iterator it(l.begin());
-        it != l.end();
-        ++it) {
-        if (it != l.begin())
-            os << ", ";
-        os << *it;
+    appendQuoted(w, v.key);
+    if (!v.value.empty()) {
+        w << '=';
+        appendQuoted(w, v.value);
+        appendParameters(w, v.parameters, false);
     }
-    return os;
+    return w;
 }
 
-std::ostream& operator<<(std::ostream& os, const MediaType &m)
+static HeaderWriter &operator<<(HeaderWriter &w, const MediaType &m)
 {
     MORDOR_ASSERT(!m.type.empty());
     MORDOR_ASSERT(!m.subtype.empty());
-    return os << m.type << "/" << m.subtype << serializeStringMapWithRequiredValue(m.parameters);
+    w << m.type << '/' << m.subtype;
+    appendParameters(w, m.parameters);
+    return w;
 }
 
-std::ostream& operator<<(std::ostream& os, const ContentRange &cr)
+static HeaderWriter &operator<<(HeaderWriter &w, const ContentRange &cr)
 {
-    os << "bytes ";
+    w << "bytes ";
     if (cr.first == ~0ull) {
-        os << '*';
+        w << '*';
     } else {
-        os << cr.first << '-';
+        w << cr.first << '-';
         if (cr.last != ~0ull)
-            os << cr.last;
+            w << cr.last;
     }
-    os << '/';
+    w << '/';
     if (cr.instance == ~0ull)
-        os << '*';
+        w << '*';
     else
-        os << cr.instance;
-    return os;
+        w << cr.instance;
+    return w;
 }
 
-std::ostream& operator<<(std::ostream& os, const AcceptValue &v)
+static HeaderWriter &operator<<(HeaderWriter &w, const RangeSet &set)
 {
-    if (v.value.empty())
-        os << '*';
-    else
-        os << v.value;
-    if (v.qvalue != ~0u) {
-        MORDOR_ASSERT(v.qvalue <= 1000);
-        unsigned int qvalue = v.qvalue;
-        unsigned int curPlace = 100;
-        if (qvalue == 1000) {
-            os << ";q=1";
-        } else {
-            os << ";q=0";
-            while (curPlace > 0 && qvalue > 0) {
-                if (curPlace == 100)
-                    os << '.';
-                unsigned int cur = qvalue / curPlace;
-                MORDOR_ASSERT(cur < 10);
-                os << cur;
-                qvalue -= cur * curPlace;
-                curPlace /= 10;
-            }
-        }
+    MORDOR_ASSERT(!set.empty());
+    w << "bytes=";
+    for (RangeSet::const_iterator it(set.begin());
+        it != set.end();
+        ++it) {
+        if (it != set.begin())
+            w << ", ";
+        if (it->first != ~0ull)
+            w << it->first;
+        w << '-';
+        if (it->second != ~0ull)
+            w << it->second;
     }
-
-    return os;
+    return w;
 }
 
-std::ostream& operator<<(std::ostream& os, const AcceptList &l)
+static void appendQvalue(HeaderWriter &w, unsigned int qvalue)
 {
-    MORDOR_ASSERT(!l.empty());
-    for (AcceptList::const_iterator it(l.begin());
-        it != l.end();
-        ++it) {
-        if (it != l.begin())
-            os << ", ";
-        os << *it;
+    MORDOR_ASSERT(qvalue <= 1000);
+    if (qvalue == 1000) {
+        w << ";q=1";
+        return;
     }
-    return os;
+    w << ";q=0";
+    if (qvalue == 0)
+        return;
+    // Thousandths, without trailing zeros
+    char digits[4] = { '.', (char)('0' + qvalue / 100),
+        (char)('0' + qvalue / 10 % 10), (char)('0' + qvalue % 10) };
+    size_t length = 4;
+    while (digits[length - 1] == '0')
+        --length;
+    w.append(digits, length);
 }
 
-std::ostream& operator<<(std::ostream& os, const AcceptValueWithParameters &v)
+static HeaderWriter &operator<<(HeaderWriter &w, const AcceptValue &v)
+{
+    if (v.value.empty())
+        w << '*';
+    else
+        w << v.value;
+    if (v.qvalue != ~0u)
+        appendQvalue(w, v.qvalue);
+    return w;
+}
+
+static HeaderWriter &operator<<(HeaderWriter &w,
+    const AcceptValueWithParameters &v)
 {
     MORDOR_ASSERT(!v.value.empty());
-    os << v.value << serializeStringMapWithRequiredValue(v.parameters);
+    w << v.value;
+    appendParameters(w, v.parameters);
     if (v.qvalue != ~0u) {
-        MORDOR_ASSERT(v.qvalue <= 1000);
-        unsigned int qvalue = v.qvalue;
-        unsigned int curPlace = 100;
-        if (qvalue == 1000) {
-            os << ";q=1";
-        } else {
-            os << ";q=0";
-            while (curPlace > 0 && qvalue > 0) {
-                if (curPlace == 100)
-                    os << '.';
-                unsigned int cur = qvalue / curPlace;
-                MORDOR_ASSERT(cur < 10);
-                os << cur;
-                qvalue -= cur * curPlace;
-                curPlace /= 10;
-            }
-        }
-        os << serializeStringMapWithOptionalValue(v.acceptParams);
+        appendQvalue(w, v.qvalue);
+        appendParameters(w, v.acceptParams, false);
     } else {
         MORDOR_ASSERT(v.acceptParams.empty());
     }
+    return w;
+}
 
-    return os;
+static HeaderWriter &operator<<(HeaderWriter &w, const StringSet &set)
+{
+    appendList(w, set);
+    return w;
 }
 
-std::ostream& operator<<(std::ostream& os, const AcceptListWithParameters &l)
+static HeaderWriter &operator<<(HeaderWriter &w,
+    const std::vector<std::string> &list)
+{
+    appendList(w, list);
+    return w;
+}
+
+static HeaderWriter &operator<<(HeaderWriter &w, const ProductList &l)
 {
     MORDOR_ASSERT(!l.empty());
-    for (AcceptListWithParameters::const_iterator it(l.begin());
-        it != l.end();
-        ++it) {
-        if (it != l.begin())
-            os << ", ";
-        os << *it;
-    }
-    return os;
+    appendList(w, l);
+    return w;
 }
 
-std::ostream& operator<<(std::ostream& os, const RequestLine &r)
+static HeaderWriter &operator<<(HeaderWriter &w, const ParameterizedList &l)
+{
+    appendList(w, l);
+    return w;
+}
+
+static HeaderWriter &operator<<(HeaderWriter &w, const ChallengeList &l)
+{
+    appendList(w, l);
+    return w;
+}
+
+static HeaderWriter &operator<<(HeaderWriter &w,
+    const ParameterizedKeyValueList &l)
+{
+    MORDOR_ASSERT(!l.empty());
+    appendList(w, l);
+    return w;
+}
+
+static HeaderWriter &operator<<(HeaderWriter &w, const AcceptList &l)
 {
+    MORDOR_ASSERT(!l.empty());
+    appendList(w, l);
+    return w;
+}
+
+static HeaderWriter &operator<<(HeaderWriter &w,
+    const AcceptListWithParameters &l)
+{
+    MORDOR_ASSERT(!l.empty());
+    appendList(w, l);
+    return w;
+}
+
+static HeaderWriter &operator<<(HeaderWriter &w, const RequestLine &r)
+{
+    w << r.method;
     // CONNECT is special cased to only do the authority
     if (r.method == CONNECT) {
         MORDOR_ASSERT(r.uri.authority.hostDefined());
@@ -659,154 +739,320 @@ std::ostream& operator<<(std::ostream& os, const RequestLine &r)
         MORDOR_ASSERT(r.uri.path.isEmpty());
         MORDOR_ASSERT(!r.uri.queryDefined());
         MORDOR_ASSERT(!r.uri.fragmentDefined());
-        return os << r.method << ' ' << r.uri.authority << ' ' << r.ver;
+        w << ' ' << r.uri.authority.toString() << ' ';
+    } else if (!r.uri.isDefined()) {
+        w << " * ";
     } else {
-        if (!r.uri.isDefined()) {
-            return os << r.method << " * " << r.ver;
-        } else {
-            MORDOR_ASSERT(!r.uri.fragmentDefined());
+        MORDOR_ASSERT(!r.uri.fragmentDefined());
 #ifndef NDEBUG
-            // Must be a absolute_URI or a path_absolute (with query allowed)
-            if (!r.uri.schemeDefined()) {
-                MORDOR_ASSERT(!r.uri.authority.hostDefined());
-                MORDOR_ASSERT(r.uri.path.isAbsolute());
-                // The first path segment (after the leading slash)
-                // cannot be empty (unless it is the trailing slash
-                // as well)
-                MORDOR_ASSERT(r.uri.path.segments.size() <= 2 ||
-                    !r.uri.path.segments[1].empty())
-            }
-#endif
-            return os << r.method << " " << r.uri << " " << r.ver;
+        if (!r.uri.schemeDefined()) {
+            MORDOR_ASSERT(!r.uri.authority.hostDefined());
+            MORDOR_ASSERT(r.uri.path.isAbsolute());
+            MORDOR_ASSERT(r.uri.path.segments.size() <= 2 ||
+                !r.uri.path.segments[1].empty())
         }
+#endif
+        w << ' ' << r.uri.toString() << ' ';
     }
+    return w << r.ver;
 }
 
-std::ostream& operator<<(std::ostream& os, const StatusLine &s)
+static HeaderWriter &operator<<(HeaderWriter &w, const StatusLine &s)
 {
     MORDOR_ASSERT(!s.reason.empty());
-    return os << s.ver << " " << s.status << " " << s.reason;
+    return w << s.ver << ' ' << (unsigned long long)s.status << ' '
+        << s.reason;
 }
 
-std::ostream& operator<<(std::ostream& os, const GeneralHeaders &g)
+static HeaderWriter &operator<<(HeaderWriter &w, const GeneralHeaders &g)
 {
-    os.imbue(std::locale(os.getloc(), &rfc1123Facet_out));
     if (!g.connection.empty())
-        os << "Connection: " << g.connection << "\r\n";
+        w << "Connection: " << g.connection << "\r\n";
     if (!g.date.is_not_a_date_time())
-        os << "Date: " << g.date << "\r\n";
+        w << "Date: " << g.date << "\r\n";
     if (!g.proxyConnection.empty())
-        os << "Proxy-Connection: " << g.proxyConnection << "\r\n";
+        w << "Proxy-Connection: " << g.proxyConnection << "\r\n";
     if (!g.trailer.empty())
-        os << "Trailer: " << g.trailer << "\r\n";
+        w << "Trailer: " << g.trailer << "\r\n";
     if (!g.transferEncoding.empty())
-        os << "Transfer-Encoding: " << g.transferEncoding << "\r\n";
+        w << "Transfer-Encoding: " << g.transferEncoding << "\r\n";
     if (!g.upgrade.empty())
-        os << "Upgrade: " << g.upgrade << "\r\n";
-    return os;
+        w << "Upgrade: " << g.upgrade << "\r\n";
+    return w;
 }
 
-std::ostream& operator<<(std::ostream& os, const RequestHeaders &r)
+static HeaderWriter &operator<<(HeaderWriter &w, const RequestHeaders &r)
 {
-    os.imbue(std::locale(os.getloc(), &rfc1123Facet_out));
     if (!r.acceptCharset.empty())
-        os << "Accept-Charset: " << r.acceptCharset << "\r\n";
+        w << "Accept-Charset: " << r.acceptCharset << "\r\n";
     if (!r.acceptEncoding.empty())
-        os << "Accept-Encoding: " << r.acceptEncoding << "\r\n";
+        w << "Accept-Encoding: " << r.acceptEncoding << "\r\n";
     if (!r.authorization.scheme.empty())
-        os << "Authorization: " << r.authorization << "\r\n";
+        w << "Authorization: " << r.authorization << "\r\n";
     if (!r.expect.empty())
-        os << "Expect: " << r.expect << "\r\n";
+        w << "Expect: " << r.expect << "\r\n";
     if (!r.host.empty())
-        os << "Host: " << r.host << "\r\n";
+        w << "Host: " << r.host << "\r\n";
     if (!r.ifMatch.empty())
-        os << "If-Match: " << r.ifMatch << "\r\n";
+        w << "If-Match: " << r.ifMatch << "\r\n";
     if (!r.ifModifiedSince.is_not_a_date_time())
-        os << "If-Modified-Since: " << r.ifModifiedSince << "\r\n";
+        w << "If-Modified-Since: " << r.ifModifiedSince << "\r\n";
     if (!r.ifNoneMatch.empty())
-        os << "If-None-Match: " << r.ifNoneMatch << "\r\n";
+        w << "If-None-Match: " << r.ifNoneMatch << "\r\n";
     const ETag *ifRangeEtag = boost::get<ETag>(&r.ifRange);
     if (ifRangeEtag && !ifRangeEtag->unspecified)
-        os << "If-Range: " << *ifRangeEtag << "\r\n";
+        w << "If-Range: " << *ifRangeEtag << "\r\n";
     const boost::posix_time::ptime *ifRangeHttpDate = boost::get<boost::posix_time::ptime>(&r.ifRange);
     if (ifRangeHttpDate && !ifRangeHttpDate->is_not_a_date_time())
-        os << "If-Range: " << *ifRangeHttpDate << "\r\n";
+        w << "If-Range: " << *ifRangeHttpDate << "\r\n";
     if (!r.ifUnmodifiedSince.is_not_a_date_time())
-        os << "If-Unmodified-Since: " << r.ifUnmodifiedSince << "\r\n";
+        w << "If-Unmodified-Since: " << r.ifUnmodifiedSince << "\r\n";
     if (!r.proxyAuthorization.scheme.empty())
-        os << "Proxy-Authorization: " << r.proxyAuthorization << "\r\n";
+        w << "Proxy-Authorization: " << r.proxyAuthorization << "\r\n";
     if (!r.range.empty())
-        os << "Range: " << r.range << "\r\n";
+        w << "Range: " << r.range << "\r\n";
     if (r.referer.isDefined())
-        os << "Referer: " << r.referer << "\r\n";
+        w << "Referer: " << r.referer.toString() << "\r\n";
     if (!r.te.empty())
-        os << "TE: " << r.te << "\r\n";
+        w << "TE: " << r.te << "\r\n";
     if (!r.userAgent.empty())
-        os << "User-Agent: " << r.userAgent << "\r\n";
-    return os;
+        w << "User-Agent: " << r.userAgent << "\r\n";
+    return w;
 }
 
-std::ostream& operator<<(std::ostream& os, const ResponseHeaders &r)
+static HeaderWriter &operator<<(HeaderWriter &w, const ResponseHeaders &r)
 {
-    os.imbue(std::locale(os.getloc(), &rfc1123Facet_out));
     if (!r.acceptRanges.empty())
-        os << "Accept-Ranges: " << r.acceptRanges << "\r\n";
+        w << "Accept-Ranges: " << r.acceptRanges << "\r\n";
     if (!r.eTag.unspecified)
-        os << "ETag: " << r.eTag << "\r\n";
+        w << "ETag: " << r.eTag << "\r\n";
     if (r.location.isDefined())
-        os << "Location: " << r.location << "\r\n";
+        w << "Location: " << r.location.toString() << "\r\n";
     if (!r.proxyAuthenticate.empty())
-        os << "Proxy-Authenticate: " << r.proxyAuthenticate << "\r\n";
+        w << "Proxy-Authenticate: " << r.proxyAuthenticate << "\r\n";
     const boost::posix_time::ptime *retryAfterHttpDate = boost::get<boost::posix_time::ptime>(&r.retryAfter);
     if (retryAfterHttpDate && !retryAfterHttpDate->is_not_a_date_time())
-        os << "Retry-After: " << *retryAfterHttpDate << "\r\n";
+        w << "Retry-After: " << *retryAfterHttpDate << "\r\n";
     const unsigned long long *retryAfterDeltaSeconds = boost::get<unsigned long long>(&r.retryAfter);
     if (retryAfterDeltaSeconds && *retryAfterDeltaSeconds != ~0ull)
-        os << "Retry-After: " << *retryAfterDeltaSeconds << "\r\n";
+        w << "Retry-After: " << *retryAfterDeltaSeconds << "\r\n";
     if (!r.server.empty())
-        os << "Server: " << r.server << "\r\n";
+        w << "Server: " << r.server << "\r\n";
     if (!r.wwwAuthenticate.empty())
-        os << "WWW-Authenticate: " << r.wwwAuthenticate << "\r\n";
-    return os;
+        w << "WWW-Authenticate: " << r.wwwAuthenticate << "\r\n";
+    return w;
 }
 
-std::ostream& operator<<(std::ostream& os, const EntityHeaders &e)
+static HeaderWriter &operator<<(HeaderWriter &w, const EntityHeaders &e)
 {
-    os.imbue(std::locale(os.getloc(), &rfc1123Facet_out));
     if (!e.contentEncoding.empty())
-        os << "Content-Encoding: " << e.contentEncoding << "\r\n";
+        w << "Content-Encoding: " << e.contentEncoding << "\r\n";
     if (e.contentLength != ~0ull)
-        os << "Content-Length: " << e.contentLength << "\r\n";
+        w << "Content-Length: " << e.contentLength << "\r\n";
     if (e.contentRange.first != ~0ull || e.contentRange.last != ~0ull || e.contentRange.instance != ~0ull)
-        os << "Content-Range: " << e.contentRange << "\r\n";
+        w << "Content-Range: " << e.contentRange << "\r\n";
     if (!e.contentType.type.empty() && !e.contentType.subtype.empty())
-        os << "Content-Type: " << e.contentType << "\r\n";
+        w << "Content-Type: " << e.contentType << "\r\n";
     if (!e.expires.is_not_a_date_time())
-        os << "Expires: " << e.expires << "\r\n";
+        w << "Expires: " << e.expires << "\r\n";
     if (!e.lastModified.is_not_a_date_time())
-        os << "Last-Modified: " << e.lastModified << "\r\n";
+        w << "Last-Modified: " << e.lastModified << "\r\n";
     for (StringMap::const_iterator it(e.extension.begin());
         it != e.extension.end();
         ++it) {
-        os << it->first << ": " << it->second << "\r\n";
+        w << it->first << ": " << it->second << "\r\n";
     }
-    return os;
+    return w;
 }
 
-std::ostream& operator<<(std::ostream& os, const Request &r)
+static HeaderWriter &operator<<(HeaderWriter &w, const Request &r)
 {
-    return os << r.requestLine << "\r\n"
+    return w << r.requestLine << "\r\n"
         << r.general
         << r.request
         << r.entity << "\r\n";
 }
 
-std::ostream& operator<<(std::ostream& os, const Response &r)
+static HeaderWriter &operator<<(HeaderWriter &w, const Response &r)
 {
-    return os << r.status << "\r\n"
+    return w << r.status << "\r\n"
         << r.general
         << r.response
         << r.entity << "\r\n";
 }
 
+// The iostream operators render through the same HeaderWriter overloads as
+// serialize(), into a scratch Buffer
+template <class T>
+static std::ostream &print(std::ostream &os, const T &value)
+{
+    Buffer buffer;
+    HeaderWriter w(buffer, 128);
+    w << value;
+    w.finish();
+    return os << buffer.toString();
+}
+
+std::ostream& operator<<(std::ostream& os, Status s)
+{
+    return os << (int)s;
+}
+
+std::ostream& operator<<(std::ostream& os, Version v)
+{
+    return print(os, v);
+}
+
+std::ostream& operator<<(std::ostream& os, const ETag &e)
+{
+    return print(os, e);
+}
+
+std::ostream& operator<<(std::ostream& os, const std::set<ETag> &v)
+{
+    return print(os, v);
+}
+
+std::ostream& operator<<(std::ostream& os, const Product &p)
+{
+    return print(os, p);
+}
+
+std::ostream& operator<<(std::ostream& os, const ProductList &l)
+{
+    return print(os, l);
+}
+
+std::ostream& operator<<(std::ostream& os, const ProductAndCommentList &l)
+{
+    return print(os, l);
+}
+
+std::ostream& operator<<(std::ostream& os, const ValueWithParameters &v)
+{
+    return print(os, v);
+}
+
+std::ostream& operator<<(std::ostream& os, const ParameterizedList &l)
+{
+    return print(os, l);
+}
+
+std::ostream& operator<<(std::ostream& os, const AuthParams &a)
+{
+    return print(os, a);
+}
+
+std::ostream& operator<<(std::ostream& os, const ChallengeList &l)
+{
+    return print(os, l);
+}
+
+std::ostream& operator<<(std::ostream& os, const KeyValueWithParameters &v)
+{
+    return print(os, v);
+}
+
+std::ostream& operator<<(std::ostream& os, const ParameterizedKeyValueList &l)
+{
+    return print(os, l);
+}
+
+std::ostream& operator<<(std::ostream& os, const MediaType &m)
+{
+    return print(os, m);
+}
+
+std::ostream& operator<<(std::ostream& os, const ContentRange &cr)
+{
+    return print(os, cr);
+}
+
+std::ostream& operator<<(std::ostream& os, const AcceptValue &v)
+{
+    return print(os, v);
+}
+
+std::ostream& operator<<(std::ostream& os, const AcceptList &l)
+{
+    return print(os, l);
+}
+
+std::ostream& operator<<(std::ostream& os, const AcceptValueWithParameters &v)
+{
+    return print(os, v);
+}
+
+std::ostream& operator<<(std::ostream& os, const AcceptListWithParameters &l)
+{
+    return print(os, l);
+}
+
+std::ostream& operator<<(std::ostream& os, const RequestLine &r)
+{
+    return print(os, r);
+}
+
+std::ostream& operator<<(std::ostream& os, const StatusLine &s)
+{
+    return print(os, s);
+}
+
+std::ostream& operator<<(std::ostream& os, const GeneralHeaders &g)
+{
+    return print(os, g);
+}
+
+std::ostream& operator<<(std::ostream& os, const RequestHeaders &r)
+{
+    return print(os, r);
+}
+
+std::ostream& operator<<(std::ostream& os, const ResponseHeaders &r)
+{
+    return print(os, r);
+}
+
+std::ostream& operator<<(std::ostream& os, const EntityHeaders &e)
+{
+    return print(os, e);
+}
+
+std::ostream& operator<<(std::ostream& os, const Request &r)
+{
+    return print(os, r);
+}
+
+std::ostream& operator<<(std::ostream& os, const Response &r)
+{
+    return print(os, r);
+}
+
+// Room for the request or status line and the fixed headers, plus the
+// extension headers, which are the only ones that routinely run long
+static size_t estimateLength(const EntityHeaders &e)
+{
+    size_t length = 512;
+    for (StringMap::const_iterator it(e.extension.begin());
+        it != e.extension.end();
+        ++it)
+        length += it->first.size() + it->second.size() + 4;
+    return length;
+}
+
+void serialize(Buffer &buffer, const Request &r)
+{
+    HeaderWriter w(buffer, estimateLength(r.entity) +
+        r.request.host.size() + r.requestLine.uri.path.segments.size() * 16);
+    w << r;
+    w.finish();
+}
+
+void serialize(Buffer &buffer, const Response &r)
+{
+    HeaderWriter w(buffer, estimateLength(r.entity));
+    w << r;
+    w.finish();
+}
+
 }}
@@ -16,6 +16,9 @@
 #include "mordor/version.h"
 
 namespace Mordor {
+
+struct Buffer;
+
 namespace HTTP {
 
 struct Exception : virtual Mordor::Exception {};
@@ -530,6 +533,15 @@ std::ostream& operator<<(std::ostream& os, const EntityHeaders &e);
 std::ostream& operator<<(std::ostream& os, const Request &r);
 std::ostream& operator<<(std::ostream& os, const Response &r);
 
+/// Append the header block straight to buffer
+
+/// Fields are rendered without iostreams, into write space reserved up front
+/// from an estimate of the header block's length; this is what Client and
+/// Server use to put headers on the wire.  The operator<<s above render
+/// through the same code, and copy the result into the ostream.
+void serialize(Buffer &buffer, const Request &r);
+void serialize(Buffer &buffer, const Response &r);
+
 }}
 
 #endif
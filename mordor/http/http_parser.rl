@@ -4,6 +4,8 @@
 
 #include "mordor/http/parser.h"
 
+#include "mordor/http/compact.h"
+
 #include <locale>
 #include <sstream>
 #include <string>
@@ -690,9 +692,12 @@ unquote(const std::string &str)
     # an authority might be a scheme
     Connect_Line = 'CONNECT' %save_Method SP authority >set_request_uri SP HTTP_Version CRLF;
     Request_Line = (Method - 'CONNECT') SP Request_URI >set_request_uri SP HTTP_Version CRLF;
-    Request = (Request_Line | Connect_Line) (((general_header | request_header | entity_header) %clearmark2 | message_header) CRLF)* CRLF @done;
+    Request_Headers = (((general_header | request_header | entity_header) %clearmark2 | message_header) CRLF)* CRLF @done;
+    Request = (Request_Line | Connect_Line) Request_Headers;
 
     main := Request;
+    # For a request line that's already been parsed (see RequestHeadersParser)
+    request_headers := Request_Headers;
     write data;
 }%%
 
@@ -763,6 +768,13 @@ RequestParser::error() const
     return cs == http_request_parser_error;
 }
 
+void
+RequestHeadersParser::init()
+{
+    RequestParser::init();
+    cs = http_request_parser_en_request_headers;
+}
+
 void
 RequestParser::exec()
 {
@@ -928,6 +940,103 @@ TrailerParser::exec()
 #endif
 }
 
+%%{
+    machine http_compact_request_parser;
+    include http_parser;
+
+    action start { m_start = offset(fpc); }
+    action start_after { m_start = offset(fpc) + 1; }
+
+    action save_compact_method {
+        m_request->m_method = CompactRequest::Span(m_start,
+            offset(fpc) - m_start);
+    }
+    action save_compact_uri {
+        m_request->m_uri = CompactRequest::Span(m_start,
+            offset(fpc) - m_start);
+    }
+    action save_compact_version {
+        m_request->m_versionText = CompactRequest::Span(m_start,
+            offset(fpc) - m_start);
+    }
+    action save_compact_headers {
+        m_request->m_headers = offset(fpc) + 1;
+    }
+    action save_compact_field_name {
+        CompactRequest::Field field;
+        field.field = EXTENSION_HEADER;
+        field.name = CompactRequest::Span(m_start, offset(fpc) - m_start);
+        m_request->m_fields.push_back(field);
+    }
+    # Also runs at the end of each line of a folded value; the last time is
+    # the whole value
+    action save_compact_field_value {
+        m_request->m_fields.back().value = CompactRequest::Span(m_start,
+            offset(fpc) - m_start);
+    }
+
+    compact_method = token >start %save_compact_method;
+    # Parsed as a URI only if the Request is asked for
+    compact_request_target = (any -- (SP | CTL))+ >start %save_compact_uri;
+    compact_version = ("HTTP/" DIGIT+ "." DIGIT+) >start %save_compact_version;
+    compact_header = token >start %save_compact_field_name ':' @start_after
+        TEXT* %save_compact_field_value;
+
+    compact_request_line = compact_method SP compact_request_target SP compact_version CRLF @save_compact_headers;
+    main := compact_request_line (compact_header CRLF)* CRLF @done;
+
+    write data;
+}%%
+
+CompactRequestParser::CompactRequestParser(CompactRequest &request)
+: m_request(&request)
+{}
+
+void
+CompactRequestParser::init()
+{
+    RagelParser::init();
+    m_request->reset();
+    m_consumed = 0;
+    m_start = 0;
+    %% write init;
+}
+
+bool
+CompactRequestParser::final() const
+{
+    return cs >= http_compact_request_parser_first_final;
+}
+
+bool
+CompactRequestParser::error() const
+{
+    return cs == http_compact_request_parser_error;
+}
+
+void
+CompactRequestParser::exec()
+{
+    m_base = p;
+#ifdef MSVC
+#pragma warning(push)
+#pragma warning(disable : 4244)
+#endif
+    %% write exec;
+#ifdef MSVC
+#pragma warning(pop)
+#endif
+    // No marks are kept, so RagelParser never holds on to earlier input;
+    // retain what was consumed here instead, in as few segments as possible
+    size_t consumed = p - m_base;
+    if (consumed > 0) {
+        m_request->m_block.reserve((std::max)(consumed, (size_t)2048));
+        m_request->m_block.copyIn(m_base, consumed);
+        m_consumed += consumed;
+    }
+    if (final())
+        m_request->finish();
+}
 
 %%{
     machine http_list_parser;
@@ -8,6 +8,8 @@
 namespace Mordor {
 namespace HTTP {
 
+class CompactRequest;
+
 class Parser : public RagelParserWithStack
 {
 public:
@@ -61,6 +63,18 @@ private:
     EntityHeaders *m_entity;
 };
 
+/// Parses just the header lines of a request, through the blank line
+
+/// For when the request line has already been parsed some other way;
+/// requestLine is left alone.
+class RequestHeadersParser : public RequestParser
+{
+public:
+    RequestHeadersParser(Request &request) : RequestParser(request) {}
+
+    void init();
+};
+
 class ResponseParser : public Parser
 {
 public:
@@ -95,6 +109,36 @@ private:
     EntityHeaders *m_entity;
 };
 
+/// Fills a CompactRequest
+
+/// Only the framing of the request line and the header lines is checked; the
+/// values themselves are left to CompactRequest to parse on demand.
+class CompactRequestParser : public RagelParserWithStack
+{
+public:
+    CompactRequestParser(CompactRequest &request);
+
+    void init();
+    bool final() const;
+    bool error() const;
+protected:
+    void exec();
+private:
+    /// Position of fpc in the whole header block
+    size_t offset(const char *fpc) const
+    { return m_consumed + (fpc - m_base); }
+
+private:
+    CompactRequest *m_request;
+    // Where the current call to exec() started, and how much of the header
+    // block preceded it
+    const char *m_base;
+    size_t m_consumed;
+    // Offset where the request line part or header currently being parsed
+    // started
+    size_t m_start;
+};
+
 class ListParser : public RagelParserWithStack
 {
 public:
@@ -7,6 +7,7 @@
 #include "mordor/fiber.h"
 #include "mordor/scheduler.h"
 #include "mordor/socket.h"
+#include "mordor/streams/buffer.h"
 #include "mordor/streams/null.h"
 #include "mordor/streams/transfer.h"
 #include "multipart.h"
@@ -777,15 +778,17 @@ ServerRequest::commit()
 
     try {
         // Write the headers
-        std::ostringstream os;
-        os << m_response;
-        std::string str = os.str();
+        Buffer headers;
+        serialize(headers, m_response);
         if (g_log->enabled(Log::DEBUG)) {
-            MORDOR_LOG_DEBUG(g_log) << m_context << " " << str;
+            MORDOR_LOG_DEBUG(g_log) << m_context << " "
+                << headers.toString();
         } else {
             MORDOR_LOG_VERBOSE(g_log) << m_context << " " << m_response.status;
         }
-        m_conn->m_stream->write(str.c_str(), str.size());
+        while (headers.readAvailable() > 0)
+            headers.consume(m_conn->m_stream->write(headers,
+                headers.readAvailable()));
 
         if (!Connection::hasMessageBody(m_response.general, m_response.entity,
             m_request.requestLine.method, m_response.status.status, false)) {
@@ -6,11 +6,25 @@
 
 #include "iomanager_epoll.h"
 
+#include <deque>
+#include <map>
+
+#include <boost/thread/condition_variable.hpp>
+
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#ifdef MORDOR_IOURING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
 
 #include "assert.h"
 #include "atomic.h"
+#include "config.h"
 #include "fiber.h"
+#include "thread.h"
 
 // EPOLLRDHUP is missing in the header on etch
 #ifndef EPOLLRDHUP
@@ -21,6 +35,24 @@ namespace Mordor {
 
 static Logger::ptr g_log = Log::lookup("mordor:iomanager");
 
+static ConfigVar<bool>::ptr g_ioUring = Config::lookup(
+    "iomanager.iouring", false,
+    "Submit socket and file I/O to an io_uring (Linux 5.6+), instead of "
+    "waiting for readiness with epoll");
+static ConfigVar<unsigned int>::ptr g_ioUringEntries = Config::lookup(
+    "iomanager.iouringentries", 256u,
+    "Submission queue size of each IOManager's io_uring");
+static ConfigVar<unsigned int>::ptr g_diskThreads = Config::lookup(
+    "iomanager.diskthreads", 4u,
+    "Number of threads each IOManager uses for blocking disk I/O");
+
+// fds per segment of the AsyncState table
+static const size_t SEGMENT_SHIFT = 10;
+static const size_t SEGMENT_SIZE = 1 << SEGMENT_SHIFT;
+// Upper bound on the table when RLIMIT_NOFILE is unlimited (matches the
+// kernel's default fs.nr_open)
+static const size_t MAX_FDS = 1024 * 1024;
+
 enum epoll_ctl_op_t
 {
     epoll_ctl_op_t_dummy = 0x7ffffff
@@ -95,7 +127,10 @@ static std::ostream &operator <<(std::ostream &os, EPOLL_EVENTS events)
 
 IOManager::AsyncState::AsyncState()
     : m_fd(0),
-      m_events(NONE)
+      m_events(NONE),
+      m_persistent(false),
+      m_added(false),
+      m_ready(NONE)
 {}
 
 IOManager::AsyncState::~AsyncState()
@@ -140,44 +175,466 @@ IOManager::AsyncState::triggerEvent(Event event, size_t *pendingEventCount,
     return true;
 }
 
-IOManager::IOManager(size_t threads, bool useCaller)
+#ifdef MORDOR_IOURING
+// The mapped submission and completion queues of an io_uring; the kernel
+// advances the submission head and completion tail, we advance the other two
+struct IOManager::Ring
+{
+    Ring() : fd(-1), rings(MAP_FAILED), sqes((io_uring_sqe *)MAP_FAILED) {}
+    ~Ring()
+    {
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqesSize);
+        if (rings != MAP_FAILED)
+            munmap(rings, ringsSize);
+        if (fd >= 0)
+            close(fd);
+    }
+
+    /// Hand everything queued to the kernel
+    /// @return false if the kernel couldn't take it all right now, because
+    /// its completion queue is overflowing (or it's short of memory)
+    bool submit()
+    {
+        unsigned int toSubmit = *sqTail -
+            __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        while (toSubmit > 0) {
+            int rc = (int)syscall(__NR_io_uring_enter, fd, toSubmit, 0, 0,
+                NULL, 0);
+            error_t error = errno;
+            MORDOR_LOG_LEVEL(g_log, rc < 0 ? Log::WARNING : Log::TRACE)
+                << "io_uring_enter(" << fd << ", " << toSubmit << "): " << rc
+                << " (" << error << ")";
+            if (rc < 0 && error == EINTR)
+                continue;
+            if (rc < 0 && (error == EBUSY || error == EAGAIN))
+                return false;
+            if (rc < 0)
+                MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "io_uring_enter");
+            toSubmit -= rc;
+        }
+        return true;
+    }
+
+    int fd;
+    void *rings;
+    size_t ringsSize;
+    io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned int *sqHead, *sqTail, *sqArray;
+    unsigned int sqMask, sqEntries;
+    unsigned int *cqHead, *cqTail;
+    unsigned int cqMask;
+    io_uring_cqe *cqes;
+    boost::mutex submitMutex, reapMutex;
+};
+
+// An operation's user_data is its fd's AsyncState (which lives as long as
+// the IOManager) tagged with the event. The state's Completion is on the
+// submitting Fiber's stack; that's safe because the fiber stays blocked
+// until its completion or cancellation is reaped
+static __u64 userData(void *state, IOManager::Event event)
+{
+    MORDOR_ASSERT(!((uintptr_t)state & 0x7));
+    return (uintptr_t)state | (event == IOManager::READ ? 1 : 2);
+}
+
+bool
+IOManager::openRing()
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(io_uring_params));
+    unsigned int entries = g_ioUringEntries->val();
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    error_t error = lastError();
+    MORDOR_LOG_LEVEL(g_log, fd < 0 ? Log::WARNING : Log::VERBOSE) << this
+        << " io_uring_setup(" << entries << "): " << fd << " (" << error
+        << ")";
+    if (fd < 0)
+        return false;
+    // Owned by m_ring from here on, so the constructor's closeRing cleans
+    // up if anything below throws
+    Ring *ring = m_ring = new Ring();
+    ring->fd = fd;
+    // One mapping for both queues (5.4), completions are never dropped
+    // (5.5), and reads and writes can use the file position (5.6)
+    const __u32 required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+        IORING_FEAT_RW_CUR_POS;
+    if ((params.features & required) != required) {
+        MORDOR_LOG_WARNING(g_log) << this << " io_uring features "
+            << params.features << " are too old";
+        closeRing();
+        return false;
+    }
+    ring->ringsSize = (std::max)(
+        params.sq_off.array + params.sq_entries * sizeof(unsigned int),
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    ring->rings = mmap(NULL, ring->ringsSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    ring->sqes = (io_uring_sqe *)mmap(NULL, ring->sqesSize,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+        IORING_OFF_SQES);
+    if (ring->rings == MAP_FAILED || ring->sqes == MAP_FAILED)
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("mmap");
+    unsigned char *rings = (unsigned char *)ring->rings;
+    ring->sqHead = (unsigned int *)(rings + params.sq_off.head);
+    ring->sqTail = (unsigned int *)(rings + params.sq_off.tail);
+    ring->sqArray = (unsigned int *)(rings + params.sq_off.array);
+    ring->sqMask = *(unsigned int *)(rings + params.sq_off.ring_mask);
+    ring->sqEntries = params.sq_entries;
+    ring->cqHead = (unsigned int *)(rings + params.cq_off.head);
+    ring->cqTail = (unsigned int *)(rings + params.cq_off.tail);
+    ring->cqMask = *(unsigned int *)(rings + params.cq_off.ring_mask);
+    ring->cqes = (io_uring_cqe *)(rings + params.cq_off.cqes);
+
+    // The ring is readable whenever there are completions to reap
+    epoll_event event;
+    memset(&event, 0, sizeof(epoll_event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    int rc = epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &event);
+    MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
+        << " epoll_ctl(" << m_epfd << ", EPOLL_CTL_ADD, " << fd
+        << ", EPOLLIN): " << rc << " (" << lastError() << ")";
+    if (rc)
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
+    return true;
+}
+
+void
+IOManager::closeRing()
+{
+    delete m_ring;
+    m_ring = NULL;
+}
+
+int
+IOManager::submitEvent(int fd, Event event, io_uring_sqe &sqe)
+{
+    MORDOR_ASSERT(m_ring);
+    MORDOR_ASSERT(fd >= 0);
+    MORDOR_ASSERT(Scheduler::getThis());
+    MORDOR_ASSERT(event == READ || event == WRITE);
+
+    AsyncState &state = *asyncState(fd, true);
+    AsyncState::EventContext &context = state.contextForEvent(event);
+    Completion completion;
+    completion.scheduler = Scheduler::getThis();
+    completion.fiber = Fiber::getThis();
+    {
+        boost::mutex::scoped_lock lock(state.m_mutex);
+        MORDOR_ASSERT(!context.completion);
+        context.completion = &completion;
+    }
+    sqe.user_data = userData(&state, event);
+    atomicIncrement(m_pendingEventCount);
+    try {
+        // Only our own threads flush at the end of each batch
+        queueSubmission(sqe, Scheduler::getThis() != this);
+    } catch (...) {
+        {
+            boost::mutex::scoped_lock lock(state.m_mutex);
+            context.completion = NULL;
+        }
+        atomicDecrement(m_pendingEventCount);
+        throw;
+    }
+    Scheduler::yieldTo();
+    return completion.result;
+}
+
+void
+IOManager::queueSubmission(const io_uring_sqe &sqe, bool flush)
+{
+    Ring &ring = *m_ring;
+    boost::mutex::scoped_lock lock(ring.submitMutex);
+    while (true) {
+        unsigned int tail = *ring.sqTail;
+        if (tail - __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE) <
+            ring.sqEntries) {
+            unsigned int index = tail & ring.sqMask;
+            ring.sqes[index] = sqe;
+            ring.sqArray[index] = index;
+            __atomic_store_n(ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+            break;
+        }
+        // Full; the kernel has to take what's queued, and it may need its
+        // completion queue drained first
+        if (!ring.submit()) {
+            lock.unlock();
+            reapCompletions(true);
+            lock.lock();
+        }
+    }
+    // Somebody else will have to reap before the kernel takes it
+    if (flush && !ring.submit())
+        tickle();
+}
+
+void
+IOManager::flushSubmissions()
+{
+    Ring &ring = *m_ring;
+    // Only submitters move the tail, and the kernel only moves the head
+    // while we're in io_uring_enter, so nothing queued means nothing to do
+    if (__atomic_load_n(ring.sqTail, __ATOMIC_RELAXED) ==
+        __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE))
+        return;
+    boost::mutex::scoped_lock lock(ring.submitMutex);
+    ring.submit();
+}
+
+void
+IOManager::reapCompletions(bool wait)
+{
+    Ring &ring = *m_ring;
+    boost::mutex::scoped_lock lock(ring.reapMutex, boost::defer_lock);
+    if (wait)
+        lock.lock();
+    else if (!lock.try_lock())
+        return;
+    unsigned int head = *ring.cqHead;
+    unsigned int tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        const io_uring_cqe &cqe = ring.cqes[head & ring.cqMask];
+        // Cancellations are fire-and-forget
+        if (!cqe.user_data)
+            continue;
+        AsyncState &state = *(AsyncState *)(uintptr_t)(cqe.user_data & ~7ull);
+        Event event = (cqe.user_data & 1) ? READ : WRITE;
+        Scheduler *scheduler;
+        Fiber::ptr fiber;
+        {
+            boost::mutex::scoped_lock lock2(state.m_mutex);
+            AsyncState::EventContext &context = state.contextForEvent(event);
+            MORDOR_ASSERT(context.completion);
+            MORDOR_LOG_TRACE(g_log) << this << " io_uring completion {"
+                << state.m_fd << ", " << event << ", " << cqe.res << "}";
+            context.completion->result = cqe.res;
+            scheduler = context.completion->scheduler;
+            fiber.swap(context.completion->fiber);
+            context.completion = NULL;
+        }
+        scheduler->schedule(fiber);
+        atomicDecrement(m_pendingEventCount);
+    }
+    __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+}
+#else
+struct IOManager::Ring {};
+
+bool
+IOManager::openRing()
+{
+    MORDOR_LOG_WARNING(g_log) << this << " built without io_uring support";
+    return false;
+}
+
+void
+IOManager::closeRing()
+{}
+
+int
+IOManager::submitEvent(int fd, Event event, io_uring_sqe &sqe)
+{
+    MORDOR_NOTREACHED();
+}
+
+void
+IOManager::queueSubmission(const io_uring_sqe &sqe, bool flush)
+{
+    MORDOR_NOTREACHED();
+}
+
+void
+IOManager::flushSubmissions()
+{}
+
+void
+IOManager::reapCompletions(bool wait)
+{}
+#endif
+
+// Threads that run blocking syscalls for Fibers, so they don't stall the
+// IOManager's own threads; each fd's work is kept together, so one file's
+// reads and writes stay in order and run back to back
+struct IOManager::DiskPool
+{
+    struct Job
+    {
+        boost::function<void ()> dg;
+        Scheduler *scheduler;
+        Fiber::ptr fiber;
+    };
+
+    DiskPool() : stopping(false) {}
+
+    boost::mutex mutex;
+    boost::condition_variable condition;
+    // An fd has an entry while it has work queued or running; a disk thread
+    // only erases it after finding its queue empty
+    std::map<int, std::deque<Job *> > files;
+    // fds with work that no disk thread has picked up yet
+    std::deque<int> ready;
+    bool stopping;
+    std::vector<boost::shared_ptr<Thread> > threads;
+};
+
+void
+IOManager::runDiskJobs(DiskPool &pool, size_t &pendingEventCount)
+{
+    boost::mutex::scoped_lock lock(pool.mutex);
+    while (true) {
+        while (pool.ready.empty() && !pool.stopping)
+            pool.condition.wait(lock);
+        if (pool.ready.empty())
+            return;
+        int fd = pool.ready.front();
+        pool.ready.pop_front();
+        std::deque<DiskPool::Job *> &jobs = pool.files[fd];
+        while (!jobs.empty()) {
+            DiskPool::Job &job = *jobs.front();
+            jobs.pop_front();
+            lock.unlock();
+            job.dg();
+            // job lives on the Fiber's stack
+            Scheduler *scheduler = job.scheduler;
+            Fiber::ptr fiber;
+            fiber.swap(job.fiber);
+            // Before scheduling it, like triggerEvent; otherwise an idle
+            // thread woken by the schedule can still see the job pending,
+            // and go back to waiting with nothing left to wake it
+            atomicDecrement(pendingEventCount);
+            scheduler->schedule(fiber);
+            lock.lock();
+        }
+        pool.files.erase(fd);
+    }
+}
+
+void
+IOManager::stopDiskJobs(DiskPool *pool)
+{
+    {
+        boost::mutex::scoped_lock lock(pool->mutex);
+        pool->stopping = true;
+        pool->condition.notify_all();
+    }
+    for (size_t i = 0; i < pool->threads.size(); ++i)
+        pool->threads[i]->join();
+    delete pool;
+}
+
+void
+IOManager::runBlocking(int fd, const boost::function<void ()> &dg)
+{
+    // No Fiber to park; this thread blocks either way
+    if (!Scheduler::getThis()) {
+        dg();
+        return;
+    }
+    if (!m_diskPool) {
+        boost::mutex::scoped_lock lock(m_diskPoolMutex);
+        if (!m_diskPool) {
+            DiskPool *pool = new DiskPool();
+            unsigned int threads = (std::max)(g_diskThreads->val(), 1u);
+            try {
+                for (unsigned int i = 0; i < threads; ++i)
+                    pool->threads.push_back(boost::shared_ptr<Thread>(
+                        new Thread(boost::bind(&runDiskJobs,
+                            boost::ref(*pool),
+                            boost::ref(m_pendingEventCount)), "disk")));
+            } catch (...) {
+                // The threads already started are using it
+                stopDiskJobs(pool);
+                throw;
+            }
+            m_diskPool = pool;
+        }
+    }
+    DiskPool &pool = *m_diskPool;
+    DiskPool::Job job;
+    job.dg = dg;
+    job.scheduler = Scheduler::getThis();
+    job.fiber = Fiber::getThis();
+    atomicIncrement(m_pendingEventCount);
+    {
+        boost::mutex::scoped_lock lock(pool.mutex);
+        std::map<int, std::deque<DiskPool::Job *> >::iterator it =
+            pool.files.find(fd);
+        if (it != pool.files.end()) {
+            it->second.push_back(&job);
+        } else {
+            pool.files[fd].push_back(&job);
+            pool.ready.push_back(fd);
+            pool.condition.notify_one();
+        }
+    }
+    Scheduler::yieldTo();
+}
+
+IOManager::IOManager(size_t threads, bool useCaller, Backend backend)
     : Scheduler(threads, useCaller),
-      m_pendingEventCount(0)
+      m_tickled(0),
+      m_pendingEventCount(0),
+      m_ring(NULL),
+      m_diskPool(NULL)
 {
+    // The hard limit is as high as this process can ever raise its soft
+    // limit, so every fd it can open fits in the directory
+    size_t maxFds = MAX_FDS;
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+        limit.rlim_max != RLIM_INFINITY && limit.rlim_max < maxFds)
+        maxFds = (size_t)limit.rlim_max;
+    m_segmentCount = (maxFds + SEGMENT_SIZE - 1) >> SEGMENT_SHIFT;
+    m_segments = new AsyncState *[m_segmentCount];
+    memset((void *)m_segments, 0, m_segmentCount * sizeof(AsyncState *));
+    MORDOR_LOG_VERBOSE(g_log) << this << " fd table sized for " << maxFds
+        << " fds in " << m_segmentCount << " segments";
+
     m_epfd = epoll_create(5000);
     MORDOR_LOG_LEVEL(g_log, m_epfd <= 0 ? Log::ERROR : Log::TRACE) << this
         << " epoll_create(5000): " << m_epfd;
-    if (m_epfd <= 0)
+    if (m_epfd <= 0) {
+        delete [] m_segments;
         MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_create");
-    int rc = pipe(m_tickleFds);
-    MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this << " pipe(): "
-        << rc << " (" << lastError() << ")";
-    if (rc) {
+    }
+    // Non-blocking, because more than one thread can see it readable at
+    // once, and only one of them will get to read it
+    m_tickleFd = eventfd(0, EFD_NONBLOCK);
+    MORDOR_LOG_LEVEL(g_log, m_tickleFd < 0 ? Log::ERROR : Log::VERBOSE) << this
+        << " eventfd(): " << m_tickleFd << " (" << lastError() << ")";
+    if (m_tickleFd < 0) {
         close(m_epfd);
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("pipe");
+        delete [] m_segments;
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("eventfd");
     }
-    MORDOR_ASSERT(m_tickleFds[0] > 0);
-    MORDOR_ASSERT(m_tickleFds[1] > 0);
     epoll_event event;
     memset(&event, 0, sizeof(epoll_event));
     event.events = EPOLLIN;
-    event.data.fd = m_tickleFds[0];
-    rc = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);
+    event.data.fd = m_tickleFd;
+    int rc = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFd, &event);
     MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
-        << " epoll_ctl(" << m_epfd << ", EPOLL_CTL_ADD, " << m_tickleFds[0]
+        << " epoll_ctl(" << m_epfd << ", EPOLL_CTL_ADD, " << m_tickleFd
         << ", EPOLLIN): " << rc << " (" << lastError() << ")";
     if (rc) {
-        close(m_tickleFds[0]);
-        close(m_tickleFds[1]);
+        close(m_tickleFd);
         close(m_epfd);
+        delete [] m_segments;
         MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
     }
     try {
+        if (backend == IOURING ||
+            (backend == CONFIGURED && g_ioUring->val()))
+            openRing();
         start();
     } catch (...) {
-        close(m_tickleFds[0]);
-        close(m_tickleFds[1]);
+        closeRing();
+        close(m_tickleFd);
         close(m_epfd);
+        delete [] m_segments;
         throw;
     }
 }
@@ -185,17 +642,49 @@ IOManager::IOManager(size_t threads, bool useCaller)
 IOManager::~IOManager()
 {
     stop();
+    if (m_diskPool)
+        stopDiskJobs(m_diskPool);
+    closeRing();
     close(m_epfd);
     MORDOR_LOG_TRACE(g_log) << this << " close(" << m_epfd << ")";
-    close(m_tickleFds[0]);
-    MORDOR_LOG_VERBOSE(g_log) << this << " close(" << m_tickleFds[0] << ")";
-    close(m_tickleFds[1]);
-    // Yes, it would be more C++-esque to store a boost::shared_ptr in the
-    // vector, but that requires an extra allocation per fd for the counter
-    for (size_t i = 0; i < m_pendingEvents.size(); ++i) {
-        if (m_pendingEvents[i])
-            delete m_pendingEvents[i];
+    close(m_tickleFd);
+    MORDOR_LOG_VERBOSE(g_log) << this << " close(" << m_tickleFd << ")";
+    for (size_t i = 0; i < m_segmentCount; ++i)
+        delete [] m_segments[i];
+    delete [] m_segments;
+}
+
+IOManager::AsyncState *
+IOManager::asyncState(int fd, bool create)
+{
+    size_t index = (size_t)fd >> SEGMENT_SHIFT;
+    if (index >= m_segmentCount) {
+        // Only possible if a privileged process raised its hard limit after
+        // we were constructed
+        if (create)
+            MORDOR_THROW_EXCEPTION(std::out_of_range(
+                "fd is beyond RLIMIT_NOFILE"));
+        return NULL;
     }
+    AsyncState *segment = m_segments[index];
+    if (!segment) {
+        if (!create)
+            return NULL;
+        AsyncState *newSegment = new AsyncState[SEGMENT_SIZE];
+        for (size_t i = 0; i < SEGMENT_SIZE; ++i)
+            newSegment[i].m_fd = (int)((index << SEGMENT_SHIFT) + i);
+        // Full barrier, so the initialized states are visible to anyone
+        // that can see the segment; if we lost the race, use the winner's
+        segment = atomicCompareAndSwap(m_segments[index], newSegment,
+            (AsyncState *)NULL);
+        if (segment)
+            delete [] newSegment;
+        else
+            segment = newSegment;
+    }
+    AsyncState *state = &segment[fd & (SEGMENT_SIZE - 1)];
+    MORDOR_ASSERT(fd == state->m_fd);
+    return state;
 }
 
 bool
@@ -213,32 +702,34 @@ IOManager::registerEvent(int fd, Event event, boost::function<void ()> dg)
     MORDOR_ASSERT(dg || Fiber::getThis());
     MORDOR_ASSERT(event == READ || event == WRITE || event == CLOSE);
 
-    // Look up our state in the global map, expanding it if necessary
-    boost::mutex::scoped_lock lock(m_mutex);
-    if (m_pendingEvents.size() < (size_t)fd)
-        m_pendingEvents.resize(fd * 3 / 2);
-    if (!m_pendingEvents[fd - 1]) {
-        m_pendingEvents[fd - 1] = new AsyncState();
-        m_pendingEvents[fd - 1]->m_fd = fd;
-    }
-    AsyncState &state = *m_pendingEvents[fd - 1];
-    MORDOR_ASSERT(fd == state.m_fd);
-    lock.unlock();
-
+    AsyncState &state = *asyncState(fd, true);
+    // Destructed after the lock is released, in case the event is already
+    // ready
+    Fiber::ptr readyFiber;
+    boost::function<void ()> readyDg;
     boost::mutex::scoped_lock lock2(state.m_mutex);
 
     MORDOR_ASSERT(!(state.m_events & event));
-    int op = state.m_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
-    epoll_event epevent;
-    epevent.events = EPOLLET | state.m_events | event;
-    epevent.data.ptr = &state;
-    int rc = epoll_ctl(m_epfd, op, fd, &epevent);
-    MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
-        << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", "
-        << fd << ", " << (EPOLL_EVENTS)epevent.events << "): " << rc
-        << " (" << lastError() << ")";
-    if (rc)
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
+    if (!state.m_added) {
+        int op;
+        epoll_event epevent;
+        if (state.m_persistent) {
+            op = EPOLL_CTL_ADD;
+            epevent.events = EPOLLET | EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+        } else {
+            op = state.m_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+            epevent.events = EPOLLET | state.m_events | event;
+        }
+        epevent.data.ptr = &state;
+        int rc = epoll_ctl(m_epfd, op, fd, &epevent);
+        MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
+            << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", "
+            << fd << ", " << (EPOLL_EVENTS)epevent.events << "): " << rc
+            << " (" << lastError() << ")";
+        if (rc)
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
+        state.m_added = state.m_persistent;
+    }
     atomicIncrement(m_pendingEventCount);
     state.m_events = (Event)(state.m_events | event);
     AsyncState::EventContext &context = state.contextForEvent(event);
@@ -249,6 +740,13 @@ IOManager::registerEvent(int fd, Event event, boost::function<void ()> dg)
     if (!dg)
         context.fiber = Fiber::getThis();
     context.dg.swap(dg);
+
+    // The edge already came and went
+    if (state.m_ready & event) {
+        state.m_ready = (Event)(state.m_ready & ~event);
+        state.triggerEvent(event, &m_pendingEventCount, &readyFiber,
+            &readyDg);
+    }
 }
 
 bool
@@ -257,32 +755,30 @@ IOManager::unregisterEvent(int fd, Event event)
     MORDOR_ASSERT(fd > 0);
     MORDOR_ASSERT(event == READ || event == WRITE || event == CLOSE);
 
-    boost::mutex::scoped_lock lock(m_mutex);
-    if (m_pendingEvents.size() < (size_t)fd)
-        return false;
-    if (!m_pendingEvents[fd - 1])
+    AsyncState *pState = asyncState(fd, false);
+    if (!pState)
         return false;
-    AsyncState &state = *m_pendingEvents[fd - 1];
-    MORDOR_ASSERT(fd == state.m_fd);
-    lock.unlock();
-
+    AsyncState &state = *pState;
     boost::mutex::scoped_lock lock2(state.m_mutex);
     if (!(state.m_events & event))
         return false;
 
     MORDOR_ASSERT(fd == state.m_fd);
     Event newEvents = (Event)(state.m_events &~event);
-    int op = newEvents ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-    epoll_event epevent;
-    epevent.events = EPOLLET | newEvents;
-    epevent.data.ptr = &state;
-    int rc = epoll_ctl(m_epfd, op, fd, &epevent);
-    MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
-        << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", "
-        << fd << ", " << (EPOLL_EVENTS)epevent.events << "): " << rc
-        << " (" << lastError() << ")";
-    if (rc)
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
+    // Persistent fds stay in the epoll set regardless
+    if (!state.m_persistent) {
+        int op = newEvents ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+        epoll_event epevent;
+        epevent.events = EPOLLET | newEvents;
+        epevent.data.ptr = &state;
+        int rc = epoll_ctl(m_epfd, op, fd, &epevent);
+        MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
+            << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", "
+            << fd << ", " << (EPOLL_EVENTS)epevent.events << "): " << rc
+            << " (" << lastError() << ")";
+        if (rc)
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
+    }
     atomicDecrement(m_pendingEventCount);
     state.m_events = newEvents;
     AsyncState::EventContext &context = state.contextForEvent(event);
@@ -299,32 +795,43 @@ IOManager::cancelEvent(int fd, Event event)
     MORDOR_ASSERT(fd > 0);
     MORDOR_ASSERT(event == READ || event == WRITE || event == CLOSE);
 
-    boost::mutex::scoped_lock lock(m_mutex);
-    if (m_pendingEvents.size() < (size_t)fd)
+    AsyncState *pState = asyncState(fd, false);
+    if (!pState)
         return false;
-    if (!m_pendingEvents[fd - 1])
-        return false;
-    AsyncState &state = *m_pendingEvents[fd - 1];
-    MORDOR_ASSERT(fd == state.m_fd);
-    lock.unlock();
-
+    AsyncState &state = *pState;
     boost::mutex::scoped_lock lock2(state.m_mutex);
+#ifdef MORDOR_IOURING
+    if (event != CLOSE && state.contextForEvent(event).completion) {
+        lock2.unlock();
+        // It completes (with -ECANCELED, unless it beat us to it)
+        io_uring_sqe sqe;
+        memset(&sqe, 0, sizeof(io_uring_sqe));
+        sqe.opcode = IORING_OP_ASYNC_CANCEL;
+        sqe.fd = -1;
+        sqe.addr = userData(&state, event);
+        queueSubmission(sqe, true);
+        return true;
+    }
+#endif
     if (!(state.m_events & event))
         return false;
 
     MORDOR_ASSERT(fd == state.m_fd);
     Event newEvents = (Event)(state.m_events &~event);
-    int op = newEvents ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-    epoll_event epevent;
-    epevent.events = EPOLLET | newEvents;
-    epevent.data.ptr = &state;
-    int rc = epoll_ctl(m_epfd, op, fd, &epevent);
-    MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
-        << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", "
-        << fd << ", " << (EPOLL_EVENTS)epevent.events << "): " << rc
-        << " (" << lastError() << ")";
-    if (rc)
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
+    // Persistent fds stay in the epoll set regardless
+    if (!state.m_persistent) {
+        int op = newEvents ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+        epoll_event epevent;
+        epevent.events = EPOLLET | newEvents;
+        epevent.data.ptr = &state;
+        int rc = epoll_ctl(m_epfd, op, fd, &epevent);
+        MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
+            << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", "
+            << fd << ", " << (EPOLL_EVENTS)epevent.events << "): " << rc
+            << " (" << lastError() << ")";
+        if (rc)
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
+    }
     Fiber::ptr fiber;
     boost::function<void ()> dg;
     state.triggerEvent(event, &m_pendingEventCount, &fiber, &dg);
@@ -332,6 +839,56 @@ IOManager::cancelEvent(int fd, Event event)
     return true;
 }
 
+void
+IOManager::registerFile(int fd)
+{
+    MORDOR_ASSERT(fd > 0);
+    AsyncState &state = *asyncState(fd, true);
+    boost::mutex::scoped_lock lock(state.m_mutex);
+    MORDOR_ASSERT(!state.m_events);
+    MORDOR_ASSERT(!state.m_persistent);
+    state.m_persistent = true;
+    MORDOR_LOG_VERBOSE(g_log) << this << " registerFile(" << fd << ")";
+}
+
+void
+IOManager::unregisterFile(int fd)
+{
+    MORDOR_ASSERT(fd > 0);
+    AsyncState *pState = asyncState(fd, false);
+    if (!pState)
+        return;
+    AsyncState &state = *pState;
+    Fiber::ptr readFiber, writeFiber, closeFiber;
+    boost::function<void ()> readDg, writeDg, closeDg;
+    boost::mutex::scoped_lock lock(state.m_mutex);
+    if (!state.m_persistent)
+        return;
+    if (state.m_added) {
+        epoll_event epevent;
+        memset(&epevent, 0, sizeof(epoll_event));
+        int rc = epoll_ctl(m_epfd, EPOLL_CTL_DEL, fd, &epevent);
+        MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
+            << " epoll_ctl(" << m_epfd << ", EPOLL_CTL_DEL, " << fd << "): "
+            << rc << " (" << lastError() << ")";
+        // Not fatal (we're usually called from a destructor); the kernel
+        // drops the fd from the epoll set itself when it's closed
+    }
+    state.triggerEvent(READ, &m_pendingEventCount, &readFiber, &readDg);
+    state.triggerEvent(WRITE, &m_pendingEventCount, &writeFiber, &writeDg);
+    state.triggerEvent(CLOSE, &m_pendingEventCount, &closeFiber, &closeDg);
+    state.m_persistent = state.m_added = false;
+    state.m_ready = NONE;
+    bool readInFlight = state.m_in.completion != NULL;
+    bool writeInFlight = state.m_out.completion != NULL;
+    lock.unlock();
+    MORDOR_LOG_VERBOSE(g_log) << this << " unregisterFile(" << fd << ")";
+    if (readInFlight)
+        cancelEvent(fd, READ);
+    if (writeInFlight)
+        cancelEvent(fd, WRITE);
+}
+
 bool
 IOManager::stopping(unsigned long long &nextTimeout)
 {
@@ -348,6 +905,9 @@ IOManager::idle()
         unsigned long long nextTimeout;
         if (stopping(nextTimeout))
             return;
+        // Anything queued by fibers that ran since the last batch ended
+        if (m_ring)
+            flushSubmissions();
         int rc;
         int timeout;
         do {
@@ -372,13 +932,22 @@ IOManager::idle()
 
         for(int i = 0; i < rc; ++i) {
             epoll_event &event = events[i];
-            if (event.data.fd == m_tickleFds[0]) {
-                unsigned char dummy;
-                int rc2 = read(m_tickleFds[0], &dummy, 1);
-                MORDOR_VERIFY(rc2 == 1);
+            if (event.data.fd == m_tickleFd) {
+                uint64_t count;
+                int rc2 = read(m_tickleFd, &count, sizeof(count));
+                MORDOR_VERIFY(rc2 == sizeof(count) ||
+                    (rc2 < 0 && errno == EAGAIN));
+                // Only after the eventfd has been drained; a tickle that
+                // comes in between is consumed by the Scheduler looking for
+                // work once we yield
+                atomicCompareAndSwap(m_tickled, 0, 1);
                 MORDOR_LOG_VERBOSE(g_log) << this << " received tickle";
                 continue;
             }
+            if (m_ring && event.data.fd == m_ring->fd) {
+                reapCompletions(true);
+                continue;
+            }
 
             AsyncState &state = *(AsyncState *)event.data.ptr;
 
@@ -390,6 +959,28 @@ IOManager::idle()
             if (event.events & (EPOLLERR | EPOLLHUP))
                 event.events |= EPOLLIN | EPOLLOUT;
 
+            if (state.m_persistent) {
+                // Still in the epoll set; just hand out the edges, and
+                // remember the ones nobody is waiting for yet
+                Fiber::ptr readFiber, writeFiber, closeFiber;
+                boost::function<void ()> readDg, writeDg, closeDg;
+                Event ready = (Event)(event.events &
+                    (EPOLLIN | EPOLLOUT | EPOLLRDHUP));
+                state.m_ready = (Event)(state.m_ready |
+                    (ready & ~state.m_events));
+                if (ready & READ)
+                    state.triggerEvent(READ, &m_pendingEventCount,
+                        &readFiber, &readDg);
+                if (ready & WRITE)
+                    state.triggerEvent(WRITE, &m_pendingEventCount,
+                        &writeFiber, &writeDg);
+                if (ready & CLOSE)
+                    state.triggerEvent(CLOSE, &m_pendingEventCount,
+                        &closeFiber, &closeDg);
+                lock2.unlock();
+                continue;
+            }
+
             bool triggered = false;
             uint32_t toTrigger = event.events;
             uint32_t oldEvents = state.m_events;
@@ -441,13 +1032,29 @@ IOManager::idle()
     }
 }
 
+void
+IOManager::endBatch()
+{
+    if (m_ring) {
+        flushSubmissions();
+        reapCompletions(false);
+    }
+}
+
 void
 IOManager::tickle()
 {
-    int rc = write(m_tickleFds[1], "T", 1);
-    MORDOR_LOG_VERBOSE(g_log) << this << " write(" << m_tickleFds[1] << ", 1): "
+    // A thread is already going to wake up and look for work (full barrier,
+    // so any work scheduled before this is visible to it)
+    if (atomicCompareAndSwap(m_tickled, 1, 0) != 0) {
+        MORDOR_LOG_VERBOSE(g_log) << this << " tickle already pending";
+        return;
+    }
+    uint64_t one = 1;
+    int rc = write(m_tickleFd, &one, sizeof(one));
+    MORDOR_LOG_VERBOSE(g_log) << this << " write(" << m_tickleFd << ", 1): "
         << rc << " (" << lastError() << ")";
-    MORDOR_VERIFY(rc == 1);
+    MORDOR_VERIFY(rc == sizeof(one));
 }
 
 }
@@ -10,6 +10,15 @@
 #error IOManagerEPoll is Linux only
 #endif
 
+// io_uring needs kernel headers from 5.1 or later
+#ifdef __has_include
+#if __has_include(<linux/io_uring.h>)
+#define MORDOR_IOURING
+#endif
+#endif
+
+struct io_uring_sqe;
+
 namespace Mordor {
 
 class Fiber;
@@ -24,7 +33,30 @@ public:
         CLOSE = 0x2000
     };
 
+    enum Backend {
+        /// Whichever the iomanager.iouring ConfigVar selects
+        CONFIGURED,
+        /// Wait for readiness with epoll, then do the I/O
+        EPOLL,
+        /// Submit the I/O to an io_uring, and wait for it to complete; falls
+        /// back to EPOLL if the kernel doesn't support it
+        IOURING
+    };
+
 private:
+    /// An operation submitted to the io_uring, owned by the Fiber waiting
+    /// for it
+    struct Completion
+    {
+        Completion() : scheduler(NULL), result(0) {}
+        Scheduler *scheduler;
+        boost::shared_ptr<Fiber> fiber;
+        int result;
+    };
+
+    struct Ring;
+    struct DiskPool;
+
     struct AsyncState : boost::noncopyable
     {
         AsyncState();
@@ -32,10 +64,12 @@ private:
 
         struct EventContext
         {
-            EventContext() : scheduler(NULL) {}
+            EventContext() : scheduler(NULL), completion(NULL) {}
             Scheduler *scheduler;
             boost::shared_ptr<Fiber> fiber;
             boost::function<void ()> dg;
+            // In flight in the io_uring, independent of the above
+            Completion *completion;
         };
 
         EventContext &contextForEvent(Event event);
@@ -46,15 +80,47 @@ private:
         int m_fd;
         EventContext m_in, m_out, m_close;
         Event m_events;
+        // Set by registerFile; the fd stays in the epoll set, watching for
+        // every event, until unregisterFile
+        bool m_persistent;
+        // A persistent fd has been added to the epoll set
+        bool m_added;
+        // Edges seen on a persistent fd while nobody was waiting for them
+        Event m_ready;
         boost::mutex m_mutex;
     };
 
 public:
-    IOManager(size_t threads = 1, bool useCaller = true);
+    IOManager(size_t threads = 1, bool useCaller = true,
+        Backend backend = CONFIGURED);
     ~IOManager();
 
     bool stopping();
 
+    /// If I/O should be submitted with submitEvent, instead of waiting for
+    /// readiness with registerEvent
+    bool ioUring() const { return m_ring != NULL; }
+    /// Submit sqe to the io_uring, as fd's event, and block this Fiber until
+    /// it completes; cancelEvent(fd, event) cancels it
+    ///
+    /// Submissions from this IOManager's own threads are batched, and go to
+    /// the kernel together once the Scheduler has run everything that was
+    /// ready; sqe.user_data is overwritten.
+    /// @return The completion's result; >= 0 on success, otherwise -errno
+    /// @pre ioUring()
+    int submitEvent(int fd, Event event, io_uring_sqe &sqe);
+
+    /// Run dg on one of this IOManager's disk threads, blocking the calling
+    /// Fiber (but not its thread) until it returns
+    ///
+    /// For syscalls on regular files, which always block and which epoll
+    /// can't wait for.  Work for the same fd runs in the order it was
+    /// queued, back to back on one disk thread.  The threads are started on
+    /// first use; iomanager.diskthreads says how many.  Called from a thread
+    /// with no Scheduler, dg just runs on the calling thread.
+    /// @pre dg does not throw
+    void runBlocking(int fd, const boost::function<void ()> &dg);
+
     void registerEvent(int fd, Event events,
         boost::function<void ()> dg = NULL);
     /// Will not cause the event to fire
@@ -63,19 +129,67 @@ public:
     /// Will cause the event to fire
     bool cancelEvent(int fd, Event events);
 
+    /// Keep fd in the epoll set, edge-triggered for every event, from its
+    /// first registerEvent until unregisterFile, instead of adding and
+    /// removing it for each wait
+    ///
+    /// Readiness that arrives while nobody is waiting is remembered, and
+    /// satisfies the next registerEvent immediately; this may occasionally
+    /// be stale, so callers must retry the operation and wait again if it
+    /// still fails with EAGAIN.
+    /// @pre No events are registered for fd
+    void registerFile(int fd);
+    /// Must be called before closing an fd passed to registerFile; any
+    /// pending events are cancelled (they fire)
+    void unregisterFile(int fd);
+
 protected:
     bool stopping(unsigned long long &nextTimeout);
     void idle();
     void tickle();
+    void endBatch();
 
     void onTimerInsertedAtFront() { tickle(); }
 
+private:
+    /// Finds the state for fd without taking any locks
+    /// @param create Allocate the segment containing fd if it doesn't exist
+    /// yet; otherwise NULL is returned for a never-registered fd
+    AsyncState *asyncState(int fd, bool create);
+
+    /// Fails (returning false) if the kernel has no io_uring
+    bool openRing();
+    void closeRing();
+    /// @param flush Hand everything queued to the kernel now, instead of
+    /// waiting for the end of the current batch
+    void queueSubmission(const io_uring_sqe &sqe, bool flush);
+    void flushSubmissions();
+    /// Schedule the Fibers whose operations have completed
+    /// @param wait Wait for another thread that's already reaping, instead
+    /// of leaving it to that thread
+    void reapCompletions(bool wait);
+
+    static void runDiskJobs(DiskPool &pool, size_t &pendingEventCount);
+    /// Joins pool's threads once they run out of work, then deletes it
+    static void stopDiskJobs(DiskPool *pool);
+
 private:
     int m_epfd;
-    int m_tickleFds[2];
+    int m_tickleFd;
+    // An eventfd write is already pending; further tickles can be skipped
+    // until a thread wakes up and consumes it
+    volatile int m_tickled;
     size_t m_pendingEventCount;
-    boost::mutex m_mutex;
-    std::vector<AsyncState *> m_pendingEvents;
+    // fd -> AsyncState, in fixed-size segments that are published with a
+    // CAS and never freed or moved until destruction, so lookups don't
+    // need a lock; the segment directory is sized from RLIMIT_NOFILE
+    AsyncState * volatile *m_segments;
+    size_t m_segmentCount;
+    // NULL unless using the io_uring backend
+    Ring *m_ring;
+    // NULL until the first runBlocking
+    DiskPool * volatile m_diskPool;
+    boost::mutex m_diskPoolMutex;
 };
 
 }
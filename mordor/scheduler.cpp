@@ -5,17 +5,110 @@
 #include <boost/bind.hpp>
 
 #include "assert.h"
+#include "atomic.h"
 #include "fiber.h"
 
 namespace Mordor {
 
 static Logger::ptr g_log = Log::lookup("mordor:scheduler");
 
+namespace {
+
+/// Bounded FIFO ring of pointers
+
+/// Only the owning thread may push(), but any thread may take(); the owner
+/// takes its own work, and idle threads steal from the front of the ring.
+/// Neither operation takes a lock.
+template <class T>
+class RunQueue : boost::noncopyable
+{
+public:
+    enum { CAPACITY = 256 };
+
+    RunQueue()
+        : m_head(0),
+          m_tail(0)
+    {}
+
+    /// @return false if the ring is full
+    bool push(T *t)
+    {
+        intptr_t tail = m_tail;
+        if (tail - m_head >= (intptr_t)CAPACITY)
+            return false;
+        m_items[tail & (CAPACITY - 1)] = t;
+        // The item must be visible before the new tail is
+        m_tail = tail + 1;
+        return true;
+    }
+
+    /// @return NULL if the ring is empty
+    T *take()
+    {
+        while (true) {
+            intptr_t head = m_head;
+            if (head >= m_tail)
+                return NULL;
+            // The slot can't be overwritten until m_head moves past it, so
+            // if the CAS succeeds we read the right item
+            T *t = m_items[head & (CAPACITY - 1)];
+            if (atomicCompareAndSwap(m_head, head + 1, head) == head)
+                return t;
+        }
+    }
+
+    bool empty() const { return m_head >= m_tail; }
+
+private:
+    volatile intptr_t m_head, m_tail;
+    T * volatile m_items[CAPACITY];
+};
+
+}
+
+// Most Tasks a thread keeps for reuse; beyond that they go back to the
+// Scheduler's shared pool, which keeps up to MAX_FREE_TASKS * threadCount()
+enum { MAX_FREE_TASKS = 256 };
+
+struct Scheduler::ThreadQueue : boost::noncopyable
+{
+    ThreadQueue(tid_t thread)
+        : owner(thread),
+          pinnedCount(0),
+          idle(0),
+          wakePending(0),
+          freeTasks(NULL),
+          freeTaskCount(0)
+    {}
+
+    volatile tid_t owner;
+    /// Work scheduled by the owning thread; other threads steal from it
+    RunQueue<SchedulerHook> local;
+    /// Mailbox of work that may only run on the owning thread
+    boost::mutex mutex;
+    HookQueue pinned;
+    volatile size_t pinnedCount;
+    /// The owning thread is in (or about to enter) the idle fiber, and needs
+    /// to be tickled to notice new work in its mailbox
+    volatile int idle;
+    /// The owning thread was sent a tickle that may have gone to some other
+    /// thread instead
+    volatile int wakePending;
+    /// Tasks that have run, kept for reuse; only the owning thread uses these
+    Task *freeTasks;
+    size_t freeTaskCount;
+};
+
 ThreadLocalStorage<Scheduler *> Scheduler::t_scheduler;
 ThreadLocalStorage<Fiber *> Scheduler::t_fiber;
+ThreadLocalStorage<Scheduler::ThreadQueue *> Scheduler::t_queue;
 
 Scheduler::Scheduler(size_t threads, bool useCaller, size_t batchSize)
-    : m_activeThreadCount(0),
+    : m_sharedCount(0),
+      m_freeTasks(NULL),
+      m_freeTaskCount(0),
+      m_queues(new std::vector<ThreadQueue *>()),
+      m_activeThreadCount(0),
       m_stopping(true),
       m_autoStop(false),
       m_batchSize(batchSize)
@@ -25,6 +118,7 @@ Scheduler::Scheduler(size_t threads, bool useCaller, size_t batchSize)
         --threads;
         MORDOR_ASSERT(getThis() == NULL);
         t_scheduler = this;
+        t_queue = NULL;
         m_rootFiber.reset(new Fiber(boost::bind(&Scheduler::run, this)));
         t_scheduler = this;
         t_fiber = m_rootFiber.get();
@@ -40,7 +134,35 @@ Scheduler::~Scheduler()
     MORDOR_ASSERT(m_stopping);
     if (getThis() == this) {
         t_scheduler = NULL;
+        t_queue = NULL;
+    }
+    Fiber::ptr fiber;
+    while (SchedulerHook *hook = m_fibers.pop())
+        delete unpack(hook, fiber);
+    while (m_freeTasks) {
+        Task *task = m_freeTasks;
+        m_freeTasks = static_cast<Task *>(task->next);
+        delete task;
     }
+    std::vector<ThreadQueue *> *queues = m_queues;
+    for (std::vector<ThreadQueue *>::iterator it = queues->begin();
+        it != queues->end();
+        ++it) {
+        ThreadQueue *queue = *it;
+        while (SchedulerHook *hook = queue->local.take())
+            delete unpack(hook, fiber);
+        while (SchedulerHook *hook = queue->pinned.pop())
+            delete unpack(hook, fiber);
+        while (queue->freeTasks) {
+            Task *task = queue->freeTasks;
+            queue->freeTasks = static_cast<Task *>(task->next);
+            delete task;
+        }
+        delete queue;
+    }
+    delete queues;
+    for (size_t i = 0; i < m_retiredQueues.size(); ++i)
+        delete m_retiredQueues[i];
 }
 
 Scheduler *
@@ -73,8 +195,22 @@ Scheduler::start()
 bool
 Scheduler::hasWorkToDo()
 {
-    boost::mutex::scoped_lock lock(m_mutex);
-    return !m_fibers.empty();
+    return !queuesEmpty();
+}
+
+bool
+Scheduler::queuesEmpty()
+{
+    if (m_sharedCount != 0)
+        return false;
+    std::vector<ThreadQueue *> *queues = m_queues;
+    for (std::vector<ThreadQueue *>::const_iterator it = queues->begin();
+        it != queues->end();
+        ++it) {
+        if (!(*it)->local.empty() || (*it)->pinnedCount != 0)
+            return false;
+    }
+    return true;
 }
 
 void
@@ -146,48 +282,63 @@ Scheduler::stop()
     MORDOR_LOG_VERBOSE(g_log) << this << " stopped";
 }
 
+#ifndef NDEBUG
+static bool contains(const std::vector<boost::shared_ptr<Thread> >
+    &threads, tid_t thread)
+{
+    for (std::vector<boost::shared_ptr<Thread> >::const_iterator it =
+        threads.begin(); it != threads.end(); ++it)
+        if ((*it)->tid() == thread)
+            return true;
+    return false;
+}
+#endif
+
 bool
 Scheduler::stopping()
 {
-    boost::mutex::scoped_lock lock(m_mutex);
-    return m_stopping && m_fibers.empty() && m_activeThreadCount == 0;
+    return m_stopping && queuesEmpty() && m_activeThreadCount == 0;
 }
 
 void
 Scheduler::schedule(Fiber::ptr f, tid_t thread)
 {
-    bool tickleMe;
-    {
-        boost::mutex::scoped_lock lock(m_mutex);
-        tickleMe = scheduleNoLock(f, thread);
-    }
-    if (tickleMe && Scheduler::getThis() != this)
-        tickle();
+    MORDOR_LOG_DEBUG(g_log) << this << " scheduling " << f << " on thread "
+        << thread;
+    MORDOR_ASSERT(f);
+    // Not thread-targeted, or this scheduler owns the targetted thread
+    MORDOR_ASSERT(thread == emptytid() || thread == m_rootThread ||
+        contains(m_threads, thread));
+    enqueue(hook(f, thread, false));
 }
 
 void
 Scheduler::schedule(boost::function<void ()> dg, tid_t thread)
 {
-    bool tickleMe;
-    {
-        boost::mutex::scoped_lock lock(m_mutex);
-        tickleMe = scheduleNoLock(dg, thread);
-    }
-    if (tickleMe && Scheduler::getThis() != this)
-        tickle();
+    MORDOR_LOG_DEBUG(g_log) << this << " scheduling " << dg << " on thread "
+        << thread;
+    MORDOR_ASSERT(dg);
+    // Not thread-targeted, or this scheduler owns the targetted thread
+    MORDOR_ASSERT(thread == emptytid() || thread == m_rootThread ||
+        contains(m_threads, thread));
+    Task *task = allocateTask(false);
+    task->dg.assign(dg);
+    task->thread = thread;
+    enqueue(task);
 }
 
-#ifndef NDEBUG
-static bool contains(const std::vector<boost::shared_ptr<Thread> >
-    &threads, tid_t thread)
+// The part of schedule(F, tid_t) that needs this file's logger and helpers
+void
+Scheduler::scheduleTask(Task *task, tid_t thread)
 {
-    for (std::vector<boost::shared_ptr<Thread> >::const_iterator it =
-        threads.begin(); it != threads.end(); ++it)
-        if ((*it)->tid() == thread)
-            return true;
-    return false;
+    MORDOR_LOG_DEBUG(g_log) << this << " scheduling " << task << " on thread "
+        << thread;
+    // Not thread-targeted, or this scheduler owns the targetted thread
+    MORDOR_ASSERT(thread == emptytid() || thread == m_rootThread ||
+        contains(m_threads, thread));
+    task->thread = thread;
+    enqueue(task);
 }
-#endif
 
 bool
 Scheduler::scheduleNoLock(Fiber::ptr f, tid_t thread)
@@ -198,10 +349,7 @@ Scheduler::scheduleNoLock(Fiber::ptr f, tid_t thread)
     // Not thread-targeted, or this scheduler owns the targetted thread
     MORDOR_ASSERT(thread == emptytid() || thread == m_rootThread ||
         contains(m_threads, thread));
-    FiberAndThread ft = {f, NULL, thread };
-    bool tickleMe = m_fibers.empty();
-    m_fibers.push_back(ft);
-    return tickleMe;
+    return enqueueNoLock(hook(f, thread, true));
 }
 
 bool
@@ -213,12 +361,301 @@ Scheduler::scheduleNoLock(boost::function<void ()> dg, tid_t thread)
     // Not thread-targeted, or this scheduler owns the targetted thread
     MORDOR_ASSERT(thread == emptytid() || thread == m_rootThread ||
         contains(m_threads, thread));
-    FiberAndThread ft = {Fiber::ptr(), dg, thread };
+    Task *task = allocateTask(true);
+    task->dg.assign(dg);
+    task->thread = thread;
+    return enqueueNoLock(task);
+}
+
+// Takes over the reference in fiber, and returns the queue entry for it.
+// That's normally the Fiber's own hook; only if the Fiber is (wrongly) still
+// queued from an earlier schedule() is a Task needed.
+SchedulerHook *
+Scheduler::hook(Fiber::ptr &fiber, tid_t thread, bool locked)
+{
+    Fiber *f = fiber.get();
+    if (atomicCompareAndSwap(f->m_queued, 1, 0) == 0) {
+        f->m_hook.thread = thread;
+        f->m_scheduledSelf.swap(fiber);
+        return &f->m_hook;
+    }
+    Task *task = allocateTask(locked);
+    task->fiber = f;
+    task->fiberRef.swap(fiber);
+    task->thread = thread;
+    return task;
+}
+
+// Gives up hook's place in the queue.  If it's a Fiber, the reference that
+// kept it alive while it was queued is moved into fiber.  Any Task is
+// returned, and the caller is responsible for freeing it.
+Scheduler::Task *
+Scheduler::unpack(SchedulerHook *hook, Fiber::ptr &fiber)
+{
+    Fiber *f = hook->fiber;
+    if (!f)
+        return static_cast<Task *>(hook);
+    if (hook == &f->m_hook) {
+        fiber.swap(f->m_scheduledSelf);
+        // Full barrier; the hook can be reused as soon as this is cleared
+        atomicCompareAndSwap(f->m_queued, 0, 1);
+        return NULL;
+    }
+    Task *task = static_cast<Task *>(hook);
+    fiber.swap(task->fiberRef);
+    return task;
+}
+
+// Tasks come from this thread's cache if it's one of ours, then the shared
+// pool, and only then the heap.  If locked, m_mutex is already held.
+Scheduler::Task *
+Scheduler::allocateTask(bool locked)
+{
+    Task *task;
+    ThreadQueue *queue = t_queue.get();
+    if (queue && Scheduler::getThis() == this && queue->freeTasks) {
+        task = queue->freeTasks;
+        queue->freeTasks = static_cast<Task *>(task->next);
+        --queue->freeTaskCount;
+        return task;
+    }
+    if (m_freeTaskCount != 0) {
+        boost::mutex::scoped_lock lock(m_mutex, boost::defer_lock);
+        if (!locked)
+            lock.lock();
+        if ( (task = m_freeTasks) ) {
+            m_freeTasks = static_cast<Task *>(task->next);
+            --m_freeTaskCount;
+            return task;
+        }
+    }
+    return new Task();
+}
+
+void
+Scheduler::freeTask(Task *task)
+{
+    task->dg.reset();
+    task->fiberRef.reset();
+    task->fiber = NULL;
+    ThreadQueue *queue = t_queue.get();
+    if (queue && Scheduler::getThis() == this &&
+        queue->freeTaskCount < MAX_FREE_TASKS) {
+        task->next = queue->freeTasks;
+        queue->freeTasks = task;
+        ++queue->freeTaskCount;
+        return;
+    }
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (m_freeTaskCount >= MAX_FREE_TASKS * threadCount()) {
+        lock.unlock();
+        delete task;
+        return;
+    }
+    task->next = m_freeTasks;
+    m_freeTasks = task;
+    ++m_freeTaskCount;
+}
+
+// Our own thread's local queue doesn't need a lock; anything else goes
+// through enqueueNoLock
+void
+Scheduler::enqueue(SchedulerHook *hook)
+{
+    tid_t thread = hook->thread;
+    ThreadQueue *queue = t_queue.get();
+    if (thread == emptytid() && queue && Scheduler::getThis() == this &&
+        queue->local.push(hook))
+        return;
+    bool tickleMe;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        tickleMe = enqueueNoLock(hook);
+    }
+    if (tickleMe) {
+        if (thread != emptytid())
+            wakeThread(thread);
+        else if (Scheduler::getThis() != this)
+            tickle();
+    }
+}
+
+// Places hook on the shared queue, or directly into the mailbox of the
+// thread it targets.  m_mutex must be held.
+// @return If a thread needs to be tickled to pick up the work
+bool
+Scheduler::enqueueNoLock(SchedulerHook *hook)
+{
+    tid_t thread = hook->thread;
+    if (thread != emptytid()) {
+        ThreadQueue *queue = threadQueue(thread);
+        {
+            boost::mutex::scoped_lock lock(queue->mutex);
+            queue->pinned.push(hook);
+        }
+        // atomicIncrement is a full barrier, pairing with the one in run()
+        // before the owner checks its mailbox one last time and idles; either
+        // it sees this work, or we see that it's idle
+        atomicIncrement(queue->pinnedCount);
+        // Nobody else can run this, so only the target thread needs a tickle,
+        // and only if it's idle
+        return thread != gettid() && queue->idle;
+    }
     bool tickleMe = m_fibers.empty();
-    m_fibers.push_back(ft);
+    m_fibers.push(hook);
+    ++m_sharedCount;
     return tickleMe;
 }
 
+Scheduler::ThreadQueue *
+Scheduler::threadQueue(tid_t thread)
+{
+    MORDOR_ASSERT(thread != emptytid());
+    std::vector<ThreadQueue *> *queues = m_queues;
+    std::vector<ThreadQueue *>::const_iterator it;
+    for (it = queues->begin(); it != queues->end(); ++it)
+        if ((*it)->owner == thread)
+            return *it;
+
+    boost::mutex::scoped_lock lock(m_queuesMutex);
+    queues = m_queues;
+    ThreadQueue *unowned = NULL;
+    for (it = queues->begin(); it != queues->end(); ++it) {
+        if ((*it)->owner == thread)
+            return *it;
+        if ((*it)->owner == emptytid() && !unowned)
+            unowned = *it;
+    }
+    if (unowned) {
+        boost::mutex::scoped_lock lock2(unowned->mutex);
+        if (unowned->local.empty() && unowned->pinned.empty()) {
+            unowned->owner = thread;
+            return unowned;
+        }
+    }
+    std::vector<ThreadQueue *> *newQueues =
+        new std::vector<ThreadQueue *>(*queues);
+    ThreadQueue *queue = new ThreadQueue(thread);
+    newQueues->push_back(queue);
+    // Publish the new list; anyone still walking the old one can finish
+    m_queues = newQueues;
+    m_retiredQueues.push_back(queues);
+    return queue;
+}
+
+void
+Scheduler::detachThreadQueue(ThreadQueue *queue)
+{
+    // Anything left in the local queue can run on any thread
+    SchedulerHook *hook;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        while ( (hook = queue->local.take()) ) {
+            m_fibers.push(hook);
+            ++m_sharedCount;
+        }
+    }
+    boost::mutex::scoped_lock lock(m_queuesMutex);
+    boost::mutex::scoped_lock lock2(queue->mutex);
+    // Thread-targeted work keeps the queue reserved for this thread
+    if (queue->pinned.empty())
+        queue->owner = emptytid();
+}
+
+bool
+Scheduler::tickleThread(tid_t thread)
+{
+    tickle();
+    return false;
+}
+
+void
+Scheduler::wakeThread(tid_t thread)
+{
+    ThreadQueue *queue = threadQueue(thread);
+    MORDOR_LOG_DEBUG(g_log) << this << " tickling thread " << thread;
+    queue->wakePending = 1;
+    if (tickleThread(thread))
+        queue->wakePending = 0;
+}
+
+void
+Scheduler::passTickle(ThreadQueue *queue)
+{
+    std::vector<ThreadQueue *> *queues = m_queues;
+    for (std::vector<ThreadQueue *>::const_iterator it = queues->begin();
+        it != queues->end();
+        ++it) {
+        ThreadQueue *other = *it;
+        if (other != queue && other->wakePending && other->idle &&
+            other->pinnedCount != 0) {
+            MORDOR_LOG_DEBUG(g_log) << this << " passing tickle on to thread "
+                << other->owner;
+            if (tickleThread(other->owner))
+                other->wakePending = 0;
+            return;
+        }
+    }
+}
+
+SchedulerHook *
+Scheduler::takeShared()
+{
+    if (m_sharedCount == 0)
+        return NULL;
+    boost::mutex::scoped_lock lock(m_mutex);
+    SchedulerHook *hook = m_fibers.pop();
+    if (hook)
+        --m_sharedCount;
+    return hook;
+}
+
+SchedulerHook *
+Scheduler::steal(ThreadQueue *queue)
+{
+    std::vector<ThreadQueue *> *queues = m_queues;
+    size_t count = queues->size();
+    if (count <= 1)
+        return NULL;
+    // Start at a different victim each time so thieves don't all pile onto
+    // the same queue
+    size_t start = (size_t)(queue->owner) % count;
+    for (size_t i = 0; i < count; ++i) {
+        ThreadQueue *victim = (*queues)[(start + i) % count];
+        if (victim == queue)
+            continue;
+        if (SchedulerHook *hook = victim->local.take()) {
+            MORDOR_LOG_DEBUG(g_log) << this << " stole work from thread "
+                << victim->owner;
+            return hook;
+        }
+    }
+    return NULL;
+}
+
+// Work is taken from, in order: this thread's mailbox of thread-targeted
+// work, this thread's local queue, the shared queue, and finally other
+// threads' local queues
+SchedulerHook *
+Scheduler::takeWork(ThreadQueue *queue, bool sharedFirst)
+{
+    SchedulerHook *hook;
+    if (queue->pinnedCount != 0) {
+        boost::mutex::scoped_lock lock(queue->mutex);
+        if ( (hook = queue->pinned.pop()) ) {
+            atomicDecrement(queue->pinnedCount);
+            return hook;
+        }
+    }
+    if (sharedFirst && (hook = takeShared()))
+        return hook;
+    if ( (hook = queue->local.take()) )
+        return hook;
+    if ( (hook = takeShared()) )
+        return hook;
+    return steal(queue);
+}
+
 void
 Scheduler::switchTo(tid_t thread)
 {
@@ -310,23 +747,29 @@ Scheduler::run()
         // Hijacked a thread
         MORDOR_ASSERT(t_fiber.get() == Fiber::getThis().get());
     }
+    ThreadQueue *queue = threadQueue(gettid());
+    t_queue = queue;
     Fiber::ptr idleFiber(new Fiber(boost::bind(&Scheduler::idle, this)));
     MORDOR_LOG_VERBOSE(g_log) << this << " starting thread with idle fiber " << idleFiber;
+    // Functors run on dgFiber, which picks up the Task to run from dgTask
+    Task *dgTask = NULL;
     Fiber::ptr dgFiber;
     // use a vector for O(1) .size()
-    std::vector<FiberAndThread> batch(m_batchSize);
+    std::vector<SchedulerHook *> batch;
+    batch.reserve(m_batchSize);
     bool isActive = false;
+    unsigned int tick = 0;
     while (true) {
         batch.clear();
         bool dontIdle = false;
-        bool tickleMe = false;
-        {
+        // Kill ourselves off if needed; check without the lock first, since
+        // this is rare
+        if (gettid() != m_rootThread && m_threads.size() > m_threadCount) {
             boost::mutex::scoped_lock lock(m_mutex);
-            // Kill ourselves off if needed
-            if (m_threads.size() > m_threadCount && gettid() != m_rootThread) {
+            if (m_threads.size() > m_threadCount) {
                 // Accounting
                 if (isActive)
-                    --m_activeThreadCount;
+                    atomicDecrement(m_activeThreadCount);
                 // Kill off the idle fiber
                 try {
                     throw boost::enable_current_exception(
@@ -334,6 +777,10 @@ Scheduler::run()
                 } catch(...) {
                     idleFiber->inject(boost::current_exception());
                 }
+                lock.unlock();
+                t_queue = NULL;
+                detachThreadQueue(queue);
+                lock.lock();
                 // Detach our thread
                 for (std::vector<boost::shared_ptr<Thread> >
                     ::iterator it = m_threads.begin();
@@ -347,117 +794,167 @@ Scheduler::run()
                     }
                 MORDOR_NOTREACHED();
             }
+        }
 
-            std::list<FiberAndThread>::iterator it(m_fibers.begin());
-            while (it != m_fibers.end()) {
-                // If we've met our batch size, and we're not checking to see
-                // if we need to tickle another thread, then break
-                if ( (tickleMe || m_activeThreadCount == threadCount()) &&
-                    batch.size() == m_batchSize)
-                    break;
-
-                if (it->thread != emptytid() && it->thread != gettid()) {
-                    MORDOR_LOG_DEBUG(g_log) << this
-                        << " skipping item scheduled for thread "
-                        << it->thread;
-
-                    // Wake up another thread to hopefully service this
-                    tickleMe = true;
-                    dontIdle = true;
-                    ++it;
-                    continue;
-                }
-                MORDOR_ASSERT(it->fiber || it->dg);
-                // This fiber is still executing; probably just some race
-                // race condition that it needs to yield on one thread
-                // before running on another thread
-                if (it->fiber && it->fiber->state() == Fiber::EXEC) {
-                    MORDOR_LOG_DEBUG(g_log) << this
-                        << " skipping executing fiber " << it->fiber;
-                    ++it;
-                    dontIdle = true;
-                    continue;
-                }
-                // We were just checking if there is more work; there is, so
-                // set the flag and don't actually take this piece of work
-                if (batch.size() == m_batchSize) {
-                    tickleMe = true;
-                    break;
-                }
-                batch.push_back(*it);
-                it = m_fibers.erase(it);
-                if (!isActive) {
-                    ++m_activeThreadCount;
-                    isActive = true;
+        // Every so often look at the shared queue first, so that work
+        // scheduled from outside can't be starved by fibers that keep
+        // rescheduling themselves locally
+        bool sharedFirst = (++tick % 61) == 0;
+        // Count ourselves active before taking anything, so stopping() can
+        // never see the queues empty and no active threads while work we've
+        // popped is still in flight
+        if (!isActive) {
+            atomicIncrement(m_activeThreadCount);
+            isActive = true;
+        }
+        while (batch.size() < m_batchSize) {
+            SchedulerHook *hook = takeWork(queue, sharedFirst);
+            if (!hook)
+                break;
+            // This fiber is still executing; probably just some race
+            // race condition that it needs to yield on one thread
+            // before running on another thread
+            if (hook->fiber && hook->fiber->state() == Fiber::EXEC) {
+                MORDOR_LOG_DEBUG(g_log) << this
+                    << " skipping executing fiber " << hook->fiber;
+                if (hook->thread != emptytid()) {
+                    boost::mutex::scoped_lock lock(queue->mutex);
+                    queue->pinned.push(hook);
+                    atomicIncrement(queue->pinnedCount);
+                } else {
+                    boost::mutex::scoped_lock lock(m_mutex);
+                    m_fibers.push(hook);
+                    ++m_sharedCount;
                 }
+                dontIdle = true;
+                break;
             }
-            if (batch.empty() && isActive) {
-                --m_activeThreadCount;
-                isActive = false;
-            }
+            batch.push_back(hook);
+        }
+        if (batch.empty()) {
+            atomicDecrement(m_activeThreadCount);
+            isActive = false;
         }
-        if (tickleMe)
+        // There's more work than we can do right now; wake up another
+        // thread to steal it
+        if (!batch.empty() && m_activeThreadCount < threadCount() &&
+            (!queue->local.empty() || m_sharedCount != 0))
             tickle();
         MORDOR_LOG_DEBUG(g_log) << this
             << " got " << batch.size() << " fiber/dgs to process (max: "
             << m_batchSize << ", active: " << isActive << ")";
         MORDOR_ASSERT(isActive == !batch.empty());
         if (!batch.empty()) {
-            std::vector<FiberAndThread>::iterator it;
+            std::vector<SchedulerHook *>::iterator it;
             for (it = batch.begin(); it != batch.end(); ++it) {
-                Fiber::ptr f = it->fiber;
-                boost::function<void ()> dg = it->dg;
+                Fiber::ptr f;
+                Task *task = unpack(*it, f);
+                *it = NULL;
+                if (f && task) {
+                    freeTask(task);
+                    task = NULL;
+                }
 
                 try {
-                    if (f && f->state() != Fiber::TERM) {
-                        MORDOR_LOG_DEBUG(g_log) << this << " running " << f;
-                        f->yieldTo();
-                    } else if (dg) {
+                    if (f) {
+                        if (f->state() != Fiber::TERM) {
+                            MORDOR_LOG_DEBUG(g_log) << this << " running "
+                                << f;
+                            f->yieldTo();
+                        }
+                    } else {
                         if (!dgFiber)
-                            dgFiber.reset(new Fiber(dg));
-                        dgFiber->reset(dg);
-                        MORDOR_LOG_DEBUG(g_log) << this << " running " << dg;
+                            dgFiber.reset(new Fiber(boost::bind(
+                                &Scheduler::runTask, this, &dgTask)));
+                        else
+                            dgFiber->reset();
+                        dgTask = task;
+                        MORDOR_LOG_DEBUG(g_log) << this << " running "
+                            << task;
                         dgFiber->yieldTo();
+                        // The functor blocked; leave it the Fiber (and the
+                        // Task), and use a new one for the next functor
                         if (dgFiber->state() != Fiber::TERM)
                             dgFiber.reset();
-                        else
-                            dgFiber->reset(NULL);
                     }
                 } catch (...) {
                     MORDOR_LOG_FATAL(Log::root())
                         << boost::current_exception_diagnostic_information();
                     {
                         boost::mutex::scoped_lock lock(m_mutex);
-                        std::vector<FiberAndThread>::iterator it2 = it;
-                        // push all un-executed fibers back to m_fibers
+                        std::vector<SchedulerHook *>::iterator it2 = it;
+                        // push all un-executed fibers back to the shared
+                        // queue
                         while (++it2 != batch.end()) {
-                            m_fibers.push_back(*it2);
+                            if ((*it2)->thread != emptytid()) {
+                                boost::mutex::scoped_lock lock2(queue->mutex);
+                                queue->pinned.push(*it2);
+                                atomicIncrement(queue->pinnedCount);
+                            } else {
+                                m_fibers.push(*it2);
+                                ++m_sharedCount;
+                            }
                         }
                         batch.clear();
                         // decrease the activeCount as this thread is in exception
                         isActive = false;
-                        --m_activeThreadCount;
+                        atomicDecrement(m_activeThreadCount);
                     }
+                    t_queue = NULL;
+                    detachThreadQueue(queue);
                     throw;
                 }
             }
+            endBatch();
             continue;
         }
         if (dontIdle)
             continue;
+        // If we were woken by a tickle that was really meant for some other
+        // thread, hand it along instead of swallowing it
+        passTickle(queue);
 
         if (idleFiber->state() == Fiber::TERM) {
             MORDOR_LOG_DEBUG(g_log) << this << " idle fiber terminated";
             if (gettid() == m_rootThread)
                 m_callingFiber.reset();
+            t_queue = NULL;
+            detachThreadQueue(queue);
             // Unblock the next thread
             if (threadCount() > 1)
                 tickle();
             return;
         }
+        // Advertise that we're idle, then look in the mailbox one last time
+        // (atomicCompareAndSwap is a full barrier); anyone scheduling
+        // thread-targeted work after this point will tickle us
+        atomicCompareAndSwap(queue->idle, 1, 0);
+        if (queue->pinnedCount != 0) {
+            queue->idle = 0;
+            continue;
+        }
         MORDOR_LOG_DEBUG(g_log) << this << " idling";
         idleFiber->call();
+        queue->idle = 0;
+        queue->wakePending = 0;
+    }
+}
+
+// Entry point of the Fiber that runs scheduled functors.  The Task is
+// picked up before the functor can block, so that if it does, this Fiber
+// keeps it and the Scheduler can reuse task for the next Fiber.
+void
+Scheduler::runTask(Task **task)
+{
+    Task *myTask = *task;
+    *task = NULL;
+    try {
+        myTask->dg();
+    } catch (...) {
+        freeTask(myTask);
+        throw;
     }
+    freeTask(myTask);
 }
 
 SchedulerSwitcher::SchedulerSwitcher(Scheduler *target)
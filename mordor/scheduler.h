@@ -2,20 +2,22 @@
 #define __MORDOR_SCHEDULER_H__
 // Copyright (c) 2009 - Mozy, Inc.
 
-#include <list>
+#include <new>
+#include <vector>
 
 #include <boost/function.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/type_traits/alignment_of.hpp>
+#include <boost/type_traits/integral_constant.hpp>
 
+#include "fiber.h"
 #include "thread.h"
 #include "thread_local_storage.h"
 
 namespace Mordor {
 
-class Fiber;
-
 /// Cooperative user-mode thread (Fiber) Scheduler
 
 /// A Scheduler is used to cooperatively schedule fibers on threads,
@@ -84,6 +86,21 @@ public:
     /// @param thread Optionally provide a specific thread for the functor to
     /// run on
     void schedule(boost::function<void ()> dg, tid_t thread = emptytid());
+    /// Schedule a functor without converting it to a boost::function first
+
+    /// Functors no bigger than a few pointers (such as most boost::bind
+    /// expressions) are stored in place, so once the Scheduler has warmed up
+    /// this doesn't allocate.
+    /// @param f The functor to schedule
+    /// @param thread Optionally provide a specific thread for the functor to
+    /// run on
+    template <class F>
+    void schedule(F f, tid_t thread = emptytid())
+    {
+        Task *task = allocateTask(false);
+        task->dg.assign(f);
+        scheduleTask(task, thread);
+    }
 
     /// Schedule multiple items to be executed at once
 
@@ -169,33 +186,188 @@ protected:
     /// The Scheduler wants to force the idle fiber to Fiber::yield(), because
     /// new work has been scheduled.
     virtual void tickle() = 0;
+    /// The Scheduler wants to force the idle fiber on a specific thread to
+    /// Fiber::yield(), because work that can only run on that thread has been
+    /// scheduled.  It is only called when that thread is idle.
+    ///
+    /// The default implementation just calls tickle(), which may wake a
+    /// different thread; the Scheduler then passes the tickle along until it
+    /// reaches the right one.  Implementors that can wake a particular thread
+    /// should do so and return true.
+    /// @return If exactly the requested thread was tickled
+    virtual bool tickleThread(tid_t thread);
+    /// Called on a thread each time it has run a batch of scheduled work,
+    /// before it looks for more.  The default does nothing; implementors can
+    /// use it to flush whatever the batch queued up.
+    virtual void endBatch() {}
 
     bool hasWorkToDo();
 
 private:
+    /// Type-erased functor that stores small functors in place
+    class Functor : boost::noncopyable
+    {
+    public:
+        Functor() : m_invoke(NULL), m_destroy(NULL) {}
+        ~Functor() { reset(); }
+
+        template <class F>
+        void assign(const F &f)
+        {
+            assign(f, boost::integral_constant<bool,
+                sizeof(F) <= sizeof(Storage) &&
+                boost::alignment_of<F>::value <=
+                    boost::alignment_of<Storage>::value>());
+        }
+        /// Takes over dg's target instead of copying it
+        void assign(boost::function<void ()> &dg)
+        {
+            (new (m_storage.buffer) boost::function<void ()>())->swap(dg);
+            m_invoke = &invokeInPlace<boost::function<void ()> >;
+            m_destroy = &destroyInPlace<boost::function<void ()> >;
+        }
+
+        void operator()() { m_invoke(&m_storage); }
+
+        void reset()
+        {
+            if (m_destroy)
+                m_destroy(&m_storage);
+            m_invoke = m_destroy = NULL;
+        }
+
+    private:
+        union Storage {
+            void *pointer;
+            long long integer;
+            long double floating;
+            char buffer[6 * sizeof(void *)];
+        };
+
+        template <class F>
+        void assign(const F &f, boost::true_type)
+        {
+            new (m_storage.buffer) F(f);
+            m_invoke = &invokeInPlace<F>;
+            m_destroy = &destroyInPlace<F>;
+        }
+        template <class F>
+        void assign(const F &f, boost::false_type)
+        {
+            m_storage.pointer = new F(f);
+            m_invoke = &invokeOnHeap<F>;
+            m_destroy = &destroyOnHeap<F>;
+        }
+
+        template <class F>
+        static void invokeInPlace(Storage *storage)
+        { (*reinterpret_cast<F *>(storage->buffer))(); }
+        template <class F>
+        static void destroyInPlace(Storage *storage)
+        { reinterpret_cast<F *>(storage->buffer)->~F(); }
+        template <class F>
+        static void invokeOnHeap(Storage *storage)
+        { (*static_cast<F *>(storage->pointer))(); }
+        template <class F>
+        static void destroyOnHeap(Storage *storage)
+        { delete static_cast<F *>(storage->pointer); }
+
+    private:
+        Storage m_storage;
+        void (*m_invoke)(Storage *);
+        void (*m_destroy)(Storage *);
+    };
+
+    /// A scheduled functor, or a Fiber whose own hook was already in use
+    struct Task : public SchedulerHook
+    {
+        boost::shared_ptr<Fiber> fiberRef;
+        Functor dg;
+    };
+
+    /// Intrusive FIFO of queued work
+    struct HookQueue
+    {
+        HookQueue() : head(NULL), tail(NULL) {}
+
+        bool empty() const { return head == NULL; }
+        void push(SchedulerHook *hook)
+        {
+            hook->next = NULL;
+            if (tail)
+                tail->next = hook;
+            else
+                head = hook;
+            tail = hook;
+        }
+        SchedulerHook *pop()
+        {
+            SchedulerHook *hook = head;
+            if (hook) {
+                head = hook->next;
+                if (!head)
+                    tail = NULL;
+            }
+            return hook;
+        }
+
+        SchedulerHook *head, *tail;
+    };
+
+    /// Per-thread run queue and mailbox; defined in scheduler.cpp
+    struct ThreadQueue;
+
     void yieldTo(bool yieldToCallerOnTerminate);
     void run();
+    void runTask(Task **task);
 
     bool scheduleNoLock(boost::shared_ptr<Fiber> fiber,
         tid_t thread = emptytid());
     bool scheduleNoLock(boost::function<void ()> dg,
         tid_t thread = emptytid());
+    SchedulerHook *hook(boost::shared_ptr<Fiber> &fiber, tid_t thread,
+        bool locked);
+    Task *unpack(SchedulerHook *hook, boost::shared_ptr<Fiber> &fiber);
+    Task *allocateTask(bool locked);
+    void freeTask(Task *task);
+    void scheduleTask(Task *task, tid_t thread);
+    void enqueue(SchedulerHook *hook);
+    bool enqueueNoLock(SchedulerHook *hook);
+
+    ThreadQueue *threadQueue(tid_t thread);
+    void detachThreadQueue(ThreadQueue *queue);
+    SchedulerHook *takeWork(ThreadQueue *queue, bool sharedFirst);
+    SchedulerHook *takeShared();
+    SchedulerHook *steal(ThreadQueue *queue);
+    void wakeThread(tid_t thread);
+    void passTickle(ThreadQueue *queue);
+    bool queuesEmpty();
 
 private:
-    struct FiberAndThread {
-        boost::shared_ptr<Fiber> fiber;
-        boost::function<void ()> dg;
-        tid_t thread;
-    };
     static ThreadLocalStorage<Scheduler *> t_scheduler;
     static ThreadLocalStorage<Fiber *> t_fiber;
+    static ThreadLocalStorage<ThreadQueue *> t_queue;
     boost::mutex m_mutex;
-    std::list<FiberAndThread> m_fibers;
+    // Work scheduled from outside of this Scheduler's threads (or while
+    // a thread's local queue is full)
+    HookQueue m_fibers;
+    volatile size_t m_sharedCount;
+    // Tasks freed by threads whose own cache was full, or that aren't part
+    // of this Scheduler
+    Task *m_freeTasks;
+    volatile size_t m_freeTaskCount;
+    // Copy-on-write list of every thread's queue, so it can be walked for
+    // stealing without holding a lock; superseded lists are kept until
+    // destruction because a thief may still be looking at them
+    boost::mutex m_queuesMutex;
+    std::vector<ThreadQueue *> * volatile m_queues;
+    std::vector<std::vector<ThreadQueue *> *> m_retiredQueues;
     tid_t m_rootThread;
     boost::shared_ptr<Fiber> m_rootFiber;
     boost::shared_ptr<Fiber> m_callingFiber;
     std::vector<boost::shared_ptr<Thread> > m_threads;
-    size_t m_threadCount, m_activeThreadCount;
+    size_t m_threadCount;
+    volatile size_t m_activeThreadCount;
     bool m_stopping;
     bool m_autoStop;
     size_t m_batchSize;
@@ -2,14 +2,21 @@
 
 #include "socket.h"
 
+#include <map>
+
 #include <boost/bind.hpp>
+#include <boost/exception_ptr.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include "assert.h"
 #include "config.h"
 #include "fiber.h"
+#include "fibersynchronization.h"
 #include "iomanager.h"
+#include "statistics.h"
 #include "string.h"
 #include "version.h"
+#include "workerpool.h"
 
 #ifdef WINDOWS
 #include <mswsock.h>
@@ -28,6 +35,13 @@
 #define closesocket close
 #endif
 
+#ifdef LINUX
+#include <sys/sendfile.h>
+#ifdef MORDOR_IOURING
+#include <linux/io_uring.h>
+#endif
+#endif
+
 namespace Mordor {
 
 #ifdef WINDOWS
@@ -161,6 +175,32 @@ static struct Initializer {
 #endif
 
 static Logger::ptr g_log = Log::lookup("mordor:socket");
+
+static ConfigVar<size_t>::ptr g_dnsThreads = Config::lookup<size_t>(
+    "dns.threads", 4u,
+    "Threads resolving names for Fibers, so a slow name server doesn't stall "
+    "their Scheduler (0 to resolve on the calling thread); read at the first "
+    "lookup");
+static ConfigVar<unsigned int>::ptr g_dnsTtl = Config::lookup<unsigned int>(
+    "dns.ttl", 60u, "Seconds to cache the result of a name lookup");
+static ConfigVar<unsigned int>::ptr g_dnsNegativeTtl =
+    Config::lookup<unsigned int>("dns.negativettl", 5u,
+    "Seconds to cache a name lookup finding that the name doesn't exist");
+static ConfigVar<size_t>::ptr g_dnsCacheSize = Config::lookup<size_t>(
+    "dns.cachesize", 1024u, "Maximum number of cached name lookups");
+
+static CountStatistic<unsigned long long> &g_statLookups =
+    Statistics::registerStatistic("dns.lookups",
+    CountStatistic<unsigned long long>(),
+    "Names passed to the resolver");
+static CountStatistic<unsigned long long> &g_statCacheHits =
+    Statistics::registerStatistic("dns.cachehits",
+    CountStatistic<unsigned long long>(),
+    "Name lookups answered from the cache");
+static CountStatistic<unsigned long long> &g_statCoalesced =
+    Statistics::registerStatistic("dns.coalesced",
+    CountStatistic<unsigned long long>(),
+    "Name lookups that waited for the same name already being resolved");
 static int g_iosPortIndex;
 
 namespace {
@@ -282,6 +322,9 @@ Socket::Socket(IOManager &ioManager, int family, int type, int protocol)
         MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("fcntl");
     }
 #endif
+#ifdef LINUX
+    m_ioManager->registerFile(m_sock);
+#endif
 #ifdef OSX
     unsigned int opt = 1;
     if (setsockopt(m_sock, SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt)) == -1) {
@@ -304,6 +347,10 @@ Socket::~Socket()
 #else
     if (m_isRegisteredForRemoteClose)
         m_ioManager->unregisterEvent(m_sock, IOManager::CLOSE);
+#endif
+#ifdef LINUX
+    if (m_ioManager && m_sock != -1)
+        m_ioManager->unregisterFile(m_sock);
 #endif
     if (m_sock != -1) {
         int rc = ::closesocket(m_sock);
@@ -509,13 +556,36 @@ suckylsp:
             }
         }
 #else
+#ifdef MORDOR_IOURING
+        if (m_ioManager->ioUring()) {
+            if (m_cancelledSend) {
+                MORDOR_LOG_ERROR(g_log) << this << " connect(" << m_sock << ", " << to
+                    << "): (" << m_cancelledSend << ")";
+                MORDOR_THROW_EXCEPTION_FROM_ERROR_API(m_cancelledSend, "connect");
+            }
+            io_uring_sqe sqe;
+            memset(&sqe, 0, sizeof(io_uring_sqe));
+            sqe.opcode = IORING_OP_CONNECT;
+            sqe.fd = m_sock;
+            sqe.addr = (uintptr_t)to.name();
+            sqe.off = to.nameLen();
+            int rc = submitIo(sqe, IOManager::WRITE, m_cancelledSend,
+                m_sendTimeout);
+            if (rc < 0) {
+                MORDOR_LOG_ERROR(g_log) << this << " connect(" << m_sock << ", " << to
+                    << "): (" << -rc << ")";
+                MORDOR_THROW_EXCEPTION_FROM_ERROR_API(-rc, "connect");
+            }
+            MORDOR_LOG_INFO(g_log) << this << " connect(" << m_sock << ", " << to
+                << ")";
+        } else
+#endif
         if (!::connect(m_sock, to.name(), to.nameLen())) {
             MORDOR_LOG_INFO(g_log) << this << " connect(" << m_sock << ", " << to
                 << ")";
             // Worked first time
             return;
-        }
-        if (errno == EINPROGRESS) {
+        } else if (errno == EINPROGRESS) {
             m_ioManager->registerEvent(m_sock, IOManager::WRITE);
             if (m_cancelledSend) {
                 MORDOR_LOG_ERROR(g_log) << this << " connect(" << m_sock << ", " << to
@@ -742,6 +812,24 @@ suckylsp:
 #else
         int newsock;
         error_t error;
+#ifdef MORDOR_IOURING
+        if (m_ioManager && m_ioManager->ioUring()) {
+            if (m_cancelledReceive) {
+                MORDOR_LOG_ERROR(g_log) << this << " accept(" << m_sock << "): ("
+                    << m_cancelledReceive << ")";
+                MORDOR_THROW_EXCEPTION_FROM_ERROR_API(m_cancelledReceive, "accept");
+            }
+            io_uring_sqe sqe;
+            memset(&sqe, 0, sizeof(io_uring_sqe));
+            sqe.opcode = IORING_OP_ACCEPT;
+            sqe.fd = m_sock;
+            newsock = submitIo(sqe, IOManager::READ, m_cancelledReceive,
+                m_receiveTimeout);
+            error = newsock < 0 ? -newsock : 0;
+            if (newsock < 0)
+                newsock = -1;
+        } else
+#endif
         do {
             newsock = ::accept(m_sock, NULL, NULL);
             error = errno;
@@ -776,12 +864,16 @@ suckylsp:
         if (newsock == -1) {
             MORDOR_LOG_ERROR(g_log) << this << " accept(" << m_sock << "): "
                 << newsock << " (" << error << ")";
-            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("accept");
+            MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "accept");
         }
         if (fcntl(newsock, F_SETFL, O_NONBLOCK) == -1) {
             ::close(newsock);
             MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("fcntl");
         }
+#ifdef LINUX
+        if (target.m_ioManager)
+            target.m_ioManager->registerFile(newsock);
+#endif
         target.m_sock = newsock;
         MORDOR_LOG_INFO(g_log) << this << " accept(" << m_sock << "): "
             << newsock << " (" << *target.remoteAddress() << ')';
@@ -940,7 +1032,8 @@ Socket::doIO(iovec *buffers, size_t length, int &flags, Address *address)
     msghdr msg;
     memset(&msg, 0, sizeof(msghdr));
     msg.msg_iov = buffers;
-    msg.msg_iovlen = length;
+    // The kernel rejects anything longer, where a short transfer is fine
+    msg.msg_iovlen = (std::min)(length, (size_t)IOV_MAX);
     if (address) {
         msg.msg_name = (sockaddr *)address->name();
         msg.msg_namelen = address->nameLen();
@@ -958,15 +1051,39 @@ Socket::doIO(iovec *buffers, size_t length, int &flags, Address *address)
         rc = isSend ? sendmsg(m_sock, &msg, flags) : recvmsg(m_sock, &msg, flags);
         error = errno;
     } while (rc == -1 && error == EINTR);
+#ifdef MORDOR_IOURING
+    // Let the kernel do the I/O as soon as it can, instead of telling us
+    // to try again
+    if (m_ioManager && m_ioManager->ioUring() && rc == -1 &&
+        error == EAGAIN) {
+        io_uring_sqe sqe;
+        memset(&sqe, 0, sizeof(io_uring_sqe));
+        sqe.opcode = isSend ? IORING_OP_SENDMSG : IORING_OP_RECVMSG;
+        sqe.fd = m_sock;
+        sqe.addr = (uintptr_t)&msg;
+        sqe.len = 1;
+        sqe.msg_flags = flags;
+        rc = submitIo(sqe, event, cancelled, timeout);
+        error = rc < 0 ? -rc : 0;
+        // Kernels before 5.7 hand back EAGAIN instead of waiting, so it
+        // falls through to waiting for readiness below
+        if (rc < 0)
+            rc = -1;
+    }
+#endif
     while (m_ioManager && rc == -1 && error == EAGAIN) {
         m_ioManager->registerEvent(m_sock, event);
-        Timer::ptr timer;
-        if (timeout != ~0ull)
-            timer = m_ioManager->registerTimer(timeout, boost::bind(
-                &Socket::cancelIo, this, event, boost::ref(cancelled),
-                ETIMEDOUT));
+        Timer::ptr &timer = isSend ? m_sendTimer : m_receiveTimer;
+        bool timed = timeout != ~0ull;
+        if (timed) {
+            if (!timer)
+                timer = m_ioManager->createTimer(boost::bind(
+                    &Socket::cancelIo, this, event, boost::ref(cancelled),
+                    ETIMEDOUT));
+            timer->reset(timeout, true);
+        }
         Scheduler::yieldTo();
-        if (timer)
+        if (timed)
             timer->cancel();
         if (cancelled) {
             MORDOR_SOCKET_LOG(-1, cancelled);
@@ -979,7 +1096,7 @@ Socket::doIO(iovec *buffers, size_t length, int &flags, Address *address)
     }
     MORDOR_SOCKET_LOG(rc, error);
     if (rc == -1)
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API(api);
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, api);
     if (!isSend)
         flags = msg.msg_flags;
     return rc;
@@ -1059,6 +1176,121 @@ Socket::receiveFrom(iovec *buffers, size_t length, Address &from, int *flags)
     return doIO<false>(buffers, length, *flags, &from);
 }
 
+#ifdef LINUX
+static ssize_t sendFileOp(int sock, int fd, size_t length)
+{
+    return sendfile(sock, fd, NULL, length);
+}
+
+// The pipe never blocks; only the socket is waited on
+static ssize_t spliceFromOp(int sock, int pipe, size_t length)
+{
+    return splice(pipe, NULL, sock, NULL, length,
+        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+}
+
+static ssize_t spliceToOp(int sock, int pipe, size_t length)
+{
+    return splice(sock, NULL, pipe, NULL, length,
+        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+}
+
+// The same waiting, timeout and cancellation as doIO, around a zero-copy
+// syscall
+template <bool isSend>
+size_t
+Socket::doZeroCopy(ssize_t (*op)(int, int, size_t), int fd, size_t length,
+    const char *api)
+{
+    Address *address = NULL;
+    error_t &cancelled = isSend ? m_cancelledSend : m_cancelledReceive;
+    unsigned long long &timeout = isSend ? m_sendTimeout : m_receiveTimeout;
+    IOManager::Event event = isSend ? IOManager::WRITE : IOManager::READ;
+    if (m_ioManager && cancelled) {
+        MORDOR_SOCKET_LOG(-1, cancelled);
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(cancelled, api);
+    }
+    ssize_t rc;
+    error_t error;
+    do {
+        rc = op(m_sock, fd, length);
+        error = errno;
+    } while (rc == -1 && error == EINTR);
+    while (m_ioManager && rc == -1 && error == EAGAIN) {
+        m_ioManager->registerEvent(m_sock, event);
+        Timer::ptr &timer = isSend ? m_sendTimer : m_receiveTimer;
+        bool timed = timeout != ~0ull;
+        if (timed) {
+            if (!timer)
+                timer = m_ioManager->createTimer(boost::bind(
+                    &Socket::cancelIo, this, event, boost::ref(cancelled),
+                    ETIMEDOUT));
+            timer->reset(timeout, true);
+        }
+        Scheduler::yieldTo();
+        if (timed)
+            timer->cancel();
+        if (cancelled) {
+            MORDOR_SOCKET_LOG(-1, cancelled);
+            MORDOR_THROW_EXCEPTION_FROM_ERROR_API(cancelled, api);
+        }
+        do {
+            rc = op(m_sock, fd, length);
+            error = errno;
+        } while (rc == -1 && error == EINTR);
+    }
+    MORDOR_SOCKET_LOG(rc, error);
+    if (rc == -1)
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, api);
+    return rc;
+}
+
+int
+Socket::submitIo(io_uring_sqe &sqe, int event, error_t &cancelled,
+    unsigned long long timeout)
+{
+#ifdef MORDOR_IOURING
+    Timer::ptr &timer = event == IOManager::WRITE ? m_sendTimer :
+        m_receiveTimer;
+    bool timed = timeout != ~0ull;
+    if (timed) {
+        if (!timer)
+            timer = m_ioManager->createTimer(boost::bind(
+                &Socket::cancelIo, this, event, boost::ref(cancelled),
+                ETIMEDOUT));
+        timer->reset(timeout, true);
+    }
+    int rc = m_ioManager->submitEvent(m_sock, (IOManager::Event)event, sqe);
+    if (timed)
+        timer->cancel();
+    // Anything that completed before the cancel caught up with it stands
+    if ((rc == -ECANCELED || rc == -EINTR) && cancelled)
+        rc = -cancelled;
+    return rc;
+#else
+    MORDOR_NOTREACHED();
+#endif
+}
+
+size_t
+Socket::sendFile(int fd, size_t length)
+{
+    return doZeroCopy<true>(&sendFileOp, fd, length, "sendfile");
+}
+
+size_t
+Socket::spliceFrom(int pipe, size_t length)
+{
+    return doZeroCopy<true>(&spliceFromOp, pipe, length, "splice");
+}
+
+size_t
+Socket::spliceTo(int pipe, size_t length)
+{
+    return doZeroCopy<false>(&spliceToOp, pipe, length, "splice");
+}
+#endif
+
 void
 Socket::getOption(int level, int option, void *result, size_t *len)
 {
@@ -1348,15 +1580,17 @@ static void throwGaiException(int error)
     }
 }
 
-std::vector<Address::ptr>
-Address::lookup(const std::string &host, int family, int type, int protocol)
+// @return The getaddrinfo error
+static int
+getAddrInfo(const std::string &host, int family, int type, int protocol,
+    int flags, std::vector<Address::ptr> &result)
 {
 #ifdef WINDOWS
     addrinfoW hints, *results, *next;
 #else
     addrinfo hints, *results, *next;
 #endif
-    hints.ai_flags = 0;
+    hints.ai_flags = flags;
     hints.ai_family = family;
     hints.ai_socktype = type;
     hints.ai_protocol = protocol;
@@ -1406,26 +1640,222 @@ Address::lookup(const std::string &host, int family, int type, int protocol)
 #else
     error = getaddrinfo(node.c_str(), service, &hints, &results);
 #endif
-    if (error) {
-        MORDOR_LOG_ERROR(g_log) << "getaddrinfo(" << host << ", "
-            << (Family)family << ", " << (Type)type << "): (" << error << ")";
-        throwGaiException(error);
-    }
+    if (error)
+        return error;
 
-    std::vector<Address::ptr> result;
     next = results;
-    while (next) {
-        result.push_back(create(next->ai_addr, (socklen_t)next->ai_addrlen));
-        next = next->ai_next;
+    try {
+        while (next) {
+            result.push_back(Address::create(next->ai_addr,
+                (socklen_t)next->ai_addrlen));
+            next = next->ai_next;
+        }
+    } catch (...) {
+#ifdef WINDOWS
+        pFreeAddrInfoW(results);
+#else
+        freeaddrinfo(results);
+#endif
+        throw;
     }
 #ifdef WINDOWS
     pFreeAddrInfoW(results);
 #else
     freeaddrinfo(results);
 #endif
+    return 0;
+}
+
+namespace {
+struct LookupKey
+{
+    std::string host;
+    int family, type, protocol;
+
+    bool operator <(const LookupKey &rhs) const
+    {
+        if (host != rhs.host)
+            return host < rhs.host;
+        if (family != rhs.family)
+            return family < rhs.family;
+        if (type != rhs.type)
+            return type < rhs.type;
+        return protocol < rhs.protocol;
+    }
+};
+
+// A resolution in progress, or its cached outcome
+struct LookupResult
+{
+    LookupResult()
+        : done(false),
+          expires(0),
+          event(false)
+    {}
+
+    bool done;
+    unsigned long long expires;
+    std::vector<Address::ptr> addresses;
+    boost::exception_ptr exception;
+    FiberEvent event;
+};
+}
+
+typedef std::map<LookupKey, boost::shared_ptr<LookupResult> > LookupCache;
+
+static boost::mutex g_lookupMutex;
+static LookupCache g_lookupCache;
+
+// Only called with g_lookupMutex held
+static Scheduler *lookupPool()
+{
+    // Deliberately never destroyed, so a lookup still in progress at exit
+    // can't be left without anywhere to run
+    static WorkerPool *pool = NULL;
+    if (!pool) {
+        size_t threads = g_dnsThreads->val();
+        if (threads == 0)
+            return NULL;
+        pool = new WorkerPool(threads, false);
+    }
+    return pool;
+}
+
+// Only called with g_lookupMutex held
+static bool makeRoomInLookupCache()
+{
+    size_t cacheSize = g_dnsCacheSize->val();
+    if (g_lookupCache.size() < cacheSize)
+        return true;
+    unsigned long long now = TimerManager::now();
+    for (LookupCache::iterator it = g_lookupCache.begin();
+        it != g_lookupCache.end();) {
+        if (it->second->done && it->second->expires <= now)
+            g_lookupCache.erase(it++);
+        else
+            ++it;
+    }
+    return g_lookupCache.size() < cacheSize;
+}
+
+// Failures that say the name (or service) doesn't exist, as opposed to the
+// resolver having trouble finding out
+static bool isNegativeAnswer(int error)
+{
+    switch (error) {
+        case EAI_FAIL:
+        case EAI_NONAME:
+        case EAI_SERVICE:
+#if defined(WSANO_DATA) || defined(EAI_NODATA)
+        case MORDOR_NATIVE(WSANO_DATA, EAI_NODATA):
+#endif
+            return true;
+        default:
+            return false;
+    }
+}
+
+std::vector<Address::ptr>
+Address::lookup(const std::string &host, int family, int type, int protocol)
+{
+    std::vector<Address::ptr> result;
+    // Literal addresses don't need the resolver, or caching
+    if (getAddrInfo(host, family, type, protocol, AI_NUMERICHOST, result) == 0)
+        return result;
+
+    LookupKey key;
+    key.host = host;
+    key.family = family;
+    key.type = type;
+    key.protocol = protocol;
+    boost::shared_ptr<LookupResult> lookup;
+    bool wait = false;
+    Scheduler *pool = NULL;
+    {
+        boost::mutex::scoped_lock lock(g_lookupMutex);
+        LookupCache::iterator it = g_lookupCache.find(key);
+        if (it != g_lookupCache.end() && it->second->done &&
+            it->second->expires <= TimerManager::now()) {
+            g_lookupCache.erase(it);
+            it = g_lookupCache.end();
+        }
+        // A lookup that's still in progress can only be waited for by a
+        // Fiber; anyone else resolves for themselves
+        if (it != g_lookupCache.end() &&
+            (it->second->done || Scheduler::getThis())) {
+            lookup = it->second;
+            wait = !lookup->done;
+            if (wait)
+                g_statCoalesced.increment();
+            else
+                g_statCacheHits.increment();
+        } else {
+            lookup.reset(new LookupResult());
+            if (it == g_lookupCache.end() && makeRoomInLookupCache())
+                g_lookupCache[key] = lookup;
+            pool = lookupPool();
+        }
+    }
+
+    if (wait) {
+        MORDOR_LOG_DEBUG(g_log) << "waiting for lookup of " << host;
+        lookup->event.wait();
+    } else if (!lookup->done) {
+        int error = 0;
+        try {
+            g_statLookups.increment();
+            if (pool && Scheduler::getThis()) {
+                SchedulerSwitcher switcher(pool);
+                error = getAddrInfo(host, family, type, protocol, 0,
+                    lookup->addresses);
+            } else {
+                error = getAddrInfo(host, family, type, protocol, 0,
+                    lookup->addresses);
+            }
+            if (error) {
+                MORDOR_LOG_ERROR(g_log) << "getaddrinfo(" << host << ", "
+                    << (Family)family << ", " << (Type)type << "): (" << error
+                    << ")";
+                throwGaiException(error);
+            }
+        } catch (...) {
+            lookup->exception = boost::current_exception();
+        }
+        unsigned long long ttl = 0;
+        if (!lookup->exception)
+            ttl = g_dnsTtl->val();
+        else if (isNegativeAnswer(error))
+            ttl = g_dnsNegativeTtl->val();
+        {
+            boost::mutex::scoped_lock lock(g_lookupMutex);
+            lookup->expires = TimerManager::now() + ttl * 1000000ull;
+            lookup->done = true;
+            LookupCache::iterator it = g_lookupCache.find(key);
+            if (ttl == 0 && it != g_lookupCache.end() && it->second == lookup)
+                g_lookupCache.erase(it);
+        }
+        lookup->event.set();
+    }
+
+    if (lookup->exception)
+        Mordor::rethrow_exception(lookup->exception);
+    // Callers are free to modify what they get back (such as setting the
+    // port), so the cached addresses are never handed out directly
+    result.reserve(lookup->addresses.size());
+    for (std::vector<Address::ptr>::const_iterator it(lookup->addresses.begin());
+        it != lookup->addresses.end();
+        ++it)
+        result.push_back((*it)->clone());
     return result;
 }
 
+void
+Address::flushLookupCache()
+{
+    boost::mutex::scoped_lock lock(g_lookupMutex);
+    g_lookupCache.clear();
+}
+
 template <class T>
 static unsigned int countBits(T value)
 {
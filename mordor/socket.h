@@ -17,6 +17,7 @@
 #include <ws2tcpip.h>
 #include "iomanager.h"
 #else
+#include <limits.h>
 #include <stdint.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -28,9 +29,14 @@
 #include <sys/un.h>
 #endif
 
+#ifdef LINUX
+struct io_uring_sqe;
+#endif
+
 namespace Mordor {
 
 class IOManager;
+class Timer;
 
 #ifdef WINDOWS
 struct iovec
@@ -54,6 +60,15 @@ typedef size_t iov_len_t;
 typedef int socket_t;
 #endif
 
+/// How many iovecs a single scatter/gather call is handed; kept small enough
+/// to live on a fiber's stack.  Short transfers are always allowed, so longer
+/// lists are simply truncated
+#if defined(IOV_MAX) && IOV_MAX < 64
+#define MORDOR_IOV_MAX IOV_MAX
+#else
+#define MORDOR_IOV_MAX 64
+#endif
+
 struct SocketException : virtual NativeException {};
 
 struct AddressInUseException : virtual SocketException {};
@@ -133,6 +148,22 @@ public:
     size_t receiveFrom(void *buffer, size_t length, Address &from, int *flags = NULL);
     size_t receiveFrom(iovec *buffers, size_t length, Address &from, int *flags = NULL);
 
+#ifdef LINUX
+    /// Send up to length bytes of fd, from its current offset, with
+    /// sendfile(2); the offset is advanced past what was sent
+    ///
+    /// Waits, times out, and is cancelled just like send()
+    size_t sendFile(int fd, size_t length);
+    /// Move up to length bytes out of pipe and into this socket with
+    /// splice(2); pipe must already hold data, since only the socket is waited
+    /// on
+    size_t spliceFrom(int pipe, size_t length);
+    /// Move up to length bytes received on this socket into pipe with
+    /// splice(2); pipe must have room, since only the socket is waited on
+    /// @return 0 at end of stream
+    size_t spliceTo(int pipe, size_t length);
+#endif
+
     boost::shared_ptr<Address> emptyAddress();
     boost::shared_ptr<Address> remoteAddress();
     boost::shared_ptr<Address> localAddress();
@@ -153,6 +184,14 @@ public:
 private:
     template <bool isSend>
     size_t doIO(iovec *buffers, size_t length, int &flags, Address *address = NULL);
+#ifdef LINUX
+    template <bool isSend>
+    size_t doZeroCopy(ssize_t (*op)(int, int, size_t), int fd, size_t length,
+        const char *api);
+    // The io_uring equivalent of waiting for event; the timeout cancels it
+    int submitIo(io_uring_sqe &sqe, int event, error_t &cancelled,
+        unsigned long long timeout);
+#endif
     static void callOnRemoteClose(weak_ptr self);
     void registerForRemoteClose();
     void accept(Socket &target);
@@ -182,7 +221,10 @@ private:
     AsyncEvent m_sendEvent, m_receiveEvent;
     bool m_useAcceptEx;         //Cache the values in case they are changed in the registry at
     bool m_useConnectEx;        //runtime
-
+#else
+    // Re-armed for each send/receive that has to wait, instead of
+    // registering a new timer every time
+    boost::shared_ptr<Timer> m_sendTimer, m_receiveTimer;
 #endif
     bool m_isConnected, m_isRegisteredForRemoteClose;
     boost::signals2::signal<void ()> m_onRemoteClose;
@@ -210,9 +252,19 @@ protected:
 public:
     virtual ~Address() {}
 
+    /// Resolve "node", "node:service" or "[ipv6]:service"
+    /// @details
+    /// Unless host is a literal address, the resolver is called on a small
+    /// pool of threads shared by the process (dns.threads) when called from
+    /// a Fiber, so that a slow name server doesn't stall everything else on
+    /// the caller's Scheduler, and simultaneous lookups of the same name
+    /// share a single resolution.  Results are cached for dns.ttl seconds,
+    /// and failures saying the name doesn't exist for dns.negativettl.
     static std::vector<ptr>
         lookup(const std::string& host, int family = AF_UNSPEC,
             int type = 0, int protocol = 0);
+    /// Forget every cached lookup result
+    static void flushLookupCache();
     /// @returns interface => (address, prefixLength)
     static std::multimap<std::string, std::pair<ptr, unsigned int> >
         getInterfaceAddresses(int family = AF_UNSPEC);
@@ -4,8 +4,23 @@
 
 #include <string.h>
 #include <algorithm>
+#include <new>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define MORDOR_SSE2_FIND
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
 
 #include "mordor/assert.h"
+#include "mordor/atomic.h"
+#include "mordor/config.h"
+#include "mordor/statistics.h"
 #include "mordor/util.h"
 
 #ifdef WINDOWS
@@ -20,28 +35,355 @@ static size_t iovLength(size_t length)
 }
 #endif
 
+#ifdef MORDOR_SSE2_FIND
+static unsigned lowestSetBit(unsigned mask)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+#endif
+
+#ifdef MORDOR_SSE2_FIND
+// Tests 16 candidate starts at once against the first and last byte of the
+// needle; only those matching both are worth a memcmp
+// @return The match, or NULL with p left where fewer than 16 candidates remain
+static const unsigned char *searchSse2(const unsigned char *&p,
+    const unsigned char *end, const unsigned char *needle,
+    size_t needleLength)
+{
+    const __m128i firsts = _mm_set1_epi8((char)needle[0]);
+    const __m128i lasts = _mm_set1_epi8((char)needle[needleLength - 1]);
+    for (; p + 16 <= end; p += 16) {
+        __m128i starts = _mm_loadu_si128((const __m128i *)p);
+        __m128i ends = _mm_loadu_si128(
+            (const __m128i *)(p + needleLength - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(starts, firsts), _mm_cmpeq_epi8(ends, lasts)));
+        while (mask != 0) {
+            unsigned bit = lowestSetBit(mask);
+            if (memcmp(p + bit + 1, needle + 1, needleLength - 2) == 0)
+                return p + bit;
+            mask &= mask - 1;
+        }
+    }
+    return NULL;
+}
+#endif
+
+// Finds the first occurrence of needle in a contiguous haystack
+// @return Its offset, or -1
+static ptrdiff_t search(const unsigned char *haystack, size_t length,
+    const unsigned char *needle, size_t needleLength)
+{
+    if (needleLength > length)
+        return -1;
+    if (needleLength == 1) {
+        const void *point = memchr(haystack, needle[0], length);
+        return point ? (const unsigned char *)point - haystack : -1;
+    }
+    // Every candidate start is before end
+    const unsigned char *end = haystack + length - needleLength + 1;
+    const unsigned char *p = haystack;
+    const unsigned char last = needle[needleLength - 1];
+    // memchr is hard to beat while the first byte is rare (binary data);
+    // once it keeps stopping on false candidates (text, where the needle
+    // starts with a common byte such as \r), filter on two bytes instead
+    size_t falseCandidates = 0;
+    while (p < end) {
+        p = (const unsigned char *)memchr(p, needle[0], end - p);
+        if (!p)
+            return -1;
+        if (p[needleLength - 1] == last &&
+            memcmp(p + 1, needle + 1, needleLength - 2) == 0)
+            return p - haystack;
+        ++p;
+#ifdef MORDOR_SSE2_FIND
+        if (++falseCandidates * 256 > (size_t)(p - haystack) + 4096) {
+            const unsigned char *match = searchSse2(p, end, needle,
+                needleLength);
+            if (match)
+                return match - haystack;
+        }
+#endif
+    }
+    return -1;
+}
+
+// Describes length bytes at start with as many of the count - filled
+// remaining iovecs as it takes (more than one only on Windows, where each is
+// limited to 4GB)
+// @return the number of bytes described
+static size_t fillIovecs(iovec *iovs, size_t count, size_t &filled,
+    unsigned char *start, size_t length)
+{
+    size_t described = 0;
+    while (length > 0 && filled < count) {
+        iovec &iov = iovs[filled++];
+        iov.iov_base = start;
+        iov.iov_len = iovLength(length);
+        start += iov.iov_len;
+        length -= iov.iov_len;
+        described += iov.iov_len;
+    }
+    return described;
+}
+
 namespace Mordor {
 
+static ConfigVar<size_t>::ptr g_slabCacheSize = Config::lookup<size_t>(
+    "buffer.slabcachesize", 1024 * 1024u,
+    "Bytes of freed Buffer blocks each thread keeps for reuse, when using "
+    "the slab allocator");
+static ConfigVar<size_t>::ptr g_globalSlabCacheSize = Config::lookup<size_t>(
+    "buffer.globalslabcachesize", 16 * 1024 * 1024u,
+    "Bytes of freed Buffer blocks kept for reuse by any thread, once a "
+    "thread's own cache is full");
+
+static CountStatistic<unsigned long long> &g_statSlabCacheHits =
+    Statistics::registerStatistic("buffer.slabcachehits",
+    CountStatistic<unsigned long long>(),
+    "Buffer blocks reused instead of being allocated");
+
+namespace {
+
+class HeapAllocator : public BufferAllocator
+{
+public:
+    Block *allocate(size_t length)
+    {
+        Block *block = (Block *)new unsigned char[sizeof(Block) + length];
+        block->refs = 1;
+        block->allocator = this;
+        block->capacity = length;
+        return block;
+    }
+
+    void deallocate(Block *block)
+    {
+        delete [] (unsigned char *)block;
+    }
+};
+
+// Size classes are powers of two from 1KB to 256KB; anything bigger goes
+// straight to the heap
+enum {
+    MIN_SLAB_SHIFT = 10,
+    MAX_SLAB_SHIFT = 18,
+    SIZE_CLASSES = MAX_SLAB_SHIFT - MIN_SLAB_SHIFT + 1
+};
+
+/// Freed blocks, by size class, linked through their data
+
+/// Each thread has one, and overflows into a global one.
+struct SlabCache : boost::noncopyable
+{
+    SlabCache() : bytes(0)
+    {
+        memset(blocks, 0, sizeof(blocks));
+    }
+    ~SlabCache();
+
+    static BufferAllocator::Block *&next(BufferAllocator::Block *block)
+    {
+        return *(BufferAllocator::Block **)block->data();
+    }
+
+    BufferAllocator::Block *take(size_t sizeClass)
+    {
+        BufferAllocator::Block *block = blocks[sizeClass];
+        if (block) {
+            blocks[sizeClass] = next(block);
+            bytes -= block->capacity;
+        }
+        return block;
+    }
+
+    void put(size_t sizeClass, BufferAllocator::Block *block)
+    {
+        next(block) = blocks[sizeClass];
+        blocks[sizeClass] = block;
+        bytes += block->capacity;
+    }
+
+    BufferAllocator::Block *blocks[SIZE_CLASSES];
+    size_t bytes;
+};
+
+}
+
+static boost::thread_specific_ptr<SlabCache> t_slabCache;
+
+// These are never destroyed, so that Buffers outliving static destruction
+// can still free their blocks
+static boost::mutex &g_slabCacheMutex()
+{
+    static boost::mutex *mutex = new boost::mutex();
+    return *mutex;
+}
+static SlabCache &g_slabCache()
+{
+    static SlabCache *cache = new SlabCache();
+    return *cache;
+}
+
+// A thread is exiting; hand its blocks on to the global cache
+SlabCache::~SlabCache()
+{
+    boost::mutex::scoped_lock lock(g_slabCacheMutex());
+    SlabCache &global = g_slabCache();
+    for (size_t i = 0; i < SIZE_CLASSES; ++i) {
+        while (BufferAllocator::Block *block = take(i)) {
+            if (global.bytes + block->capacity <= g_globalSlabCacheSize->val())
+                global.put(i, block);
+            else
+                delete [] (unsigned char *)block;
+        }
+    }
+}
+
+namespace {
+
+class SlabAllocator : public BufferAllocator
+{
+public:
+    Block *allocate(size_t length)
+    {
+        size_t sizeClass = 0;
+        while (sizeClass < SIZE_CLASSES &&
+            length > ((size_t)1 << (sizeClass + MIN_SLAB_SHIFT)))
+            ++sizeClass;
+        size_t capacity = sizeClass < SIZE_CLASSES ?
+            (size_t)1 << (sizeClass + MIN_SLAB_SHIFT) : length;
+        Block *block = NULL;
+        if (sizeClass < SIZE_CLASSES) {
+            SlabCache *cache = t_slabCache.get();
+            if (cache)
+                block = cache->take(sizeClass);
+            if (!block) {
+                boost::mutex::scoped_lock lock(g_slabCacheMutex());
+                block = g_slabCache().take(sizeClass);
+            }
+        }
+        if (block)
+            g_statSlabCacheHits.increment();
+        else
+            block = (Block *)new unsigned char[sizeof(Block) + capacity];
+        block->refs = 1;
+        block->allocator = this;
+        block->capacity = capacity;
+        return block;
+    }
+
+    // Keeps the block in this thread's cache, the global cache, or failing
+    // that, returns it to the heap
+    void deallocate(Block *block)
+    {
+        size_t sizeClass = 0;
+        while (sizeClass < SIZE_CLASSES &&
+            block->capacity != ((size_t)1 << (sizeClass + MIN_SLAB_SHIFT)))
+            ++sizeClass;
+        if (sizeClass < SIZE_CLASSES) {
+            SlabCache *cache = t_slabCache.get();
+            if (!cache) {
+                cache = new SlabCache();
+                t_slabCache.reset(cache);
+            }
+            if (cache->bytes + block->capacity <= g_slabCacheSize->val()) {
+                cache->put(sizeClass, block);
+                return;
+            }
+            boost::mutex::scoped_lock lock(g_slabCacheMutex());
+            SlabCache &global = g_slabCache();
+            if (global.bytes + block->capacity <=
+                g_globalSlabCacheSize->val()) {
+                global.put(sizeClass, block);
+                return;
+            }
+        }
+        delete [] (unsigned char *)block;
+    }
+};
+
+}
+
+BufferAllocator &
+BufferAllocator::heap()
+{
+    static HeapAllocator *allocator = new HeapAllocator();
+    return *allocator;
+}
+
+BufferAllocator &
+BufferAllocator::slab()
+{
+    static SlabAllocator *allocator = new SlabAllocator();
+    return *allocator;
+}
+
 Buffer::SegmentData::SegmentData()
+    : m_block(NULL)
 {
     start(NULL);
     length(0);
 }
 
-Buffer::SegmentData::SegmentData(size_t length)
+Buffer::SegmentData::SegmentData(size_t length, BufferAllocator &allocator)
 {
-    m_array.reset(new unsigned char[length]);
-    start(m_array.get());
-    this->length(length);
+    m_block = allocator.allocate(length);
+    start(m_block->data());
+    // Use all of it, if the allocator rounded up
+    this->length(m_block->capacity);
 }
 
 Buffer::SegmentData::SegmentData(void *buffer, size_t length)
+    : m_block(NULL)
+{
+    start(buffer);
+    this->length(length);
+}
+
+Buffer::SegmentData::SegmentData(void *buffer, size_t length,
+    BufferAllocator::Block &owner)
+    : m_block(&owner)
 {
-    m_array.reset((unsigned char *)buffer, &nop<unsigned char *>);
-    start(m_array.get());
+    atomicIncrement(m_block->refs);
+    start(buffer);
     this->length(length);
 }
 
+Buffer::SegmentData::SegmentData(const SegmentData &copy)
+    : m_start(copy.m_start),
+      m_length(copy.m_length),
+      m_block(copy.m_block)
+{
+    if (m_block)
+        atomicIncrement(m_block->refs);
+}
+
+Buffer::SegmentData::~SegmentData()
+{
+    if (m_block && atomicDecrement(m_block->refs) == 0)
+        m_block->allocator->deallocate(m_block);
+}
+
+Buffer::SegmentData &
+Buffer::SegmentData::operator =(const SegmentData &copy)
+{
+    if (copy.m_block)
+        atomicIncrement(copy.m_block->refs);
+    if (m_block && atomicDecrement(m_block->refs) == 0)
+        m_block->allocator->deallocate(m_block);
+    m_start = copy.m_start;
+    m_length = copy.m_length;
+    m_block = copy.m_block;
+    return *this;
+}
+
 Buffer::SegmentData
 Buffer::SegmentData::slice(size_t start, size_t length)
 {
@@ -49,8 +391,7 @@ Buffer::SegmentData::slice(size_t start, size_t length)
         length = this->length() - start;
     MORDOR_ASSERT(start <= this->length());
     MORDOR_ASSERT(length + start <= this->length());
-    SegmentData result;
-    result.m_array = m_array;
+    SegmentData result(*this);
     result.start((unsigned char*)this->start() + start);
     result.length(length);
     return result;
@@ -63,8 +404,7 @@ Buffer::SegmentData::slice(size_t start, size_t length) const
         length = this->length() - start;
     MORDOR_ASSERT(start <= this->length());
     MORDOR_ASSERT(length + start <= this->length());
-    SegmentData result;
-    result.m_array = m_array;
+    SegmentData result(*this);
     result.start((unsigned char*)this->start() + start);
     result.length(length);
     return result;
@@ -77,8 +417,8 @@ Buffer::SegmentData::extend(size_t length)
     m_length += length;
 }
 
-Buffer::Segment::Segment(size_t length)
-: m_writeIndex(0), m_data(length)
+Buffer::Segment::Segment(size_t length, BufferAllocator &allocator)
+: m_writeIndex(0), m_data(length, allocator)
 {
     invariant();
 }
@@ -178,10 +518,135 @@ Buffer::Segment::invariant() const
 }
 
 
+Buffer::SegmentList::SegmentList()
+: m_slots((Segment *)m_inline),
+  m_capacity(INLINE_SEGMENTS),
+  m_head(0),
+  m_size(0)
+{}
+
+Buffer::SegmentList::~SegmentList()
+{
+    clear();
+    if (m_slots != (Segment *)m_inline)
+        operator delete(m_slots);
+}
+
+// Segments hold no pointers into themselves, so they are moved around the
+// array with memmove instead of being copied and destroyed
+void
+Buffer::SegmentList::makeRoom(bool atFront)
+{
+    if (atFront ? m_head > 0 : m_head + m_size < m_capacity)
+        return;
+    Segment *slots = m_slots;
+    size_t capacity = m_capacity;
+    if (m_size == m_capacity) {
+        capacity *= 2;
+        slots = (Segment *)operator new(capacity * sizeof(Segment));
+    }
+    // Split the free slots between the two ends, favoring the one that
+    // needs one now
+    size_t free = capacity - m_size;
+    size_t head = atFront ? (free + 1) / 2 : free / 2;
+    memmove((void *)(slots + head), (void *)(m_slots + m_head),
+        m_size * sizeof(Segment));
+    if (slots != m_slots) {
+        if (m_slots != (Segment *)m_inline)
+            operator delete(m_slots);
+        m_slots = slots;
+        m_capacity = capacity;
+    }
+    m_head = head;
+}
+
+void
+Buffer::SegmentList::push_back(const Segment &segment)
+{
+    makeRoom(false);
+    new (m_slots + m_head + m_size) Segment(segment);
+    ++m_size;
+}
+
+void
+Buffer::SegmentList::push_front(const Segment &segment)
+{
+    makeRoom(true);
+    new (m_slots + m_head - 1) Segment(segment);
+    --m_head;
+    ++m_size;
+}
+
+void
+Buffer::SegmentList::pop_front()
+{
+    MORDOR_ASSERT(m_size > 0);
+    m_slots[m_head].~Segment();
+    ++m_head;
+    if (--m_size == 0)
+        m_head = 0;
+}
+
+Buffer::SegmentList::iterator
+Buffer::SegmentList::insert(iterator position, const Segment &segment)
+{
+    size_t index = position.m_index;
+    MORDOR_ASSERT(index <= m_size);
+    if (index == 0) {
+        push_front(segment);
+        return begin();
+    }
+    makeRoom(false);
+    Segment *slot = m_slots + m_head + index;
+    memmove((void *)(slot + 1), (void *)slot,
+        (m_size - index) * sizeof(Segment));
+    new (slot) Segment(segment);
+    ++m_size;
+    return iterator(this, index);
+}
+
+Buffer::SegmentList::iterator
+Buffer::SegmentList::erase(iterator first, iterator last)
+{
+    MORDOR_ASSERT(first.m_index <= last.m_index);
+    MORDOR_ASSERT(last.m_index <= m_size);
+    size_t count = last.m_index - first.m_index;
+    for (size_t i = first.m_index; i < last.m_index; ++i)
+        m_slots[m_head + i].~Segment();
+    if (first.m_index == 0) {
+        // Cheaper to just advance the window
+        m_head += count;
+    } else {
+        Segment *slot = m_slots + m_head + first.m_index;
+        memmove((void *)slot, (void *)(slot + count),
+            (m_size - last.m_index) * sizeof(Segment));
+    }
+    m_size -= count;
+    if (m_size == 0)
+        m_head = 0;
+    return first;
+}
+
+Buffer::SegmentList::iterator
+Buffer::SegmentList::erase(iterator position)
+{
+    iterator last = position;
+    return erase(position, ++last);
+}
+
+void
+Buffer::SegmentList::clear()
+{
+    for (size_t i = 0; i < m_size; ++i)
+        m_slots[m_head + i].~Segment();
+    m_head = m_size = 0;
+}
+
 Buffer::Buffer()
 {
     m_readAvailable = m_writeAvailable = 0;
     m_writeIt = m_segments.end();
+    m_allocator = &BufferAllocator::heap();
     invariant();
 }
 
@@ -189,6 +654,7 @@ Buffer::Buffer(const Buffer &copy)
 {
     m_readAvailable = m_writeAvailable = 0;
     m_writeIt = m_segments.end();
+    m_allocator = copy.m_allocator;
     copyIn(copy);
 }
 
@@ -196,6 +662,7 @@ Buffer::Buffer(const char *string)
 {
     m_readAvailable = m_writeAvailable = 0;
     m_writeIt = m_segments.end();
+    m_allocator = &BufferAllocator::heap();
     copyIn(string, strlen(string));
 }
 
@@ -203,6 +670,7 @@ Buffer::Buffer(const std::string &string)
 {
     m_readAvailable = m_writeAvailable = 0;
     m_writeIt = m_segments.end();
+    m_allocator = &BufferAllocator::heap();
     copyIn(string);
 }
 
@@ -210,6 +678,7 @@ Buffer::Buffer(const void *data, size_t length)
 {
     m_readAvailable = m_writeAvailable = 0;
     m_writeIt = m_segments.end();
+    m_allocator = &BufferAllocator::heap();
     copyIn(data, length);
 }
 
@@ -260,12 +729,34 @@ Buffer::adopt(void *buffer, size_t length)
     invariant();
 }
 
+void
+Buffer::reference(const void *data, size_t length,
+    BufferAllocator::Block &owner)
+{
+    if (length == 0)
+        return;
+    Buffer referenced;
+    referenced.m_segments.push_back(Segment(SegmentData((void *)data, length,
+        owner)));
+    referenced.m_readAvailable = length;
+    referenced.m_writeIt = referenced.m_segments.end();
+    // copyIn(Buffer) slices the segment, and merges it with one before it
+    // from the same owner
+    copyIn(referenced);
+}
+
 void
 Buffer::reserve(size_t length)
+{
+    reserve(length, *m_allocator);
+}
+
+void
+Buffer::reserve(size_t length, BufferAllocator &allocator)
 {
     if (writeAvailable() < length) {
         // over-reserve to avoid fragmentation
-        Segment newSegment(length * 2 - writeAvailable());
+        Segment newSegment(length * 2 - writeAvailable(), allocator);
         if (readAvailable() == 0) {
             // put the new buffer at the front if possible to avoid
             // fragmentation
@@ -290,7 +781,8 @@ Buffer::compact()
     if (m_writeIt != m_segments.end()) {
         if (m_writeIt->readAvailable() > 0) {
             Segment newSegment = Segment(m_writeIt->readBuffer());
-            m_segments.insert(m_writeIt, newSegment);
+            m_writeIt = m_segments.insert(m_writeIt, newSegment);
+            ++m_writeIt;
         }
         m_writeIt = m_segments.erase(m_writeIt, m_segments.end());
         m_writeAvailable = 0;
@@ -310,7 +802,7 @@ Buffer::clear(bool clearWriteAvailableAsWell)
         m_readAvailable = 0;
         if (m_writeIt != m_segments.end() && m_writeIt->readAvailable())
             m_writeIt->consume(m_writeIt->readAvailable());
-        m_segments.erase(m_segments.begin(), m_writeIt);
+        m_writeIt = m_segments.erase(m_segments.begin(), m_writeIt);
     }
     invariant();
     MORDOR_ASSERT(m_readAvailable == 0);
@@ -344,8 +836,11 @@ Buffer::consume(size_t length)
         size_t toConsume = (std::min)(segment.readAvailable(), length);
         segment.consume(toConsume);
         length -= toConsume;
-        if (segment.length() == 0)
+        if (segment.length() == 0) {
             m_segments.pop_front();
+            // Still the same segment
+            --m_writeIt;
+        }
     }
     MORDOR_ASSERT(length == 0);
     invariant();
@@ -359,11 +854,13 @@ Buffer::truncate(size_t length)
         return;
     // Split any mixed read/write bufs
     if (m_writeIt != m_segments.end() && m_writeIt->readAvailable() != 0) {
-        m_segments.insert(m_writeIt, Segment(m_writeIt->readBuffer()));
+        m_writeIt = m_segments.insert(m_writeIt,
+            Segment(m_writeIt->readBuffer()));
+        ++m_writeIt;
         m_writeIt->consume(m_writeIt->readAvailable());
     }
     m_readAvailable = length;
-    std::list<Segment>::iterator it;
+    SegmentList::iterator it;
     for (it = m_segments.begin(); it != m_segments.end() && length > 0; ++it) {
         Segment &segment = *it;
         if (length <= segment.readAvailable()) {
@@ -379,6 +876,7 @@ Buffer::truncate(size_t length)
     while (it != m_segments.end() && it->readAvailable() > 0) {
         MORDOR_ASSERT(it->writeAvailable() == 0);
         it = m_segments.erase(it);
+        --m_writeIt;
     }
     invariant();
 }
@@ -392,7 +890,7 @@ Buffer::readBuffers(size_t length) const
     std::vector<iovec> result;
     result.reserve(m_segments.size());
     size_t remaining = length;
-    std::list<Segment>::const_iterator it;
+    SegmentList::const_iterator it;
     for (it = m_segments.begin(); it != m_segments.end(); ++it) {
         size_t toConsume = (std::min)(it->readAvailable(), remaining);
         SegmentData data = it->readBuffer().slice(0, toConsume);
@@ -419,6 +917,26 @@ Buffer::readBuffers(size_t length) const
     return result;
 }
 
+size_t
+Buffer::readBuffers(iovec *iovs, size_t count, size_t length) const
+{
+    if (length == (size_t)~0)
+        length = readAvailable();
+    MORDOR_ASSERT(length <= readAvailable());
+    size_t filled = 0;
+    SegmentList::const_iterator it;
+    for (it = m_segments.begin(); it != m_segments.end() && length > 0 &&
+        filled < count; ++it) {
+        // Straight at the segment, to avoid a reference count round trip per
+        // entry
+        size_t todo = (std::min)(it->m_writeIndex, length);
+        length -= fillIovecs(iovs, count, filled,
+            (unsigned char *)it->m_data.m_start, todo);
+    }
+    invariant();
+    return filled;
+}
+
 const iovec
 Buffer::readBuffer(size_t length, bool coalesce) const
 {
@@ -464,10 +982,12 @@ Buffer::readBuffer(size_t length, bool coalesce) const
         result.iov_len = iovLength(data.length());
         return result;
     }
-    Segment newSegment = Segment(readAvailable());
+    Segment newSegment = Segment(readAvailable(), *m_allocator);
     copyOut(newSegment.writeBuffer().start(), readAvailable());
     newSegment.produce(readAvailable());
     _this->m_segments.clear();
+    // Drop any slack the allocator rounded up to
+    newSegment = Segment(newSegment.readBuffer());
     _this->m_segments.push_back(newSegment);
     _this->m_writeAvailable = 0;
     _this->m_writeIt = _this->m_segments.end();
@@ -487,7 +1007,7 @@ Buffer::writeBuffers(size_t length)
     std::vector<iovec> result;
     result.reserve(m_segments.size());
     size_t remaining = length;
-    std::list<Segment>::iterator it = m_writeIt;
+    SegmentList::iterator it = m_writeIt;
     while (remaining > 0) {
         Segment& segment = *it;
         size_t toProduce = (std::min)(segment.writeAvailable(), remaining);
@@ -514,6 +1034,25 @@ Buffer::writeBuffers(size_t length)
     return result;
 }
 
+size_t
+Buffer::writeBuffers(iovec *iovs, size_t count, size_t length)
+{
+    if (length == (size_t)~0)
+        length = writeAvailable();
+    reserve(length);
+    size_t filled = 0;
+    SegmentList::iterator it;
+    for (it = m_writeIt; it != m_segments.end() && length > 0 &&
+        filled < count; ++it) {
+        size_t todo = (std::min)(it->m_data.m_length - it->m_writeIndex,
+            length);
+        length -= fillIovecs(iovs, count, filled,
+            (unsigned char *)it->m_data.m_start + it->m_writeIndex, todo);
+    }
+    invariant();
+    return filled;
+}
+
 iovec
 Buffer::writeBuffer(size_t length, bool coalesce)
 {
@@ -573,12 +1112,14 @@ Buffer::copyIn(const Buffer &buffer, size_t length, size_t pos)
 
     // Split any mixed read/write bufs
     if (m_writeIt != m_segments.end() && m_writeIt->readAvailable() != 0) {
-        m_segments.insert(m_writeIt, Segment(m_writeIt->readBuffer()));
+        m_writeIt = m_segments.insert(m_writeIt,
+            Segment(m_writeIt->readBuffer()));
+        ++m_writeIt;
         m_writeIt->consume(m_writeIt->readAvailable());
         invariant();
     }
 
-    std::list<Segment>::const_iterator it = buffer.m_segments.begin();
+    SegmentList::const_iterator it = buffer.m_segments.begin();
     while (pos != 0 && it != buffer.m_segments.end()) {
         if (pos < it->readAvailable())
             break;
@@ -589,11 +1130,12 @@ Buffer::copyIn(const Buffer &buffer, size_t length, size_t pos)
     for (; it != buffer.m_segments.end(); ++it) {
         size_t toConsume = (std::min)(it->readAvailable() - pos, length);
         if (m_readAvailable != 0 && it == buffer.m_segments.begin()) {
-            std::list<Segment>::iterator previousIt = m_writeIt;
+            SegmentList::iterator previousIt = m_writeIt;
             --previousIt;
             if ((char *)previousIt->readBuffer().start() +
                 previousIt->readBuffer().length() == (char *)it->readBuffer().start() + pos &&
-                previousIt->m_data.m_array.get() == it->m_data.m_array.get()) {
+                previousIt->m_data.m_block &&
+                previousIt->m_data.m_block == it->m_data.m_block) {
                 MORDOR_ASSERT(previousIt->writeAvailable() == 0);
                 previousIt->extend(toConsume);
                 m_readAvailable += toConsume;
@@ -605,7 +1147,8 @@ Buffer::copyIn(const Buffer &buffer, size_t length, size_t pos)
             }
         }
         Segment newSegment = Segment(it->readBuffer().slice(pos, toConsume));
-        m_segments.insert(m_writeIt, newSegment);
+        m_writeIt = m_segments.insert(m_writeIt, newSegment);
+        ++m_writeIt;
         m_readAvailable += toConsume;
         length -= toConsume;
         pos = 0;
@@ -635,11 +1178,17 @@ Buffer::copyIn(const void *data, size_t length)
     }
 
     if (length > 0) {
-        Segment newSegment(length);
+        Segment newSegment(length, *m_allocator);
         memcpy(newSegment.writeBuffer().start(), data, length);
         newSegment.produce(length);
         m_segments.push_back(newSegment);
         m_readAvailable += length;
+        m_writeIt = m_segments.end();
+        // The allocator may have rounded up; keep the slack as write space
+        if (newSegment.writeAvailable() != 0) {
+            --m_writeIt;
+            m_writeAvailable += newSegment.writeAvailable();
+        }
     }
 
     MORDOR_ASSERT(readAvailable() >= length);
@@ -665,7 +1214,7 @@ Buffer::copyOut(void *buffer, size_t length, size_t pos) const
 
     MORDOR_ASSERT(length + pos <= readAvailable());
     unsigned char *next = (unsigned char*)buffer;
-    std::list<Segment>::const_iterator it = m_segments.begin();
+    SegmentList::const_iterator it = m_segments.begin();
     while (pos != 0 && it != m_segments.end()) {
         if (pos < it->readAvailable())
             break;
@@ -695,7 +1244,7 @@ Buffer::find(char delimiter, size_t length) const
     size_t totalLength = 0;
     bool success = false;
 
-    std::list<Segment>::const_iterator it;
+    SegmentList::const_iterator it;
     for (it = m_segments.begin(); it != m_segments.end(); ++it) {
         const void *start = it->readBuffer().start();
         size_t toscan = (std::min)(length, it->readAvailable());
@@ -723,51 +1272,51 @@ Buffer::find(const std::string &string, size_t length) const
     MORDOR_ASSERT(length <= readAvailable());
     MORDOR_ASSERT(!string.empty());
 
-    size_t totalLength = 0;
-    size_t foundSoFar = 0;
+    const unsigned char *needle = (const unsigned char *)string.c_str();
+    size_t needleLength = string.size();
+    // Matches that span segments are found by stitching together the tail
+    // of what has been searched so far with the head of the next segment
+    unsigned char stackWindow[256];
+    std::string heapWindow;
+    unsigned char *window = stackWindow;
+    if (2 * (needleLength - 1) > sizeof(stackWindow)) {
+        heapWindow.resize(2 * (needleLength - 1));
+        window = (unsigned char *)&heapWindow[0];
+    }
+    size_t carried = 0;
+    size_t offset = 0;
 
-    std::list<Segment>::const_iterator it;
-    for (it = m_segments.begin(); it != m_segments.end(); ++it) {
-        const void *start = it->readBuffer().start();
-        size_t toscan = (std::min)(length, it->readAvailable());
-        while (toscan > 0) {
-            if (foundSoFar == 0) {
-                const void *point = memchr(start, string[0], toscan);
-                if (point != NULL) {
-                    foundSoFar = 1;
-                    size_t found = (unsigned char*)point -
-                        (unsigned char*)start;
-                    toscan -= found + 1;
-                    length -= found + 1;
-                    totalLength += found;
-                    start = (unsigned char*)point + 1;
-                } else {
-                    totalLength += toscan;
-                    length -= toscan;
-                    toscan = 0;
-                    continue;
-                }
-            }
-            MORDOR_ASSERT(foundSoFar != 0);
-            size_t tocompare = (std::min)(toscan, string.size() - foundSoFar);
-            if (memcmp(start, string.c_str() + foundSoFar, tocompare) == 0) {
-                foundSoFar += tocompare;
-                toscan -= tocompare;
-                length -= tocompare;
-                if (foundSoFar == string.size())
-                    break;
-            } else {
-                totalLength += foundSoFar;
-                foundSoFar = 0;
-            }
+    SegmentList::const_iterator it;
+    for (it = m_segments.begin(); it != m_segments.end() && length > 0;
+        ++it) {
+        const unsigned char *start =
+            (const unsigned char *)it->m_data.m_start;
+        size_t toscan = (std::min)(length, it->m_writeIndex);
+        if (carried > 0) {
+            size_t head = (std::min)(toscan, needleLength - 1);
+            memcpy(window + carried, start, head);
+            ptrdiff_t found = search(window, carried + head, needle,
+                needleLength);
+            if (found != -1)
+                return offset - carried + found;
         }
-        if (foundSoFar == string.size())
-            break;
-        if (length == 0)
-            break;
+        ptrdiff_t found = search(start, toscan, needle, needleLength);
+        if (found != -1)
+            return offset + found;
+        if (toscan >= needleLength - 1) {
+            carried = needleLength - 1;
+            memcpy(window, start + toscan - carried, carried);
+        } else {
+            // Too short to replace the carried tail; extend it instead
+            if (carried == 0)
+                memcpy(window, start, toscan);
+            size_t total = carried + toscan;
+            carried = (std::min)(total, needleLength - 1);
+            memmove(window, window + total - carried, carried);
+        }
+        offset += toscan;
+        length -= toscan;
     }
-    if (foundSoFar == string.size())
-        return totalLength;
     return -1;
 }
 
@@ -830,7 +1379,7 @@ Buffer::visit(boost::function<void (const void *, size_t)> dg, size_t length) co
         length = readAvailable();
     MORDOR_ASSERT(length <= readAvailable());
 
-    std::list<Segment>::const_iterator it;
+    SegmentList::const_iterator it;
     for (it = m_segments.begin(); it != m_segments.end() && length > 0; ++it) {
         size_t todo = (std::min)(length, it->readAvailable());
         MORDOR_ASSERT(todo != 0);
@@ -893,7 +1442,7 @@ Buffer::operator!= (const char *string) const
 int
 Buffer::opCmp(const Buffer &rhs) const
 {
-    std::list<Segment>::const_iterator leftIt, rightIt;
+    SegmentList::const_iterator leftIt, rightIt;
     int lengthResult = (int)((ptrdiff_t)readAvailable() - (ptrdiff_t)rhs.readAvailable());
     leftIt = m_segments.begin(); rightIt = rhs.m_segments.begin();
     size_t leftOffset = 0, rightOffset = 0;
@@ -929,7 +1478,7 @@ int
 Buffer::opCmp(const char *string, size_t length) const
 {
     size_t offset = 0;
-    std::list<Segment>::const_iterator it;
+    SegmentList::const_iterator it;
     int lengthResult = (int)((ptrdiff_t)readAvailable() - (ptrdiff_t)length);
     if (lengthResult > 0)
         length = readAvailable();
@@ -953,7 +1502,7 @@ Buffer::invariant() const
     size_t read = 0;
     size_t write = 0;
     bool seenWrite = false;
-    std::list<Segment>::const_iterator it;
+    SegmentList::const_iterator it;
     for (it = m_segments.begin(); it != m_segments.end(); ++it) {
         const Segment &segment = *it;
         // Strict ordering
@@ -965,7 +1514,7 @@ Buffer::invariant() const
             MORDOR_ASSERT(m_writeIt == it);
         }
         // We should keep segments optimally merged together
-        std::list<Segment>::const_iterator nextIt = it;
+        SegmentList::const_iterator nextIt = it;
         ++nextIt;
         if (nextIt != m_segments.end()) {
             const Segment& next = *nextIt;
@@ -973,12 +1522,14 @@ Buffer::invariant() const
                 next.readAvailable() != 0) {
                 MORDOR_ASSERT((const unsigned char*)segment.readBuffer().start() +
                     segment.readAvailable() != next.readBuffer().start() ||
-                    segment.m_data.m_array.get() != next.m_data.m_array.get());
+                    !segment.m_data.m_block ||
+                    segment.m_data.m_block != next.m_data.m_block);
             } else if (segment.writeAvailable() != 0 &&
                 next.readAvailable() == 0) {
                 MORDOR_ASSERT((const unsigned char*)segment.writeBuffer().start() +
                     segment.writeAvailable() != next.writeBuffer().start() ||
-                    segment.m_data.m_array.get() != next.m_data.m_array.get());
+                    !segment.m_data.m_block ||
+                    segment.m_data.m_block != next.m_data.m_block);
             }
         }
     }
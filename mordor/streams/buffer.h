@@ -1,16 +1,49 @@
 #ifndef __MORDOR_BUFFER_H__
 #define __MORDOR_BUFFER_H__
 
-#include <list>
 #include <vector>
 
-#include <boost/shared_array.hpp>
 #include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
 
 #include "mordor/socket.h"
 
 namespace Mordor {
 
+/// Supplies the memory behind Buffer segments
+
+/// Each block carries its reference count in its header, so slicing
+/// segments and copying Buffers never allocates
+struct BufferAllocator
+{
+    struct Block
+    {
+        volatile size_t refs;
+        BufferAllocator *allocator;
+        size_t capacity;
+        // Rounds the header up to 16 bytes (32 on 64-bit), so data() is as
+        // aligned as the allocation itself; SSE loads and anything a caller
+        // overlays on the data expect that much
+        size_t padding;
+
+        unsigned char *data() { return (unsigned char *)(this + 1); }
+    };
+
+    virtual ~BufferAllocator() {}
+
+    /// @return A block with refs == 1, and capacity >= length
+    virtual Block *allocate(size_t length) = 0;
+    virtual void deallocate(Block *block) = 0;
+
+    /// Every block comes straight from the heap; what a Buffer uses unless
+    /// told otherwise
+    static BufferAllocator &heap();
+    /// Blocks are rounded up to power-of-two size classes, and recycled
+    /// through per-thread caches (overflowing into a global one) instead of
+    /// going back to the heap
+    static BufferAllocator &slab();
+};
+
 struct Buffer
 {
 private:
@@ -19,8 +52,14 @@ private:
         friend struct Buffer;
     public:
         SegmentData();
-        SegmentData(size_t length);
+        SegmentData(size_t length, BufferAllocator &allocator);
         SegmentData(void *buffer, size_t length);
+        SegmentData(void *buffer, size_t length,
+            BufferAllocator::Block &owner);
+        SegmentData(const SegmentData &copy);
+        ~SegmentData();
+
+        SegmentData &operator =(const SegmentData &copy);
 
         SegmentData slice(size_t start, size_t length = ~0);
         const SegmentData slice(size_t start, size_t length = ~0) const;
@@ -37,14 +76,15 @@ private:
         void *m_start;
         size_t m_length;
     private:
-        boost::shared_array<unsigned char> m_array;
+        // NULL for adopted memory
+        BufferAllocator::Block *m_block;
     };
 
     struct Segment
     {
         friend struct Buffer;
     public:
-        Segment(size_t len);
+        Segment(size_t len, BufferAllocator &allocator);
         Segment(SegmentData);
         Segment(void *buffer, size_t length);
 
@@ -66,6 +106,104 @@ private:
         void invariant() const;
     };
 
+    /// The chain of segments; a replacement for std::list<Segment> that
+    /// keeps them in a contiguous window of an array, with room for a few
+    /// inline so short chains never touch the heap
+
+    /// Unlike std::list, an iterator is a position: inserting or erasing
+    /// in front of it changes which segment it refers to
+    class SegmentList : boost::noncopyable
+    {
+    public:
+        struct iterator
+        {
+            iterator(SegmentList *list = NULL, size_t index = 0)
+                : m_list(list), m_index(index)
+            {}
+
+            Segment &operator *() const { return (*m_list)[m_index]; }
+            Segment *operator ->() const { return &(*m_list)[m_index]; }
+            iterator &operator ++() { ++m_index; return *this; }
+            iterator &operator --() { --m_index; return *this; }
+            friend bool operator ==(const iterator &lhs, const iterator &rhs)
+            { return lhs.m_index == rhs.m_index; }
+            friend bool operator !=(const iterator &lhs, const iterator &rhs)
+            { return lhs.m_index != rhs.m_index; }
+
+            SegmentList *m_list;
+            size_t m_index;
+        };
+
+        struct const_iterator
+        {
+            const_iterator(const SegmentList *list = NULL, size_t index = 0)
+                : m_list(list), m_index(index)
+            {}
+            const_iterator(const iterator &it)
+                : m_list(it.m_list), m_index(it.m_index)
+            {}
+
+            const Segment &operator *() const { return (*m_list)[m_index]; }
+            const Segment *operator ->() const
+            { return &(*m_list)[m_index]; }
+            const_iterator &operator ++() { ++m_index; return *this; }
+            const_iterator &operator --() { --m_index; return *this; }
+            friend bool operator ==(const const_iterator &lhs,
+                const const_iterator &rhs)
+            { return lhs.m_index == rhs.m_index; }
+            friend bool operator !=(const const_iterator &lhs,
+                const const_iterator &rhs)
+            { return lhs.m_index != rhs.m_index; }
+
+            const SegmentList *m_list;
+            size_t m_index;
+        };
+
+    public:
+        SegmentList();
+        ~SegmentList();
+
+        iterator begin() { return iterator(this, 0); }
+        iterator end() { return iterator(this, m_size); }
+        const_iterator begin() const { return const_iterator(this, 0); }
+        const_iterator end() const { return const_iterator(this, m_size); }
+        size_t size() const { return m_size; }
+        bool empty() const { return m_size == 0; }
+        Segment &front() { return m_slots[m_head]; }
+        const Segment &front() const { return m_slots[m_head]; }
+        Segment &operator [](size_t index) { return m_slots[m_head + index]; }
+        const Segment &operator [](size_t index) const
+        { return m_slots[m_head + index]; }
+
+        // segment must not already be in this list
+        void push_back(const Segment &segment);
+        void push_front(const Segment &segment);
+        void pop_front();
+        /// @return The position of the inserted segment
+        iterator insert(iterator position, const Segment &segment);
+        /// @return The position of the segment that followed the erased
+        /// range
+        iterator erase(iterator first, iterator last);
+        iterator erase(iterator position);
+        void clear();
+
+    private:
+        /// Make sure there is a free slot just outside the window on the
+        /// given end, sliding or growing the array as necessary
+        void makeRoom(bool atFront);
+
+    private:
+        enum { INLINE_SEGMENTS = 4 };
+
+        Segment *m_slots;
+        size_t m_capacity, m_head, m_size;
+        union {
+            void *m_align;
+            size_t m_alignSize;
+            unsigned char m_inline[INLINE_SEGMENTS * sizeof(Segment)];
+        };
+    };
+
 public:
     Buffer();
     Buffer(const Buffer &copy);
@@ -80,8 +218,20 @@ public:
     // Primarily for unit tests
     size_t segments() const;
 
+    /// Where new segments come from; copies of this Buffer inherit it
+    BufferAllocator &allocator() const { return *m_allocator; }
+    void allocator(BufferAllocator &allocator) { m_allocator = &allocator; }
+
     void adopt(void *buffer, size_t length);
+    /// Append length bytes at data as readable data, without copying them;
+    /// a reference on owner keeps them alive for as long as any Buffer
+    /// refers to them
+    /// @pre The bytes are never modified
+    void reference(const void *data, size_t length,
+        BufferAllocator::Block &owner);
     void reserve(size_t length);
+    /// Reserve from allocator instead of this Buffer's own allocator
+    void reserve(size_t length, BufferAllocator &allocator);
     void compact();
     void clear(bool clearWriteAvailableAsWell = true);
     void produce(size_t length);
@@ -89,8 +239,16 @@ public:
     void truncate(size_t length);
 
     const std::vector<iovec> readBuffers(size_t length = ~0) const;
+    /// Fill iovs with up to count entries describing the first length bytes
+    /// of readable data, without allocating
+    /// @return The number of entries filled; if count runs out first, they
+    /// describe less than length bytes
+    size_t readBuffers(iovec *iovs, size_t count, size_t length = ~0) const;
     const iovec readBuffer(size_t length, bool reallocate) const;
     std::vector<iovec> writeBuffers(size_t length = ~0);
+    /// Reserve length bytes, then fill iovs as readBuffers(iovs, count,
+    /// length) does, but describing writable space
+    size_t writeBuffers(iovec *iovs, size_t count, size_t length = ~0);
     iovec writeBuffer(size_t length, bool reallocate);
 
     void copyIn(const Buffer& buf, size_t length = ~0, size_t pos = 0);
@@ -120,10 +278,11 @@ public:
     bool operator!= (const char *str) const;
 
 private:
-    std::list<Segment> m_segments;
+    SegmentList m_segments;
     size_t m_readAvailable;
     size_t m_writeAvailable;
-    std::list<Segment>::iterator m_writeIt;
+    SegmentList::iterator m_writeIt;
+    BufferAllocator *m_allocator;
 
     int opCmp(const Buffer &rhs) const;
     int opCmp(const char *string, size_t length) const;
@@ -2,9 +2,16 @@
 
 #include "buffered.h"
 
+#include <deque>
+
+#include <boost/bind.hpp>
+#include <boost/exception_ptr.hpp>
+
 #include "mordor/config.h"
 #include "mordor/exception.h"
+#include "mordor/fibersynchronization.h"
 #include "mordor/log.h"
+#include "mordor/scheduler.h"
 
 namespace Mordor {
 
@@ -14,22 +21,139 @@ static ConfigVar<size_t>::ptr g_defaultBufferSize =
 
 static Logger::ptr g_log = Log::lookup("mordor:streams:buffered");
 
+// The Fibers reading ahead and writing behind hold a reference to this, so
+// that it stays valid until they're completely done with it, even if the
+// BufferedStream has already seen them finish and gone away
+struct BufferedStream::Background
+{
+    Background(Stream::ptr parent)
+        : parent(parent),
+          condition(mutex),
+          prefetched(false),
+          writing(false),
+          prefetchResult(0)
+    {}
+
+    void readAhead(size_t length);
+    void writeBehind();
+
+    Stream::ptr parent;
+    FiberMutex mutex;
+    FiberCondition condition;
+    bool prefetched, writing;
+    size_t prefetchResult;
+    Buffer prefetchBuffer;
+    boost::exception_ptr prefetchException, writeException;
+    std::deque<Buffer> writeQueue;
+};
+
+void
+BufferedStream::Background::readAhead(size_t length)
+{
+    size_t result = 0;
+    boost::exception_ptr exception;
+    try {
+        result = parent->read(prefetchBuffer, length);
+        MORDOR_LOG_DEBUG(g_log) << parent.get() << " read ahead(" << length
+            << "): " << result;
+    } catch (boost::exception &ex) {
+        removeTopFrames(ex);
+        exception = boost::current_exception();
+    } catch (...) {
+        exception = boost::current_exception();
+    }
+    FiberMutex::ScopedLock lock(mutex);
+    prefetchResult = result;
+    prefetchException = exception;
+    prefetched = true;
+    condition.broadcast();
+}
+
+void
+BufferedStream::Background::writeBehind()
+{
+    FiberMutex::ScopedLock lock(mutex);
+    while (!writeQueue.empty()) {
+        // Only this Fiber removes from the queue, so block stays put
+        Buffer &block = writeQueue.front();
+        lock.unlock();
+        boost::exception_ptr exception;
+        try {
+            while (block.readAvailable()) {
+                size_t result = parent->write(block, block.readAvailable());
+                MORDOR_LOG_DEBUG(g_log) << parent.get() << " write behind("
+                    << block.readAvailable() << "): " << result;
+                block.consume(result);
+            }
+        } catch (boost::exception &ex) {
+            removeTopFrames(ex);
+            exception = boost::current_exception();
+        } catch (...) {
+            exception = boost::current_exception();
+        }
+        lock.lock();
+        if (exception) {
+            // Whatever was queued behind the failed block goes with it
+            writeException = exception;
+            writeQueue.clear();
+        } else {
+            writeQueue.pop_front();
+        }
+        condition.broadcast();
+    }
+    writing = false;
+    condition.broadcast();
+}
+
 BufferedStream::BufferedStream(Stream::ptr parent, bool own)
 : FilterStream(parent, own)
 {
     m_bufferSize = g_defaultBufferSize->val();
     m_allowPartialReads = false;
     m_flushMultiplesOfBuffer = false;
+    m_readBuffer.allocator(BufferAllocator::slab());
+    m_writeBuffer.allocator(BufferAllocator::slab());
+    m_readAhead = m_readAheadEof = false;
+    m_writeBehind = 0;
+    m_prefetching = m_writingBehind = false;
+}
+
+BufferedStream::~BufferedStream()
+{
+    // Don't leave the parent being used behind its owner's back
+    if (m_prefetching)
+        joinReadAhead(false);
+    joinWriteBehind(false);
+}
+
+void
+BufferedStream::readAhead(bool readAhead)
+{
+    if (!readAhead && m_prefetching)
+        joinReadAhead(false);
+    m_readAhead = readAhead;
+}
+
+void
+BufferedStream::writeBehind(size_t maxInFlight)
+{
+    if (maxInFlight == 0)
+        joinWriteBehind();
+    m_writeBehind = maxInFlight;
 }
 
 void
 BufferedStream::close(CloseType type)
 {
     MORDOR_LOG_VERBOSE(g_log) << this << " close(" << type << ")";
-    if (type & READ)
+    if (type & READ) {
+        if (m_prefetching)
+            joinReadAhead(false);
         m_readBuffer.clear();
+    }
     try {
-        if ((type & WRITE) && m_writeBuffer.readAvailable())
+        if ((type & WRITE) &&
+            (m_writeBuffer.readAvailable() || m_writingBehind))
             flush(false);
     } catch (...) {
         if (ownsParent())
@@ -79,8 +203,10 @@ BufferedStream::readInternal(T &buffer, size_t length)
     MORDOR_LOG_VERBOSE(g_log) << this << " read(" << length << "): "
         << buffered << " read from buffer";
 
-    if (remaining == 0)
+    if (remaining == 0) {
+        startReadAhead();
         return length;
+    }
 
     if (buffered == 0 || !m_allowPartialReads) {
         size_t result;
@@ -89,11 +215,7 @@ BufferedStream::readInternal(T &buffer, size_t length)
             // the buffer size
             size_t todo = ((remaining - 1) / m_bufferSize + 1) * m_bufferSize;
             try {
-                MORDOR_LOG_TRACE(g_log) << this << " parent()->read(" << todo
-                    << ")";
-                result = parent()->read(m_readBuffer, todo);
-                MORDOR_LOG_DEBUG(g_log) << this << " parent()->read(" << todo
-                    << "): " << result;
+                result = readParent(todo);
             } catch (...) {
                 if (remaining == length) {
                     MORDOR_LOG_VERBOSE(g_log) << this << " forwarding exception";
@@ -113,9 +235,67 @@ BufferedStream::readInternal(T &buffer, size_t length)
         } while (remaining > 0 && !m_allowPartialReads && result != 0);
     }
 
+    startReadAhead();
     return length - remaining;
 }
 
+size_t
+BufferedStream::readParent(size_t length)
+{
+    size_t result;
+    if (m_prefetching) {
+        result = joinReadAhead(true);
+        MORDOR_LOG_DEBUG(g_log) << this << " read ahead: " << result;
+    } else {
+        MORDOR_LOG_TRACE(g_log) << this << " parent()->read(" << length
+            << ")";
+        result = parent()->read(m_readBuffer, length);
+        MORDOR_LOG_DEBUG(g_log) << this << " parent()->read(" << length
+            << "): " << result;
+    }
+    m_readAheadEof = result == 0;
+    return result;
+}
+
+void
+BufferedStream::startReadAhead()
+{
+    Scheduler *scheduler = Scheduler::getThis();
+    if (!m_readAhead || m_prefetching || m_readAheadEof || !scheduler)
+        return;
+    if (!m_background)
+        m_background.reset(new Background(parent()));
+    // Nothing else looks at the prefetch until it's been scheduled
+    m_background->prefetched = false;
+    m_prefetching = true;
+    MORDOR_LOG_TRACE(g_log) << this << " read ahead(" << m_bufferSize << ")";
+    scheduler->schedule(boost::bind(&Background::readAhead, m_background,
+        m_bufferSize));
+}
+
+size_t
+BufferedStream::joinReadAhead(bool rethrow)
+{
+    MORDOR_ASSERT(m_prefetching);
+    Background &background = *m_background;
+    FiberMutex::ScopedLock lock(background.mutex);
+    while (!background.prefetched)
+        background.condition.wait();
+    m_prefetching = false;
+    m_readBuffer.copyIn(background.prefetchBuffer);
+    background.prefetchBuffer.clear();
+    boost::exception_ptr exception = background.prefetchException;
+    background.prefetchException = boost::exception_ptr();
+    lock.unlock();
+    if (exception) {
+        if (rethrow)
+            Mordor::rethrow_exception(exception);
+        // Whoever reads from here again will hit it for themselves
+        MORDOR_LOG_VERBOSE(g_log) << this << " discarding read ahead exception";
+    }
+    return background.prefetchResult;
+}
+
 size_t
 BufferedStream::write(const Buffer &buffer, size_t length)
 {
@@ -137,6 +317,16 @@ BufferedStream::write(const void *buffer, size_t length)
     return result;
 }
 
+#ifdef LINUX
+size_t
+BufferedStream::sendFile(int fd, size_t length)
+{
+    // Whatever was written before has to go out ahead of the file
+    flush(false);
+    return parent()->sendFile(fd, length);
+}
+#endif
+
 size_t
 BufferedStream::flushWrite(size_t length)
 {
@@ -144,10 +334,17 @@ BufferedStream::flushWrite(size_t length)
     {
         size_t result;
         try {
+            if (supportsSeek() && m_prefetching)
+                joinReadAhead(false);
             if (supportsSeek() && m_readBuffer.readAvailable()) {
                 parent()->seek(-(long long)m_readBuffer.readAvailable(), CURRENT);
                 m_readBuffer.clear();
             }
+            if (m_writeBehind && Scheduler::getThis()) {
+                // One block at a time, so maxInFlight bounds the memory
+                queueWrite(m_bufferSize);
+                continue;
+            }
             size_t toWrite = m_writeBuffer.readAvailable();
             if (m_flushMultiplesOfBuffer)
                 toWrite = toWrite / m_bufferSize * m_bufferSize;
@@ -182,9 +379,62 @@ BufferedStream::flushWrite(size_t length)
     return length;
 }
 
+void
+BufferedStream::queueWrite(size_t length)
+{
+    if (!m_background)
+        m_background.reset(new Background(parent()));
+    Background &background = *m_background;
+    FiberMutex::ScopedLock lock(background.mutex);
+    while (background.writeQueue.size() >= m_writeBehind &&
+        !background.writeException)
+        background.condition.wait();
+    if (background.writeException) {
+        boost::exception_ptr exception = background.writeException;
+        background.writeException = boost::exception_ptr();
+        lock.unlock();
+        MORDOR_LOG_VERBOSE(g_log) << this << " write behind failed";
+        Mordor::rethrow_exception(exception);
+    }
+    MORDOR_LOG_TRACE(g_log) << this << " write behind(" << length << ")";
+    background.writeQueue.push_back(Buffer());
+    background.writeQueue.back().copyIn(m_writeBuffer, length);
+    m_writeBuffer.consume(length);
+    m_writingBehind = true;
+    if (!background.writing) {
+        background.writing = true;
+        Scheduler::getThis()->schedule(boost::bind(&Background::writeBehind,
+            m_background));
+    }
+}
+
+void
+BufferedStream::joinWriteBehind(bool rethrow)
+{
+    if (!m_writingBehind)
+        return;
+    Background &background = *m_background;
+    FiberMutex::ScopedLock lock(background.mutex);
+    while (background.writing)
+        background.condition.wait();
+    m_writingBehind = false;
+    boost::exception_ptr exception = background.writeException;
+    background.writeException = boost::exception_ptr();
+    lock.unlock();
+    if (exception) {
+        if (rethrow)
+            Mordor::rethrow_exception(exception);
+        MORDOR_LOG_ERROR(g_log) << this << " discarding write behind exception";
+    }
+}
+
 long long
 BufferedStream::seek(long long offset, Anchor anchor)
 {
+    joinWriteBehind();
+    if (m_prefetching)
+        joinReadAhead(false);
+    m_readAheadEof = false;
     MORDOR_ASSERT(parent()->supportsTell());
     long long parentPos = parent()->tell();
     long long bufferedPos = parentPos - m_readBuffer.readAvailable()
@@ -235,6 +485,7 @@ BufferedStream::seek(long long offset, Anchor anchor)
 long long
 BufferedStream::size()
 {
+    joinWriteBehind();
     long long size = parent()->size();
     if (parent()->supportsTell()) {
         return (std::max)(size, tell());
@@ -248,6 +499,10 @@ BufferedStream::size()
 void
 BufferedStream::truncate(long long size)
 {
+    joinWriteBehind();
+    if (m_prefetching)
+        joinReadAhead(false);
+    m_readAheadEof = false;
     if (!parent()->supportsTell() ||
         parent()->tell() + (long long)m_writeBuffer.readAvailable() >= size)
         flush(false);
@@ -259,7 +514,11 @@ BufferedStream::truncate(long long size)
 void
 BufferedStream::flush(bool flushParent)
 {
+    // What's been queued goes out ahead of the rest
+    joinWriteBehind();
     while (m_writeBuffer.readAvailable()) {
+        if (supportsSeek() && m_prefetching)
+            joinReadAhead(false);
         if (supportsSeek() && m_readBuffer.readAvailable()) {
             parent()->seek(-(long long)m_readBuffer.readAvailable(), CURRENT);
             m_readBuffer.clear();
@@ -299,11 +558,7 @@ BufferedStream::find(char delim, size_t sanitySize, bool throwIfNotFound)
             return -(ptrdiff_t)m_readBuffer.readAvailable() - 1;
         }
 
-        MORDOR_LOG_TRACE(g_log) << this << " parent()->read(" << m_bufferSize
-            << ")";
-        size_t result = parent()->read(m_readBuffer, m_bufferSize);
-        MORDOR_LOG_DEBUG(g_log) << this << " parent()->read(" << m_bufferSize
-            << "): " << result;
+        size_t result = readParent(m_bufferSize);
         if (result == 0) {
             // EOF
             if (throwIfNotFound)
@@ -336,11 +591,7 @@ BufferedStream::find(const std::string &str, size_t sanitySize, bool throwIfNotF
             return -(ptrdiff_t)m_readBuffer.readAvailable() - 1;
         }
 
-        MORDOR_LOG_TRACE(g_log) << this << " parent()->read(" << m_bufferSize
-            << ")";
-        size_t result = parent()->read(m_readBuffer, m_bufferSize);
-        MORDOR_LOG_DEBUG(g_log) << this << " parent()->read(" << m_bufferSize
-            << "): " << result;
+        size_t result = readParent(m_bufferSize);
         if (result == 0) {
             // EOF
             if (throwIfNotFound)
@@ -24,6 +24,7 @@ public:
     typedef boost::shared_ptr<BufferedStream> ptr;
 
     BufferedStream(Stream::ptr parent, bool own = true);
+    ~BufferedStream();
 
     size_t bufferSize() { return m_bufferSize; }
     void bufferSize(size_t bufferSize) { m_bufferSize = bufferSize; }
@@ -34,6 +35,34 @@ public:
     bool flushMultiplesOfBuffer() { return m_flushMultiplesOfBuffer; }
     void flushMultiplesOfBuffer(bool flushMultiplesOfBuffer ) { m_flushMultiplesOfBuffer = flushMultiplesOfBuffer; }
 
+    /// @brief Prefetch the next block from the parent on a background Fiber
+    /// @details
+    /// After each read(), a read of bufferSize() from the parent is started
+    /// on the current Scheduler, so that it overlaps with the caller
+    /// processing what it has already.  At most one block is outstanding,
+    /// and it's collected by the next read() or find() that runs out of
+    /// buffered data; that is also where an error prefetching is reported.
+    /// The prefetch is waited for before seeking (including tell()),
+    /// writing to a seekable parent, closing for read, or destroying the
+    /// stream, so this shouldn't be enabled on a parent whose reads can
+    /// block indefinitely, such as a socket in a request/response protocol.
+    /// Without a Scheduler, reads stay synchronous.
+    bool readAhead() { return m_readAhead; }
+    void readAhead(bool readAhead);
+
+    /// @brief Write full blocks to the parent on a background Fiber
+    /// @details
+    /// Instead of writing to the parent inline, each time bufferSize() is
+    /// buffered the block is queued for a background Fiber, which writes
+    /// the queue to the parent in order.  At most maxInFlight blocks are
+    /// queued; write() waits for room beyond that.  flush(), seek(),
+    /// truncate() and close() wait for the queue to drain.  Because write()
+    /// has already reported success, an error writing behind is thrown
+    /// from the next write(), flush() or close() instead.  0 (the default)
+    /// writes synchronously, as does a stream used without a Scheduler.
+    size_t writeBehind() { return m_writeBehind; }
+    void writeBehind(size_t maxInFlight);
+
     bool supportsFind() { return supportsRead(); }
     bool supportsUnread() { return supportsRead() && (!supportsWrite() || !supportsSeek()); }
 
@@ -42,6 +71,9 @@ public:
     size_t read(void *buffer, size_t length);
     size_t write(const Buffer &buffer, size_t length);
     size_t write(const void *buffer, size_t length);
+#ifdef LINUX
+    size_t sendFile(int fd, size_t length);
+#endif
     long long seek(long long offset, Anchor anchor = BEGIN);
     long long size();
     void truncate(long long size);
@@ -53,11 +85,31 @@ public:
 private:
     template <class T> size_t readInternal(T &buffer, size_t length);
     size_t flushWrite(size_t length);
+    /// Read from the parent (or collect the prefetch) into m_readBuffer
+    size_t readParent(size_t length);
+
+    void startReadAhead();
+    /// Wait for the outstanding prefetch, and append it to m_readBuffer
+    /// @return The prefetch's result
+    size_t joinReadAhead(bool rethrow);
+
+    void queueWrite(size_t length);
+    /// Wait for everything queued to be written to the parent
+    void joinWriteBehind(bool rethrow = true);
 
 private:
+    struct Background;
+
     size_t m_bufferSize;
     bool m_allowPartialReads, m_flushMultiplesOfBuffer;
     Buffer m_readBuffer, m_writeBuffer;
+    bool m_readAhead, m_readAheadEof;
+    size_t m_writeBehind;
+    // A prefetch has been started and not yet joined; blocks have been
+    // queued since the write-behind queue was last joined
+    bool m_prefetching, m_writingBehind;
+    // Shared with the Fibers reading ahead and writing behind
+    boost::shared_ptr<Background> m_background;
 };
 
 }
@@ -8,21 +8,98 @@
 #include <sys/stat.h>
 #include <sys/uio.h>
 
+#include <boost/bind.hpp>
+
 #include "buffer.h"
 #include "mordor/assert.h"
+#include "mordor/config.h"
 #include "mordor/iomanager.h"
 
+#ifdef MORDOR_IOURING
+#include <linux/io_uring.h>
+#endif
+
 namespace Mordor {
 
 static Logger::ptr g_log = Log::lookup("mordor:streams:fd");
 
+#ifdef LINUX
+static ConfigVar<bool>::ptr g_asyncFiles = Config::lookup(
+    "fdstream.asyncfiles", false,
+    "Hand reads, writes and fsyncs of regular files on an FDStream with an "
+    "IOManager to the IOManager's disk threads, so they don't block the "
+    "calling thread; every call pays a thread hop, even when the page cache "
+    "could have served it");
+
+// Disk threads block the calling Fiber, so there has to be one
+static bool useDiskThreads(IOManager *ioManager, bool regular)
+{
+    return ioManager && regular && g_asyncFiles->val() &&
+        Scheduler::getThis();
+}
+
+static void callBlocking(const boost::function<ssize_t ()> &syscall,
+    ssize_t &rc, int &error)
+{
+    rc = syscall();
+    error = errno;
+}
+
+// Runs syscall on one of ioManager's disk threads; fails like the syscall
+// would (-1 and errno)
+static int runBlocking(IOManager &ioManager, int fd,
+    const boost::function<ssize_t ()> &syscall)
+{
+    ssize_t rc;
+    int error;
+    ioManager.runBlocking(fd, boost::bind(&callBlocking, boost::cref(syscall),
+        boost::ref(rc), boost::ref(error)));
+    errno = error;
+    return (int)rc;
+}
+#endif
+
+#ifdef MORDOR_IOURING
+// Only regular files go through the ring; anything else waits for readiness
+// as it always has.  Without a Scheduler there's no Fiber to park while the
+// ring completes the request, so the syscall is made directly.
+static bool useRing(IOManager *ioManager, bool regular)
+{
+    return ioManager && regular && ioManager->ioUring() &&
+        Scheduler::getThis();
+}
+
+// readv/writev at the current file position, through the io_uring; fails
+// like the syscall would (-1 and errno)
+static int submitRw(IOManager &ioManager, int fd, IOManager::Event event,
+    const iovec *iovs, size_t count, const bool &cancelled)
+{
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(io_uring_sqe));
+    sqe.opcode = event == IOManager::READ ? IORING_OP_READV : IORING_OP_WRITEV;
+    sqe.fd = fd;
+    sqe.addr = (uintptr_t)iovs;
+    sqe.len = (__u32)count;
+    sqe.off = (__u64)-1;
+    int rc = ioManager.submitEvent(fd, event, sqe);
+    if ((rc == -ECANCELED || rc == -EINTR) && cancelled)
+        MORDOR_THROW_EXCEPTION(OperationAbortedException());
+    if (rc < 0) {
+        errno = -rc;
+        return -1;
+    }
+    return rc;
+}
+#endif
+
 FDStream::FDStream()
 : m_ioManager(NULL),
   m_scheduler(NULL),
   m_fd(-1),
   m_own(false),
   m_cancelledRead(false),
-  m_cancelledWrite(false)
+  m_cancelledWrite(false),
+  m_regular(false)
 {}
 
 void
@@ -34,7 +111,10 @@ FDStream::init(int fd, IOManager *ioManager, Scheduler *scheduler, bool own)
     m_fd = fd;
     m_own = own;
     m_cancelledRead = m_cancelledWrite = false;
+    m_regular = false;
     if (m_ioManager) {
+        struct stat statbuf;
+        m_regular = fstat(m_fd, &statbuf) == 0 && S_ISREG(statbuf.st_mode);
         if (fcntl(m_fd, F_SETFL, O_NONBLOCK)) {
             error_t error = lastError();
             if (own) {
@@ -43,12 +123,21 @@ FDStream::init(int fd, IOManager *ioManager, Scheduler *scheduler, bool own)
             }
             MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "fcntl");
         }
+#ifdef LINUX
+        // Only if we own it, since we need to know before it gets closed
+        if (own)
+            m_ioManager->registerFile(m_fd);
+#endif
     }
 }
 
 FDStream::~FDStream()
 {
     if (m_own && m_fd >= 0) {
+#ifdef LINUX
+        if (m_ioManager)
+            m_ioManager->unregisterFile(m_fd);
+#endif
         SchedulerSwitcher switcher(m_scheduler);
         int rc = ::close(m_fd);
         MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
@@ -61,6 +150,10 @@ FDStream::close(CloseType type)
 {
     MORDOR_ASSERT(type == BOTH);
     if (m_fd > 0 && m_own) {
+#ifdef LINUX
+        if (m_ioManager)
+            m_ioManager->unregisterFile(m_fd);
+#endif
         SchedulerSwitcher switcher(m_scheduler);
         int rc = ::close(m_fd);
         error_t error = lastError();
@@ -81,8 +174,22 @@ FDStream::read(Buffer &buffer, size_t length)
     MORDOR_ASSERT(m_fd >= 0);
     if (length > 0xfffffffe)
         length = 0xfffffffe;
-    std::vector<iovec> iovs = buffer.writeBuffers(length);
-    int rc = readv(m_fd, &iovs[0], iovs.size());
+    iovec iovs[MORDOR_IOV_MAX];
+    size_t count = buffer.writeBuffers(iovs, MORDOR_IOV_MAX, length);
+    int rc;
+#ifdef MORDOR_IOURING
+    if (useRing(m_ioManager, m_regular)) {
+        rc = submitRw(*m_ioManager, m_fd, IOManager::READ, iovs, count,
+            m_cancelledRead);
+    } else
+#endif
+#ifdef LINUX
+    if (useDiskThreads(m_ioManager, m_regular))
+        rc = runBlocking(*m_ioManager, m_fd, boost::bind(&readv, m_fd,
+            iovs, (int)count));
+    else
+#endif
+    rc = readv(m_fd, iovs, count);
     while (rc < 0 && errno == EAGAIN && m_ioManager) {
         MORDOR_LOG_TRACE(g_log) << this << " readv(" << m_fd << ", " << length
             << "): " << rc << " (EAGAIN)";
@@ -90,7 +197,7 @@ FDStream::read(Buffer &buffer, size_t length)
         Scheduler::yieldTo();
         if (m_cancelledRead)
             MORDOR_THROW_EXCEPTION(OperationAbortedException());
-        rc = readv(m_fd, &iovs[0], iovs.size());
+        rc = readv(m_fd, iovs, count);
     }
     error_t error = lastError();
     MORDOR_LOG_LEVEL(g_log, rc < 0 ? Log::ERROR : Log::DEBUG) << this
@@ -111,7 +218,21 @@ FDStream::read(void *buffer, size_t length)
     MORDOR_ASSERT(m_fd >= 0);
     if (length > 0xfffffffe)
         length = 0xfffffffe;
-    int rc = ::read(m_fd, buffer, length);
+    int rc;
+#ifdef MORDOR_IOURING
+    if (useRing(m_ioManager, m_regular)) {
+        iovec iov = { buffer, length };
+        rc = submitRw(*m_ioManager, m_fd, IOManager::READ, &iov, 1,
+            m_cancelledRead);
+    } else
+#endif
+#ifdef LINUX
+    if (useDiskThreads(m_ioManager, m_regular))
+        rc = runBlocking(*m_ioManager, m_fd, boost::bind(&::read, m_fd,
+            buffer, length));
+    else
+#endif
+    rc = ::read(m_fd, buffer, length);
     while (rc < 0 && errno == EAGAIN && m_ioManager) {
         MORDOR_LOG_TRACE(g_log) << this << " read(" << m_fd << ", " << length
             << "): " << rc << " (EAGAIN)";
@@ -135,7 +256,7 @@ FDStream::cancelRead()
 {
     m_cancelledRead = true;
     if (m_ioManager)
-        m_ioManager->cancelEvent(m_fd, IOManager::WRITE);
+        m_ioManager->cancelEvent(m_fd, IOManager::READ);
 }
 
 size_t
@@ -147,8 +268,22 @@ FDStream::write(const Buffer &buffer, size_t length)
     MORDOR_ASSERT(m_fd >= 0);
     if (length > 0xfffffffe)
         length = 0xfffffffe;
-    const std::vector<iovec> iovs = buffer.readBuffers(length);
-    int rc = writev(m_fd, &iovs[0], iovs.size());
+    iovec iovs[MORDOR_IOV_MAX];
+    size_t count = buffer.readBuffers(iovs, MORDOR_IOV_MAX, length);
+    int rc;
+#ifdef MORDOR_IOURING
+    if (useRing(m_ioManager, m_regular)) {
+        rc = submitRw(*m_ioManager, m_fd, IOManager::WRITE, iovs, count,
+            m_cancelledWrite);
+    } else
+#endif
+#ifdef LINUX
+    if (useDiskThreads(m_ioManager, m_regular))
+        rc = runBlocking(*m_ioManager, m_fd, boost::bind(&writev, m_fd,
+            iovs, (int)count));
+    else
+#endif
+    rc = writev(m_fd, iovs, count);
     while (rc < 0 && errno == EAGAIN && m_ioManager) {
         MORDOR_LOG_TRACE(g_log) << this << " writev(" << m_fd << ", " << length
             << "): " << rc << " (EAGAIN)";
@@ -156,7 +291,7 @@ FDStream::write(const Buffer &buffer, size_t length)
         Scheduler::yieldTo();
         if (m_cancelledWrite)
             MORDOR_THROW_EXCEPTION(OperationAbortedException());
-        rc = writev(m_fd, &iovs[0], iovs.size());
+        rc = writev(m_fd, iovs, count);
     }
     error_t error = lastError();
     MORDOR_LOG_LEVEL(g_log, rc < 0 ? Log::ERROR : Log::DEBUG) << this
@@ -178,7 +313,21 @@ FDStream::write(const void *buffer, size_t length)
     MORDOR_ASSERT(m_fd >= 0);
     if (length > 0xfffffffe)
         length = 0xfffffffe;
-    int rc = ::write(m_fd, buffer, length);
+    int rc;
+#ifdef MORDOR_IOURING
+    if (useRing(m_ioManager, m_regular)) {
+        iovec iov = { (void *)buffer, length };
+        rc = submitRw(*m_ioManager, m_fd, IOManager::WRITE, &iov, 1,
+            m_cancelledWrite);
+    } else
+#endif
+#ifdef LINUX
+    if (useDiskThreads(m_ioManager, m_regular))
+        rc = runBlocking(*m_ioManager, m_fd, boost::bind(&::write,
+            m_fd, buffer, length));
+    else
+#endif
+    rc = ::write(m_fd, buffer, length);
     while (rc < 0 && errno == EAGAIN && m_ioManager) {
         MORDOR_LOG_TRACE(g_log) << this << " write(" << m_fd << ", " << length
             << "): " << rc << " (EAGAIN)";
@@ -254,9 +403,17 @@ FDStream::truncate(long long size)
 void
 FDStream::flush(bool flushParent)
 {
-    SchedulerSwitcher switcher(m_scheduler);
     MORDOR_ASSERT(m_fd >= 0);
-    int rc = fsync(m_fd);
+    int rc;
+#ifdef LINUX
+    if (useDiskThreads(m_ioManager, m_regular)) {
+        rc = runBlocking(*m_ioManager, m_fd, boost::bind(&fsync, m_fd));
+    } else
+#endif
+    {
+        SchedulerSwitcher switcher(m_scheduler);
+        rc = fsync(m_fd);
+    }
     error_t error = lastError();
     MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
         << " fsync(" << m_fd << "): " << rc << " (" << error << ")";
@@ -43,12 +43,17 @@ public:
     void flush(bool flushParent = true);
 
     int fd() { return m_fd; }
+    IOManager *ioManager() { return m_ioManager; }
 
 private:
     IOManager *m_ioManager;
     Scheduler *m_scheduler;
     int m_fd;
     bool m_own, m_cancelledRead, m_cancelledWrite;
+    // A regular file, which is never ready or not; with an IOManager, its
+    // I/O can go to the io_uring or (with fdstream.asyncfiles) the
+    // IOManager's disk threads instead
+    bool m_regular;
 };
 
 typedef FDStream NativeStream;
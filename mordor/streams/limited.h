@@ -29,6 +29,9 @@ public:
     size_t read(Buffer &b, size_t len);
     using MutatingFilterStream::write;
     size_t write(const Buffer &b, size_t len);
+#ifdef LINUX
+    size_t sendFile(int fd, size_t length);
+#endif
     long long seek(long long offset, Anchor anchor = BEGIN);
     long long size();
     void truncate(long long size);
@@ -0,0 +1,243 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "mmap.h"
+
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "buffer.h"
+#include "mordor/assert.h"
+#include "mordor/atomic.h"
+#include "mordor/config.h"
+#include "mordor/log.h"
+
+namespace Mordor {
+
+static Logger::ptr g_log = Log::lookup("mordor:streams:mmap");
+
+static ConfigVar<size_t>::ptr g_readAhead = Config::lookup<size_t>(
+    "mmapstream.readahead", 1024 * 1024u,
+    "Bytes ahead of a sequential MMapStream's position to ask the kernel to "
+    "page in");
+
+// Owns the mapping; the MMapStream and every Buffer segment pointing into
+// the mapping hold a reference on block, and the last one unmaps it
+struct MMapStream::Mapping : BufferAllocator
+{
+    Mapping(void *address, size_t length)
+        : address(address),
+          length(length)
+    {
+        block.refs = 1;
+        block.allocator = this;
+        block.capacity = 0;
+    }
+
+    Block *allocate(size_t length)
+    {
+        MORDOR_NOTREACHED();
+    }
+
+    void deallocate(Block *block)
+    {
+        MORDOR_ASSERT(block == &this->block);
+        int rc = munmap(address, length);
+        MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
+            << " munmap(" << address << ", " << length << "): " << rc
+            << " (" << lastError() << ")";
+        delete this;
+    }
+
+    Block block;
+    void *address;
+    size_t length;
+};
+
+MMapStream::MMapStream(const std::string &path, Advice advice)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    error_t error = lastError();
+    MORDOR_LOG_VERBOSE(g_log) << "open(" << path << ", O_RDONLY): " << fd
+        << " (" << error << ")";
+    if (fd < 0) {
+        try {
+            MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "open");
+        } catch (boost::exception &ex) {
+            ex << boost::errinfo_file_name(path);
+            throw;
+        }
+    }
+    try {
+        init(fd, advice);
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+}
+
+MMapStream::MMapStream(int fd, Advice advice)
+{
+    init(fd, advice);
+}
+
+void
+MMapStream::init(int fd, Advice advice)
+{
+    m_mapping = NULL;
+    m_data = NULL;
+    m_size = m_offset = m_willNeed = 0;
+    m_advice = advice;
+    struct stat statbuf;
+    if (fstat(fd, &statbuf))
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("fstat");
+    if ((unsigned long long)statbuf.st_size > (size_t)~0)
+        MORDOR_THROW_EXCEPTION(std::invalid_argument(
+            "File is too large to map into the virtual address space."));
+    m_size = (size_t)statbuf.st_size;
+    // mmap refuses an empty mapping
+    if (m_size == 0)
+        return;
+    void *address = mmap(NULL, m_size, PROT_READ, MAP_SHARED, fd, 0);
+    error_t error = lastError();
+    MORDOR_LOG_LEVEL(g_log, address == MAP_FAILED ? Log::ERROR : Log::VERBOSE)
+        << this << " mmap(" << fd << ", " << m_size << "): " << address
+        << " (" << error << ")";
+    if (address == MAP_FAILED)
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "mmap");
+    m_mapping = new Mapping(address, m_size);
+    m_data = (const unsigned char *)address;
+    // Only a hint; failing is harmless
+    if (advice != NORMAL)
+        madvise(address, m_size, advice);
+}
+
+MMapStream::~MMapStream()
+{
+    if (m_mapping && atomicDecrement(m_mapping->block.refs) == 0)
+        m_mapping->deallocate(&m_mapping->block);
+}
+
+void
+MMapStream::reference(Buffer &buffer, size_t length)
+{
+    buffer.reference(m_data + m_offset, length, m_mapping->block);
+}
+
+size_t
+MMapStream::read(Buffer &buffer, size_t length)
+{
+    if (m_offset >= m_size)
+        return 0;
+    length = (std::min)(length, m_size - m_offset);
+    if (m_advice == SEQUENTIAL) {
+        // Keep at least half a read-ahead window requested beyond what's
+        // being read, so the kernel works ahead of us a window at a time
+        size_t readAhead = g_readAhead->val();
+        if (m_offset + length + readAhead / 2 > m_willNeed)
+            willNeed(length + readAhead);
+    }
+    reference(buffer, length);
+    m_offset += length;
+    return length;
+}
+
+size_t
+MMapStream::read(void *buffer, size_t length)
+{
+    if (m_offset >= m_size)
+        return 0;
+    length = (std::min)(length, m_size - m_offset);
+    memcpy(buffer, m_data + m_offset, length);
+    m_offset += length;
+    return length;
+}
+
+long long
+MMapStream::seek(long long offset, Anchor anchor)
+{
+    switch (anchor) {
+        case BEGIN:
+            break;
+        case CURRENT:
+            offset += (long long)m_offset;
+            break;
+        case END:
+            offset += (long long)m_size;
+            break;
+        default:
+            MORDOR_NOTREACHED();
+    }
+    if (offset < 0)
+        MORDOR_THROW_EXCEPTION(std::invalid_argument(
+            "resulting offset is negative"));
+    if ((unsigned long long)offset > (size_t)~0)
+        MORDOR_THROW_EXCEPTION(std::invalid_argument(
+            "MMap stream position cannot exceed virtual address space."));
+    if ((size_t)offset != m_offset) {
+        // Sequential read-ahead starts over from the new position
+        m_offset = (size_t)offset;
+        m_willNeed = 0;
+    }
+    return offset;
+}
+
+ptrdiff_t
+MMapStream::find(char delimiter, size_t sanitySize, bool throwIfNotFound)
+{
+    size_t available = m_offset < m_size ? m_size - m_offset : 0;
+    size_t length = (std::min)(sanitySize, available);
+    const void *found = length == 0 ? NULL :
+        memchr(m_data + m_offset, delimiter, length);
+    if (found)
+        return (const unsigned char *)found - (m_data + m_offset);
+    if (throwIfNotFound) {
+        if (sanitySize < available)
+            MORDOR_THROW_EXCEPTION(BufferOverflowException());
+        MORDOR_THROW_EXCEPTION(UnexpectedEofException());
+    }
+    return -(ptrdiff_t)available - 1;
+}
+
+ptrdiff_t
+MMapStream::find(const std::string &delimiter, size_t sanitySize,
+    bool throwIfNotFound)
+{
+    size_t available = m_offset < m_size ? m_size - m_offset : 0;
+    Buffer remaining;
+    if (available > 0)
+        reference(remaining, available);
+    ptrdiff_t result = remaining.find(delimiter,
+        (std::min)(sanitySize, available));
+    if (result != -1)
+        return result;
+    if (throwIfNotFound) {
+        if (sanitySize < available)
+            MORDOR_THROW_EXCEPTION(BufferOverflowException());
+        MORDOR_THROW_EXCEPTION(UnexpectedEofException());
+    }
+    return -(ptrdiff_t)available - 1;
+}
+
+void
+MMapStream::willNeed(size_t length)
+{
+    if (m_offset >= m_size)
+        return;
+    size_t end = m_offset + (std::min)(length, m_size - m_offset);
+    size_t start = (std::max)(m_offset, m_willNeed);
+    if (start >= end)
+        return;
+    // madvise wants a page-aligned start; the mapping itself is one
+    static const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    start &= ~(pageSize - 1);
+    int rc = madvise((void *)(m_data + start), end - start, MADV_WILLNEED);
+    MORDOR_LOG_LEVEL(g_log, rc ? Log::WARNING : Log::DEBUG) << this
+        << " madvise(" << start << ", " << end - start
+        << ", MADV_WILLNEED): " << rc << " (" << lastError() << ")";
+    m_willNeed = end;
+}
+
+}
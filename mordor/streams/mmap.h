@@ -0,0 +1,78 @@
+#ifndef __MORDOR_MMAP_STREAM_H__
+#define __MORDOR_MMAP_STREAM_H__
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include <sys/mman.h>
+
+#include "stream.h"
+
+namespace Mordor {
+
+/// Read-only Stream over a memory-mapped file
+
+/// read(Buffer &, size_t) hands out segments that point straight into the
+/// mapping instead of copying; the mapping lives until the MMapStream and
+/// every Buffer referring to it are gone.  The file should not be truncated
+/// while it is mapped (touching pages past its end raises SIGBUS).
+/// @note Reads fault pages in synchronously, so they can block on the disk
+class MMapStream : public Stream
+{
+public:
+    typedef boost::shared_ptr<MMapStream> ptr;
+
+    /// How the Stream is expected to be read, passed on to madvise
+    enum Advice {
+        NORMAL = MADV_NORMAL,
+        /// Front to back; pages well ahead of the current position are also
+        /// requested with MADV_WILLNEED as reading progresses
+        SEQUENTIAL = MADV_SEQUENTIAL,
+        RANDOM = MADV_RANDOM
+    };
+
+public:
+    MMapStream(const std::string &path, Advice advice = SEQUENTIAL);
+    /// Maps the whole of fd, which remains the caller's (closing it doesn't
+    /// affect the mapping)
+    MMapStream(int fd, Advice advice = SEQUENTIAL);
+    ~MMapStream();
+
+    bool supportsRead() { return true; }
+    bool supportsSeek() { return true; }
+    bool supportsSize() { return true; }
+    bool supportsFind() { return true; }
+
+    size_t read(Buffer &buffer, size_t length);
+    size_t read(void *buffer, size_t length);
+    long long seek(long long offset, Anchor anchor = BEGIN);
+    long long size() { return (long long)m_size; }
+    ptrdiff_t find(char delimiter, size_t sanitySize = ~0,
+        bool throwIfNotFound = true);
+    ptrdiff_t find(const std::string &delimiter, size_t sanitySize = ~0,
+        bool throwIfNotFound = true);
+
+    /// Ask the kernel to start paging in the next length bytes from the
+    /// current position (MADV_WILLNEED)
+    void willNeed(size_t length);
+
+    /// Direct access to the mapping; NULL for an empty file
+    const void *data() const { return m_data; }
+
+private:
+    void init(int fd, Advice advice);
+    /// A Buffer referring to length bytes from the current position
+    void reference(Buffer &buffer, size_t length);
+
+private:
+    struct Mapping;
+
+    Mapping *m_mapping;
+    const unsigned char *m_data;
+    size_t m_size, m_offset;
+    Advice m_advice;
+    // Where the last MADV_WILLNEED for sequential reading ended
+    size_t m_willNeed;
+};
+
+}
+
+#endif
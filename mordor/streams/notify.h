@@ -64,6 +64,19 @@ public:
         }
     }
 
+#ifdef LINUX
+    size_t sendFile(int fd, size_t length)
+    {
+        try {
+            return parent()->sendFile(fd, length);
+        } catch(...) {
+            if (notifyOnException)
+                notifyOnException();
+            throw;
+        }
+    }
+#endif
+
     void flush(bool flushParent = true)
     {
         try {
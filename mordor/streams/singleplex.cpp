@@ -57,6 +57,15 @@ SingleplexStream::write(const void *buffer, size_t length)
     return parent()->write(buffer, length);
 }
 
+#ifdef LINUX
+size_t
+SingleplexStream::sendFile(int fd, size_t length)
+{
+    MORDOR_ASSERT(m_type == WRITE);
+    return parent()->sendFile(fd, length);
+}
+#endif
+
 void
 SingleplexStream::truncate(long long size)
 {
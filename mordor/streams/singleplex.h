@@ -31,6 +31,9 @@ public:
     size_t read(void *buffer, size_t length);
     size_t write(const Buffer &buffer, size_t length);
     size_t write(const void *buffer, size_t length);
+#ifdef LINUX
+    size_t sendFile(int fd, size_t length);
+#endif
     void truncate(long long size);
     void flush(bool flushParent = true);
     ptrdiff_t find(char delimiter, size_t sanitySize = ~0,
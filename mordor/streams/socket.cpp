@@ -38,8 +38,12 @@ SocketStream::close(CloseType type)
 size_t
 SocketStream::read(Buffer &buffer, size_t length)
 {
-    std::vector<iovec> iovs = buffer.writeBuffers(length);
-    size_t result = m_socket->receive(&iovs[0], iovs.size());
+    // Any new segment comes from the slab allocator, since it will likely
+    // be freed as soon as the data is consumed
+    buffer.reserve(length, BufferAllocator::slab());
+    iovec iovs[MORDOR_IOV_MAX];
+    size_t count = buffer.writeBuffers(iovs, MORDOR_IOV_MAX, length);
+    size_t result = m_socket->receive(iovs, count);
     buffer.produce(result);
     return result;
 }
@@ -59,8 +63,9 @@ SocketStream::cancelRead()
 size_t
 SocketStream::write(const Buffer &buffer, size_t length)
 {
-    const std::vector<iovec> iovs = buffer.readBuffers(length);
-    size_t result = m_socket->send(&iovs[0], iovs.size());
+    iovec iovs[MORDOR_IOV_MAX];
+    size_t count = buffer.readBuffers(iovs, MORDOR_IOV_MAX, length);
+    size_t result = m_socket->send(iovs, count);
     MORDOR_ASSERT(result > 0);
     return result;
 }
@@ -77,6 +82,14 @@ SocketStream::cancelWrite()
     m_socket->cancelSend();
 }
 
+#ifdef LINUX
+size_t
+SocketStream::sendFile(int fd, size_t length)
+{
+    return m_socket->sendFile(fd, length);
+}
+#endif
+
 boost::signals2::connection
 SocketStream::onRemoteClose(
     const boost::signals2::slot<void ()> &slot)
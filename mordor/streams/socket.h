@@ -29,6 +29,9 @@ public:
     size_t write(const Buffer &buffer, size_t length);
     size_t write(const void *buffer, size_t length);
     void cancelWrite();
+#ifdef LINUX
+    size_t sendFile(int fd, size_t length);
+#endif
 
     boost::signals2::connection onRemoteClose(
         const boost::signals2::slot<void ()> &slot);
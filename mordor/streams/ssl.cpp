@@ -213,6 +213,8 @@ SSLStream::SSLStream(Stream::ptr parent, bool client, bool own, SSL_CTX *ctx)
     BIO_set_mem_eof_return(m_readBio, -1);
 
     SSL_set_bio(m_ssl.get(), m_readBio, m_writeBio);
+    m_readBuffer.allocator(BufferAllocator::slab());
+    m_writeBuffer.allocator(BufferAllocator::slab());
 }
 
 void
@@ -147,6 +147,19 @@ public:
     /// blocked. This is safe to call on any Stream, but may not have any
     /// effect.
     virtual void cancelWrite() {}
+#ifdef LINUX
+    /// @brief Write data from a file without copying it through user space
+    /// @details
+    /// Writes up to length bytes of the regular file fd, starting at (and
+    /// advancing) its current offset.  Only a Stream that would pass the
+    /// data through unchanged to a socket can do this, so the default
+    /// declines; filters that don't alter the data forward to their parent,
+    /// after flushing anything they have buffered.
+    /// @return The amount actually written (0 at the end of the file), or ~0
+    /// if this Stream can't, in which case nothing was written
+    /// @pre supportsWrite()
+    virtual size_t sendFile(int fd, size_t length) { return ~0; }
+#endif
 
     /// @brief Change the current stream pointer
     /// @param offset Where to seek to
@@ -8,16 +8,38 @@
 #include "mordor/config.h"
 #include "mordor/fiber.h"
 #include "mordor/parallel.h"
+#include "mordor/statistics.h"
 #include "mordor/streams/buffer.h"
 #include "mordor/streams/null.h"
 #include "stream.h"
 
+#ifdef LINUX
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mordor/iomanager.h"
+#include "mordor/socket.h"
+#include "mordor/streams/fd.h"
+#include "mordor/streams/socket.h"
+#endif
+
 namespace Mordor {
 
 static ConfigVar<size_t>::ptr g_chunkSize =
     Config::lookup("transferstream.chunksize",
                    (size_t)65536,
                    "transfer chunk size.");
+#ifdef LINUX
+static ConfigVar<bool>::ptr g_zeroCopy =
+    Config::lookup("transferstream.zerocopy", true,
+                   "Use sendfile/splice to transfer directly between files "
+                   "and sockets.");
+static SumStatistic<unsigned long long> &g_statZeroCopyBytes =
+    Statistics::registerStatistic("transferstream.zerocopybytes",
+    SumStatistic<unsigned long long>("bytes"),
+    "Bytes transferred by sendfile/splice instead of through a Buffer");
+#endif
 static Logger::ptr g_log = Log::lookup("mordor:stream:transfer");
 
 static void readOne(Stream &src, Buffer *&buffer, size_t len, size_t &result)
@@ -36,6 +58,152 @@ static void writeOne(Stream &dst, Buffer *&buffer)
     }
 }
 
+#ifdef LINUX
+// Files opened for append can't be spliced into
+static bool isSpliceableFile(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        return false;
+    int flags = fcntl(fd, F_GETFL);
+    return flags != -1 && !(flags & O_APPEND);
+}
+
+namespace {
+struct Pipe
+{
+    Pipe() { fds[0] = fds[1] = -1; }
+    ~Pipe()
+    {
+        if (fds[0] != -1) ::close(fds[0]);
+        if (fds[1] != -1) ::close(fds[1]);
+    }
+
+    int fds[2];
+};
+}
+
+static void spliceToFile(int pipe, int fd, size_t length)
+{
+    while (length > 0) {
+        ssize_t result = splice(pipe, NULL, fd, NULL, length, SPLICE_F_MOVE);
+        error_t error = lastError();
+        if (result == -1 && error == EINTR)
+            continue;
+        MORDOR_LOG_LEVEL(g_log, result == -1 ? Log::ERROR : Log::TRACE)
+            << "splice(" << pipe << ", " << fd << ", " << length << "): "
+            << result << " (" << error << ")";
+        if (result == -1)
+            MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "splice");
+        length -= result;
+    }
+}
+
+// spliceToFile, on one of an IOManager's disk threads
+static void spliceToFileBlocking(int pipe, int fd, size_t length,
+    boost::exception_ptr &exception)
+{
+    try {
+        spliceToFile(pipe, fd, length);
+    } catch (...) {
+        exception = boost::current_exception();
+    }
+}
+
+// Moves data between endpoints the kernel can connect directly, without it
+// ever being copied into a Buffer: a file to a socket with sendfile, or a
+// socket to a socket or file with splice through a pipe.  For sendfile, dst
+// may be layered on the socket, so long as every layer passes the data
+// through unchanged (Stream::sendFile); anything else (SSL, chunking,
+// compression) is left to the generic path
+// @return false if src and dst aren't such a pair
+static bool zeroCopyTransfer(Stream &src, Stream &dst,
+    unsigned long long toTransfer, unsigned long long &totalRead)
+{
+    if (!g_zeroCopy->val())
+        return false;
+    FDStream *srcFile = dynamic_cast<FDStream *>(&src);
+    SocketStream *srcSocket = dynamic_cast<SocketStream *>(&src);
+    FDStream *dstFile = dynamic_cast<FDStream *>(&dst);
+    SocketStream *dstSocket = dynamic_cast<SocketStream *>(&dst);
+    // Keep each call well inside ssize_t
+    const size_t maxChunk = 0x40000000;
+
+    if (srcFile && isSpliceableFile(srcFile->fd())) {
+        while (totalRead < toTransfer) {
+            size_t todo = (size_t)std::min<unsigned long long>(
+                toTransfer - totalRead, maxChunk);
+            size_t result = dst.sendFile(srcFile->fd(), todo);
+            if (result == (size_t)~0) {
+                // dst declines up front, or not at all
+                MORDOR_ASSERT(totalRead == 0);
+                return false;
+            }
+            if (totalRead == 0)
+                MORDOR_LOG_DEBUG(g_log) << "using sendfile from " << &src
+                    << " to " << &dst;
+            if (result == 0)
+                break;
+            totalRead += result;
+            g_statZeroCopyBytes.add(result);
+        }
+        return true;
+    }
+
+    if (srcSocket && (dstSocket ||
+        (dstFile && isSpliceableFile(dstFile->fd())))) {
+        Pipe pipe;
+        if (pipe2(pipe.fds, O_NONBLOCK | O_CLOEXEC) != 0) {
+            MORDOR_LOG_WARNING(g_log) << "pipe2(): (" << lastError()
+                << "); not splicing";
+            return false;
+        }
+        MORDOR_LOG_DEBUG(g_log) << "using splice from " << &src << " to "
+            << &dst;
+        Socket::ptr socket = srcSocket->socket();
+        // Never more than the pipe can hold, so it is always drained before
+        // the next splice into it
+        size_t chunkSize = g_chunkSize->val();
+#ifdef F_GETPIPE_SZ
+        int pipeSize = fcntl(pipe.fds[1], F_GETPIPE_SZ);
+#else
+        int pipeSize = -1;
+#endif
+        // The default capacity
+        if (pipeSize <= 0)
+            pipeSize = 65536;
+        chunkSize = std::min<size_t>(chunkSize, pipeSize);
+        while (totalRead < toTransfer) {
+            size_t todo = (size_t)std::min<unsigned long long>(
+                toTransfer - totalRead, chunkSize);
+            size_t result = socket->spliceTo(pipe.fds[1], todo);
+            if (result == 0)
+                break;
+            totalRead += result;
+            g_statZeroCopyBytes.add(result);
+            if (dstSocket) {
+                while (result > 0)
+                    result -= dstSocket->socket()->spliceFrom(pipe.fds[0],
+                        result);
+            } else if (dstFile->ioManager()) {
+                // Writing to a file blocks; keep it off the IOManager's own
+                // threads, like the file's own writes
+                boost::exception_ptr exception;
+                dstFile->ioManager()->runBlocking(dstFile->fd(),
+                    boost::bind(&spliceToFileBlocking, pipe.fds[0],
+                        dstFile->fd(), result, boost::ref(exception)));
+                if (exception)
+                    Mordor::rethrow_exception(exception);
+            } else {
+                spliceToFile(pipe.fds[0], dstFile->fd(), result);
+            }
+        }
+        return true;
+    }
+    return false;
+}
+#endif
+
 unsigned long long transferStream(Stream &src, Stream &dst,
                                   unsigned long long toTransfer,
                                   ExactLength exactLength)
@@ -56,6 +224,19 @@ unsigned long long transferStream(Stream &src, Stream &dst,
         exactLength = (toTransfer == ~0ull ? UNTILEOF : EXACT);
     MORDOR_ASSERT(exactLength == EXACT || exactLength == UNTILEOF);
 
+#ifdef LINUX
+    if (zeroCopyTransfer(src, dst, toTransfer, totalRead)) {
+        if (totalRead < toTransfer && exactLength == EXACT) {
+            MORDOR_LOG_ERROR(g_log) << "only read " << totalRead << "/"
+                << toTransfer << " from " << &src;
+            MORDOR_THROW_EXCEPTION(UnexpectedEofException());
+        }
+        MORDOR_LOG_VERBOSE(g_log) << "transferred " << totalRead << "/"
+            << toTransfer << " from " << &src << " to " << &dst;
+        return totalRead;
+    }
+#endif
+
     readBuffer = &buf1;
     todo = chunkSize;
     if (toTransfer - totalRead < (unsigned long long)todo)
@@ -838,3 +838,141 @@ MORDOR_UNITTEST(Buffer, clearReadPortionOnly)
     MORDOR_TEST_ASSERT_EQUAL(b.readAvailable(), 0u);
     MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(b.writeAvailable(), 5u);
 }
+
+MORDOR_UNITTEST(Buffer, slabAllocator)
+{
+    Buffer b;
+    b.allocator(BufferAllocator::slab());
+    b.reserve(1000);
+    // Rounded up to the size class
+    MORDOR_TEST_ASSERT_EQUAL(b.writeAvailable(), 2048u);
+    const void *first = b.writeBuffer(1, false).iov_base;
+    MORDOR_TEST_ASSERT_EQUAL((uintptr_t)first % 16, 0u);
+    b.clear();
+    b.reserve(1000);
+    // The block is recycled through the thread cache
+    MORDOR_TEST_ASSERT_EQUAL(b.writeBuffer(1, false).iov_base, first);
+
+    b.clear();
+    b.copyIn("hello");
+    Buffer b2(b);
+    MORDOR_TEST_ASSERT(&b2.allocator() == &BufferAllocator::slab());
+    b.clear();
+    MORDOR_TEST_ASSERT(b2 == "hello");
+    b2.copyIn(std::string(1000000, 'a'));
+    MORDOR_TEST_ASSERT_EQUAL(b2.readAvailable(), 1000005u);
+}
+
+MORDOR_UNITTEST(Buffer, readBuffersArray)
+{
+    Buffer b("hello");
+    b.copyIn(Buffer("world"));
+    b.copyIn(Buffer("!"));
+    MORDOR_TEST_ASSERT_EQUAL(b.segments(), 3u);
+    iovec iovs[2];
+    MORDOR_TEST_ASSERT_EQUAL(b.readBuffers(iovs, 2), 2u);
+    MORDOR_TEST_ASSERT_EQUAL(iovs[0].iov_len, 5u);
+    MORDOR_TEST_ASSERT_EQUAL(iovs[1].iov_len, 5u);
+    MORDOR_TEST_ASSERT(memcmp(iovs[1].iov_base, "world", 5) == 0);
+    MORDOR_TEST_ASSERT_EQUAL(b.readBuffers(iovs, 2, 7), 2u);
+    MORDOR_TEST_ASSERT_EQUAL(iovs[1].iov_len, 2u);
+    MORDOR_TEST_ASSERT_EQUAL(b.readBuffers(iovs, 2, 3), 1u);
+    MORDOR_TEST_ASSERT_EQUAL(iovs[0].iov_len, 3u);
+    MORDOR_TEST_ASSERT_EQUAL(b.readBuffers(iovs, 2, 0), 0u);
+}
+
+MORDOR_UNITTEST(Buffer, writeBuffersArray)
+{
+    char a[5], b[5], c[5];
+    Buffer buffer;
+    buffer.adopt(c, 5);
+    buffer.adopt(b, 5);
+    buffer.adopt(a, 5);
+    MORDOR_TEST_ASSERT_EQUAL(buffer.writeAvailable(), 15u);
+    iovec iovs[2];
+    MORDOR_TEST_ASSERT_EQUAL(buffer.writeBuffers(iovs, 2), 2u);
+    MORDOR_TEST_ASSERT_EQUAL(iovs[0].iov_len + iovs[1].iov_len, 10u);
+    MORDOR_TEST_ASSERT_EQUAL(buffer.writeBuffers(iovs, 2, 7), 2u);
+    MORDOR_TEST_ASSERT_EQUAL(iovs[1].iov_len, 2u);
+    MORDOR_TEST_ASSERT_EQUAL(buffer.writeBuffers(iovs, 1, 3), 1u);
+    MORDOR_TEST_ASSERT_EQUAL(iovs[0].iov_len, 3u);
+    // Nothing was reserved beyond what was adopted
+    MORDOR_TEST_ASSERT_EQUAL(buffer.writeAvailable(), 15u);
+    MORDOR_TEST_ASSERT_EQUAL(buffer.segments(), 3u);
+}
+
+MORDOR_UNITTEST(Buffer, longSegmentChain)
+{
+    Buffer b;
+    std::string expected;
+    // Enough segments to spill past the inline slots a few times over,
+    // consuming from the front as we go
+    for (int i = 0; i < 100; ++i) {
+        std::string piece(1 + i % 7, (char)('a' + i % 26));
+        b.copyIn(Buffer(piece));
+        expected.append(piece);
+        if (i % 3 == 0) {
+            b.consume(1);
+            expected.erase(0, 1);
+        }
+    }
+    MORDOR_TEST_ASSERT(b == expected);
+    MORDOR_TEST_ASSERT_EQUAL(b.find('z'), (ptrdiff_t)expected.find('z'));
+    b.truncate(expected.size() / 2);
+    expected.resize(expected.size() / 2);
+    MORDOR_TEST_ASSERT(b == expected);
+    b.reserve(10);
+    b.copyIn("xyz");
+    expected.append("xyz");
+    MORDOR_TEST_ASSERT(b == expected);
+    b.clear(false);
+    MORDOR_TEST_ASSERT_EQUAL(b.readAvailable(), 0u);
+    MORDOR_TEST_ASSERT_EQUAL(b.segments(), 1u);
+}
+
+MORDOR_UNITTEST(Buffer, findStringSpanningSegments)
+{
+    Buffer b("xx\r");
+    b.copyIn(Buffer("\n"));
+    b.copyIn(Buffer("\r"));
+    b.copyIn(Buffer("\nyy"));
+    MORDOR_TEST_ASSERT_EQUAL(b.find("\r\n\r\n"), 2);
+    MORDOR_TEST_ASSERT_EQUAL(b.find("\r\n\r\n", 5), -1);
+    MORDOR_TEST_ASSERT_EQUAL(b.find("\nyy"), 5);
+    MORDOR_TEST_ASSERT_EQUAL(b.find("yyy"), -1);
+
+    // A partial match across a boundary must not hide one that overlaps it
+    Buffer b2("aa");
+    b2.copyIn(Buffer("ab"));
+    MORDOR_TEST_ASSERT_EQUAL(b2.find("aab"), 1);
+}
+
+MORDOR_UNITTEST(Buffer, findLongString)
+{
+    std::string needle(300, 'n');
+    needle[0] = needle[299] = 'x';
+    std::string data(1000, 'n');
+    data.replace(650, 300, needle);
+    Buffer b;
+    // Odd sized segments, so the match starts and ends mid-segment
+    for (size_t i = 0; i < data.size(); i += 37)
+        b.copyIn(Buffer(data.substr(i, 37)));
+    MORDOR_TEST_ASSERT_EQUAL(b.find(needle), 650);
+    MORDOR_TEST_ASSERT_EQUAL(b.find(needle, 949), -1);
+    Buffer contiguous(data);
+    MORDOR_TEST_ASSERT_EQUAL(contiguous.find(needle), 650);
+}
+
+MORDOR_UNITTEST(Buffer, findFrequentFirstByte)
+{
+    // Long enough runs of false candidates switch to the vectorized search;
+    // check matches at every alignment, including the unvectorized tail
+    for (size_t position = 9000; position < 9100; ++position) {
+        std::string data(9100, 'a');
+        data[position] = 'b';
+        Buffer b(data);
+        MORDOR_TEST_ASSERT_EQUAL(b.find("ab"), (ptrdiff_t)position - 1);
+        MORDOR_TEST_ASSERT_EQUAL(b.find("aab"), (ptrdiff_t)position - 2);
+        MORDOR_TEST_ASSERT_EQUAL(b.find("abc"), -1);
+    }
+}
@@ -611,3 +611,119 @@ MORDOR_UNITTEST(BufferedStream, parallelReadWriteSeeklessStream)
     parallelReadWrite(Stream::ptr(new BufferedStream(
         Stream::ptr(new SeeklessStream(NullStream::get_ptr())))));
 }
+
+MORDOR_UNITTEST(BufferedStream, readAhead)
+{
+    WorkerPool pool;
+    MemoryStream::ptr baseStream(new MemoryStream(Buffer("01234567890123456789")));
+    BufferedStream::ptr bufferedStream(new BufferedStream(baseStream));
+    bufferedStream->bufferSize(5);
+    bufferedStream->readAhead(true);
+
+    Buffer output;
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->read(output, 2), 2u);
+    MORDOR_TEST_ASSERT(output == "01");
+    // One block was read synchronously; the next is on its way
+    MORDOR_TEST_ASSERT_EQUAL(baseStream->tell(), 5);
+    Scheduler::yield();
+    MORDOR_TEST_ASSERT_EQUAL(baseStream->tell(), 10);
+    // The prefetched block is accounted for
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->tell(), 2);
+
+    output.clear();
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->read(output, 8), 8u);
+    MORDOR_TEST_ASSERT(output == "23456789");
+    Scheduler::yield();
+    MORDOR_TEST_ASSERT_EQUAL(baseStream->tell(), 15);
+
+    output.clear();
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->read(output, 20), 10u);
+    MORDOR_TEST_ASSERT(output == "0123456789");
+    output.clear();
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->read(output, 20), 0u);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->tell(), 20);
+
+    // Seeking discards what was read ahead
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->seek(7), 7);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->read(output, 3), 3u);
+    MORDOR_TEST_ASSERT(output == "789");
+}
+
+MORDOR_UNITTEST(BufferedStream, errorOnReadAhead)
+{
+    WorkerPool pool;
+    MemoryStream::ptr baseStream(new MemoryStream(Buffer("01234567890123456789")));
+    TestStream::ptr testStream(new TestStream(baseStream));
+    BufferedStream::ptr bufferedStream(new BufferedStream(testStream));
+    bufferedStream->bufferSize(5);
+    bufferedStream->readAhead(true);
+    testStream->onRead(&throwRuntimeError, 5);
+
+    Buffer output;
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->read(output, 2), 2u);
+    // The failed prefetch doesn't affect what's already buffered
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->read(output, 3), 3u);
+    MORDOR_TEST_ASSERT(output == "01234");
+    output.clear();
+    MORDOR_TEST_ASSERT_EXCEPTION(bufferedStream->read(output, 1),
+        std::runtime_error);
+    MORDOR_TEST_ASSERT_EQUAL(output.readAvailable(), 0u);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->tell(), 5);
+
+    testStream->onRead(NULL);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->read(output, 5), 5u);
+    MORDOR_TEST_ASSERT(output == "56789");
+}
+
+MORDOR_UNITTEST(BufferedStream, writeBehind)
+{
+    WorkerPool pool;
+    MemoryStream::ptr baseStream(new MemoryStream());
+    BufferedStream::ptr bufferedStream(new BufferedStream(baseStream));
+    bufferedStream->bufferSize(5);
+    bufferedStream->writeBehind(2);
+
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->write("hel", 3), 3u);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->write("lowor", 5), 5u);
+    // A full block is queued, but hasn't been written yet
+    MORDOR_TEST_ASSERT_EQUAL(baseStream->size(), 0);
+    Scheduler::yield();
+    MORDOR_TEST_ASSERT_EQUAL(baseStream->size(), 5);
+
+    // More than two blocks at once has to wait for the first to be written
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->write("ld0123456789abcde", 17),
+        17u);
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(baseStream->size(), 10);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->size(), 25);
+    bufferedStream->flush();
+    MORDOR_TEST_ASSERT_EQUAL(baseStream->size(), 25);
+    MORDOR_TEST_ASSERT(baseStream->buffer() == "helloworld0123456789abcde");
+}
+
+MORDOR_UNITTEST(BufferedStream, errorOnWriteBehind)
+{
+    WorkerPool pool;
+    MemoryStream::ptr baseStream(new MemoryStream());
+    TestStream::ptr testStream(new TestStream(baseStream));
+    BufferedStream::ptr bufferedStream(new BufferedStream(testStream));
+    bufferedStream->bufferSize(5);
+    bufferedStream->writeBehind(2);
+
+    testStream->onWrite(&throwRuntimeError);
+    // Accepted, and only fails once it's written behind
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->write("hello", 5), 5u);
+    Scheduler::yield();
+    // Reported by the next write, which is backed out
+    MORDOR_TEST_ASSERT_EXCEPTION(bufferedStream->write("world", 5),
+        std::runtime_error);
+    MORDOR_TEST_ASSERT_EQUAL(baseStream->size(), 0);
+
+    testStream->onWrite(NULL);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->write("world", 5), 5u);
+    bufferedStream->flush();
+    MORDOR_TEST_ASSERT(baseStream->buffer() == "world");
+
+    testStream->onWrite(&throwRuntimeError);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->write("hello", 5), 5u);
+    MORDOR_TEST_ASSERT_EXCEPTION(bufferedStream->flush(), std::runtime_error);
+}
@@ -1,8 +1,13 @@
 // Copyright (c) 2009 - Mozy, Inc.
 
+#include <stdio.h>
+#include <string.h>
+
 #include <boost/bind.hpp>
 
+#include "mordor/config.h"
 #include "mordor/fiber.h"
+#include "mordor/statistics.h"
 #include "mordor/test/test.h"
 
 using namespace Mordor;
@@ -601,3 +606,135 @@ MORDOR_UNITTEST(Fibers, exceptionDestructsBeforeFiberDestructs)
     }
     MORDOR_TEST_ASSERT_EQUAL(++sequence, 7);
 }
+
+#ifndef WINDOWS
+static void countDown(int &count)
+{
+    --count;
+}
+
+MORDOR_UNITTEST(Fibers, stackReuse)
+{
+    CountStatistic<unsigned int> *hits =
+        Statistics::lookup<CountStatistic<unsigned int> >(
+            "fiber.stackcachehits");
+    MORDOR_TEST_ASSERT(hits);
+    int count = 2;
+    // Prime the cache
+    {
+        Fiber::ptr fiber(new Fiber(boost::bind(&countDown,
+            boost::ref(count))));
+        fiber->call();
+    }
+    unsigned int before = hits->count;
+    {
+        Fiber::ptr fiber(new Fiber(boost::bind(&countDown,
+            boost::ref(count))));
+        fiber->call();
+    }
+    MORDOR_TEST_ASSERT_EQUAL(count, 0);
+    MORDOR_TEST_ASSERT_EQUAL(hits->count, before + 1);
+}
+#endif
+
+#ifdef LINUX
+// Whether the mapping holding address is directly preceded by an
+// inaccessible one
+static bool guardedBelow(const void *address)
+{
+    FILE *maps = fopen("/proc/self/maps", "r");
+    MORDOR_TEST_ASSERT(maps);
+    unsigned long long previousEnd = 0;
+    bool previousInaccessible = false, result = false;
+    char line[512];
+    while (fgets(line, sizeof(line), maps)) {
+        unsigned long long start, end;
+        char perms[5];
+        if (sscanf(line, "%llx-%llx %4s", &start, &end, perms) != 3)
+            continue;
+        if ((unsigned long long)(uintptr_t)address >= start &&
+            (unsigned long long)(uintptr_t)address < end) {
+            result = previousEnd == start && previousInaccessible;
+            break;
+        }
+        previousEnd = end;
+        previousInaccessible = strncmp(perms, "---", 3) == 0;
+    }
+    fclose(maps);
+    return result;
+}
+
+static void checkGuardPage(bool &guarded)
+{
+    int local = 0;
+    guarded = guardedBelow(&local);
+}
+
+MORDOR_UNITTEST(Fibers, stackGuardPage)
+{
+    ConfigVarBase::ptr guardPage = Config::lookup("fiber.stackguardpage");
+    MORDOR_TEST_ASSERT(guardPage);
+    guardPage->fromString("1");
+    try {
+        bool guarded = false;
+        Fiber::ptr fiber(new Fiber(boost::bind(&checkGuardPage,
+            boost::ref(guarded))));
+        fiber->call();
+        MORDOR_TEST_ASSERT(guarded);
+    } catch (...) {
+        guardPage->fromString("0");
+        throw;
+    }
+    guardPage->fromString("0");
+}
+#endif
+
+#ifndef WINDOWS
+static void useStack(int depth)
+{
+    volatile char buffer[4096];
+    buffer[0] = buffer[sizeof(buffer) - 1] = (char)depth;
+    if (depth > 0) {
+        useStack(depth - 1);
+        // Keep this frame live across the call
+        buffer[1] = buffer[0];
+    }
+}
+
+static void measureStackUsage()
+{
+    AverageMinMaxStatistic<unsigned long long> *usage =
+        Statistics::lookup<AverageMinMaxStatistic<unsigned long long> >(
+            "fiber.stackusage");
+    MORDOR_TEST_ASSERT(usage);
+    {
+        Fiber::ptr fiber(new Fiber(boost::bind(&useStack, 64), 1024 * 1024));
+        fiber->call();
+        MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(fiber->stackUsage(),
+            64 * 4096u);
+        MORDOR_TEST_ASSERT_LESS_THAN(fiber->stackUsage(), 1024 * 1024u);
+    }
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(usage->maximum.maximum,
+        64 * 4096u);
+    // The stack was cleared before being cached, so a shallow Fiber reusing
+    // it doesn't look deep
+    Fiber::ptr fiber(new Fiber(boost::bind(&useStack, 0), 1024 * 1024));
+    fiber->call();
+    MORDOR_TEST_ASSERT_LESS_THAN(fiber->stackUsage(), 64 * 4096u);
+}
+
+MORDOR_UNITTEST(Fibers, stackUsage)
+{
+    ConfigVarBase::ptr trackStackUsage =
+        Config::lookup("fiber.trackstackusage");
+    MORDOR_TEST_ASSERT(trackStackUsage);
+    trackStackUsage->fromString("1");
+    try {
+        measureStackUsage();
+    } catch (...) {
+        trackStackUsage->fromString("0");
+        throw;
+    }
+    trackStackUsage->fromString("0");
+}
+#endif
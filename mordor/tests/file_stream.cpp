@@ -2,6 +2,11 @@
 
 #include "mordor/pch.h"
 
+#include <boost/bind.hpp>
+
+#include "mordor/config.h"
+#include "mordor/iomanager.h"
+#include "mordor/streams/buffer.h"
 #include "mordor/streams/file.h"
 #include "mordor/test/test.h"
 
@@ -133,4 +138,79 @@ MORDOR_UNITTEST(FileStream, openSymlinkToNothing)
     }
     unlink(sym.c_str());
 }
+
+#ifdef LINUX
+static void readWriteFile(IOManager &ioManager)
+{
+    std::string path = tempfilename();
+    FileStream stream(path, FileStream::READWRITE,
+        (FileStream::CreateFlags)(FileStream::CREATE |
+        FileStream::DELETE_ON_CLOSE), &ioManager);
+    std::string data(100000, 'a');
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = (char)('a' + i % 26);
+    Buffer buffer(data);
+    while (buffer.readAvailable() > 0)
+        buffer.consume(stream.write(buffer, buffer.readAvailable()));
+    MORDOR_TEST_ASSERT_EQUAL(stream.write("!", 1), 1u);
+    stream.flush();
+    MORDOR_TEST_ASSERT_EQUAL(stream.size(), (long long)data.size() + 1);
+
+    MORDOR_TEST_ASSERT_EQUAL(stream.seek(26, Stream::BEGIN), 26);
+    char letters[4];
+    MORDOR_TEST_ASSERT_EQUAL(stream.read(letters, 3), 3u);
+    letters[3] = 0;
+    MORDOR_TEST_ASSERT_EQUAL((const char *)letters, "abc");
+    stream.seek(0, Stream::BEGIN);
+    Buffer read;
+    size_t result;
+    while ((result = stream.read(read, 65536)) > 0);
+    MORDOR_TEST_ASSERT(read == data + "!");
+}
+
+MORDOR_UNITTEST(FileStream, diskThreads)
+{
+    ConfigVarBase::ptr asyncFiles = Config::lookup("fdstream.asyncfiles");
+    MORDOR_TEST_ASSERT(asyncFiles);
+    asyncFiles->fromString("1");
+    try {
+        IOManager ioManager(1, true, IOManager::EPOLL);
+        readWriteFile(ioManager);
+    } catch (...) {
+        asyncFiles->fromString("0");
+        throw;
+    }
+    asyncFiles->fromString("0");
+}
+
+MORDOR_UNITTEST(FileStream, ioUring)
+{
+    IOManager ioManager(1, true, IOManager::IOURING);
+    if (!ioManager.ioUring())
+        throw Test::TestSkippedException();
+    readWriteFile(ioManager);
+}
+
+// There's no Fiber to park, so the syscalls are just made directly
+MORDOR_UNITTEST(FileStream, ioManagerWithoutScheduler)
+{
+    ConfigVarBase::ptr asyncFiles = Config::lookup("fdstream.asyncfiles");
+    MORDOR_TEST_ASSERT(asyncFiles);
+    asyncFiles->fromString("1");
+    try {
+        {
+            IOManager ioManager(1, false, IOManager::EPOLL);
+            readWriteFile(ioManager);
+        }
+        {
+            IOManager ioManager(1, false, IOManager::IOURING);
+            readWriteFile(ioManager);
+        }
+    } catch (...) {
+        asyncFiles->fromString("0");
+        throw;
+    }
+    asyncFiles->fromString("0");
+}
+#endif
 #endif
@@ -6,6 +6,7 @@
 
 #include <boost/bind.hpp>
 
+#include "mordor/config.h"
 #include "mordor/fiber.h"
 #include "mordor/http/broker.h"
 #include "mordor/http/client.h"
@@ -16,6 +17,8 @@
 #include "mordor/iomanager.h"
 #include "mordor/scheduler.h"
 #include "mordor/sleep.h"
+#include "mordor/socket.h"
+#include "mordor/statistics.h"
 #include "mordor/streams/buffered.h"
 #include "mordor/streams/cat.h"
 #include "mordor/streams/duplex.h"
@@ -2636,3 +2639,239 @@ MORDOR_UNITTEST(HTTPConnectionCache, pendingConnectionsFailTogether)
     pool.schedule(boost::bind(&expectPriorFail, boost::ref(cache)));
     pool.dispatch();
 }
+
+namespace {
+// Connections that go nowhere; the far ends are kept so they stay open
+class PipeStreamBroker : public StreamBroker
+{
+public:
+    Stream::ptr getStream(const URI &uri)
+    {
+        std::pair<Stream::ptr, Stream::ptr> pipe = pipeStream();
+        m_remotes.push_back(pipe.second);
+        return pipe.first;
+    }
+
+private:
+    std::vector<Stream::ptr> m_remotes;
+};
+}
+
+static unsigned long long endpointStatistic(const char *name)
+{
+    CountStatistic<unsigned long long> *stat =
+        Statistics::lookup<CountStatistic<unsigned long long> >(
+        std::string("http.endpoint.http://localhost.") + name);
+    return stat ? stat->count : 0ull;
+}
+
+MORDOR_UNITTEST(HTTPConnectionCache, leastPendingContentLength)
+{
+    WorkerPool pool;
+    StreamBroker::ptr broker(new PipeStreamBroker());
+    ConnectionCache cache(broker);
+    cache.connectionsPerHost(2);
+    unsigned long long connections = endpointStatistic("connections");
+    unsigned long long pipelined = endpointStatistic("pipelined");
+
+    ClientConnection::ptr conn1 = cache.getConnection("http://localhost/").first;
+    // An idle connection is reused rather than opening another
+    MORDOR_TEST_ASSERT(cache.getConnection("http://localhost/").first == conn1);
+
+    Request requestHeaders;
+    requestHeaders.requestLine.method = PUT;
+    requestHeaders.requestLine.uri = "/";
+    requestHeaders.request.host = "localhost";
+    requestHeaders.entity.contentLength = 1000;
+    ClientRequest::ptr request1 = conn1->request(requestHeaders);
+    MORDOR_TEST_ASSERT_EQUAL(conn1->pendingContentLength(), 1000ull);
+    MORDOR_TEST_ASSERT_EQUAL(conn1->currentResponseLength(), 0ull);
+
+    // Below the limit, a busy connection isn't pipelined on
+    ClientConnection::ptr conn2 = cache.getConnection("http://localhost/").first;
+    MORDOR_TEST_ASSERT(conn2 != conn1);
+    requestHeaders.requestLine.method = GET;
+    requestHeaders.entity.contentLength = ~0ull;
+    ClientRequest::ptr request2 = conn2->request(requestHeaders);
+    MORDOR_TEST_ASSERT_EQUAL(conn2->pendingContentLength(), 0ull);
+
+    // At the limit, the request goes behind the least pending Content-Length
+    MORDOR_TEST_ASSERT(cache.getConnection("http://localhost/").first == conn2);
+    MORDOR_TEST_ASSERT_EQUAL(endpointStatistic("connections"),
+        connections + 2);
+    MORDOR_TEST_ASSERT_EQUAL(endpointStatistic("pipelined"), pipelined + 1);
+}
+
+static void fetchConnection(ConnectionCache &cache, ClientConnection::ptr &conn)
+{
+    conn = cache.getConnection("http://localhost/").first;
+}
+
+MORDOR_UNITTEST(HTTPConnectionCache, pipelineDepth)
+{
+    WorkerPool pool;
+    StreamBroker::ptr broker(new PipeStreamBroker());
+    ConnectionCache cache(broker);
+    EndpointPolicy policy;
+    policy.maxPipelineDepth = 1;
+    cache.policy("http://localhost/", policy);
+    unsigned long long waits = endpointStatistic("waits");
+
+    ClientConnection::ptr conn1 = cache.getConnection("http://localhost/").first;
+    Request requestHeaders;
+    requestHeaders.requestLine.uri = "/";
+    requestHeaders.request.host = "localhost";
+    ClientRequest::ptr request = conn1->request(requestHeaders);
+
+    // The only connection allowed is as deep as it's allowed to get
+    ClientConnection::ptr conn2;
+    pool.schedule(boost::bind(&fetchConnection, boost::ref(cache),
+        boost::ref(conn2)));
+    Scheduler::yield();
+    MORDOR_TEST_ASSERT(!conn2);
+    MORDOR_TEST_ASSERT_EQUAL(endpointStatistic("waits"), waits + 1);
+
+    // Abandoning the request kills the connection, and wakes the waiter up
+    // to establish another one
+    request->cancel(true);
+    pool.dispatch();
+    MORDOR_TEST_ASSERT(conn2);
+    MORDOR_TEST_ASSERT(conn2 != conn1);
+}
+
+MORDOR_UNITTEST(HTTPConnectionCache, connectionOutlivesCache)
+{
+    WorkerPool pool;
+    StreamBroker::ptr broker(new PipeStreamBroker());
+    ClientConnection::ptr conn;
+    {
+        ConnectionCache cache(broker);
+        EndpointPolicy policy;
+        policy.maxPipelineDepth = 1;
+        cache.policy("http://localhost/", policy);
+        conn = cache.getConnection("http://localhost/").first;
+    }
+    Request requestHeaders;
+    requestHeaders.requestLine.uri = "/";
+    requestHeaders.request.host = "localhost";
+    ClientRequest::ptr request = conn->request(requestHeaders);
+    // Completing a request calls back for the cache's waiters; the cache
+    // being gone has to be harmless
+    request->cancel(true);
+}
+
+static void connectToOtherEndpoint()
+{
+    StreamBroker::ptr broker(new PipeStreamBroker());
+    ConnectionCache cache(broker);
+    cache.getConnection("http://otherendpoint/");
+}
+
+MORDOR_UNITTEST(HTTPConnectionCache, endpointStatisticsLimit)
+{
+    CountStatistic<unsigned long long> *other =
+        Statistics::lookup<CountStatistic<unsigned long long> >(
+        "http.endpoint.other.connections");
+    unsigned long long connections = other ? other->count : 0ull;
+    ConfigVarBase::ptr limit = Config::lookup("http.endpointstatistics");
+    MORDOR_TEST_ASSERT(limit);
+    std::string oldLimit = limit->toString();
+    limit->fromString("0");
+    try {
+        connectToOtherEndpoint();
+    } catch (...) {
+        limit->fromString(oldLimit);
+        throw;
+    }
+    limit->fromString(oldLimit);
+    // Past the limit, a new endpoint doesn't get statistics of its own
+    MORDOR_TEST_ASSERT(!Statistics::lookup<CountStatistic<unsigned long long> >(
+        "http.endpoint.http://otherendpoint.connections"));
+    other = Statistics::lookup<CountStatistic<unsigned long long> >(
+        "http.endpoint.other.connections");
+    MORDOR_TEST_ASSERT(other);
+    MORDOR_TEST_ASSERT_EQUAL(other->count, connections + 1);
+}
+
+// A socket listening on 127.0.0.1 that never accepts; once its backlog is
+// full, the kernel ignores further connection attempts, like a blackholed
+// address
+static Socket::ptr blackhole(IOManager &ioManager,
+    std::vector<Socket::ptr> &queued)
+{
+    IPv4Address address(0x7f000001);
+    Socket::ptr listen = address.createSocket(ioManager, SOCK_STREAM);
+    listen->bind(address);
+    listen->listen(0);
+    while (queued.size() < 8) {
+        Socket::ptr socket = address.createSocket(ioManager, SOCK_STREAM);
+        socket->sendTimeout(200000ull);
+        try {
+            socket->connect(listen->localAddress());
+        } catch (TimedOutException &) {
+            return listen;
+        }
+        queued.push_back(socket);
+    }
+    throw TestSkippedException();
+}
+
+MORDOR_UNITTEST(SocketStreamBroker, raceConnections)
+{
+    IOManager ioManager;
+    std::vector<Socket::ptr> queued;
+    Socket::ptr unresponsive = blackhole(ioManager, queued);
+    IPv4Address address(0x7f000001);
+    Socket::ptr listen = address.createSocket(ioManager, SOCK_STREAM);
+    listen->bind(address);
+    listen->listen();
+    std::vector<Address::ptr> addresses;
+    addresses.push_back(unresponsive->localAddress());
+    addresses.push_back(listen->localAddress());
+
+    SocketStreamBroker broker(&ioManager);
+    // One at a time, the first address costs the whole connect timeout
+    broker.connectTimeout(300000ull);
+    broker.connectAttemptDelay(~0ull);
+    unsigned long long start = TimerManager::now();
+    Socket::ptr socket = broker.connect(addresses);
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(TimerManager::now() - start,
+        300000ull);
+    MORDOR_TEST_ASSERT(*socket->remoteAddress() == *listen->localAddress());
+
+    // Racing, only the connection attempt delay
+    broker.connectTimeout(10000000ull);
+    broker.connectAttemptDelay(50000ull);
+    start = TimerManager::now();
+    socket = broker.connect(addresses);
+    MORDOR_TEST_ASSERT_LESS_THAN(TimerManager::now() - start, 1000000ull);
+    MORDOR_TEST_ASSERT(*socket->remoteAddress() == *listen->localAddress());
+}
+
+MORDOR_UNITTEST(SocketStreamBroker, connectUnsupportedFamily)
+{
+    IOManager ioManager;
+    IPv4Address address(0x7f000001);
+    Socket::ptr listen = address.createSocket(ioManager, SOCK_STREAM);
+    listen->bind(address);
+    listen->listen();
+    // Not even a socket can be created for an unsupported family
+    std::vector<Address::ptr> addresses;
+    addresses.push_back(Address::ptr(new UnknownAddress(AF_MAX + 1)));
+    addresses.push_back(listen->localAddress());
+
+    SocketStreamBroker broker(&ioManager);
+    // Racing, then one at a time
+    for (int i = 0; i < 2; ++i) {
+        if (i == 1)
+            broker.connectAttemptDelay(~0ull);
+        addresses.back() = listen->localAddress();
+        Socket::ptr socket = broker.connect(addresses);
+        MORDOR_TEST_ASSERT(*socket->remoteAddress() ==
+            *listen->localAddress());
+
+        addresses.back() = Address::ptr(new UnknownAddress(AF_MAX + 2));
+        MORDOR_TEST_ASSERT_EXCEPTION(broker.connect(addresses),
+            OperationNotSupportedException);
+    }
+}
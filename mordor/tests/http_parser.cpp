@@ -2,7 +2,9 @@
 
 #include <boost/bind.hpp>
 
+#include "mordor/http/compact.h"
 #include "mordor/http/parser.h"
+#include "mordor/streams/buffer.h"
 #include "mordor/streams/buffered.h"
 #include "mordor/streams/duplex.h"
 #include "mordor/streams/memory.h"
@@ -803,3 +805,305 @@ MORDOR_UNITTEST(HTTP, proxyAuthorizationHeader)
     MORDOR_TEST_ASSERT_EQUAL(request.request.proxyAuthorization.scheme, "NTLM");
     MORDOR_TEST_ASSERT_EQUAL(request.request.proxyAuthorization.base64, "TlRMTVNTUAABAAAAt4II4gAAAAAAAAAAAAAAAAAAAAAGAbAdAAAADw==");
 }
+
+static std::string serialized(const Request &request)
+{
+    Buffer buffer;
+    serialize(buffer, request);
+    return buffer.toString();
+}
+
+static std::string serialized(const Response &response)
+{
+    Buffer buffer;
+    serialize(buffer, response);
+    return buffer.toString();
+}
+
+MORDOR_UNITTEST(HTTP, serializeRequest)
+{
+    boost::posix_time::ptime date(boost::gregorian::date(1994, 11, 6),
+        boost::posix_time::time_duration(8, 49, 37));
+    Request request;
+    request.requestLine.method = PUT;
+    request.requestLine.uri = "/some/path?query=value";
+    request.requestLine.ver = Version(1, 1);
+    request.general.connection.insert("Keep-Alive");
+    request.general.connection.insert("TE");
+    request.general.date = date;
+    request.general.transferEncoding.push_back("chunked");
+    request.general.upgrade.push_back(Product("websocket", ""));
+    request.request.acceptEncoding.push_back(AcceptValue("gzip", 1000));
+    request.request.acceptEncoding.push_back(AcceptValue("deflate", 500));
+    request.request.acceptEncoding.push_back(AcceptValue("identity", 5));
+    request.request.acceptEncoding.push_back(AcceptValue("", 0));
+    request.request.authorization.scheme = "Basic";
+    request.request.authorization.base64 = "dXNlcjpwYXNz";
+    request.request.expect.push_back("100-continue");
+    request.request.host = "example.com";
+    request.request.ifNoneMatch.insert(ETag("abc", true));
+    request.request.ifNoneMatch.insert(ETag("x\"y"));
+    request.request.ifModifiedSince = date;
+    request.request.ifRange = ETag("abc");
+    request.request.range.push_back(std::make_pair(0ull, 99ull));
+    request.request.range.push_back(std::make_pair(~0ull, 100ull));
+    request.request.te.push_back(AcceptValueWithParameters("trailers"));
+    request.request.te.push_back(AcceptValueWithParameters("deflate", 250));
+    request.request.userAgent.push_back(Product("mordor", "1.0"));
+    request.request.userAgent.push_back(std::string("a (nested) comment"));
+    request.entity.contentType = MediaType("text", "plain");
+    request.entity.contentType.parameters["charset"] = "utf-8";
+    request.entity.contentType.parameters["name"] = "a b";
+    request.entity.extension["X-Custom"] = "value";
+
+    std::string expected =
+        "PUT /some/path?query=value HTTP/1.1\r\n"
+        "Connection: Keep-Alive, TE\r\n"
+        "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+        "Transfer-Encoding: chunked\r\n"
+        "Upgrade: websocket\r\n"
+        "Accept-Encoding: gzip;q=1, deflate;q=0.5, identity;q=0.005, *;q=0\r\n"
+        "Authorization: Basic dXNlcjpwYXNz\r\n"
+        "Expect: 100-continue\r\n"
+        "Host: example.com\r\n"
+        "If-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+        "If-None-Match: \"x\\\"y\", W/\"abc\"\r\n"
+        "If-Range: \"abc\"\r\n"
+        "Range: bytes=0-99, -100\r\n"
+        "TE: trailers, deflate;q=0.25\r\n"
+        "User-Agent: mordor/1.0 (a (nested) comment)\r\n"
+        "Content-Type: text/plain;charset=utf-8;name=\"a b\"\r\n"
+        "X-Custom: value\r\n"
+        "\r\n";
+    MORDOR_TEST_ASSERT_EQUAL(serialized(request), expected);
+    MORDOR_TEST_ASSERT_EQUAL(boost::lexical_cast<std::string>(request),
+        expected);
+
+    // Doesn't fit in the space reserved up front
+    request.request.userAgent.push_back(std::string(5000, 'c'));
+    request.request.range.clear();
+    std::string range = "\r\nRange: bytes=";
+    for (unsigned long long i = 0; i < 500; ++i) {
+        request.request.range.push_back(std::make_pair(i * 10, i * 10 + 5));
+        if (i != 0)
+            range += ", ";
+        range += boost::lexical_cast<std::string>(i * 10) + "-" +
+            boost::lexical_cast<std::string>(i * 10 + 5);
+    }
+    range += "\r\n";
+    expected = serialized(request);
+    MORDOR_TEST_ASSERT(expected.find(range) != std::string::npos);
+    MORDOR_TEST_ASSERT(expected.find(
+        "(a (nested) comment) (" + std::string(5000, 'c') + ")\r\n") !=
+        std::string::npos);
+    MORDOR_TEST_ASSERT_EQUAL(boost::lexical_cast<std::string>(request),
+        expected);
+
+    request = Request();
+    request.requestLine.method = OPTIONS;
+    request.requestLine.ver = Version(1, 0);
+    MORDOR_TEST_ASSERT_EQUAL(serialized(request),
+        "OPTIONS * HTTP/1.0\r\n\r\n");
+}
+
+MORDOR_UNITTEST(HTTP, serializeResponse)
+{
+    Response response;
+    response.status.ver = Version(1, 1);
+    response.status.status = PARTIAL_CONTENT;
+    response.status.reason = reason(PARTIAL_CONTENT);
+    response.general.date = boost::posix_time::ptime(
+        boost::gregorian::date(2010, 1, 31),
+        boost::posix_time::time_duration(23, 5, 0));
+    response.response.acceptRanges.insert("bytes");
+    response.response.eTag = ETag("abc");
+    response.response.location = "http://example.com/a";
+    response.response.retryAfter = 120ull;
+    response.response.server.push_back(Product("mordor", ""));
+    response.response.wwwAuthenticate.push_back(AuthParams("Basic"));
+    response.response.wwwAuthenticate.back().parameters["realm"] = "the realm";
+    response.response.wwwAuthenticate.back().parameters["charset"] = "UTF-8";
+    response.entity.contentEncoding.push_back("gzip");
+    response.entity.contentLength = 1234;
+    response.entity.contentRange = ContentRange(0, 1233, ~0ull);
+    response.entity.lastModified = boost::posix_time::ptime(
+        boost::gregorian::date(2009, 12, 1));
+    response.entity.extension["Set-Cookie"] = "a=b";
+
+    std::string expected =
+        "HTTP/1.1 206 Partial Content\r\n"
+        "Date: Sun, 31 Jan 2010 23:05:00 GMT\r\n"
+        "Accept-Ranges: bytes\r\n"
+        "ETag: \"abc\"\r\n"
+        "Location: http://example.com/a\r\n"
+        "Retry-After: 120\r\n"
+        "Server: mordor\r\n"
+        "WWW-Authenticate: Basic charset=UTF-8, realm=\"the realm\"\r\n"
+        "Content-Encoding: gzip\r\n"
+        "Content-Length: 1234\r\n"
+        "Content-Range: bytes 0-1233/*\r\n"
+        "Last-Modified: Tue, 01 Dec 2009 00:00:00 GMT\r\n"
+        "Set-Cookie: a=b\r\n"
+        "\r\n";
+    MORDOR_TEST_ASSERT_EQUAL(serialized(response), expected);
+    MORDOR_TEST_ASSERT_EQUAL(boost::lexical_cast<std::string>(response),
+        expected);
+
+    response = Response();
+    response.status.ver = Version(1, 0);
+    response.status.status = NOT_FOUND;
+    response.status.reason = reason(NOT_FOUND);
+    response.entity.contentLength = 0;
+    MORDOR_TEST_ASSERT_EQUAL(serialized(response),
+        "HTTP/1.0 404 Not Found\r\n"
+        "Content-Length: 0\r\n"
+        "\r\n");
+}
+
+static const char *compactRequestText =
+    "GET /some/path?query=value HTTP/1.1\r\n"
+    "Host: example.com\r\n"
+    "Content-Length: 12\r\n"
+    "X-Custom:   spaced out \r\n"
+    "X-Folded: first\r\n"
+    " second\r\n"
+    "x-empty:\r\n"
+    "host: again\r\n"
+    "\r\n";
+
+static void checkCompactRequest(const CompactRequest &request)
+{
+    MORDOR_TEST_ASSERT_EQUAL(request.method().str(), GET);
+    MORDOR_TEST_ASSERT_EQUAL(request.uri().str(), "/some/path?query=value");
+    MORDOR_TEST_ASSERT_EQUAL(request.version(), Version(1, 1));
+    MORDOR_TEST_ASSERT_EQUAL(request.fields(), 6u);
+    MORDOR_TEST_ASSERT_EQUAL(request.field(0), HOST);
+    MORDOR_TEST_ASSERT_EQUAL(request.name(0).str(), "Host");
+    MORDOR_TEST_ASSERT_EQUAL(request.field(2), EXTENSION_HEADER);
+    MORDOR_TEST_ASSERT_EQUAL(request.field(5), HOST);
+    MORDOR_TEST_ASSERT_EQUAL(request.header(HOST).str(), "example.com");
+    MORDOR_TEST_ASSERT_EQUAL(request.header("x-custom").str(), "spaced out");
+    MORDOR_TEST_ASSERT_EQUAL(request.header("X-Folded").str(),
+        "first\r\n second");
+    MORDOR_TEST_ASSERT(request.header("X-Empty").data);
+    MORDOR_TEST_ASSERT(request.header("X-Empty").empty());
+    MORDOR_TEST_ASSERT(!request.header("X-Missing").data);
+    MORDOR_TEST_ASSERT(!request.header(USER_AGENT).data);
+    MORDOR_TEST_ASSERT_EQUAL(request.contentLength(), 12ull);
+    MORDOR_TEST_ASSERT_EQUAL(request.block().segments(), 1u);
+    MORDOR_TEST_ASSERT(request.block() == compactRequestText);
+
+    const Request &parsed = request.request();
+    MORDOR_TEST_ASSERT_EQUAL(&parsed, &request.request());
+    MORDOR_TEST_ASSERT_EQUAL(parsed.requestLine.uri,
+        URI("/some/path?query=value"));
+    MORDOR_TEST_ASSERT_EQUAL(parsed.request.host, "again");
+    MORDOR_TEST_ASSERT_EQUAL(parsed.entity.contentLength, 12ull);
+    MORDOR_TEST_ASSERT_EQUAL(parsed.entity.extension.find("X-Custom")->second,
+        "spaced out");
+}
+
+MORDOR_UNITTEST(HTTP, compactRequest)
+{
+    CompactRequest request;
+    CompactRequestParser parser(request);
+
+    std::string text(compactRequestText);
+    text.append("body");
+    MORDOR_TEST_ASSERT_EQUAL(parser.run(text), text.size() - 4);
+    MORDOR_TEST_ASSERT(!parser.error());
+    MORDOR_TEST_ASSERT(parser.complete());
+    checkCompactRequest(request);
+
+    // The same parser and request can be reused
+    MORDOR_TEST_ASSERT_EQUAL(parser.run("OPTIONS * HTTP/1.0\r\n\r\n"), 22u);
+    MORDOR_TEST_ASSERT(parser.complete());
+    MORDOR_TEST_ASSERT_EQUAL(request.method().str(), OPTIONS);
+    MORDOR_TEST_ASSERT_EQUAL(request.uri().str(), "*");
+    MORDOR_TEST_ASSERT_EQUAL(request.version(), Version(1, 0));
+    MORDOR_TEST_ASSERT_EQUAL(request.fields(), 0u);
+    MORDOR_TEST_ASSERT_EQUAL(request.contentLength(), ~0ull);
+    MORDOR_TEST_ASSERT(!request.request().requestLine.uri.isDefined());
+    MORDOR_TEST_ASSERT_EQUAL(request.request().requestLine.method, OPTIONS);
+    MORDOR_TEST_ASSERT_EQUAL(request.request().requestLine.ver,
+        Version(1, 0));
+
+    MORDOR_TEST_ASSERT(parser.run("CONNECT mozy.com:443 HTTP/1.1\r\n"
+        "Host: mozy.com:443\r\n"
+        "\r\n"));
+    MORDOR_TEST_ASSERT(parser.complete());
+    const Request &connect = request.request();
+    MORDOR_TEST_ASSERT_EQUAL(connect.requestLine.method, CONNECT);
+    MORDOR_TEST_ASSERT_EQUAL(connect.requestLine.uri.authority.host(),
+        "mozy.com");
+    MORDOR_TEST_ASSERT_EQUAL(connect.requestLine.uri.authority.port(), 443);
+    MORDOR_TEST_ASSERT_EQUAL(connect.request.host, "mozy.com:443");
+}
+
+MORDOR_UNITTEST(HTTP, compactRequestPartial)
+{
+    CompactRequest request;
+    CompactRequestParser parser(request);
+
+    // A byte at a time, so every span crosses calls to exec()
+    parser.init();
+    const char *text = compactRequestText;
+    size_t length = strlen(text);
+    for (size_t i = 0; i < length; ++i) {
+        MORDOR_TEST_ASSERT(!parser.complete());
+        MORDOR_TEST_ASSERT_EQUAL(parser.run(text + i, 1, false), 1u);
+        MORDOR_TEST_ASSERT(!parser.error());
+    }
+    MORDOR_TEST_ASSERT(parser.complete());
+    checkCompactRequest(request);
+}
+
+MORDOR_UNITTEST(HTTP, compactRequestErrors)
+{
+    CompactRequest request;
+    CompactRequestParser parser(request);
+
+    parser.run("GET / HTTP/1.1\r\nNot a header\r\n\r\n");
+    MORDOR_TEST_ASSERT(parser.error());
+    parser.run("GET / HTTP/x\r\n\r\n");
+    MORDOR_TEST_ASSERT(parser.error());
+
+    // Framing is fine, but the values only fail once they're looked at
+    parser.run("GET / HTTP/1.1\r\nContent-Length: twelve\r\n\r\n");
+    MORDOR_TEST_ASSERT(parser.complete());
+    MORDOR_TEST_ASSERT_EXCEPTION(request.contentLength(),
+        BadMessageHeaderException);
+    parser.run("GET \x7f HTTP/1.1\r\n\r\n");
+    MORDOR_TEST_ASSERT(parser.error());
+    parser.run("GET /a<b HTTP/1.1\r\n\r\n");
+    MORDOR_TEST_ASSERT(parser.complete());
+    MORDOR_TEST_ASSERT_EXCEPTION(request.request(),
+        BadMessageHeaderException);
+    parser.run("GET /a#b HTTP/1.1\r\n\r\n");
+    MORDOR_TEST_ASSERT(parser.complete());
+    MORDOR_TEST_ASSERT_EXCEPTION(request.request(),
+        BadMessageHeaderException);
+    parser.run("GET a/b HTTP/1.1\r\n\r\n");
+    MORDOR_TEST_ASSERT(parser.complete());
+    MORDOR_TEST_ASSERT_EXCEPTION(request.request(),
+        BadMessageHeaderException);
+}
+
+MORDOR_UNITTEST(HTTP, compactRequestBareLF)
+{
+    CompactRequest request;
+    CompactRequestParser parser(request);
+
+    MORDOR_TEST_ASSERT_EQUAL(parser.run("PUT /upload HTTP/1.1\n"
+        "Host: example.com\n"
+        "X-Folded: first\n"
+        "\tsecond\n"
+        "\n"
+        "body"), 64u);
+    MORDOR_TEST_ASSERT(parser.complete());
+    MORDOR_TEST_ASSERT_EQUAL(request.method().str(), PUT);
+    MORDOR_TEST_ASSERT_EQUAL(request.fields(), 2u);
+    MORDOR_TEST_ASSERT_EQUAL(request.header(HOST).str(), "example.com");
+    MORDOR_TEST_ASSERT_EQUAL(request.header("X-Folded").str(),
+        "first\n\tsecond");
+}
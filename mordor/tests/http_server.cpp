@@ -1,5 +1,7 @@
 // Copyright (c) 2009 - Mozy, Inc.
 
+#include <stdlib.h>
+
 #include <boost/bind.hpp>
 
 #include "mordor/fiber.h"
@@ -8,11 +10,16 @@
 #include "mordor/http/multipart.h"
 #include "mordor/http/parser.h"
 #include "mordor/http/server.h"
+#include "mordor/iomanager.h"
+#include "mordor/socket.h"
+#include "mordor/statistics.h"
 #include "mordor/streams/duplex.h"
+#include "mordor/streams/fd.h"
 #include "mordor/streams/limited.h"
 #include "mordor/streams/null.h"
 #include "mordor/streams/memory.h"
 #include "mordor/streams/random.h"
+#include "mordor/streams/socket.h"
 #include "mordor/streams/test.h"
 #include "mordor/streams/transfer.h"
 #include "mordor/test/test.h"
@@ -823,3 +830,113 @@ MORDOR_UNITTEST(HTTPServer, badRequestOnExpectContinueWithNoRequestBody)
     ClientRequest::ptr request = requestBroker.request(requestHeaders);
     MORDOR_TEST_ASSERT_EQUAL(request->response().status.status, BAD_REQUEST);
 }
+
+#ifdef LINUX
+static void fileServer(int fd, ServerRequest::ptr request)
+{
+    FDStream file(fd, NULL, NULL, false);
+    file.seek(0, Stream::BEGIN);
+    respondStream(request, file);
+}
+
+static void acceptFileConnection(Socket::ptr listen, int fd)
+{
+    Socket::ptr socket = listen->accept();
+    ServerConnection::ptr conn(new ServerConnection(
+        Stream::ptr(new SocketStream(socket)),
+        boost::bind(&fileServer, fd, _1)));
+    conn->processRequests();
+}
+
+// A client connected over loopback TCP to a server that responds to every
+// request with respondStream on fd
+static ClientConnection::ptr fileServerConnection(IOManager &ioManager,
+    int fd)
+{
+    std::vector<Address::ptr> addresses = Address::lookup("localhost");
+    MORDOR_TEST_ASSERT(!addresses.empty());
+    IPAddress::ptr address =
+        boost::dynamic_pointer_cast<IPAddress>(addresses.front());
+    address->port(0);
+    Socket::ptr listen = address->createSocket(ioManager, SOCK_STREAM);
+    listen->bind(address);
+    listen->listen();
+    ioManager.schedule(boost::bind(&acceptFileConnection, listen, fd));
+    Socket::ptr socket = address->createSocket(ioManager, SOCK_STREAM);
+    socket->connect(listen->localAddress());
+    return ClientConnection::ptr(new ClientConnection(
+        Stream::ptr(new SocketStream(socket))));
+}
+
+// Unlinked as soon as it's created; contents of "" means a sparse file of
+// size bytes
+static int tempFile(const std::string &contents, long long size = 0)
+{
+    char path[] = "/tmp/mordor_http_server_XXXXXX";
+    int fd = mkstemp(path);
+    MORDOR_TEST_ASSERT(fd >= 0);
+    unlink(path);
+    FDStream stream(fd, NULL, NULL, false);
+    if (contents.empty()) {
+        stream.truncate(size);
+    } else {
+        MemoryStream source(Buffer(contents.c_str(), contents.size()));
+        transferStream(source, stream);
+    }
+    return fd;
+}
+
+static unsigned long long zeroCopyBytes()
+{
+    return Statistics::lookup<SumStatistic<unsigned long long> >(
+        "transferstream.zerocopybytes")->sum;
+}
+
+MORDOR_UNITTEST(HTTPServer, respondStreamSendFile)
+{
+    IOManager ioManager;
+    std::string data(1024 * 1024 + 13, '\0');
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = (char)rand();
+    FDStream file(tempFile(data));
+    ClientConnection::ptr conn = fileServerConnection(ioManager, file.fd());
+
+    Request requestHeaders;
+    requestHeaders.requestLine.uri = "/file";
+    requestHeaders.request.host = "localhost";
+    unsigned long long before = zeroCopyBytes();
+    ClientRequest::ptr request = conn->request(requestHeaders);
+    MORDOR_TEST_ASSERT_EQUAL(request->response().status.status, OK);
+    MORDOR_TEST_ASSERT_EQUAL(request->response().entity.contentLength,
+        (unsigned long long)data.size());
+    MemoryStream body;
+    transferStream(request->responseStream(), body);
+    MORDOR_TEST_ASSERT(body.buffer() == data);
+    MORDOR_TEST_ASSERT_EQUAL(zeroCopyBytes() - before,
+        (unsigned long long)data.size());
+
+    // A single range goes straight from the file, too
+    requestHeaders.request.range.push_back(std::make_pair(100ull, 100099ull));
+    before = zeroCopyBytes();
+    request = conn->request(requestHeaders);
+    MORDOR_TEST_ASSERT_EQUAL(request->response().status.status,
+        PARTIAL_CONTENT);
+    MemoryStream range;
+    transferStream(request->responseStream(), range);
+    MORDOR_TEST_ASSERT(range.buffer() == data.substr(100, 100000));
+    MORDOR_TEST_ASSERT_EQUAL(zeroCopyBytes() - before, 100000ull);
+
+    // But compression has to see the data
+    requestHeaders.request.range.clear();
+    requestHeaders.request.te.push_back(AcceptValueWithParameters("deflate"));
+    requestHeaders.general.connection.insert("close");
+    before = zeroCopyBytes();
+    request = conn->request(requestHeaders);
+    MORDOR_TEST_ASSERT_EQUAL(request->response().status.status, OK);
+    MORDOR_TEST_ASSERT(!request->response().general.transferEncoding.empty());
+    MemoryStream compressed;
+    transferStream(request->responseStream(), compressed);
+    MORDOR_TEST_ASSERT(compressed.buffer() == data);
+    MORDOR_TEST_ASSERT_EQUAL(zeroCopyBytes(), before);
+}
+#endif
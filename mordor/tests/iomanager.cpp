@@ -1,10 +1,17 @@
 // Copyright (c) 2009 - Mozy, Inc.
 
+#ifdef LINUX
+#include <fcntl.h>
+#endif
+
 #include <boost/bind.hpp>
 
+#include "mordor/atomic.h"
 #include "mordor/future.h"
 #include "mordor/iomanager.h"
 #include "mordor/sleep.h"
+#include "mordor/streams/buffer.h"
+#include "mordor/streams/fd.h"
 #include "mordor/streams/pipe.h"
 #include "mordor/test/test.h"
 
@@ -114,6 +121,25 @@ MORDOR_UNITTEST(IOManager, lotsOfTickles)
     }
 }
 
+static void increment(volatile int &count)
+{
+    atomicIncrement(count);
+}
+
+// A burst of work scheduled from outside only needs one wakeup at a time;
+// make sure none of it gets stranded, and all the threads still stop
+MORDOR_UNITTEST(IOManager, coalescedTickles)
+{
+    volatile int count = 0;
+    {
+        IOManager ioManager(4, false);
+        for (int i = 0; i < 10000; ++i)
+            ioManager.schedule(boost::bind(&increment, boost::ref(count)));
+        ioManager.stop();
+    }
+    MORDOR_TEST_ASSERT_EQUAL(count, 10000);
+}
+
 // Windows doesn't support asynchronous anonymous pipes yet
 #ifndef WINDOWS
 static void writeOne(Stream::ptr stream)
@@ -133,6 +159,140 @@ MORDOR_UNITTEST(IOManager, rapidClose)
 }
 #endif
 
+#ifdef LINUX
+static void persistentReadiness(IOManager &ioManager, int fds[2])
+{
+    char buffer;
+    MORDOR_TEST_ASSERT_EQUAL(write(fds[1], "a", 1), 1);
+    ioManager.registerEvent(fds[0], IOManager::READ);
+    Scheduler::yieldTo();
+    MORDOR_TEST_ASSERT_EQUAL(read(fds[0], &buffer, 1), 1);
+    // Nobody is waiting when this edge arrives; epoll won't report it
+    // again, so the IOManager has to remember it
+    MORDOR_TEST_ASSERT_EQUAL(write(fds[1], "b", 1), 1);
+    sleep(ioManager, 50000ull);
+    ioManager.registerEvent(fds[0], IOManager::READ);
+    Scheduler::yieldTo();
+    MORDOR_TEST_ASSERT_EQUAL(read(fds[0], &buffer, 1), 1);
+    MORDOR_TEST_ASSERT_EQUAL(buffer, 'b');
+    // And it was consumed by that wait
+    ioManager.registerEvent(fds[0], IOManager::READ);
+    MORDOR_TEST_ASSERT(ioManager.unregisterEvent(fds[0], IOManager::READ));
+    ioManager.unregisterFile(fds[0]);
+}
+
+MORDOR_UNITTEST(IOManager, persistentRegistration)
+{
+    int fds[2];
+    MORDOR_TEST_ASSERT_EQUAL(pipe(fds), 0);
+    MORDOR_TEST_ASSERT_EQUAL(fcntl(fds[0], F_SETFL, O_NONBLOCK), 0);
+    IOManager ioManager;
+    ioManager.registerFile(fds[0]);
+    ioManager.schedule(boost::bind(&persistentReadiness,
+        boost::ref(ioManager), fds));
+    ioManager.dispatch();
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void ioUringRead(FDStream::ptr stream, Buffer &buffer)
+{
+    while (stream->read(buffer, 4096) > 0);
+}
+
+MORDOR_UNITTEST(IOManager, ioUringFDStream)
+{
+    IOManager ioManager(1, true, IOManager::IOURING);
+    if (!ioManager.ioUring())
+        throw TestSkippedException();
+    int fds[2];
+    MORDOR_TEST_ASSERT_EQUAL(pipe(fds), 0);
+    FDStream::ptr readStream(new FDStream(fds[0], &ioManager));
+    FDStream::ptr writeStream(new FDStream(fds[1], &ioManager));
+
+    // Pipes aren't files, so they still wait for readiness with a ring
+    Buffer read;
+    ioManager.schedule(boost::bind(&ioUringRead, readStream,
+        boost::ref(read)));
+    Scheduler::yield();
+    Buffer written("hello");
+    MORDOR_TEST_ASSERT_EQUAL(writeStream->write(written, 5), 5u);
+    MORDOR_TEST_ASSERT_EQUAL(writeStream->write(" world", 6), 6u);
+    writeStream->close();
+    ioManager.dispatch();
+    MORDOR_TEST_ASSERT(read == "hello world");
+}
+
+static void cancelRead(FDStream::ptr stream)
+{
+    stream->cancelRead();
+}
+
+MORDOR_UNITTEST(IOManager, ioUringFDStreamCancelRead)
+{
+    IOManager ioManager(1, true, IOManager::IOURING);
+    if (!ioManager.ioUring())
+        throw TestSkippedException();
+    int fds[2];
+    MORDOR_TEST_ASSERT_EQUAL(pipe(fds), 0);
+    FDStream::ptr readStream(new FDStream(fds[0], &ioManager));
+    FDStream::ptr writeStream(new FDStream(fds[1], &ioManager));
+    ioManager.schedule(boost::bind(&cancelRead, readStream));
+    char buffer;
+    MORDOR_TEST_ASSERT_EXCEPTION(readStream->read(&buffer, 1),
+        OperationAbortedException);
+}
+
+static void blockFor(unsigned int us, int &order, int &sequence)
+{
+    usleep(us);
+    order = ++sequence;
+}
+
+static void runBlocking(IOManager &ioManager, int fd, unsigned int us,
+    int &order, int &sequence)
+{
+    ioManager.runBlocking(fd, boost::bind(&blockFor, us, boost::ref(order),
+        boost::ref(sequence)));
+}
+
+static void setTrue(bool &flag)
+{
+    flag = true;
+}
+
+// The IOManager's only thread keeps running Fibers while a disk thread is
+// blocked on their behalf
+MORDOR_UNITTEST(IOManager, runBlockingDoesNotStall)
+{
+    IOManager ioManager(1, true, IOManager::EPOLL);
+    int order = 0, sequence = 0;
+    bool ran = false;
+    ioManager.schedule(boost::bind(&setTrue, boost::ref(ran)));
+    ioManager.runBlocking(0, boost::bind(&blockFor, 100000u,
+        boost::ref(order), boost::ref(sequence)));
+    MORDOR_TEST_ASSERT(ran);
+    MORDOR_TEST_ASSERT_EQUAL(order, 1);
+}
+
+// Work for one fd runs in order, even with threads to spare
+MORDOR_UNITTEST(IOManager, runBlockingOrderedPerFile)
+{
+    IOManager ioManager(1, true, IOManager::EPOLL);
+    int order[3] = { 0, 0, 0 }, sequence = 0;
+    ioManager.schedule(boost::bind(&runBlocking, boost::ref(ioManager), 5,
+        50000u, boost::ref(order[0]), boost::ref(sequence)));
+    ioManager.schedule(boost::bind(&runBlocking, boost::ref(ioManager), 5,
+        0u, boost::ref(order[1]), boost::ref(sequence)));
+    ioManager.schedule(boost::bind(&runBlocking, boost::ref(ioManager), 5,
+        0u, boost::ref(order[2]), boost::ref(sequence)));
+    ioManager.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(order[0], 1);
+    MORDOR_TEST_ASSERT_EQUAL(order[1], 2);
+    MORDOR_TEST_ASSERT_EQUAL(order[2], 3);
+}
+#endif
+
 MORDOR_UNITTEST(IOManager, timerRefCountNoExpired)
 {
     IOManager manager;
@@ -0,0 +1,99 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "mordor/streams/buffer.h"
+#include "mordor/streams/mmap.h"
+#include "mordor/test/test.h"
+
+using namespace Mordor;
+using namespace Mordor::Test;
+
+namespace {
+// An unlinked temporary file holding contents
+struct TempFile
+{
+    TempFile(const std::string &contents)
+    {
+        char path[] = "/tmp/mordorXXXXXX";
+        fd = mkstemp(path);
+        if (fd < 0)
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("mkstemp");
+        unlink(path);
+        if (!contents.empty() &&
+            write(fd, contents.c_str(), contents.size()) !=
+            (ssize_t)contents.size())
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("write");
+    }
+    ~TempFile() { close(fd); }
+
+    int fd;
+};
+}
+
+MORDOR_UNITTEST(MMapStream, basic)
+{
+    TempFile file("hello\nworld\r\n");
+    MMapStream stream(file.fd);
+    MORDOR_TEST_ASSERT_EQUAL(stream.size(), 13);
+    MORDOR_TEST_ASSERT_EQUAL(stream.find('\n'), 5);
+    MORDOR_TEST_ASSERT_EQUAL(stream.getDelimited(), "hello\n");
+    MORDOR_TEST_ASSERT_EQUAL(stream.tell(), 6);
+    MORDOR_TEST_ASSERT_EQUAL(stream.find("\r\n"), 5);
+    MORDOR_TEST_ASSERT_EXCEPTION(stream.find('x'), UnexpectedEofException);
+    MORDOR_TEST_ASSERT_EQUAL(stream.find("x", ~0, false), -8);
+    // Giving up before EOF is an overflow, not an EOF
+    MORDOR_TEST_ASSERT_EXCEPTION(stream.find('\r', 3), BufferOverflowException);
+    MORDOR_TEST_ASSERT_EXCEPTION(stream.find("\r\n", 3),
+        BufferOverflowException);
+    MORDOR_TEST_ASSERT_EQUAL(stream.find('\r', 3, false), -8);
+    MORDOR_TEST_ASSERT_EXCEPTION(stream.find('x', 7), UnexpectedEofException);
+    char buffer[5];
+    MORDOR_TEST_ASSERT_EQUAL(stream.read(buffer, 5), 5u);
+    MORDOR_TEST_ASSERT(memcmp(buffer, "world", 5) == 0);
+    MORDOR_TEST_ASSERT_EQUAL(stream.seek(-2, Stream::END), 11);
+    MORDOR_TEST_ASSERT_EQUAL(stream.read(buffer, 5), 2u);
+    MORDOR_TEST_ASSERT_EQUAL(stream.read(buffer, 5), 0u);
+    MORDOR_TEST_ASSERT_EQUAL(stream.seek(20, Stream::BEGIN), 20);
+    MORDOR_TEST_ASSERT_EQUAL(stream.read(buffer, 5), 0u);
+    MORDOR_TEST_ASSERT_EXCEPTION(stream.seek(-1, Stream::BEGIN),
+        std::invalid_argument);
+}
+
+MORDOR_UNITTEST(MMapStream, emptyFile)
+{
+    TempFile file("");
+    MMapStream stream(file.fd);
+    MORDOR_TEST_ASSERT_EQUAL(stream.size(), 0);
+    MORDOR_TEST_ASSERT(!stream.data());
+    Buffer buffer;
+    MORDOR_TEST_ASSERT_EQUAL(stream.read(buffer, 10), 0u);
+    MORDOR_TEST_ASSERT_EQUAL(stream.find('\n', ~0, false), -1);
+}
+
+MORDOR_UNITTEST(MMapStream, readIsZeroCopy)
+{
+    std::string contents(100000, 'a');
+    for (size_t i = 0; i < contents.size(); ++i)
+        contents[i] = (char)('a' + i % 26);
+    TempFile file(contents);
+    Buffer buffer;
+    const void *data;
+    {
+        MMapStream stream(file.fd, MMapStream::SEQUENTIAL);
+        data = stream.data();
+        MORDOR_TEST_ASSERT_EQUAL(stream.read(buffer, 30000), 30000u);
+        MORDOR_TEST_ASSERT_EQUAL(stream.read(buffer, 100000), 70000u);
+    }
+    // Consecutive reads of the mapping share one segment, and it outlives
+    // the stream
+    MORDOR_TEST_ASSERT_EQUAL(buffer.segments(), 1u);
+    MORDOR_TEST_ASSERT(
+        buffer.readBuffer(buffer.readAvailable(), false).iov_base == data);
+    MORDOR_TEST_ASSERT(buffer == contents);
+
+    Buffer copy(buffer);
+    buffer.clear();
+    copy.consume(26);
+    MORDOR_TEST_ASSERT(copy.readBuffer(copy.readAvailable(), false).iov_base
+        == (const unsigned char *)data + 26);
+    MORDOR_TEST_ASSERT(copy == contents.substr(26));
+}
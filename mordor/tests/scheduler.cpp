@@ -381,6 +381,72 @@ MORDOR_UNITTEST(Scheduler, spreadTheLoad)
     MORDOR_TEST_ASSERT_ABOUT_EQUAL(threads.size(), 8u, 2u);
 }
 
+static void scheduleLocally(std::set<tid_t> &threads,
+    boost::mutex &mutex, Fiber::ptr scheduleMe, int *count)
+{
+    // These all land on this thread's local queue; the other threads have to
+    // steal them
+    for (size_t i = 0; i < 24; ++i)
+        Scheduler::getThis()->schedule(boost::bind(&sleepForABit,
+            boost::ref(threads), boost::ref(mutex), scheduleMe, count));
+}
+
+MORDOR_UNITTEST(Scheduler, stealLocalWork)
+{
+    std::set<tid_t> threads;
+    {
+        boost::mutex mutex;
+        WorkerPool pool(8);
+        // Wait for the other threads to get to idle first
+        Mordor::sleep(100000);
+        int count = 24;
+        pool.schedule(boost::bind(&scheduleLocally, boost::ref(threads),
+            boost::ref(mutex), Fiber::getThis(), &count));
+        Scheduler::yieldTo();
+    }
+    // Make sure we hit every thread
+    MORDOR_TEST_ASSERT_ABOUT_EQUAL(threads.size(), 8u, 2u);
+}
+
+static void checkThread(tid_t expected, int &count)
+{
+    MORDOR_TEST_ASSERT_EQUAL(gettid(), expected);
+    atomicIncrement(count);
+}
+
+MORDOR_UNITTEST(Scheduler, threadTargeted)
+{
+    WorkerPool pool(4, false);
+    int count = 0;
+    for (int i = 0; i < 100; ++i) {
+        for (size_t j = 0; j < pool.threads().size(); ++j) {
+            tid_t thread = pool.threads()[j]->tid();
+            pool.schedule(boost::bind(&checkThread, thread,
+                boost::ref(count)), thread);
+        }
+    }
+    pool.stop();
+    MORDOR_TEST_ASSERT_EQUAL(count, 400);
+}
+
+// IOManager can't wake a specific thread, so the tickle has to be passed along
+MORDOR_UNITTEST(Scheduler, threadTargetedIOManager)
+{
+    IOManager ioManager(4, false);
+    // Wait for the threads to get to idle first
+    Mordor::sleep(100000);
+    int count = 0;
+    for (int i = 0; i < 100; ++i) {
+        for (size_t j = 0; j < ioManager.threads().size(); ++j) {
+            tid_t thread = ioManager.threads()[j]->tid();
+            ioManager.schedule(boost::bind(&checkThread, thread,
+                boost::ref(count)), thread);
+        }
+    }
+    ioManager.stop();
+    MORDOR_TEST_ASSERT_EQUAL(count, 400);
+}
+
 static void fail()
 {
     MORDOR_NOTREACHED();
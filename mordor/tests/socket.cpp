@@ -9,7 +9,9 @@
 #include "mordor/exception.h"
 #include "mordor/fiber.h"
 #include "mordor/iomanager.h"
+#include "mordor/parallel.h"
 #include "mordor/socket.h"
+#include "mordor/statistics.h"
 #include "mordor/test/test.h"
 
 using namespace Mordor;
@@ -250,6 +252,82 @@ MORDOR_UNITTEST(Address, parseIPv6Address)
     }
 }
 
+static unsigned long long dnsStatistic(const char *name)
+{
+    CountStatistic<unsigned long long> *stat =
+        Statistics::lookup<CountStatistic<unsigned long long> >(name);
+    MORDOR_TEST_ASSERT(stat);
+    return stat->count;
+}
+
+MORDOR_UNITTEST(Address, lookupLiteral)
+{
+    unsigned long long lookups = dnsStatistic("dns.lookups");
+    std::vector<Address::ptr> addresses = Address::lookup("127.0.0.1:80",
+        AF_UNSPEC, SOCK_STREAM);
+    MORDOR_TEST_ASSERT_EQUAL(addresses.size(), 1u);
+    MORDOR_TEST_ASSERT_EQUAL(boost::lexical_cast<std::string>(*addresses[0]),
+        "127.0.0.1:80");
+    // Never went near the resolver
+    MORDOR_TEST_ASSERT_EQUAL(dnsStatistic("dns.lookups"), lookups);
+}
+
+MORDOR_UNITTEST(Address, lookupCached)
+{
+    Address::flushLookupCache();
+    unsigned long long lookups = dnsStatistic("dns.lookups");
+    unsigned long long hits = dnsStatistic("dns.cachehits");
+    std::vector<IPAddress::ptr> first = IPAddress::lookup("localhost",
+        AF_UNSPEC, SOCK_STREAM, 0, 80);
+    std::vector<IPAddress::ptr> second = IPAddress::lookup("localhost",
+        AF_UNSPEC, SOCK_STREAM, 0, 81);
+    MORDOR_TEST_ASSERT(!first.empty());
+    MORDOR_TEST_ASSERT_EQUAL(first.size(), second.size());
+    MORDOR_TEST_ASSERT_EQUAL(dnsStatistic("dns.lookups"), lookups + 1);
+    MORDOR_TEST_ASSERT_EQUAL(dnsStatistic("dns.cachehits"), hits + 1);
+    // Each caller gets their own copies
+    MORDOR_TEST_ASSERT_EQUAL(first[0]->port(), 80u);
+    MORDOR_TEST_ASSERT_EQUAL(second[0]->port(), 81u);
+
+    Address::flushLookupCache();
+    IPAddress::lookup("localhost", AF_UNSPEC, SOCK_STREAM);
+    MORDOR_TEST_ASSERT_EQUAL(dnsStatistic("dns.lookups"), lookups + 2);
+}
+
+MORDOR_UNITTEST(Address, lookupNegativeCached)
+{
+    Address::flushLookupCache();
+    unsigned long long lookups = dnsStatistic("dns.lookups");
+    MORDOR_TEST_ASSERT_EXCEPTION(Address::lookup("localhost:nosuchservice"),
+        NameLookupException);
+    MORDOR_TEST_ASSERT_EXCEPTION(Address::lookup("localhost:nosuchservice"),
+        NameLookupException);
+    MORDOR_TEST_ASSERT_EQUAL(dnsStatistic("dns.lookups"), lookups + 1);
+}
+
+static void lookupLocalhost(size_t &found)
+{
+    found += Address::lookup("localhost", AF_UNSPEC, SOCK_STREAM).size();
+}
+
+MORDOR_UNITTEST(Address, lookupCoalesced)
+{
+    IOManager ioManager;
+    Address::flushLookupCache();
+    unsigned long long lookups = dnsStatistic("dns.lookups");
+    unsigned long long shared = dnsStatistic("dns.cachehits") +
+        dnsStatistic("dns.coalesced");
+    size_t found = 0;
+    std::vector<boost::function<void ()> > dgs(4,
+        boost::bind(&lookupLocalhost, boost::ref(found)));
+    parallel_do(dgs);
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(found, 4u);
+    // However they interleaved, the name was only resolved once
+    MORDOR_TEST_ASSERT_EQUAL(dnsStatistic("dns.lookups"), lookups + 1);
+    MORDOR_TEST_ASSERT_EQUAL(dnsStatistic("dns.cachehits") +
+        dnsStatistic("dns.coalesced"), shared + 3);
+}
+
 static void cancelMe(Socket::ptr sock)
 {
     sock->cancelAccept();
@@ -510,3 +588,77 @@ MORDOR_UNITTEST(Socket, eventOnRemoteReset)
     ioManager.dispatch();
     MORDOR_TEST_ASSERT(remoteClosed);
 }
+
+#ifdef LINUX
+static void requireIoUring(IOManager &ioManager)
+{
+    if (!ioManager.ioUring())
+        throw TestSkippedException();
+}
+
+MORDOR_UNITTEST(Socket, ioUringSendReceive)
+{
+    IOManager ioManager(1, true, IOManager::IOURING);
+    requireIoUring(ioManager);
+    Connection conns = establishConn(ioManager);
+    ioManager.schedule(boost::bind(&acceptOne, boost::ref(conns)));
+    conns.connect->connect(conns.address);
+    ioManager.dispatch();
+    MORDOR_TEST_ASSERT(conns.accept);
+
+    char receivebuf[5];
+    memset(receivebuf, 0, 5);
+    MORDOR_TEST_ASSERT_EQUAL(conns.connect->send("abcd", 4), 4u);
+    MORDOR_TEST_ASSERT_EQUAL(conns.accept->receive(receivebuf, 4), 4u);
+    MORDOR_TEST_ASSERT_EQUAL((const char *)receivebuf, "abcd");
+    conns.connect->shutdown();
+    MORDOR_TEST_ASSERT_EQUAL(conns.accept->receive(receivebuf, 4), 0u);
+}
+
+MORDOR_UNITTEST(Socket, ioUringReceiveTimeout)
+{
+    IOManager ioManager(1, true, IOManager::IOURING);
+    requireIoUring(ioManager);
+    Connection conns = establishConn(ioManager);
+    conns.connect->receiveTimeout(100000);
+    ioManager.schedule(boost::bind(&acceptOne, boost::ref(conns)));
+    conns.connect->connect(conns.address);
+    ioManager.dispatch();
+    char buf;
+    unsigned long long start = TimerManager::now();
+    MORDOR_TEST_ASSERT_EXCEPTION(conns.connect->receive(&buf, 1), TimedOutException);
+    MORDOR_TEST_ASSERT_ABOUT_EQUAL(start + 100000, TimerManager::now(), 50000);
+    MORDOR_TEST_ASSERT_EXCEPTION(conns.connect->receive(&buf, 1), TimedOutException);
+}
+
+MORDOR_UNITTEST(Socket, ioUringCancelAccept)
+{
+    IOManager ioManager(1, true, IOManager::IOURING);
+    requireIoUring(ioManager);
+    Connection conns = establishConn(ioManager);
+
+    // The accept is already in the ring when cancelMe runs
+    ioManager.schedule(boost::bind(&cancelMe, conns.listen));
+    MORDOR_TEST_ASSERT_EXCEPTION(conns.listen->accept(), OperationAbortedException);
+}
+
+static void cancelReceive(Socket::ptr sock)
+{
+    sock->cancelReceive();
+}
+
+MORDOR_UNITTEST(Socket, ioUringCancelReceive)
+{
+    IOManager ioManager(1, true, IOManager::IOURING);
+    requireIoUring(ioManager);
+    Connection conns = establishConn(ioManager);
+    ioManager.schedule(boost::bind(&acceptOne, boost::ref(conns)));
+    conns.connect->connect(conns.address);
+    ioManager.dispatch();
+
+    char buf[3];
+    ioManager.schedule(boost::bind(&cancelReceive, conns.connect));
+    MORDOR_TEST_ASSERT_EXCEPTION(conns.connect->receive(buf, 3), OperationAbortedException);
+    MORDOR_TEST_ASSERT_EXCEPTION(conns.connect->receive(buf, 3), OperationAbortedException);
+}
+#endif
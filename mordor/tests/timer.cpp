@@ -304,3 +304,86 @@ MORDOR_UNITTEST(Timer, workerPoolConditonInvalid)
     // TestTimerClass::timedOut is NOT executed
     MORDOR_TEST_ASSERT_EQUAL(sequence, 1);
 }
+
+static void
+countTimer(int &count)
+{
+    ++count;
+}
+
+MORDOR_UNITTEST(Timer, reusable)
+{
+    int count = 0;
+    TimerManager manager;
+    Timer::ptr timer = manager.createTimer(
+        boost::bind(&countTimer, boost::ref(count)));
+    // Not armed yet
+    MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), ~0ull);
+    MORDOR_TEST_ASSERT(!timer->cancel());
+    MORDOR_TEST_ASSERT(!timer->reset(0, true));
+    MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), 0u);
+    manager.executeTimers();
+    MORDOR_TEST_ASSERT_EQUAL(count, 1);
+    MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), ~0ull);
+    // Fired, but can be re-armed
+    MORDOR_TEST_ASSERT(!timer->reset(0, true));
+    manager.executeTimers();
+    MORDOR_TEST_ASSERT_EQUAL(count, 2);
+    // Cancelled, and can still be re-armed
+    timer->reset(0, true);
+    MORDOR_TEST_ASSERT(timer->cancel());
+    MORDOR_TEST_ASSERT(!timer->cancel());
+    manager.executeTimers();
+    MORDOR_TEST_ASSERT_EQUAL(count, 2);
+    timer->refresh();
+    manager.executeTimers();
+    MORDOR_TEST_ASSERT_EQUAL(count, 3);
+    MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), ~0ull);
+}
+
+static void
+orderedTimer(int &sequence, int expected)
+{
+    MORDOR_TEST_ASSERT_EQUAL(sequence, expected);
+    ++sequence;
+}
+
+// Timers from every level of the wheel (and beyond it) cascade down and fire
+// exactly on time
+MORDOR_UNITTEST(Timer, wheelLevels)
+{
+    static unsigned long long clock = 1000000000ULL;
+    TimerManager::setClock(boost::bind(&fakeClock, boost::ref(clock)));
+
+    static const unsigned long long delays[] = {
+        500ULL,                         // the root
+        300000ULL,                      // level 1
+        20000000ULL,                    // level 2
+        3600000000ULL,                  // level 3
+        10ULL * 24 * 3600000000ULL,     // level 4
+        100ULL * 24 * 3600000000ULL     // past the end of the wheel
+    };
+    const int count = sizeof(delays) / sizeof(delays[0]);
+    int sequence = 0;
+    unsigned long long start = clock;
+    {
+        TimerManager manager;
+        // Registered backwards, so each is the first to expire
+        for (int i = count - 1; i >= 0; --i)
+            manager.registerTimer(delays[i],
+                boost::bind(&orderedTimer, boost::ref(sequence), i));
+        for (int i = 0; i < count; ++i) {
+            MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(),
+                start + delays[i] - clock);
+            clock = start + delays[i] - 1;
+            manager.executeTimers();
+            MORDOR_TEST_ASSERT_EQUAL(sequence, i);
+            MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), 1u);
+            ++clock;
+            manager.executeTimers();
+            MORDOR_TEST_ASSERT_EQUAL(sequence, i + 1);
+        }
+        MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), ~0ull);
+    }
+    TimerManager::setClock();
+}
@@ -1,6 +1,19 @@
 // Copyright (c) 2009 - Mozy, Inc.
 
+#include <stdlib.h>
+
+#include <boost/bind.hpp>
+
+#include "mordor/iomanager.h"
+#include "mordor/socket.h"
+#include "mordor/statistics.h"
+#include "mordor/streams/buffered.h"
+#include "mordor/streams/fd.h"
+#include "mordor/streams/limited.h"
 #include "mordor/streams/memory.h"
+#include "mordor/streams/notify.h"
+#include "mordor/streams/singleplex.h"
+#include "mordor/streams/socket.h"
 #include "mordor/streams/test.h"
 #include "mordor/streams/transfer.h"
 #include "mordor/test/test.h"
@@ -41,3 +54,208 @@ MORDOR_UNITTEST(TransferStream, inferEof)
     MemoryStream outStream;
     MORDOR_TEST_ASSERT_EQUAL(transferStream(inStream, outStream), 5ull);
 }
+
+#ifdef LINUX
+static void acceptOne(Socket::ptr listen, Socket::ptr &accepted)
+{
+    accepted = listen->accept();
+}
+
+// first is the connecting end, second the accepted one
+static std::pair<Socket::ptr, Socket::ptr> connectedSockets(
+    IOManager &ioManager)
+{
+    std::vector<Address::ptr> addresses = Address::lookup("localhost");
+    MORDOR_TEST_ASSERT(!addresses.empty());
+    IPAddress::ptr address =
+        boost::dynamic_pointer_cast<IPAddress>(addresses.front());
+    address->port(0);
+    Socket::ptr listen = address->createSocket(ioManager, SOCK_STREAM);
+    listen->bind(address);
+    listen->listen();
+    std::pair<Socket::ptr, Socket::ptr> result;
+    result.first = address->createSocket(ioManager, SOCK_STREAM);
+    ioManager.schedule(boost::bind(&acceptOne, listen,
+        boost::ref(result.second)));
+    result.first->connect(listen->localAddress());
+    ioManager.dispatch();
+    return result;
+}
+
+static std::string randomData(size_t length)
+{
+    std::string result(length, '\0');
+    for (size_t i = 0; i < length; ++i)
+        result[i] = (char)rand();
+    return result;
+}
+
+static int tempFile(const std::string &contents)
+{
+    char path[] = "/tmp/mordor_transfer_XXXXXX";
+    int fd = mkstemp(path);
+    MORDOR_TEST_ASSERT(fd >= 0);
+    unlink(path);
+    FDStream stream(fd, NULL, NULL, false);
+    MemoryStream source(Buffer(contents.c_str(), contents.size()));
+    transferStream(source, stream);
+    stream.seek(0, Stream::BEGIN);
+    return fd;
+}
+
+static unsigned long long zeroCopyBytes()
+{
+    return Statistics::lookup<SumStatistic<unsigned long long> >(
+        "transferstream.zerocopybytes")->sum;
+}
+
+static void sendAll(Stream::ptr stream, const std::string &data)
+{
+    MemoryStream source(Buffer(data.c_str(), data.size()));
+    transferStream(source, *stream);
+    stream->close(Stream::WRITE);
+}
+
+static void receiveAll(Stream::ptr stream, MemoryStream &received)
+{
+    transferStream(*stream, received);
+}
+
+MORDOR_UNITTEST(TransferStream, sendFileToSocket)
+{
+    IOManager ioManager;
+    std::pair<Socket::ptr, Socket::ptr> sockets = connectedSockets(ioManager);
+    std::string data = randomData(1024 * 1024 + 17);
+    FDStream file(tempFile(data));
+    Stream::ptr sender(new SocketStream(sockets.first));
+    MemoryStream received;
+    ioManager.schedule(boost::bind(&receiveAll,
+        Stream::ptr(new SocketStream(sockets.second)), boost::ref(received)));
+    unsigned long long before = zeroCopyBytes();
+    MORDOR_TEST_ASSERT_EQUAL(transferStream(file, sender),
+        (unsigned long long)data.size());
+    sender->close(Stream::WRITE);
+    ioManager.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(zeroCopyBytes() - before,
+        (unsigned long long)data.size());
+    MORDOR_TEST_ASSERT(received.buffer() == data);
+}
+
+// The same layering as an HTTP response body with a Content-Length
+MORDOR_UNITTEST(TransferStream, sendFileThroughPassThroughFilters)
+{
+    IOManager ioManager;
+    std::pair<Socket::ptr, Socket::ptr> sockets = connectedSockets(ioManager);
+    std::string data = randomData(256 * 1024 + 5);
+    FDStream file(tempFile(data));
+    Stream::ptr socket(new SocketStream(sockets.first));
+    Stream::ptr buffered(new BufferedStream(socket));
+    buffered->write("headers\r\n\r\n", 11);
+    Stream::ptr singleplex(new SingleplexStream(buffered,
+        SingleplexStream::WRITE, false));
+    LimitedStream::ptr limited(new LimitedStream(singleplex, data.size()));
+    NotifyStream sender(limited);
+    MemoryStream received;
+    ioManager.schedule(boost::bind(&receiveAll,
+        Stream::ptr(new SocketStream(sockets.second)), boost::ref(received)));
+    unsigned long long before = zeroCopyBytes();
+    MORDOR_TEST_ASSERT_EQUAL(transferStream(file, sender, data.size()),
+        (unsigned long long)data.size());
+    MORDOR_TEST_ASSERT_EQUAL(limited->tell(), (long long)data.size());
+    buffered->close(Stream::WRITE);
+    ioManager.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(zeroCopyBytes() - before,
+        (unsigned long long)data.size());
+    MORDOR_TEST_ASSERT(received.buffer() == "headers\r\n\r\n" + data);
+}
+
+MORDOR_UNITTEST(TransferStream, spliceSocketToSocket)
+{
+    IOManager ioManager;
+    std::pair<Socket::ptr, Socket::ptr> client = connectedSockets(ioManager);
+    std::pair<Socket::ptr, Socket::ptr> server = connectedSockets(ioManager);
+    std::string data = randomData(1024 * 1024 + 17);
+    MemoryStream received;
+    ioManager.schedule(boost::bind(&sendAll,
+        Stream::ptr(new SocketStream(client.first)), boost::cref(data)));
+    ioManager.schedule(boost::bind(&receiveAll,
+        Stream::ptr(new SocketStream(server.second)), boost::ref(received)));
+    Stream::ptr proxyIn(new SocketStream(client.second));
+    Stream::ptr proxyOut(new SocketStream(server.first));
+    unsigned long long before = zeroCopyBytes();
+    MORDOR_TEST_ASSERT_EQUAL(transferStream(proxyIn, proxyOut),
+        (unsigned long long)data.size());
+    proxyOut->close(Stream::WRITE);
+    ioManager.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(zeroCopyBytes() - before,
+        (unsigned long long)data.size());
+    MORDOR_TEST_ASSERT(received.buffer() == data);
+}
+
+MORDOR_UNITTEST(TransferStream, spliceSocketToFile)
+{
+    IOManager ioManager;
+    std::pair<Socket::ptr, Socket::ptr> sockets = connectedSockets(ioManager);
+    std::string data = randomData(256 * 1024 + 17);
+    FDStream file(tempFile(std::string()));
+    ioManager.schedule(boost::bind(&sendAll,
+        Stream::ptr(new SocketStream(sockets.first)), boost::cref(data)));
+    Stream::ptr receiver(new SocketStream(sockets.second));
+    unsigned long long before = zeroCopyBytes();
+    // Short of what is sent, so the rest is left on the socket
+    MORDOR_TEST_ASSERT_EQUAL(transferStream(receiver, file, 100000),
+        100000ull);
+    MORDOR_TEST_ASSERT_EQUAL(zeroCopyBytes() - before, 100000ull);
+    MemoryStream rest;
+    transferStream(receiver, rest);
+    ioManager.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(file.size(), 100000ll);
+    file.seek(0, Stream::BEGIN);
+    MemoryStream written;
+    transferStream(file, written);
+    MORDOR_TEST_ASSERT(written.buffer() == data.substr(0, 100000));
+    MORDOR_TEST_ASSERT(rest.buffer() == data.substr(100000));
+}
+
+// The file's writes go to the IOManager's disk threads, and so do the splices
+MORDOR_UNITTEST(TransferStream, spliceSocketToIOManagerFile)
+{
+    IOManager ioManager;
+    std::pair<Socket::ptr, Socket::ptr> sockets = connectedSockets(ioManager);
+    std::string data = randomData(256 * 1024 + 17);
+    FDStream file(tempFile(std::string()), &ioManager);
+    ioManager.schedule(boost::bind(&sendAll,
+        Stream::ptr(new SocketStream(sockets.first)), boost::cref(data)));
+    Stream::ptr receiver(new SocketStream(sockets.second));
+    unsigned long long before = zeroCopyBytes();
+    MORDOR_TEST_ASSERT_EQUAL(transferStream(receiver, file),
+        (unsigned long long)data.size());
+    MORDOR_TEST_ASSERT_EQUAL(zeroCopyBytes() - before,
+        (unsigned long long)data.size());
+    ioManager.dispatch();
+    file.seek(0, Stream::BEGIN);
+    MemoryStream written;
+    transferStream(file, written);
+    MORDOR_TEST_ASSERT(written.buffer() == data);
+}
+
+MORDOR_UNITTEST(TransferStream, zeroCopyNotThroughFilters)
+{
+    IOManager ioManager;
+    std::pair<Socket::ptr, Socket::ptr> sockets = connectedSockets(ioManager);
+    std::string data = randomData(64 * 1024 + 17);
+    Stream::ptr file(new FDStream(tempFile(data)));
+    BufferedStream buffered(file);
+    Stream::ptr sender(new SocketStream(sockets.first));
+    MemoryStream received;
+    ioManager.schedule(boost::bind(&receiveAll,
+        Stream::ptr(new SocketStream(sockets.second)), boost::ref(received)));
+    unsigned long long before = zeroCopyBytes();
+    MORDOR_TEST_ASSERT_EQUAL(transferStream(buffered, sender),
+        (unsigned long long)data.size());
+    sender->close(Stream::WRITE);
+    ioManager.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(zeroCopyBytes(), before);
+    MORDOR_TEST_ASSERT(received.buffer() == data);
+}
+#endif
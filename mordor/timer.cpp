@@ -5,6 +5,8 @@
 #include <algorithm>
 #include <vector>
 
+#include <string.h>
+
 #include "assert.h"
 #include "atomic.h"
 #include "exception.h"
@@ -89,29 +91,30 @@ TimerManager::now()
 Timer::Timer(unsigned long long us, boost::function<void ()> dg, bool recurring,
              TimerManager *manager)
     : m_recurring(recurring),
+      m_reusable(false),
       m_us(us),
       m_dg(dg),
-      m_manager(manager)
+      m_manager(manager),
+      m_slot(NULL),
+      m_prevInSlot(NULL),
+      m_nextInSlot(NULL)
 {
     MORDOR_ASSERT(m_dg);
     m_next = TimerManager::now() + m_us;
 }
 
-Timer::Timer(unsigned long long next)
-    : m_next(next)
-{}
-
 bool
 Timer::cancel()
 {
     MORDOR_LOG_DEBUG(g_log) << this << " cancel";
+    // Released after the lock, in case it's the last reference
+    Timer::ptr self;
     boost::mutex::scoped_lock lock(m_manager->m_mutex);
-    if (m_dg) {
-        m_dg = NULL;
-        std::set<Timer::ptr, Timer::Comparator>::iterator it =
-            m_manager->m_timers.find(shared_from_this());
-        MORDOR_ASSERT(it != m_manager->m_timers.end());
-        m_manager->m_timers.erase(it);
+    if (m_self) {
+        m_manager->remove(this);
+        self.swap(m_self);
+        if (!m_reusable)
+            m_dg = NULL;
         return true;
     }
     return false;
@@ -121,32 +124,38 @@ bool
 Timer::refresh()
 {
     boost::mutex::scoped_lock lock(m_manager->m_mutex);
-    if (!m_dg)
+    bool armed = !!m_self;
+    if (!armed && !m_reusable)
         return false;
-    std::set<Timer::ptr, Timer::Comparator>::iterator it =
-        m_manager->m_timers.find(shared_from_this());
-    MORDOR_ASSERT(it != m_manager->m_timers.end());
-    m_manager->m_timers.erase(it);
+    if (armed)
+        m_manager->remove(this);
+    else
+        m_self = shared_from_this();
     m_next = TimerManager::now() + m_us;
-    m_manager->m_timers.insert(shared_from_this());
+    bool atFront = m_manager->insert(this) && !m_manager->m_tickled;
+    if (atFront)
+        m_manager->m_tickled = true;
     lock.unlock();
     MORDOR_LOG_DEBUG(g_log) << this << " refresh";
-    return true;
+    if (atFront)
+        m_manager->onTimerInsertedAtFront();
+    return armed;
 }
 
 bool
 Timer::reset(unsigned long long us, bool fromNow)
 {
     boost::mutex::scoped_lock lock(m_manager->m_mutex);
-    if (!m_dg)
+    bool armed = !!m_self;
+    if (!armed && !m_reusable)
         return false;
     // No change
-    if (us == m_us && !fromNow)
+    if (armed && us == m_us && !fromNow)
         return true;
-    std::set<Timer::ptr, Timer::Comparator>::iterator it =
-        m_manager->m_timers.find(shared_from_this());
-    MORDOR_ASSERT(it != m_manager->m_timers.end());
-    m_manager->m_timers.erase(it);
+    if (armed)
+        m_manager->remove(this);
+    else
+        m_self = shared_from_this();
     unsigned long long start;
     if (fromNow)
         start = TimerManager::now();
@@ -154,28 +163,40 @@ Timer::reset(unsigned long long us, bool fromNow)
         start = m_next - m_us;
     m_us = us;
     m_next = start + m_us;
-    it = m_manager->m_timers.insert(shared_from_this()).first;
-    bool atFront = (it == m_manager->m_timers.begin()) && !m_manager->m_tickled;
+    bool atFront = m_manager->insert(this) && !m_manager->m_tickled;
     if (atFront)
         m_manager->m_tickled = true;
     lock.unlock();
     MORDOR_LOG_DEBUG(g_log) << this << " reset to " << m_us;
     if (atFront)
         m_manager->onTimerInsertedAtFront();
-    return true;
+    return armed;
 }
 
 TimerManager::TimerManager()
-: m_tickled(false),
+: m_currentTick(now() >> TICK_SHIFT),
+  m_earliest(~0ull),
+  m_earliestStale(false),
+  m_tickled(false),
   m_previousTime(0ull)
-{}
+{
+    memset(m_wheel, 0, sizeof(m_wheel));
+    memset(m_count, 0, sizeof(m_count));
+}
 
 TimerManager::~TimerManager()
 {
-#ifndef NDEBUG
+    // Released after the lock
+    std::vector<Timer::ptr> armed;
     boost::mutex::scoped_lock lock(m_mutex);
-    MORDOR_ASSERT(m_timers.empty());
-#endif
+    for (size_t i = 0; i < WHEEL_SLOTS; ++i) {
+        for (Timer *timer = m_wheel[i]; timer; timer = timer->m_nextInSlot) {
+            timer->m_slot = NULL;
+            armed.push_back(Timer::ptr());
+            armed.back().swap(timer->m_self);
+        }
+    }
+    MORDOR_ASSERT(armed.empty());
 }
 
 Timer::ptr
@@ -185,9 +206,8 @@ TimerManager::registerTimer(unsigned long long us, boost::function<void ()> dg,
     MORDOR_ASSERT(dg);
     Timer::ptr result(new Timer(us, dg, recurring, this));
     boost::mutex::scoped_lock lock(m_mutex);
-    std::set<Timer::ptr, Timer::Comparator>::iterator it =
-        m_timers.insert(result).first;
-    bool atFront = (it == m_timers.begin()) && !m_tickled;
+    result->m_self = result;
+    bool atFront = insert(result.get()) && !m_tickled;
     if (atFront)
         m_tickled = true;
     lock.unlock();
@@ -198,6 +218,17 @@ TimerManager::registerTimer(unsigned long long us, boost::function<void ()> dg,
     return result;
 }
 
+Timer::ptr
+TimerManager::createTimer(boost::function<void ()> dg, bool recurring)
+{
+    MORDOR_ASSERT(dg);
+    Timer::ptr result(new Timer(0, dg, recurring, this));
+    result->m_reusable = true;
+    MORDOR_LOG_DEBUG(g_log) << result.get() << " createTimer(" << recurring
+        << ")";
+    return result;
+}
+
 Timer::ptr
 TimerManager::registerConditionTimer(unsigned long long us,
     boost::function<void ()> dg,
@@ -226,17 +257,20 @@ TimerManager::nextTimer()
 {
     boost::mutex::scoped_lock lock(m_mutex);
     m_tickled = false;
-    if (m_timers.empty()) {
+    if (m_earliestStale) {
+        m_earliest = earliest();
+        m_earliestStale = false;
+    }
+    if (m_earliest == ~0ull) {
         MORDOR_LOG_DEBUG(g_log) << this << " nextTimer(): ~0ull";
         return ~0ull;
     }
-    const Timer::ptr &next = *m_timers.begin();
     unsigned long long nowUs = now();
     unsigned long long result;
-    if (nowUs >= next->m_next)
+    if (nowUs >= m_earliest)
         result = 0;
     else
-        result = next->m_next - nowUs;
+        result = m_earliest - nowUs;
     MORDOR_LOG_DEBUG(g_log) << this << " nextTimer(): " << result;
     return result;
 }
@@ -261,6 +295,174 @@ TimerManager::detectClockRollover(unsigned long long nowUs)
     return rollover;
 }
 
+bool
+TimerManager::insert(Timer *timer)
+{
+    unsigned long long tick = timer->m_next >> TICK_SHIFT;
+    size_t level = 0;
+    size_t slot;
+    if (tick <= m_currentTick) {
+        // Already due
+        slot = (size_t)(m_currentTick & (ROOT_SLOTS - 1));
+    } else if (tick - m_currentTick < ROOT_SLOTS) {
+        slot = (size_t)(tick & (ROOT_SLOTS - 1));
+    } else {
+        unsigned long long delta = tick - m_currentTick;
+        size_t shift = ROOT_BITS;
+        for (level = 1; level < LEVELS; ++level) {
+            if (delta < (1ull << (shift + LEVEL_BITS)))
+                break;
+            shift += LEVEL_BITS;
+        }
+        // Past the end of the wheel; park it in the furthest slot, and it
+        // will be placed again when that slot cascades
+        if (delta >= (1ull << (shift + LEVEL_BITS)))
+            tick = m_currentTick + (1ull << (shift + LEVEL_BITS)) - 1;
+        slot = ROOT_SLOTS + (level - 1) * LEVEL_SLOTS +
+            (size_t)((tick >> shift) & (LEVEL_SLOTS - 1));
+    }
+    Timer **head = &m_wheel[slot];
+    timer->m_slot = head;
+    timer->m_prevInSlot = NULL;
+    timer->m_nextInSlot = *head;
+    if (*head)
+        (*head)->m_prevInSlot = timer;
+    *head = timer;
+    ++m_count[level];
+    // m_earliest is never later than the real first timer, so this is
+    // definitely the new first timer
+    if (timer->m_next < m_earliest) {
+        m_earliest = timer->m_next;
+        m_earliestStale = false;
+        return true;
+    }
+    return false;
+}
+
+void
+TimerManager::remove(Timer *timer)
+{
+    MORDOR_ASSERT(timer->m_slot);
+    if (timer->m_prevInSlot)
+        timer->m_prevInSlot->m_nextInSlot = timer->m_nextInSlot;
+    else
+        *timer->m_slot = timer->m_nextInSlot;
+    if (timer->m_nextInSlot)
+        timer->m_nextInSlot->m_prevInSlot = timer->m_prevInSlot;
+    size_t slot = timer->m_slot - m_wheel;
+    --m_count[slot < ROOT_SLOTS ? 0 :
+        1 + (slot - ROOT_SLOTS) / LEVEL_SLOTS];
+    timer->m_slot = NULL;
+    if (timer->m_next == m_earliest)
+        m_earliestStale = true;
+}
+
+size_t
+TimerManager::cascade(size_t level)
+{
+    size_t shift = ROOT_BITS + (level - 1) * LEVEL_BITS;
+    size_t index = (size_t)((m_currentTick >> shift) & (LEVEL_SLOTS - 1));
+    Timer **head = &m_wheel[ROOT_SLOTS + (level - 1) * LEVEL_SLOTS + index];
+    Timer *timer = *head;
+    *head = NULL;
+    while (timer) {
+        Timer *next = timer->m_nextInSlot;
+        --m_count[level];
+        insert(timer);
+        timer = next;
+    }
+    return index;
+}
+
+void
+TimerManager::advance(unsigned long long nowUs, std::vector<Timer *> &due)
+{
+    unsigned long long nowTick = nowUs >> TICK_SHIFT;
+    while (true) {
+        bool current = m_currentTick >= nowTick;
+        Timer *timer = m_wheel[m_currentTick & (ROOT_SLOTS - 1)];
+        while (timer) {
+            Timer *next = timer->m_nextInSlot;
+            // Everything in an earlier tick is due; the current tick has
+            // to be checked timer by timer
+            if (!current || timer->m_next <= nowUs) {
+                remove(timer);
+                due.push_back(timer);
+            }
+            timer = next;
+        }
+        if (current)
+            return;
+
+        // Skip ahead to the next cascade of the lowest level that has
+        // any timers, since nothing can come due before then
+        if (m_count[0]) {
+            ++m_currentTick;
+        } else {
+            size_t level = 1;
+            size_t shift = ROOT_BITS;
+            while (level <= LEVELS && !m_count[level]) {
+                ++level;
+                shift += LEVEL_BITS;
+            }
+            if (level > LEVELS) {
+                m_currentTick = nowTick;
+                continue;
+            }
+            m_currentTick = std::min(nowTick,
+                ((m_currentTick >> shift) + 1) << shift);
+        }
+        if ((m_currentTick & (ROOT_SLOTS - 1)) == 0) {
+            for (size_t level = 1; level <= LEVELS; ++level) {
+                if (cascade(level) != 0)
+                    break;
+            }
+        }
+    }
+}
+
+unsigned long long
+TimerManager::earliest() const
+{
+    unsigned long long result = ~0ull;
+    // The first non-empty slot of each level holds that level's earliest
+    // timer
+    if (m_count[0]) {
+        for (size_t i = 0; i < ROOT_SLOTS; ++i) {
+            const Timer *timer =
+                m_wheel[(m_currentTick + i) & (ROOT_SLOTS - 1)];
+            if (!timer)
+                continue;
+            for (; timer; timer = timer->m_nextInSlot)
+                result = std::min(result, timer->m_next);
+            break;
+        }
+    }
+    size_t shift = ROOT_BITS;
+    for (size_t level = 1; level <= LEVELS; ++level, shift += LEVEL_BITS) {
+        if (!m_count[level])
+            continue;
+        Timer * const *slots = m_wheel + ROOT_SLOTS + (level - 1) * LEVEL_SLOTS;
+        // The current slot has already cascaded, so start with the next one
+        for (size_t i = 1; i <= LEVEL_SLOTS; ++i) {
+            const Timer *timer =
+                slots[((m_currentTick >> shift) + i) & (LEVEL_SLOTS - 1)];
+            if (!timer)
+                continue;
+            for (; timer; timer = timer->m_nextInSlot)
+                result = std::min(result, timer->m_next);
+            break;
+        }
+    }
+    return result;
+}
+
+bool
+TimerManager::expiresBefore(const Timer *lhs, const Timer *rhs)
+{
+    return lhs->m_next < rhs->m_next;
+}
+
 std::vector<boost::function<void ()> >
 TimerManager::processTimers()
 {
@@ -269,36 +471,53 @@ TimerManager::processTimers()
     unsigned long long nowUs = now();
     {
         boost::mutex::scoped_lock lock(m_mutex);
-        if (m_timers.empty())
+        size_t count = 0;
+        for (size_t level = 0; level <= LEVELS; ++level)
+            count += m_count[level];
+        if (count == 0)
             return result;
         bool rollover = detectClockRollover(nowUs);
-        if (!rollover && (*m_timers.begin())->m_next > nowUs)
+        if (!rollover && m_earliest > nowUs)
+            return result;
+        std::vector<Timer *> due;
+        if (rollover) {
+            for (size_t i = 0; i < WHEEL_SLOTS; ++i) {
+                while (m_wheel[i]) {
+                    due.push_back(m_wheel[i]);
+                    remove(m_wheel[i]);
+                }
+            }
+            m_currentTick = nowUs >> TICK_SHIFT;
+        } else {
+            advance(nowUs, due);
+        }
+        if (due.empty())
             return result;
-        Timer nowTimer(nowUs);
-        Timer::ptr nowTimerPtr(&nowTimer, &nop<Timer *>);
-        // Find all timers that are expired
-        std::set<Timer::ptr, Timer::Comparator>::iterator it =
-            rollover ? m_timers.end() : m_timers.lower_bound(nowTimerPtr);
-        while (it != m_timers.end() && (*it)->m_next == nowUs ) ++it;
-        // Copy to expired, remove from m_timers;
-        expired.insert(expired.begin(), m_timers.begin(), it);
-        m_timers.erase(m_timers.begin(), it);
-        result.reserve(expired.size());
-        // Look at expired timers and re-register recurring timers
-        // (while under the same lock)
-        for (std::vector<Timer::ptr>::iterator it2(expired.begin());
-            it2 != expired.end();
-            ++it2) {
-            Timer::ptr &timer = *it2;
+        m_earliestStale = true;
+        std::sort(due.begin(), due.end(), &TimerManager::expiresBefore);
+        result.reserve(due.size());
+        expired.reserve(due.size());
+        // Re-register recurring timers (while under the same lock)
+        for (std::vector<Timer *>::iterator it(due.begin());
+            it != due.end();
+            ++it) {
+            Timer *timer = *it;
             MORDOR_ASSERT(timer->m_dg);
-            result.push_back(timer->m_dg);
             if (timer->m_recurring) {
                 MORDOR_LOG_TRACE(g_log) << timer << " expired and refreshed";
+                result.push_back(timer->m_dg);
                 timer->m_next = nowUs + timer->m_us;
-                m_timers.insert(timer);
+                insert(timer);
             } else {
                 MORDOR_LOG_TRACE(g_log) << timer << " expired";
-                timer->m_dg = NULL;
+                if (timer->m_reusable) {
+                    result.push_back(timer->m_dg);
+                } else {
+                    result.push_back(NULL);
+                    result.back().swap(timer->m_dg);
+                }
+                expired.push_back(Timer::ptr());
+                expired.back().swap(timer->m_self);
             }
         }
     }
@@ -323,24 +542,4 @@ TimerManager::setClock(boost::function<unsigned long long()> dg)
     ms_clockDg = dg;
 }
 
-bool
-Timer::Comparator::operator()(const Timer::ptr &lhs,
-                              const Timer::ptr &rhs) const
-{
-    // Order NULL before everything else
-    if (!lhs && !rhs)
-        return false;
-    if (!lhs)
-        return true;
-    if (!rhs)
-        return false;
-    // Order primarily on m_next
-    if (lhs->m_next < rhs->m_next)
-        return true;
-    if (rhs->m_next < lhs->m_next)
-        return false;
-    // Order by raw pointer for equivalent timeout values
-    return lhs.get() < rhs.get();
-}
-
 }
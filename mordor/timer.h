@@ -2,7 +2,6 @@
 #define __MORDOR_TIMER_H__
 // Copyright (c) 2009 - Mozy, Inc.
 
-#include <set>
 #include <vector>
 
 #include <boost/enable_shared_from_this.hpp>
@@ -41,21 +40,24 @@ public:
     /// @param fromNow If us should be relative to now, or the original
     /// starting point
     /// @return If it was reset before firing
+    /// @note A timer from TimerManager::createTimer is re-armed even if it
+    /// already fired or was cancelled
     bool reset(unsigned long long us, bool fromNow);
 
 private:
     bool m_recurring;
+    // Keeps m_dg across firing and cancel() so it can be re-armed
+    bool m_reusable;
     unsigned long long m_next;
     unsigned long long m_us;
     boost::function<void ()> m_dg;
     TimerManager *m_manager;
-
-private:
-    struct Comparator
-    {
-        bool operator()(const Timer::ptr &lhs, const Timer::ptr &rhs) const;
-    };
-
+    // Position in the TimerManager's wheel; only valid while armed
+    Timer **m_slot;
+    Timer *m_prevInSlot, *m_nextInSlot;
+    // Keeps us alive while we're armed, since the wheel only has raw
+    // pointers
+    Timer::ptr m_self;
 };
 
 class TimerManager : public boost::noncopyable
@@ -68,6 +70,12 @@ public:
     virtual Timer::ptr registerTimer(unsigned long long us,
         boost::function<void ()> dg, bool recurring = false);
 
+    /// Create a timer that isn't armed yet, and that keeps dg when it fires
+    /// or is cancelled, so that one Timer can be re-armed with
+    /// Timer::reset() for every operation that needs a timeout
+    Timer::ptr createTimer(boost::function<void ()> dg,
+        bool recurring = false);
+
     /// Conditionally execute the dg callback function only when weakCond is
     /// still in valid status, which means, the original object managed by the
     /// shared_ptr is not destroyed
@@ -102,9 +110,42 @@ protected:
 private:
     bool detectClockRollover(unsigned long long nowUs);
 
+    /// Links an armed timer into the wheel
+    /// @return If it is now the first timer to expire
+    bool insert(Timer *timer);
+    void remove(Timer *timer);
+    /// Moves the current slot of level down the wheel
+    /// @return The index of that slot
+    size_t cascade(size_t level);
+    /// Unlinks every timer due at nowUs, in no particular order
+    void advance(unsigned long long nowUs, std::vector<Timer *> &due);
+    unsigned long long earliest() const;
+    static bool expiresBefore(const Timer *lhs, const Timer *rhs);
+
 private:
+    // A hierarchical timing wheel: ROOT_SLOTS ticks of TICK_US (roughly a
+    // millisecond) each, then LEVELS levels of LEVEL_SLOTS slots, each
+    // spanning a full turn of the level below it
+    enum {
+        TICK_SHIFT = 10,
+        ROOT_BITS = 8,
+        ROOT_SLOTS = 1 << ROOT_BITS,
+        LEVEL_BITS = 6,
+        LEVEL_SLOTS = 1 << LEVEL_BITS,
+        LEVELS = 4,
+        WHEEL_SLOTS = ROOT_SLOTS + LEVELS * LEVEL_SLOTS
+    };
+
     static boost::function<unsigned long long ()> ms_clockDg;
-    std::set<Timer::ptr, Timer::Comparator> m_timers;
+    Timer *m_wheel[WHEEL_SLOTS];
+    // Timers in the root, and in each level
+    size_t m_count[LEVELS + 1];
+    // All ticks before this one have been processed
+    unsigned long long m_currentTick;
+    // Never later than the first timer to expire; exact unless
+    // m_earliestStale
+    unsigned long long m_earliest;
+    bool m_earliestStale;
     boost::mutex m_mutex;
     bool m_tickled;
     unsigned long long m_previousTime;
@@ -2,6 +2,8 @@
 
 #include "workerpool.h"
 
+#include <algorithm>
+
 #include "fiber.h"
 #include "log.h"
 
@@ -10,19 +12,53 @@ namespace Mordor {
 static Logger::ptr g_log = Log::lookup("mordor:workerpool");
 
 WorkerPool::WorkerPool(size_t threads, bool useCaller, size_t batchSize)
-    : Scheduler(threads, useCaller, batchSize)
+    : Scheduler(threads, useCaller, batchSize),
+      m_pendingTickles(0)
 {
     start();
 }
 
+Semaphore &
+WorkerPool::semaphoreNoLock(tid_t thread)
+{
+    boost::shared_ptr<Semaphore> &semaphore = m_semaphores[thread];
+    if (!semaphore)
+        semaphore.reset(new Semaphore());
+    return *semaphore;
+}
+
 void
 WorkerPool::idle()
 {
+    Semaphore *semaphore;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        semaphore = &semaphoreNoLock(gettid());
+    }
     while (true) {
         if (stopping()) {
             return;
         }
-        m_semaphore.wait();
+        bool wait = true;
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            if (m_pendingTickles > 0) {
+                --m_pendingTickles;
+                wait = false;
+            } else {
+                m_idleThreads.push_back(semaphore);
+            }
+        }
+        if (wait) {
+            semaphore->wait();
+            // We may have been woken by a stale tickleThread() while still
+            // listed as idle; make sure tickle() doesn't pick us again
+            boost::mutex::scoped_lock lock(m_mutex);
+            std::vector<Semaphore *>::iterator it = std::find(
+                m_idleThreads.begin(), m_idleThreads.end(), semaphore);
+            if (it != m_idleThreads.end())
+                m_idleThreads.erase(it);
+        }
         try {
             Fiber::yield();
         } catch (OperationAbortedException &) {
@@ -35,7 +71,34 @@ void
 WorkerPool::tickle()
 {
     MORDOR_LOG_DEBUG(g_log) << this << " tickling";
-    m_semaphore.notify();
+    Semaphore *semaphore;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        if (m_idleThreads.empty()) {
+            ++m_pendingTickles;
+            return;
+        }
+        semaphore = m_idleThreads.back();
+        m_idleThreads.pop_back();
+    }
+    semaphore->notify();
+}
+
+bool
+WorkerPool::tickleThread(tid_t thread)
+{
+    MORDOR_LOG_DEBUG(g_log) << this << " tickling thread " << thread;
+    Semaphore *semaphore;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        semaphore = &semaphoreNoLock(thread);
+        std::vector<Semaphore *>::iterator it = std::find(
+            m_idleThreads.begin(), m_idleThreads.end(), semaphore);
+        if (it != m_idleThreads.end())
+            m_idleThreads.erase(it);
+    }
+    semaphore->notify();
+    return true;
 }
 
 }
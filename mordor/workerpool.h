@@ -2,6 +2,8 @@
 #define __MORDOR_WORKERPOOL_H__
 // Copyright (c) 2009 - Mozy, Inc.
 
+#include <map>
+
 #include "scheduler.h"
 #include "semaphore.h"
 
@@ -18,15 +20,25 @@ public:
     ~WorkerPool() { stop(); }
 
 protected:
-    /// The idle Fiber for a WorkerPool simply loops waiting on a Semaphore,
-    /// and yields whenever that Semaphore is signalled, returning if
-    /// stopping() is true.
+    /// The idle Fiber for a WorkerPool simply loops waiting on a per-thread
+    /// Semaphore, and yields whenever that Semaphore is signalled, returning
+    /// if stopping() is true.
     void idle();
-    /// Signals the semaphore so that the idle Fiber will yield.
+    /// Signals the semaphore of one idle thread so that its idle Fiber will
+    /// yield.  If no thread is idle, the next thread to go idle will yield
+    /// immediately.
     void tickle();
+    /// Signals the semaphore of the given thread
+    bool tickleThread(tid_t thread);
+
+private:
+    Semaphore &semaphoreNoLock(tid_t thread);
 
 private:
-    Semaphore m_semaphore;
+    boost::mutex m_mutex;
+    std::map<tid_t, boost::shared_ptr<Semaphore> > m_semaphores;
+    std::vector<Semaphore *> m_idleThreads;
+    size_t m_pendingTickles;
 };
 
 }